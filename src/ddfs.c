@@ -1,3 +1,4 @@
+#ifdef __FreeBSD__
 #include <sys/cdefs.h>
 __FBSDID("$FreeBSD$");
 
@@ -17,13 +18,28 @@ __FBSDID("$FreeBSD$");
 #include <sys/vnode.h>
 #include <machine/atomic.h>
 #include <vm/uma.h>
+#endif
+
+#include <errno.h>
 
 #include "ddfs.h"
+#include "ddfs_alloc.h"
+#include "ddfs_backend.h"
 #include "ddfs_bitmap.h"
+#include "ddfs_gc.h"
+#include "ddfs_group.h"
 #include "ddfs_inode.h"
-
-inline uint32_t div_ceil(uint32_t a, uint32_t b) {
-    uint32_t ret = a / b;
+#include "ddfs_journal.h"
+#include "ddfs_lock.h"
+#include "ddfs_log.h"
+#include "ddfs_pool.h"
+#include "ddfs_refcount.h"
+#include "ddfs_snapshot.h"
+#include "ddfs_uring.h"
+#include "ddfs_volume.h"
+
+inline uint64_t div_ceil(uint64_t a, uint64_t b) {
+    uint64_t ret = a / b;
     
     if (a % b) {
         return ret + 1;
@@ -32,18 +48,9 @@ inline uint32_t div_ceil(uint32_t a, uint32_t b) {
     return ret;
 }
 
+// Get the size of the image or device in bytes
 int64_t get_disk_media_size(int fd) {
-    // Get media size in bytes
-    uint64_t media_size = 0;
-    int ret = ioctl(fd, DIOCGMEDIASIZE, &media_size);
-
-    if (ret == -1) {
-        perror("ioctl");
-        close(fd);
-        return ret;
-    }
-
-    return media_size;
+    return get_backend(fd)->size(fd);
 }
 
 int64_t get_disk_block_size(int fd) {
@@ -60,36 +67,176 @@ int64_t get_disk_block_size(int fd) {
     return stat_buf.st_blksize;
 }
 
+// Get the logical block size that direct I/O must be aligned to
 int64_t get_disk_sector_size(int fd) {
-    // Get sector size in bytes
-    long int sector_size = 0;
-    int ret = ioctl(fd, DIOCGSECTORSIZE, &sector_size);
+    return get_backend(fd)->sector_size(fd);
+}
 
-    if (ret == -1) {
-        perror("ioctl");
-        close(fd);
-        return ret;
+// Get the address of count blocks in a mapped volume, or NULL if the
+// volume is not mapped, not mapped for writing or too small
+uint8_t *get_block_address(int fd, uint64_t block_number, uint32_t count, 
+    int write) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    // Journaled metadata only changes through its buffers, and index
+    // pages a snapshot shares are copied before they change in place
+    if (volume == NULL || volume->map == NULL || 
+        (write && !volume->writable) || 
+        journal_covers(fd, block_number, count) ||
+        (write && preserve_index_pages(fd, block_number, count) != 
+        EXIT_SUCCESS)) {
+        return NULL;
+    }
+
+    size_t offset = (size_t)block_number * DDFS_BLOCK_SIZE;
+
+    if (offset + ((size_t)count * DDFS_BLOCK_SIZE) > volume->map_length) {
+        return NULL;
+    }
+
+    return volume->map + offset;
+}
+
+int read_block(int fd, void *buffer, uint64_t block_number) {
+    return read_blocks(fd, &buffer, block_number, 1);
+}
+
+int write_block(int fd, void *buffer, uint64_t block_number) {
+    return write_blocks(fd, &buffer, block_number, 1);
+}
+
+// Read count adjacent blocks into separate buffers with a single request
+int64_t read_blocks(int fd, void **buffers, uint64_t block_number, 
+    uint32_t count) {
+    if (journal_covers(fd, block_number, count)) {
+        return journal_read(fd, buffers, block_number, count);
+    }
+
+    uint8_t *block = get_block_address(fd, block_number, count, 0);
+
+    if (block != NULL) {
+        for (uint32_t i = 0; i < count; i++) {
+            memcpy(buffers[i], block + ((size_t)i * DDFS_BLOCK_SIZE), 
+                DDFS_BLOCK_SIZE);
+        }
+
+        return (int64_t)count * DDFS_BLOCK_SIZE;
     }
 
-    return sector_size;
+    return get_backend(fd)->read(fd, buffers, block_number, count);
 }
 
-int read_block(int fd, void *buffer, uint32_t block_number) {
-    lseek(fd, block_number * DDFS_BLOCK_SIZE, SEEK_SET);
-    int ret = read(fd, buffer, DDFS_BLOCK_SIZE);
-    lseek(fd, 0, SEEK_SET);
+// Write separate buffers to count adjacent blocks with a single request
+int64_t write_blocks(int fd, void **buffers, uint64_t block_number, 
+    uint32_t count) {
+    // Index pages a snapshot shares are copied before they change
+    if (preserve_index_pages(fd, block_number, count) != EXIT_SUCCESS) {
+        return -1;
+    }
+
+    if (journal_covers(fd, block_number, count)) {
+        return journal_write(fd, buffers, block_number, count);
+    }
+
+    uint8_t *block = get_block_address(fd, block_number, count, 1);
+
+    if (block != NULL) {
+        for (uint32_t i = 0; i < count; i++) {
+            memcpy(block + ((size_t)i * DDFS_BLOCK_SIZE), buffers[i], 
+                DDFS_BLOCK_SIZE);
+        }
+
+        return (int64_t)count * DDFS_BLOCK_SIZE;
+    }
+
+    return get_backend(fd)->write(fd, buffers, block_number, count);
+}
+
+// Check that direct I/O can use every buffer of a list of runs as is
+static int runs_are_aligned(int fd, struct ddfs_io_run *runs, 
+    uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < runs[i].count; j++) {
+            if (!buffer_is_aligned(fd, runs[i].buffers[j])) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+// Check whether any run of a list goes through the volume's journal
+static int runs_are_journaled(int fd, struct ddfs_io_run *runs, 
+    uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (journal_covers(fd, runs[i].block_number, runs[i].count)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Read a list of block runs, recording the result of each run
+int read_runs(int fd, struct ddfs_io_run *runs, uint32_t count) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume != NULL && volume->uring != NULL && volume->map == NULL &&
+        runs_are_aligned(fd, runs, count) && 
+        !runs_are_journaled(fd, runs, count)) {
+        return uring_submit_runs(volume->uring, runs, count, 0);
+    }
+
+    int ret = EXIT_SUCCESS;
+
+    for (uint32_t i = 0; i < count; i++) {
+        runs[i].result = read_blocks(fd, runs[i].buffers, 
+            runs[i].block_number, runs[i].count);
+
+        if (runs[i].result == -1) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
     return ret;
 }
 
-int write_block(int fd, void *buffer, uint32_t block_number) {
-    lseek(fd, block_number * DDFS_BLOCK_SIZE, SEEK_SET);
-    int ret = write(fd, buffer, DDFS_BLOCK_SIZE);
-    lseek(fd, 0, SEEK_SET);
+// Write a list of block runs, recording the result of each run
+int write_runs(int fd, struct ddfs_io_run *runs, uint32_t count) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume != NULL && volume->uring != NULL && volume->map == NULL &&
+        runs_are_aligned(fd, runs, count) && 
+        !runs_are_journaled(fd, runs, count)) {
+        // The queued writes bypass write_blocks(), so shared index pages
+        // are copied first
+        for (uint32_t i = 0; i < count; i++) {
+            if (preserve_index_pages(fd, runs[i].block_number, 
+                runs[i].count) != EXIT_SUCCESS) {
+                return EXIT_FAILURE;
+            }
+        }
+
+        return uring_submit_runs(volume->uring, runs, count, 1);
+    }
+
+    int ret = EXIT_SUCCESS;
+
+    for (uint32_t i = 0; i < count; i++) {
+        runs[i].result = write_blocks(fd, runs[i].buffers, 
+            runs[i].block_number, runs[i].count);
+
+        if (runs[i].result == -1) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
     return ret;
 }
 
 struct ddfs_superblock *read_superblock(int fd) {
-    struct ddfs_superblock *sb = malloc(DDFS_BLOCK_SIZE);
+    struct ddfs_superblock *sb = ddfs_malloc(DDFS_BLOCK_SIZE);
     
     if (sb == NULL) {
         return NULL;
@@ -98,54 +245,194 @@ struct ddfs_superblock *read_superblock(int fd) {
     int ret = read_block(fd, sb, 0);
     
     if (ret != DDFS_BLOCK_SIZE) {
-        free(sb);
+        ddfs_free(sb);
         return NULL;
     }
 
     return sb;
 }
 
-struct ddfs_superblock *write_superblock(int fd) {
-    struct ddfs_superblock *sb = malloc(DDFS_BLOCK_SIZE);
+// Read the superblock into a pooled block buffer, released with
+// put_block_buffer()
+struct ddfs_superblock *get_superblock(int fd) {
+    struct ddfs_superblock *sb = (struct ddfs_superblock *)get_block_buffer();
     
     if (sb == NULL) {
         return NULL;
     }
 
-    memset(sb, 0, DDFS_BLOCK_SIZE);
+    if (read_block(fd, sb, 0) != DDFS_BLOCK_SIZE) {
+        put_block_buffer(sb);
+        return NULL;
+    }
+
+    return sb;
+}
+
+// Write a superblock laid out for the given geometry, or for the default
+// geometry when it is NULL
+struct ddfs_superblock *write_superblock(int fd, 
+    const struct ddfs_geometry *geometry) {
+    struct ddfs_geometry defaults = { 0 };
+
+    if (geometry == NULL) {
+        geometry = &defaults;
+    }
 
     uint64_t media_size = get_disk_media_size(fd);
-    uint32_t block_count = media_size / DDFS_BLOCK_SIZE;
-    uint32_t inode_count = block_count;
+    uint64_t block_count = media_size / DDFS_BLOCK_SIZE;
+    uint32_t load_factor = geometry->load_factor != 0 ? 
+        geometry->load_factor : DDFS_LOAD_FACTOR;
+    uint64_t inode_ratio = geometry->inode_ratio != 0 ? 
+        geometry->inode_ratio : DDFS_BLOCK_SIZE;
+    uint64_t key_count = geometry->key_count != 0 ? 
+        geometry->key_count : media_size / inode_ratio;
+
+    // Other block sizes need a build of their own, and log-structured
+    // volumes cannot keep snapshots
+    if ((geometry->block_size != 0 && 
+        geometry->block_size != DDFS_BLOCK_SIZE) || load_factor > 100 || 
+        key_count == 0 || key_count > UINT64_MAX / 100 ||
+        (geometry->flags & ~DDFS_FS_LOG) != 0 ||
+        ((geometry->flags & DDFS_FS_LOG) && geometry->snapshot_pages != 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Size the index so the expected keys fill load_factor percent of it
+    uint64_t inode_count = div_ceil(key_count * 100, load_factor);
     uint32_t inode_size = sizeof(struct ddfs_inode);
     uint32_t inodes_per_block = DDFS_BLOCK_SIZE / inode_size;
-    uint32_t ifree_block_count = div_ceil(inode_count, DDFS_BLOCK_SIZE * 8);
-    uint32_t bfree_block_count = div_ceil(block_count, DDFS_BLOCK_SIZE * 8);
-    uint32_t istore_block_count = div_ceil(inode_count, inodes_per_block);
-    uint32_t data_block_count = block_count - ifree_block_count
-        - bfree_block_count - istore_block_count - 1;
-    uint32_t istore_offset = DDFS_BLOCK_SIZE
+    uint64_t ifree_block_count = div_ceil(inode_count, DDFS_BLOCK_SIZE * 8);
+    uint64_t bfree_block_count = div_ceil(block_count, DDFS_BLOCK_SIZE * 8);
+    uint64_t istore_block_count = div_ceil(inode_count, inodes_per_block);
+    uint64_t group_count = div_ceil(inode_count, DDFS_GROUP_INODES);
+    uint64_t group_block_count = div_ceil(group_count, 
+        DDFS_BLOCK_SIZE / sizeof(struct ddfs_group_desc));
+    uint64_t ref_block_count = div_ceil(block_count, DDFS_REFS_PER_BLOCK);
+    uint64_t reflog_block_count = DDFS_REFLOG_BLOCKS;
+    uint64_t journal_block_count = DDFS_JOURNAL_BLOCKS;
+    uint64_t segment_block_count = 0;
+    uint64_t index_slots = 0;
+    uint64_t index_block_count = 0;
+    uint64_t snapshot_pages = 0;
+    uint64_t snapshot_block_count = 0;
+
+    // Log-structured volumes size the segment table for the whole media
+    // and give the fingerprint index one slot per block
+    if (geometry->flags & DDFS_FS_LOG) {
+        segment_block_count = div_ceil(
+            div_ceil(block_count, DDFS_SEGMENT_BLOCKS), 
+            DDFS_SEGMENTS_PER_BLOCK);
+        index_slots = block_count;
+        index_block_count = div_ceil(index_slots, DDFS_INDEX_PER_BLOCK);
+    } else {
+        snapshot_pages = istore_block_count / DDFS_SNAPSHOT_SHARE;
+
+        if (geometry->snapshot_pages != 0) {
+            snapshot_pages = geometry->snapshot_pages;
+        } else if (snapshot_pages < DDFS_SNAPSHOT_MIN_PAGES) {
+            snapshot_pages = DDFS_SNAPSHOT_MIN_PAGES;
+        }
+
+        if (snapshot_pages >= block_count) {
+            errno = ENOSPC;
+            return NULL;
+        }
+
+        snapshot_block_count = get_snapshot_block_count(istore_block_count,
+            snapshot_pages);
+    }
+
+    uint64_t metadata_block_count = ifree_block_count + bfree_block_count +
+        istore_block_count + group_block_count + segment_block_count + 
+        index_block_count + ref_block_count + reflog_block_count + 
+        journal_block_count + snapshot_block_count + 1;
+
+    if (metadata_block_count >= block_count) {
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    uint64_t data_block_count = block_count - metadata_block_count;
+    uint64_t segment_count = (geometry->flags & DDFS_FS_LOG) ? 
+        data_block_count / DDFS_SEGMENT_BLOCKS : 0;
+
+    if ((geometry->flags & DDFS_FS_LOG) && 
+        segment_count <= DDFS_LOG_RESERVE) {
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    uint64_t istore_offset = (uint64_t)DDFS_BLOCK_SIZE
         * (ifree_block_count + bfree_block_count + 1);
-    uint32_t data_offset = istore_offset + 
+    uint64_t group_offset = istore_offset + 
         (istore_block_count * DDFS_BLOCK_SIZE);
+    uint64_t segment_offset = group_offset + 
+        (group_block_count * DDFS_BLOCK_SIZE);
+    uint64_t index_offset = segment_offset + 
+        (segment_block_count * DDFS_BLOCK_SIZE);
+    uint64_t ref_offset = index_offset + 
+        (index_block_count * DDFS_BLOCK_SIZE);
+    uint64_t reflog_offset = ref_offset + 
+        (ref_block_count * DDFS_BLOCK_SIZE);
+    uint64_t journal_offset = reflog_offset + 
+        (reflog_block_count * DDFS_BLOCK_SIZE);
+    uint64_t snapshot_offset = journal_offset + 
+        (journal_block_count * DDFS_BLOCK_SIZE);
+    uint64_t data_offset = snapshot_offset + 
+        (snapshot_block_count * DDFS_BLOCK_SIZE);
+
+    struct ddfs_superblock *sb = ddfs_malloc(DDFS_BLOCK_SIZE);
+    
+    if (sb == NULL) {
+        return NULL;
+    }
+
+    memset(sb, 0, DDFS_BLOCK_SIZE);
 
     sb->info = (struct ddfs_sb_info) {
         .fs_magic_num = htole32(DDFS_MAGIC_NUM),
+        .fs_revision = htole32(DDFS_REVISION),
         .fs_media_size = htole64(media_size),
         .fs_block_size = htole32(DDFS_BLOCK_SIZE),
-        .fs_block_count = htole32(block_count),
-        .fs_ifree_block_count = htole32(ifree_block_count),
-        .fs_bfree_block_count = htole32(bfree_block_count),
-        .fs_istore_block_count = htole32(istore_block_count),
-        .fs_data_block_count = htole32(data_block_count),
-        .fs_ifree_count = htole32(inode_count - 1),
-        .fs_bfree_count = htole32(block_count - 1),
+        .fs_block_count = htole64(block_count),
+        .fs_ifree_block_count = htole64(ifree_block_count),
+        .fs_bfree_block_count = htole64(bfree_block_count),
+        .fs_istore_block_count = htole64(istore_block_count),
+        .fs_data_block_count = htole64(data_block_count),
+        .fs_ifree_count = htole64(inode_count - 1),
+        .fs_bfree_count = htole64(block_count - 1),
         .fs_inode_size = htole32(inode_size),
-        .fs_inode_count = htole32(inode_count),
-        .fs_istore_offset = htole32(istore_offset),
-        .fs_data_offset = htole32(data_offset),
-        .fs_uid = htole32(getuid())
+        .fs_inode_count = htole64(inode_count),
+        .fs_istore_offset = htole64(istore_offset),
+        .fs_data_offset = htole64(data_offset),
+        .fs_group_count = htole64(group_count),
+        .fs_group_block_count = htole64(group_block_count),
+        .fs_group_offset = htole64(group_offset),
+        .fs_uid = htole32(getuid()),
         //int32_t fs_volume_name; // Volume name
+        .fs_load_factor = htole32(load_factor),
+        .fs_inode_ratio = htole64(inode_ratio),
+        .fs_key_count = htole64(key_count),
+        .fs_ref_block_count = htole64(ref_block_count),
+        .fs_ref_offset = htole64(ref_offset),
+        .fs_reflog_block_count = htole64(reflog_block_count),
+        .fs_reflog_offset = htole64(reflog_offset),
+        .fs_journal_block_count = htole64(journal_block_count),
+        .fs_journal_offset = htole64(journal_offset),
+        .fs_flags = htole32(geometry->flags),
+        .fs_segment_blocks = htole32(segment_count != 0 ? 
+            DDFS_SEGMENT_BLOCKS : 0),
+        .fs_segment_count = htole64(segment_count),
+        .fs_segment_block_count = htole64(segment_block_count),
+        .fs_segment_offset = htole64(segment_offset),
+        .fs_index_slots = htole64(index_slots),
+        .fs_index_block_count = htole64(index_block_count),
+        .fs_index_offset = htole64(index_offset),
+        .fs_snapshot_pages = htole64(snapshot_pages),
+        .fs_snapshot_block_count = htole64(snapshot_block_count),
+        .fs_snapshot_offset = htole64(snapshot_offset)
     };
 
     sb->info.fs_name[0] = 'k';
@@ -157,149 +444,105 @@ struct ddfs_superblock *write_superblock(int fd) {
     int ret = write_block(fd, sb, 0);
     
     if (ret != DDFS_BLOCK_SIZE) {
-        free(sb);
+        ddfs_free(sb);
         return NULL;
     }
 
     return sb;
 }
 
-int erase_disk(int fd) {
-    int64_t media_size = get_disk_media_size(fd);
-    uint32_t block_count = div_ceil(media_size, DDFS_BLOCK_SIZE);
-    void *buffer = malloc(DDFS_BLOCK_SIZE);
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
-    int ret;
-
-    for (uint32_t i = 0; i < block_count; i++) {
-        ret = write_block(fd, buffer, i);
-
-        if (ret == -1) {
-            perror("write");
-            close(fd);
-            return ret;
-        }
+// Check that a superblock belongs to an image of this format revision
+int check_superblock(struct ddfs_superblock *sb) {
+    if (le32toh(sb->info.fs_magic_num) != DDFS_MAGIC_NUM) {
+        return EXIT_FAILURE;
     }
 
-    return EXIT_SUCCESS;
-}
-
-int erase_superblock(int fd) {
-    void *buffer = malloc(DDFS_BLOCK_SIZE);
+    if (le32toh(sb->info.fs_revision) != DDFS_REVISION) {
+        fprintf(stderr, "ddfs: unsupported format revision %u\n", 
+            le32toh(sb->info.fs_revision));
+        return EXIT_FAILURE;
+    }
 
-    if (!buffer) {
+    if (le32toh(sb->info.fs_block_size) != DDFS_BLOCK_SIZE) {
+        fprintf(stderr, "ddfs: block size %u does not match this build "
+            "(%u)\n", le32toh(sb->info.fs_block_size), DDFS_BLOCK_SIZE);
         return EXIT_FAILURE;
     }
 
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
+    return EXIT_SUCCESS;
+}
 
-    int ret = write_block(fd, buffer, 0);
+// Make count blocks read back as zeros, as cheaply as the storage allows
+int zero_blocks(int fd, uint64_t block_number, uint64_t count) {
+    return get_backend(fd)->zero(fd, block_number, count);
+}
 
-    free(buffer);
-    return ret;
+// Tell the storage count blocks are unused. Their contents are undefined
+// afterwards.
+int discard_blocks(int fd, uint64_t block_number, uint64_t count) {
+    return get_backend(fd)->discard(fd, block_number, count);
 }
 
-// Erase free inode tracker blocks
-int erase_ifree_blocks(int fd) {
-    void *buffer = malloc(DDFS_BLOCK_SIZE);
+int erase_disk(int fd) {
+    int64_t media_size = get_disk_media_size(fd);
 
-    if (!buffer) {
+    if (media_size == -1) {
         return EXIT_FAILURE;
     }
 
-    struct ddfs_superblock *sb = read_superblock(fd);
+    return zero_blocks(fd, 0, div_ceil(media_size, DDFS_BLOCK_SIZE));
+}
+
+int erase_superblock(int fd) {
+    return zero_blocks(fd, 0, 1);
+}
+
+// Erase free inode tracker blocks
+int erase_ifree_blocks(int fd) {
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
-        free(buffer);
         return EXIT_FAILURE;
     }
 
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
-
-    int ret;
-
-    for (uint32_t i = 1; i < le32toh(sb->info.fs_ifree_block_count) + 1; i++) {
-        ret = write_block(fd, buffer, i);
-        
-        if (ret != DDFS_BLOCK_SIZE) {
-            free(buffer);
-            return EXIT_FAILURE;
-        }
-    }
+    int ret = zero_blocks(fd, 1, le64toh(sb->info.fs_ifree_block_count));
 
-    free(buffer);
-    return EXIT_SUCCESS;
+    put_block_buffer(sb);
+    return ret;
 }
 
 // Erase free block tracker blocks
 int erase_bfree_blocks(int fd) {
-    void *buffer = malloc(DDFS_BLOCK_SIZE);
-
-    if (!buffer) {
-        return EXIT_FAILURE;
-    }
-
-    struct ddfs_superblock *sb = read_superblock(fd);
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
-        free(buffer);
         return EXIT_FAILURE;
     }
 
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
+    int ret = zero_blocks(fd, le64toh(sb->info.fs_ifree_block_count) + 1, 
+        le64toh(sb->info.fs_bfree_block_count));
 
-    int ret;
-    uint32_t bfree_block_offset = sb->info.fs_ifree_block_count + 1;
-    uint32_t istore_block_offset = sb->info.fs_istore_offset / DDFS_BLOCK_SIZE;
-
-    for (uint32_t i = bfree_block_offset; i < istore_block_offset; i++) {
-        ret = write_block(fd, buffer, i);
-        
-        if (ret != DDFS_BLOCK_SIZE) {
-            free(buffer);
-            return EXIT_FAILURE;
-        }
-    }
-
-    free(buffer);
-    return EXIT_SUCCESS;
+    put_block_buffer(sb);
+    return ret;
 }
 
 int erase_inode_store(int fd) {
-    void *buffer = malloc(DDFS_BLOCK_SIZE);
-
-    if (!buffer) {
-        return EXIT_FAILURE;
-    }
-
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
-    struct ddfs_superblock *sb = read_superblock(fd);
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
-        free(buffer);
         return EXIT_FAILURE;
     }
 
-    int ret;
-    int istore_block_offset = sb->info.fs_istore_offset / DDFS_BLOCK_SIZE;
-
-    for (uint32_t i = istore_block_offset; 
-        i < (le32toh(sb->info.fs_istore_block_count) + 
-        istore_block_offset); i++) {
-        ret = write_block(fd, buffer, i);
-        
-        if (ret != DDFS_BLOCK_SIZE) {
-            free(buffer);
-            return EXIT_FAILURE;
-        }
-    }
+    int ret = zero_blocks(fd, 
+        le64toh(sb->info.fs_istore_offset) / DDFS_BLOCK_SIZE, 
+        le64toh(sb->info.fs_istore_block_count));
 
-    free(buffer);
-    return EXIT_SUCCESS;
+    put_block_buffer(sb);
+    return ret;
 }
 
 int64_t get_next_free_block(int fd) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
         return EXIT_FAILURE;
@@ -311,69 +554,191 @@ int64_t get_next_free_block(int fd) {
 
     for (uint64_t i = start_bit; i <= end_bit; i++) {
         if (get_bit(fd, i) == 0) {
-            free(sb);
+            put_block_buffer(sb);
             return i;
         }
     }
 
-    free(sb);
+    put_block_buffer(sb);
     return -1;
 }
 
 // Indicate that a block has been allocated
-int set_block_bit(int fd, uint32_t block_number) {
-    struct ddfs_superblock *sb = read_superblock(fd);
-
-    if (sb == NULL) {
-        return EXIT_FAILURE;
-    }
+int set_block_bit(int fd, uint64_t block_number) {
+    uint64_t bit_number = (DDFS_BLOCK_SIZE * 8) + block_number;
 
-    uint32_t bit_number = (DDFS_BLOCK_SIZE * 8) + block_number;
-
-    free(sb);
     return set_bit(fd, bit_number);
 }
 
 // Indicate that a block has been freed
-int clear_block_bit(int fd, uint32_t block_number) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+int clear_block_bit(int fd, uint64_t block_number) {
+    uint64_t bit_number = (DDFS_BLOCK_SIZE * 8) + block_number;
 
-    if (sb == NULL) {
+    return clear_bit(fd, bit_number);
+}
+
+// Get the allocation status of a block
+int get_block_bit(int fd, uint64_t block_number) {
+    uint64_t bit_number = (DDFS_BLOCK_SIZE * 8) + block_number;
+
+    return get_bit(fd, bit_number);
+}
+
+// Mark the superblock, the bitmaps and the inode store as in use in the
+// free block bitmap. The bitmap is built in memory DDFS_MAX_IOV blocks at
+// a time and written sequentially.
+static int reserve_metadata_blocks(int fd, struct ddfs_superblock *sb) {
+    uint64_t reserved = le64toh(sb->info.fs_data_offset) / DDFS_BLOCK_SIZE;
+    uint64_t bits_per_block = DDFS_BLOCK_SIZE * 8;
+    uint64_t bitmap_blocks = div_ceil(reserved, bits_per_block);
+    uint64_t bfree_block_offset = le64toh(sb->info.fs_ifree_block_count) + 1;
+    uint8_t *chunk = ddfs_memalign(DDFS_BLOCK_SIZE, 
+        DDFS_MAX_IOV * DDFS_BLOCK_SIZE);
+    void *buffers[DDFS_MAX_IOV];
+
+    if (chunk == NULL) {
         return EXIT_FAILURE;
     }
 
-    uint32_t bit_number = (DDFS_BLOCK_SIZE * 8) + block_number;
+    for (uint32_t i = 0; i < DDFS_MAX_IOV; i++) {
+        buffers[i] = chunk + ((size_t)i * DDFS_BLOCK_SIZE);
+    }
 
-    free(sb);
-    return clear_bit(fd, bit_number);
+    int ret = EXIT_SUCCESS;
+
+    for (uint64_t b = 0; b < bitmap_blocks; b += DDFS_MAX_IOV) {
+        uint32_t n = bitmap_blocks - b < DDFS_MAX_IOV ? 
+            bitmap_blocks - b : DDFS_MAX_IOV;
+        uint64_t bits = reserved - (b * bits_per_block);
+
+        if (bits > n * bits_per_block) {
+            bits = n * bits_per_block;
+        }
+
+        memset(chunk, 0, (size_t)n * DDFS_BLOCK_SIZE);
+        memset(chunk, 0xff, bits / 8);
+
+        if (bits % 8) {
+            chunk[bits / 8] = (1 << (bits % 8)) - 1;
+        }
+
+        if (write_blocks(fd, buffers, bfree_block_offset + b, n) != 
+            (int64_t)n * DDFS_BLOCK_SIZE) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    ddfs_free(chunk);
+    return ret;
 }
 
-// Get the allocation status of a block
-int get_block_bit(int fd, uint32_t block_number) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+// Blocks zeroed by one zero_blocks_parallel()
+struct ddfs_zero_job {
+    int fd; // Volume
+    uint64_t block_number; // First block
+    uint64_t count; // Number of blocks
+};
 
-    if (sb == NULL) {
-        return EXIT_FAILURE;
+static int zero_range(void *arg, uint32_t start, uint32_t end) {
+    struct ddfs_zero_job *job = arg;
+    uint64_t first = (uint64_t)start * DDFS_POOL_ZERO_BLOCKS;
+    uint64_t last = (uint64_t)end * DDFS_POOL_ZERO_BLOCKS;
+
+    if (last > job->count) {
+        last = job->count;
     }
 
-    uint32_t bit_number = (DDFS_BLOCK_SIZE * 8) + block_number;
+    return zero_blocks(job->fd, job->block_number + first, last - first);
+}
 
-    free(sb);
-    return get_bit(fd, bit_number);
+// Zero a long run of blocks in chunks spread over the worker pool
+static int zero_blocks_parallel(int fd, uint64_t block_number,
+    uint64_t count) {
+    struct ddfs_zero_job job = {
+        .fd = fd,
+        .block_number = block_number,
+        .count = count
+    };
+
+    return parallel_for(div_ceil(count, DDFS_POOL_ZERO_BLOCKS), 1,
+        DDFS_POOL_FOREGROUND, zero_range, &job);
 }
 
+// Format a volume with the default geometry
 int initialize_ddfs(int fd) {
+    return format_ddfs(fd, NULL);
+}
+
+// Format a volume with the given geometry, or the default one when it is
+// NULL. Old data blocks are discarded, the free block bitmap and the group
+// descriptor table are zeroed and the metadata blocks are reserved. Inode
+// groups start out uninitialized, so the free inode bitmap and the inode
+// store are not touched until they are used.
+int format_ddfs(int fd, const struct ddfs_geometry *geometry) {
+    // Changes to the old metadata are moot
+    free_journal(fd);
+    free_log(fd);
+    free_snapshots(fd);
+
     // Write superblock (block 0)
-    struct ddfs_superblock *sb = write_superblock(fd);
+    struct ddfs_superblock *sb = write_superblock(fd, geometry);
     
     if (sb == NULL) {
         perror("write_superblock()");
-        free(sb);
         return EXIT_FAILURE;
     }
-    
+
+    uint64_t data_block_offset = 
+        le64toh(sb->info.fs_data_offset) / DDFS_BLOCK_SIZE;
+
+    // Storage that cannot discard keeps its old data blocks
+    discard_blocks(fd, data_block_offset, 
+        le64toh(sb->info.fs_block_count) - data_block_offset);
+
+    int ret = zero_blocks_parallel(fd,
+        le64toh(sb->info.fs_ifree_block_count) + 1,
+        le64toh(sb->info.fs_bfree_block_count));
+
+    // The group descriptor table, the segment table, the fingerprint
+    // index, the reference count table, its log, the journal and the
+    // snapshot region sit between the inode store and the data region
+    if (ret == EXIT_SUCCESS) {
+        ret = zero_blocks_parallel(fd, 
+            le64toh(sb->info.fs_group_offset) / DDFS_BLOCK_SIZE, 
+            data_block_offset - 
+            (le64toh(sb->info.fs_group_offset) / DDFS_BLOCK_SIZE));
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        ret = initialize_reference_log(fd, sb);
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        ret = initialize_journal(fd, sb);
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        ret = initialize_snapshots(fd, sb);
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        ret = reserve_metadata_blocks(fd, sb);
+    }
+
+    ddfs_free(sb);
+
+    if (ret != EXIT_SUCCESS || load_journal(fd) != EXIT_SUCCESS ||
+        load_groups(fd) != EXIT_SUCCESS ||
+        load_reference_log(fd) != EXIT_SUCCESS ||
+        load_reclaim_queue(fd) != EXIT_SUCCESS ||
+        load_log(fd) != EXIT_SUCCESS ||
+        load_snapshots(fd) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
     // Initialize the superblock inode (inode 0)
-    int ret = initialize_superblock_inode(fd);
+    ret = initialize_superblock_inode(fd);
 
     if (ret) {
         return EXIT_FAILURE;
@@ -414,7 +779,7 @@ uint64_t key_hash(uint8_t key[20], uint64_t size) {
 void hash_block(uint8_t block[DDFS_BLOCK_SIZE], uint8_t **result) {
     uint8_t index;
     
-    for (uint16_t i = 0; i < DDFS_BLOCK_SIZE; i++) {
+    for (uint32_t i = 0; i < DDFS_BLOCK_SIZE; i++) {
         index = i % 20;
         //printf("%d ", index);
         (*result)[index] ^= block[i];
@@ -428,6 +793,40 @@ void hash_block(uint8_t block[DDFS_BLOCK_SIZE], uint8_t **result) {
     return;
 }
 
+// Blocks fingerprinted by one hash_blocks()
+struct ddfs_hash_job {
+    uint8_t **blocks; // Blocks to fingerprint, NULL to skip one
+    uint8_t **results; // Zeroed fingerprints to fill in
+};
+
+static int hash_range(void *arg, uint32_t start, uint32_t end) {
+    struct ddfs_hash_job *job = arg;
+
+    for (uint32_t i = start; i < end; i++) {
+        if (job->blocks[i] != NULL) {
+            hash_block(job->blocks[i], &job->results[i]);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Fingerprint count blocks at once, spread over the worker pool
+void hash_blocks(uint8_t **blocks, uint8_t **results, uint32_t count,
+    uint32_t priority) {
+    struct ddfs_hash_job job = { .blocks = blocks, .results = results };
+
+    parallel_for(count, DDFS_POOL_HASH_GRAIN, priority, hash_range, &job);
+}
+
+// Map a block fingerprint to its home block in the data region
+uint64_t get_data_block(struct ddfs_superblock *sb, uint8_t fingerprint[20]) {
+    uint64_t data_block_offset = sb->info.fs_data_offset / DDFS_BLOCK_SIZE;
+
+    return data_block_offset + 
+        key_hash(fingerprint, sb->info.fs_data_block_count);
+}
+
 // Shift the bits in a key to the right by a specified amount
 void shift_bits_right(uint8_t *key, uint8_t len, uint32_t shift) {
     uint8_t i = 0;
@@ -448,270 +847,605 @@ void shift_bits_right(uint8_t *key, uint8_t len, uint32_t shift) {
     return;
 }
 
-int create_kv_pair(int fd, uint8_t key[20], uint8_t *value) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+// Check whether a data block holds value. Returns 1 if it does, 0 if it
+// does not and -1 on error.
+static int block_holds(int fd, uint8_t *value, uint64_t block_number) {
+    uint8_t *block = get_block_address(fd, block_number, 1, 0);
 
-    if (sb == NULL) {
-        return EXIT_FAILURE;
+    // Mapped volumes compare the stored block in place
+    if (block != NULL) {
+        return memcmp(block, value, DDFS_BLOCK_SIZE) == 0;
     }
 
-    uint32_t inode_number = key_hash(key, sb->info.fs_inode_count);
-    int64_t inode_bit = get_inode_bit(fd, inode_number);
+    uint8_t *buffer = get_block_buffer();
+    int ret = -1;
 
-    if (inode_bit == -1) {
-        free(sb);
-        return EXIT_FAILURE;
+    if (buffer != NULL &&
+        read_block(fd, buffer, block_number) == DDFS_BLOCK_SIZE) {
+        ret = memcmp(buffer, value, DDFS_BLOCK_SIZE) == 0;
     }
 
-    uint8_t *result = calloc(20, sizeof(uint8_t));
-    uint8_t arr[20];
-    hash_block(value, &result);
+    put_block_buffer(buffer);
+    return ret;
+}
 
-    for (uint16_t c = 0; c < 20; c++) {
-        arr[c] = result[c];
+// Take a reference to a data block holding value, writing the value when
+// no block holds it yet. In place volumes use the block the fingerprint
+// hashes to, log-structured ones append the value to the head segment.
+// A home block that keys still refer to for a different value is left
+// alone, and the put fails with errno set to EEXIST.
+static int take_value_block(int fd, struct ddfs_superblock *sb, 
+    uint8_t *value, uint8_t fingerprint[20], uint64_t *block_ptr) {
+    if (le32toh(sb->info.fs_flags) & DDFS_FS_LOG) {
+        return store_value(fd, sb, value, fingerprint, block_ptr);
     }
-    
-    uint32_t block_ptr = key_hash(arr, sb->info.fs_block_count);
 
-    if (inode_bit == 0) {
-        if (initialize_inode(fd, inode_number, key, block_ptr) == NULL) {
-            free(sb);
-            return EXIT_FAILURE;
-        }
+    *block_ptr = get_data_block(sb, fingerprint);
+
+    // The block's lock keeps other puts hashing to it out until it holds
+    // the value, and the reference, taken first, keeps the collector from
+    // reclaiming it
+    int64_t previous;
+    lock_block(fd, *block_ptr);
+
+    if (take_references(fd, block_ptr, 1, &previous) != EXIT_SUCCESS) {
+        unlock_block(fd, *block_ptr);
+        return EXIT_FAILURE;
     }
 
-    int ret;
+    // Identical values share the block they hash to
+    int holds = block_holds(fd, value, *block_ptr);
+    int ret = EXIT_SUCCESS;
 
-    if (block_exists(fd, value)) {
-        ret = increment_reference_count(fd, inode_number);
-    } else {
-        ret = write_block(fd, value, block_ptr);
+    if (holds == -1 || (holds == 0 && previous > 0) || (holds == 0 &&
+        write_block(fd, value, *block_ptr) != DDFS_BLOCK_SIZE)) {
+        ret = EXIT_FAILURE;
+        release_block(fd, *block_ptr);
+
+        if (holds == 0 && previous > 0) {
+            errno = EEXIST;
+        }
     }
 
-    if (ret != DDFS_BLOCK_SIZE) {
-        free(sb);
+    unlock_block(fd, *block_ptr);
+    return ret;
+}
+
+// Replace the value of a stored key. The caller holds the key's locks.
+static int modify_locked(int fd, struct ddfs_superblock *sb, 
+    uint8_t key[20], uint8_t *value, uint64_t inode_number) {
+    uint64_t inode_block_number;
+    uint32_t inode_buffer_offset;
+    get_inode_location(sb, inode_number, &inode_block_number, 
+        &inode_buffer_offset);
+
+    uint8_t fingerprint[20];
+    uint8_t *result = fingerprint;
+    memset(fingerprint, 0, 20);
+    hash_block(value, &result);
+
+    if (get_inode_bit(fd, inode_number) != 1) {
         return EXIT_FAILURE;
     }
-    
-    free(sb);
-    return EXIT_SUCCESS;
-}
 
-int delete_kv_pair(int fd, uint8_t key[20]) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+    uint8_t *buffer = get_block_buffer();
 
-    if (sb == NULL) {
+    if (buffer == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    if (read_block(fd, buffer, inode_block_number) != DDFS_BLOCK_SIZE) {
+        put_block_buffer(buffer);
         return EXIT_FAILURE;
     }
 
     struct ddfs_inode *inode = 
-        (struct ddfs_inode*)malloc(sizeof(struct ddfs_inode));
+        (struct ddfs_inode *)(buffer + inode_buffer_offset);
 
-    if (inode == NULL) {
-        free(sb);
+    if (memcmp(inode->info.i_key, key, 20) != 0) {
+        put_block_buffer(buffer);
         return EXIT_FAILURE;
     }
 
-    memset(inode, 0, sizeof(struct ddfs_inode));
-    
-    uint32_t inode_number = key_hash(key, sb->info.fs_inode_count);
-    inode = get_inode(fd, inode_number);
+    // The new block gains its reference before the inode points at it.
+    // An append may run the segment cleaner, which repoints inodes, so
+    // log-structured volumes read the inode block again.
+    uint64_t block_ptr;
 
-    if (inode == NULL) {
-        free(sb);
-        free(inode);
+    if (take_value_block(fd, sb, value, fingerprint, &block_ptr) != 
+        EXIT_SUCCESS) {
+        put_block_buffer(buffer);
         return EXIT_FAILURE;
     }
 
-    void *value = malloc(DDFS_BLOCK_SIZE);
-    memset(value, 0, DDFS_BLOCK_SIZE);
+    if ((le32toh(sb->info.fs_flags) & DDFS_FS_LOG) && 
+        read_block(fd, buffer, inode_block_number) != DDFS_BLOCK_SIZE) {
+        put_block_buffer(buffer);
+        release_block(fd, block_ptr);
+        return EXIT_FAILURE;
+    }
 
-    uint8_t key_bool = 0;
-    int ret;
+    uint64_t old_block_ptr = inode->info.i_block_ptr;
+    inode->info.i_block_ptr = block_ptr;
+    inode->info.i_mod_time = time(NULL);
 
-    for (uint8_t i = 0; i < 20; i++) {
-        if (key[i] == inode->info.i_key[i]) {
-            key_bool = 1;
-        } else {
-            key_bool = 0;
-            break;
-        }
+    if (write_block(fd, buffer, inode_block_number) != DDFS_BLOCK_SIZE) {
+        put_block_buffer(buffer);
+        release_block(fd, block_ptr);
+        return EXIT_FAILURE;
     }
-    
-    if (key_bool == 1) {
-        if (get_reference_count(fd, inode_number) > 0) {
-            ret = decrement_reference_count(fd, inode_number);
-        } else {
-            inode = free_inode(fd, inode_number);
-        
-            if (inode == NULL) {
-                free(sb);
-                free(inode);
-                return EXIT_FAILURE;
-            }
-            
-            ret = write_block(fd, value, inode->info.i_block_ptr);
 
-            if (ret != DDFS_BLOCK_SIZE) {
-                free(sb);
-                free(inode);
-                return EXIT_FAILURE;
+    put_block_buffer(buffer);
+    return release_block(fd, old_block_ptr);
+}
+
+// Store a value under a key. The key takes a reference to the data block
+// holding its value, and putting a stored key again replaces its value.
+// Keys whose inodes share no inode store block are stored in parallel.
+int create_kv_pair(int fd, uint8_t key[20], uint8_t *value) {
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    uint64_t inode_number = key_hash(key, sb->info.fs_inode_count);
+    struct ddfs_key_locks locks;
+    key_locks_init(&locks, fd);
+    key_locks_add(&locks, sb, inode_number);
+    lock_keys(&locks, 1);
+
+    int64_t inode_bit = get_inode_bit(fd, inode_number);
+    int ret = EXIT_FAILURE;
+
+    if (inode_bit == 1) {
+        ret = modify_locked(fd, sb, key, value, inode_number);
+    } else if (inode_bit == 0) {
+        uint8_t fingerprint[20];
+        uint8_t *result = fingerprint;
+        memset(fingerprint, 0, 20);
+        hash_block(value, &result);
+
+        uint64_t block_ptr;
+
+        if (take_value_block(fd, sb, value, fingerprint, &block_ptr) == 
+            EXIT_SUCCESS) {
+            struct ddfs_inode *inode = initialize_inode(fd, inode_number, 
+                key, block_ptr);
+
+            if (inode != NULL) {
+                put_inode(inode);
+                ret = EXIT_SUCCESS;
+            } else {
+                release_block(fd, block_ptr);
             }
         }
-
-        free(sb);
-        free(inode);
-        return EXIT_SUCCESS;
     }
-    
-    free(sb);
-    free(inode);
-    free(value);
-    return EXIT_SUCCESS;
+
+    unlock_keys(&locks);
+    put_block_buffer(sb);
+    return ret;
 }
 
-int get_value(int fd, uint8_t key[20], uint8_t *value) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+// Remove a key, dropping its reference to its data block. Removing a key
+// that is not stored succeeds.
+int delete_kv_pair(int fd, uint8_t key[20]) {
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
         return EXIT_FAILURE;
     }
 
-    struct ddfs_inode *inode = 
-        (struct ddfs_inode*)malloc(sizeof(struct ddfs_inode));
+    uint64_t inode_number = key_hash(key, sb->info.fs_inode_count);
+    struct ddfs_key_locks locks;
+    key_locks_init(&locks, fd);
+    key_locks_add(&locks, sb, inode_number);
+    put_block_buffer(sb);
+    lock_keys(&locks, 1);
+
+    int inode_bit = get_inode_bit(fd, inode_number);
+    struct ddfs_inode *inode = NULL;
+    int ret = EXIT_FAILURE;
+
+    if (inode_bit != 1) {
+        ret = inode_bit == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if ((inode = get_inode(fd, inode_number)) != NULL) {
+        int key_match = memcmp(key, inode->info.i_key, 20) == 0;
+        put_inode(inode);
+        inode = NULL;
+
+        if (!key_match) {
+            ret = EXIT_SUCCESS;
+        } else if ((inode = free_inode(fd, inode_number)) != NULL) {
+            ret = release_block(fd, inode->info.i_block_ptr);
+            put_inode(inode);
+        }
+    }
+
+    unlock_keys(&locks);
+    return ret;
+}
+
+// Get the data block of the key stored in an inode slot, or -1. The
+// caller holds the key's locks.
+static int64_t find_value_block(int fd, uint8_t key[20], 
+    uint64_t inode_number) {
+    struct ddfs_inode *inode = get_inode(fd, inode_number);
 
     if (inode == NULL) {
-        free(sb);
+        return -1;
+    }
+
+    int64_t block_ptr = -1;
+
+    if (memcmp(inode->info.i_key, key, 20) == 0) {
+        block_ptr = inode->info.i_block_ptr;
+    }
+
+    put_inode(inode);
+    return block_ptr;
+}
+
+// Lock a key for a lookup that could not complete without its locks
+static int lock_key(int fd, uint8_t key[20], struct ddfs_key_locks *locks,
+    uint64_t *inode_number) {
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
         return EXIT_FAILURE;
     }
 
-    memset(inode, 0, sizeof(struct ddfs_inode));
-    memset(value, 0, DDFS_BLOCK_SIZE);
+    *inode_number = key_hash(key, sb->info.fs_inode_count);
+    key_locks_init(locks, fd);
+    key_locks_add(locks, sb, *inode_number);
+    put_block_buffer(sb);
+    lock_keys(locks, 0);
+    return EXIT_SUCCESS;
+}
 
-    uint32_t inode_number = key_hash(key, sb->info.fs_inode_count);
-    int64_t inode_bit = get_inode_bit(fd, inode_number);
-    inode = get_inode(fd, inode_number);
+// Look a key up without taking its locks, reading its value too unless
+// value is NULL. Fails if every try overlapped a change to the key, which
+// leaves the lookup to the locked path.
+static int find_value_unlocked(int fd, uint8_t key[20], uint8_t *value,
+    int64_t *block_ptr) {
+    struct ddfs_superblock *sb = get_superblock(fd);
+    struct ddfs_key_read read;
 
-    if (inode_bit == -1) {
-        free(sb);
-        free(inode);
+    if (sb == NULL) {
         return EXIT_FAILURE;
     }
 
-    if (inode_bit == 1) {
-        uint8_t key_bool = 0;
-        int ret;
+    uint64_t inode_number = key_hash(key, sb->info.fs_inode_count);
+    key_read_init(&read, fd, sb, inode_number);
+    put_block_buffer(sb);
 
-        for (uint8_t i = 0; i < 20; i++) {
-            if (key[i] == inode->info.i_key[i]) {
-                key_bool = 1;
-            } else {
-                key_bool = 0;
-                break;
-            }
+    for (uint32_t i = 0; i < DDFS_LOCK_READ_TRIES; i++) {
+        if (begin_key_read(&read) != EXIT_SUCCESS) {
+            continue;
         }
-        
-        if (key_bool == 1) {
-            ret = read_block(fd, value, inode->info.i_block_ptr);
 
-            if (ret != DDFS_BLOCK_SIZE) {
-                free(sb);
-                free(inode);
-                return EXIT_FAILURE;
+        // A torn inode may name any block; reads stay within the volume
+        // and the result is thrown away unless the lookup validates
+        *block_ptr = find_value_block(fd, key, inode_number);
+
+        if (*block_ptr != -1 && value != NULL &&
+            read_block(fd, value, *block_ptr) != DDFS_BLOCK_SIZE) {
+            *block_ptr = -1;
+        }
+
+        if (validate_key_read(&read) == EXIT_SUCCESS) {
+            if (*block_ptr == -1 && value != NULL) {
+                memset(value, 0, DDFS_BLOCK_SIZE);
             }
 
-            free(sb);
-            free(inode);
             return EXIT_SUCCESS;
         }
     }
 
-    free(sb);
-    free(inode);
     return EXIT_FAILURE;
 }
 
-int rename_key(int fd, uint8_t old_key[20], uint8_t new_key[20]) {
-    void *value = malloc(DDFS_BLOCK_SIZE);
+int get_value(int fd, uint8_t key[20], uint8_t *value) {
+    int64_t block_ptr;
 
-    if (value == NULL) {
-        return EXIT_FAILURE;
+    if (find_value_unlocked(fd, key, value, &block_ptr) == EXIT_SUCCESS) {
+        return block_ptr != -1 ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    if (get_value(fd, old_key, value) != 0) {
-        free(value);
+    memset(value, 0, DDFS_BLOCK_SIZE);
+
+    struct ddfs_key_locks locks;
+    uint64_t inode_number;
+
+    if (lock_key(fd, key, &locks, &inode_number) != EXIT_SUCCESS) {
         return EXIT_FAILURE;
     }
 
-    if (delete_kv_pair(fd, old_key) != 0) {
-        free(value);
-        return EXIT_FAILURE;
+    // The value is read under the key's locks, so the cleaner cannot move
+    // it and reuse its block in between
+    block_ptr = find_value_block(fd, key, inode_number);
+    int ret = EXIT_FAILURE;
+
+    if (block_ptr != -1 && 
+        read_block(fd, value, block_ptr) == DDFS_BLOCK_SIZE) {
+        ret = EXIT_SUCCESS;
     }
-    
-    if (create_kv_pair(fd, new_key, value) != 0) {
-        free(value);
-        return EXIT_FAILURE;
+
+    unlock_keys(&locks);
+    return ret;
+}
+
+// Get the data block holding a key's value, or -1 if the key is not found
+int64_t get_value_block(int fd, uint8_t key[20]) {
+    struct ddfs_key_locks locks;
+    uint64_t inode_number;
+    int64_t block_ptr;
+
+    if (find_value_unlocked(fd, key, NULL, &block_ptr) == EXIT_SUCCESS) {
+        return block_ptr;
     }
 
-    free(value);
-    return EXIT_SUCCESS;
+    if (lock_key(fd, key, &locks, &inode_number) != EXIT_SUCCESS) {
+        return -1;
+    }
+
+    block_ptr = find_value_block(fd, key, inode_number);
+    unlock_keys(&locks);
+    return block_ptr;
 }
 
-int modify_value(int fd, uint8_t key[20], uint8_t *value) {
-    if (delete_kv_pair(fd, key) != 0) {
-        return EXIT_FAILURE;
+// Get the data block holding a key's value with the block pinned, or -1
+// if the key is not found. The pin is taken under the key's locks, so the
+// block outlives deletes and modifies of the key until unpin_block() lets
+// it go. Pins live in memory only, so nothing is written.
+int64_t pin_value_block(int fd, uint8_t key[20]) {
+    struct ddfs_key_locks locks;
+    uint64_t inode_number;
+
+    if (lock_key(fd, key, &locks, &inode_number) != EXIT_SUCCESS) {
+        return -1;
     }
-    
-    if (create_kv_pair(fd, key, value) != 0) {
+
+    int64_t block_ptr = find_value_block(fd, key, inode_number);
+
+    if (block_ptr != -1 && pin_block(fd, block_ptr) != EXIT_SUCCESS) {
+        block_ptr = -1;
+    }
+
+    unlock_keys(&locks);
+    return block_ptr;
+}
+
+// Move an inode between slots. The caller holds both keys' locks, and the
+// bitmap blocks are locked here since they are read and written whole.
+static int rename_locked(int fd, struct ddfs_superblock *sb, 
+    uint8_t old_key[20], uint8_t new_key[20], uint64_t old_number, 
+    uint64_t new_number) {
+    uint64_t old_block, new_block, old_bit_block, new_bit_block;
+    uint32_t old_offset, new_offset, old_byte, new_byte;
+    uint8_t old_mask, new_mask;
+
+    get_inode_location(sb, old_number, &old_block, &old_offset);
+    get_inode_location(sb, new_number, &new_block, &new_offset);
+    get_bit_location((DDFS_BLOCK_SIZE * 8) + old_number, &old_bit_block, 
+        &old_byte, &old_mask);
+    get_bit_location((DDFS_BLOCK_SIZE * 8) + new_number, &new_bit_block, 
+        &new_byte, &new_mask);
+
+    // The bitmap blocks are read directly, so the old key's group must be
+    // initialized and the new key's group is initialized up front
+    if (get_group_state(fd, sb, get_inode_group(old_number)) != 1 ||
+        initialize_group(fd, sb, get_inode_group(new_number)) != 
+        EXIT_SUCCESS) {
         return EXIT_FAILURE;
     }
 
-    return EXIT_SUCCESS;
+    struct ddfs_lock_set bitmaps;
+    lock_set_init(&bitmaps, fd, DDFS_LOCK_BLOCKS);
+    lock_set_add(&bitmaps, old_bit_block);
+    lock_set_add(&bitmaps, new_bit_block);
+    lock_set_acquire(&bitmaps);
+
+    uint8_t *old_buffer = get_block_buffer();
+    uint8_t *new_buffer = get_block_buffer();
+    uint8_t *old_bitmap = get_block_buffer();
+    uint8_t *new_bitmap = get_block_buffer();
+    int ret = EXIT_FAILURE;
+
+    if (old_buffer == NULL || new_buffer == NULL || old_bitmap == NULL ||
+        new_bitmap == NULL) {
+        goto out;
+    }
+
+    if (read_block(fd, old_bitmap, old_bit_block) != DDFS_BLOCK_SIZE ||
+        read_block(fd, old_buffer, old_block) != DDFS_BLOCK_SIZE) {
+        goto out;
+    }
+
+    struct ddfs_inode *inode = 
+        (struct ddfs_inode *)(old_buffer + old_offset);
+
+    if (!(old_bitmap[old_byte] & old_mask) || 
+        memcmp(inode->info.i_key, old_key, 20) != 0) {
+        goto out;
+    }
+
+    // Both keys share a slot, so only the key changes
+    if (old_number == new_number) {
+        memcpy(inode->info.i_key, new_key, 20);
+        inode->info.i_mod_time = time(NULL);
+
+        if (write_block(fd, old_buffer, old_block) == DDFS_BLOCK_SIZE) {
+            ret = EXIT_SUCCESS;
+        }
+
+        goto out;
+    }
+
+    if (new_bit_block == old_bit_block) {
+        memcpy(new_bitmap, old_bitmap, DDFS_BLOCK_SIZE);
+    } else if (read_block(fd, new_bitmap, new_bit_block) != DDFS_BLOCK_SIZE) {
+        goto out;
+    }
+
+    // The new key's slot must be free
+    if (new_bitmap[new_byte] & new_mask) {
+        goto out;
+    }
+
+    uint8_t *target = old_buffer;
+
+    if (new_block != old_block) {
+        target = new_buffer;
+
+        if (read_block(fd, new_buffer, new_block) != DDFS_BLOCK_SIZE) {
+            goto out;
+        }
+    }
+
+    struct ddfs_inode *moved = (struct ddfs_inode *)(target + new_offset);
+    memcpy(moved, inode, sizeof(struct ddfs_inode));
+    memcpy(moved->info.i_key, new_key, 20);
+    moved->info.i_number = new_number;
+    moved->info.i_mod_time = time(NULL);
+
+    if (write_block(fd, target, new_block) != DDFS_BLOCK_SIZE) {
+        goto out;
+    }
+
+    // Flip both bits with one block write when they share a bitmap block
+    new_bitmap[new_byte] |= new_mask;
+
+    if (new_bit_block == old_bit_block) {
+        new_bitmap[old_byte] &= ~old_mask;
+    }
+
+    if (write_block(fd, new_bitmap, new_bit_block) != DDFS_BLOCK_SIZE) {
+        goto out;
+    }
+
+    if (new_bit_block != old_bit_block) {
+        old_bitmap[old_byte] &= ~old_mask;
+
+        if (write_block(fd, old_bitmap, old_bit_block) != DDFS_BLOCK_SIZE) {
+            goto out;
+        }
+    }
+
+    // Clear the old inode so a stale slot never matches the old key
+    memset(inode, 0, sizeof(struct ddfs_inode));
+
+    if (write_block(fd, old_buffer, old_block) == DDFS_BLOCK_SIZE) {
+        ret = EXIT_SUCCESS;
+    }
+
+out:
+    lock_set_release(&bitmaps);
+    put_block_buffer(old_buffer);
+    put_block_buffer(new_buffer);
+    put_block_buffer(old_bitmap);
+    put_block_buffer(new_bitmap);
+    return ret;
 }
 
-int block_exists(int fd, uint8_t *value) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+// Move a key's inode to the new key's slot without touching its value.
+// The new inode is written first and the bitmap update is the commit
+// point, so a crash leaves either the old key or the new key in place.
+int rename_key(int fd, uint8_t old_key[20], uint8_t new_key[20]) {
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
-        return 0;
+        return EXIT_FAILURE;
     }
-    
-    uint8_t *result1 = calloc(20, sizeof(uint8_t));
-    uint8_t *result2 = calloc(20, sizeof(uint8_t));
-    uint8_t arr1[20];
-    uint8_t arr2[20];
 
-    hash_block(value, &result1);
-    
-    for (uint16_t i = 0; i < 20; i++) {
-        arr1[i] = result1[i];
-    }
+    uint64_t old_number = key_hash(old_key, sb->info.fs_inode_count);
+    uint64_t new_number = key_hash(new_key, sb->info.fs_inode_count);
+    struct ddfs_key_locks locks;
+    key_locks_init(&locks, fd);
+    key_locks_add(&locks, sb, old_number);
+    key_locks_add(&locks, sb, new_number);
+    lock_keys(&locks, 1);
 
-    uint32_t block_ptr = key_hash(arr1, sb->info.fs_block_count);
+    int ret = rename_locked(fd, sb, old_key, new_key, old_number, 
+        new_number);
 
-    void *test_value = malloc(DDFS_BLOCK_SIZE);
+    unlock_keys(&locks);
+    put_block_buffer(sb);
+    return ret;
+}
 
-    if (test_value == NULL) {
+// Point a key at a new value with one data write and one inode update.
+// The value goes to its own home block unless that block already holds
+// it, and the data is written before the inode so a crash leaves the old
+// value in place. A home block other keys refer to for a different value
+// is never written: the modify fails with EEXIST and the key keeps its
+// old value. The key's reference moves to the new block, and the old
+// block is only zeroed once no other key shares it.
+int modify_value(int fd, uint8_t key[20], uint8_t *value) {
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
         return EXIT_FAILURE;
     }
 
-    int ret = read_block(fd, test_value, block_ptr);
+    uint64_t inode_number = key_hash(key, sb->info.fs_inode_count);
+    struct ddfs_key_locks locks;
+    key_locks_init(&locks, fd);
+    key_locks_add(&locks, sb, inode_number);
+    lock_keys(&locks, 1);
 
-    if (ret != DDFS_BLOCK_SIZE) {
-        free(sb);
+    int ret = modify_locked(fd, sb, key, value, inode_number);
+
+    unlock_keys(&locks);
+    put_block_buffer(sb);
+    return ret;
+}
+
+int block_exists(int fd, uint8_t *value) {
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
         return 0;
     }
+    
+    uint8_t fingerprint[20];
+    uint8_t stored_fingerprint[20];
+    uint8_t *result = fingerprint;
+    memset(fingerprint, 0, 20);
+    memset(stored_fingerprint, 0, 20);
+    hash_block(value, &result);
+
+    // Log-structured volumes look the value up in their index
+    if (le32toh(sb->info.fs_flags) & DDFS_FS_LOG) {
+        put_block_buffer(sb);
+        return find_value(fd, value, fingerprint) > 0;
+    }
+
+    uint64_t block_ptr = get_data_block(sb, fingerprint);
+    put_block_buffer(sb);
 
-    hash_block(test_value, &result2);
+    uint8_t *block = get_block_address(fd, block_ptr, 1, 0);
+    uint8_t *test_value = NULL;
 
-    for (uint16_t j = 0; j < 20; j++) {
-        arr2[j] = result2[j];
+    // Mapped volumes hash the stored block in place
+    if (block == NULL) {
+        test_value = get_block_buffer();
 
-        if (arr1[j] != arr2[j]) {
+        if (test_value == NULL) {
             return 0;
         }
+
+        if (read_block(fd, test_value, block_ptr) != DDFS_BLOCK_SIZE) {
+            put_block_buffer(test_value);
+            return 0;
+        }
+
+        block = test_value;
     }
 
-    free(sb);
-    return 1;
+    result = stored_fingerprint;
+    hash_block(block, &result);
+    put_block_buffer(test_value);
+
+    return memcmp(fingerprint, stored_fingerprint, 20) == 0;
 }
@@ -1,6 +1,7 @@
 #ifndef ddfs_H
 #define	ddfs_H
 
+#ifdef __FreeBSD__
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/conf.h>
@@ -9,52 +10,130 @@
 #include <sys/kernel.h>
 #include <sys/module.h>
 #include <sys/mount.h>
-#include <sys/stat.h>
 #include <sys/sx.h>
 #include <sys/tree.h>
 #include <sys/vnode.h>
+#include <sys/disk.h>
+#include <sys/endian.h>
+#else
+#include <endian.h>
+#endif
+
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/disk.h>
-#include <sys/endian.h>
 #include <sys/ioctl.h>
-#include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+// The block size is fixed when the library is built (make BLOCK_SIZE=n),
+// so every block size calculation folds to a constant
+#ifndef DDFS_BLOCK_SIZE
 #define DDFS_BLOCK_SIZE 4096
-#define DDFS_MAGIC_NUM 0xBA5ED
+#endif
+#define DDFS_MIN_BLOCK_SIZE 4096
+#define DDFS_MAX_BLOCK_SIZE 65536
+
+#if DDFS_BLOCK_SIZE < DDFS_MIN_BLOCK_SIZE || \
+    DDFS_BLOCK_SIZE > DDFS_MAX_BLOCK_SIZE || \
+    (DDFS_BLOCK_SIZE & (DDFS_BLOCK_SIZE - 1)) != 0
+#error "DDFS_BLOCK_SIZE must be a power of two from 4 KiB to 64 KiB"
+#endif
 
+#define DDFS_MAGIC_NUM 0xBA5ED
+#define DDFS_REVISION 9 // On-disk format revision
+#define DDFS_LOAD_FACTOR 100 // Default percent of inode slots keys fill
+#define DDFS_MAX_IOV 256 // Blocks per vectored read or write
+#define DDFS_FS_LOG 0x1 // Data blocks are appended to log segments
+
+// Format revision 2 widened block numbers, counts and byte offsets to
+// 64 bits, revision 3 added inode groups, revision 4 recorded the
+// geometry chosen at format time, revision 5 added the reference count
+// table and its delta log, revision 6 added the metadata journal,
+// revision 7 added the log-structured layout, revision 8 added the
+// snapshot region and revision 9 stamped each reference count table block
+// with the epoch of the last log applied to it. Revision 1 images leave
+// fs_revision zero.
 struct ddfs_sb_info {
     uint32_t fs_magic_num; // Magic number
+    uint32_t fs_revision; // On-disk format revision
     uint64_t fs_media_size; // Total number of bytes
     uint32_t fs_block_size; // Block size
-    uint32_t fs_block_count; // Total number of blocks
-    uint32_t fs_ifree_block_count; // Number of free inode bitmap blocks
-    uint32_t fs_bfree_block_count; // Number of free block bitmap blocks
-    uint32_t fs_istore_block_count; // Number of inode store blocks
-    uint32_t fs_data_block_count; // Number of data blocks
     uint32_t fs_inode_size; // Size of an inode
-    uint32_t fs_inode_count; // Total number of inodes
-    uint32_t fs_ifree_count; // Free inode count
-    uint32_t fs_bfree_count; // Free block count
-    uint32_t fs_istore_offset; // Inode store offset
-    uint32_t fs_data_offset; // Data offset
+    uint64_t fs_block_count; // Total number of blocks
+    uint64_t fs_ifree_block_count; // Number of free inode bitmap blocks
+    uint64_t fs_bfree_block_count; // Number of free block bitmap blocks
+    uint64_t fs_istore_block_count; // Number of inode store blocks
+    uint64_t fs_data_block_count; // Number of data blocks
+    uint64_t fs_inode_count; // Total number of inodes
+    uint64_t fs_ifree_count; // Free inode count
+    uint64_t fs_bfree_count; // Free block count
+    uint64_t fs_istore_offset; // Inode store offset in bytes
+    uint64_t fs_data_offset; // Data offset in bytes
+    uint64_t fs_group_count; // Number of inode groups
+    uint64_t fs_group_block_count; // Number of group descriptor blocks
+    uint64_t fs_group_offset; // Group descriptor table offset in bytes
     uint32_t fs_uid; // Filesystem uid
     char fs_name[12]; // Filesystem name
     char fs_volume_name[12]; // Volume name
+    uint32_t fs_load_factor; // Percent of the inode slots keys fill
+    uint64_t fs_inode_ratio; // Bytes of media per expected key
+    uint64_t fs_key_count; // Expected number of keys
+    uint64_t fs_ref_block_count; // Number of reference count table blocks
+    uint64_t fs_ref_offset; // Reference count table offset in bytes
+    uint64_t fs_reflog_block_count; // Number of reference log blocks
+    uint64_t fs_reflog_offset; // Reference log offset in bytes
+    uint64_t fs_journal_block_count; // Number of metadata journal blocks
+    uint64_t fs_journal_offset; // Metadata journal offset in bytes
+    uint32_t fs_flags; // DDFS_FS_* flags
+    uint32_t fs_segment_blocks; // Blocks per log segment
+    uint64_t fs_segment_count; // Number of log segments
+    uint64_t fs_segment_block_count; // Number of segment table blocks
+    uint64_t fs_segment_offset; // Segment table offset in bytes
+    uint64_t fs_index_slots; // Number of fingerprint index slots
+    uint64_t fs_index_block_count; // Number of fingerprint index blocks
+    uint64_t fs_index_offset; // Fingerprint index offset in bytes
+    uint64_t fs_snapshot_pages; // Inode store blocks snapshots can keep
+    uint64_t fs_snapshot_block_count; // Number of snapshot region blocks
+    uint64_t fs_snapshot_offset; // Snapshot region offset in bytes
+};
+
+// Geometry chosen when a volume is formatted. Zero fields take their
+// defaults: the build's block size, one expected key per block and a
+// load factor of DDFS_LOAD_FACTOR. A key count overrides the ratio.
+// DDFS_FS_LOG in flags appends data blocks to log segments instead of
+// placing each at the block its fingerprint hashes to. In place volumes
+// set aside a pool of snapshot_pages pages for the inode store blocks
+// snapshots keep, a quarter of the inode store by default.
+struct ddfs_geometry {
+    uint32_t block_size; // Block size, must match DDFS_BLOCK_SIZE
+    uint32_t load_factor; // Percent of the inode slots keys fill
+    uint64_t inode_ratio; // Bytes of media per expected key
+    uint64_t key_count; // Expected number of keys
+    uint32_t flags; // DDFS_FS_* flags
+    uint64_t snapshot_pages; // Inode store blocks snapshots can keep
 };
 
 struct ddfs_superblock {
     struct ddfs_sb_info info; // Superblock information
-    char padding[4000]; // Padding to match block size
+    char padding[DDFS_BLOCK_SIZE - 
+        sizeof(struct ddfs_sb_info)]; // Padding to match block size
 };
 
-extern inline uint32_t div_ceil(uint32_t a, uint32_t b);
+// A run of adjacent blocks transferred with a single request
+struct ddfs_io_run {
+    uint64_t block_number; // First block of the run
+    uint32_t count; // Number of blocks in the run
+    void **buffers; // One buffer per block
+    int64_t result; // Bytes transferred, or -1 on error
+};
+
+extern inline uint64_t div_ceil(uint64_t a, uint64_t b);
 
 extern int64_t get_disk_media_size(int fd);
 
@@ -62,13 +141,35 @@ extern int64_t get_disk_block_size(int fd);
 
 extern int64_t get_disk_sector_size(int fd);
 
-extern int read_block(int fd, void *buffer, uint32_t block_number);
+extern uint8_t *get_block_address(int fd, uint64_t block_number, 
+    uint32_t count, int write);
+
+extern int read_block(int fd, void *buffer, uint64_t block_number);
+
+extern int write_block(int fd, void *buffer, uint64_t block_number);
+
+extern int64_t read_blocks(int fd, void **buffers, uint64_t block_number, 
+    uint32_t count);
 
-extern int write_block(int fd, void *buffer, uint32_t block_number);
+extern int64_t write_blocks(int fd, void **buffers, uint64_t block_number, 
+    uint32_t count);
+
+extern int read_runs(int fd, struct ddfs_io_run *runs, uint32_t count);
+
+extern int write_runs(int fd, struct ddfs_io_run *runs, uint32_t count);
 
 extern struct ddfs_superblock *read_superblock(int fd);
 
-extern struct ddfs_superblock *write_superblock(int fd);
+extern struct ddfs_superblock *get_superblock(int fd);
+
+extern struct ddfs_superblock *write_superblock(int fd, 
+    const struct ddfs_geometry *geometry);
+
+extern int check_superblock(struct ddfs_superblock *sb);
+
+extern int zero_blocks(int fd, uint64_t block_number, uint64_t count);
+
+extern int discard_blocks(int fd, uint64_t block_number, uint64_t count);
 
 extern int erase_disk(int fd);
 
@@ -82,14 +183,16 @@ extern int erase_inode_store(int fd);
 
 extern int64_t get_next_free_block(int fd);
 
-extern int set_block_bit(int fd, uint32_t block_number);
+extern int set_block_bit(int fd, uint64_t block_number);
 
-extern int clear_block_bit(int fd, uint32_t block_number);
+extern int clear_block_bit(int fd, uint64_t block_number);
 
-extern int get_block_bit(int fd, uint32_t block_number);
+extern int get_block_bit(int fd, uint64_t block_number);
 
 extern int initialize_ddfs(int fd);
 
+extern int format_ddfs(int fd, const struct ddfs_geometry *geometry);
+
 extern void file_name_to_key(char *file_name, uint8_t key[20]);
 
 extern uint64_t key_hash(uint8_t key[20], uint64_t size);
@@ -97,6 +200,12 @@ extern uint64_t key_hash(uint8_t key[20], uint64_t size);
 extern void hash_block(uint8_t block[DDFS_BLOCK_SIZE], 
     uint8_t **result);
 
+extern void hash_blocks(uint8_t **blocks, uint8_t **results, uint32_t count,
+    uint32_t priority);
+
+extern uint64_t get_data_block(struct ddfs_superblock *sb, 
+    uint8_t fingerprint[20]);
+
 extern void shift_bits_right(uint8_t *key, uint8_t len, uint32_t shift);
 
 extern int create_kv_pair(int fd, uint8_t key[20], uint8_t *value);
@@ -105,6 +214,10 @@ extern int delete_kv_pair(int fd, uint8_t key[20]);
 
 extern int get_value(int fd, uint8_t key[20], uint8_t *value);
 
+extern int64_t get_value_block(int fd, uint8_t key[20]);
+
+extern int64_t pin_value_block(int fd, uint8_t key[20]);
+
 extern int rename_key(int fd, uint8_t old_key[20], uint8_t new_key[20]);
 
 extern int modify_value(int fd, uint8_t key[20], uint8_t *value);
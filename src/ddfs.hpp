@@ -0,0 +1,549 @@
+#ifndef ddfs_HPP
+#define	ddfs_HPP
+
+// Header-only C++17 interface to DDFS: a movable volume handle that closes
+// its descriptor, a key value type, buffers passed as spans and results
+// that carry an error instead of EXIT_FAILURE. Nothing here allocates; the
+// calls reuse the library's per-thread buffers and slabs like the C API.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+extern "C" {
+#include "ddfs.h"
+#include "ddfs_alloc.h"
+#include "ddfs_batch.h"
+#include "ddfs_inode.h"
+#include "ddfs_volume.h"
+}
+
+namespace ddfs {
+
+constexpr std::size_t block_size = DDFS_BLOCK_SIZE;
+constexpr std::size_t key_size = 20;
+
+enum class Error {
+    failed, // The volume refused or could not complete the operation
+    bad_size, // A buffer does not hold a block
+    bad_key // A key string is not 40 hexadecimal digits
+};
+
+// Value or the error that prevented it
+template <typename T>
+class Expected {
+public:
+    constexpr Expected(T value) : state(std::in_place_index<0>,
+        std::move(value)) {}
+
+    constexpr Expected(Error error) : state(std::in_place_index<1>, error) {}
+
+    constexpr bool has_value() const noexcept {
+        return state.index() == 0;
+    }
+
+    constexpr explicit operator bool() const noexcept {
+        return has_value();
+    }
+
+    // Throws std::bad_variant_access without a value
+    constexpr T &value() & {
+        return std::get<0>(state);
+    }
+
+    constexpr const T &value() const & {
+        return std::get<0>(state);
+    }
+
+    constexpr T &&value() && {
+        return std::move(std::get<0>(state));
+    }
+
+    constexpr T &operator*() & {
+        return value();
+    }
+
+    constexpr const T &operator*() const & {
+        return value();
+    }
+
+    constexpr T *operator->() {
+        return &value();
+    }
+
+    constexpr const T *operator->() const {
+        return &value();
+    }
+
+    // Throws std::bad_variant_access with a value
+    constexpr Error error() const {
+        return std::get<1>(state);
+    }
+
+private:
+    std::variant<T, Error> state;
+};
+
+template <>
+class Expected<void> {
+public:
+    constexpr Expected() noexcept : failure(), ok(true) {}
+
+    constexpr Expected(Error error) noexcept : failure(error), ok(false) {}
+
+    constexpr bool has_value() const noexcept {
+        return ok;
+    }
+
+    constexpr explicit operator bool() const noexcept {
+        return ok;
+    }
+
+    constexpr Error error() const noexcept {
+        return failure;
+    }
+
+private:
+    Error failure;
+    bool ok;
+};
+
+// Map a C return code to a result
+constexpr Expected<void> check(int ret) noexcept {
+    if (ret != EXIT_SUCCESS) {
+        return Error::failed;
+    }
+
+    return {};
+}
+
+// Contiguous elements owned elsewhere, like std::span, which C++17 lacks
+template <typename T>
+class Span {
+public:
+    constexpr Span() noexcept = default;
+
+    constexpr Span(T *data, std::size_t size) noexcept : first(data),
+        count(size) {}
+
+    template <std::size_t N>
+    constexpr Span(T (&array)[N]) noexcept : first(array), count(N) {}
+
+    // Anything with data() and size() of a compatible element type, such
+    // as std::array, std::vector, std::span or a Span of non-const T
+    template <typename Container, typename = std::enable_if_t<
+        !std::is_same_v<std::decay_t<Container>, Span> &&
+        std::is_convertible_v<decltype(std::declval<Container &>().data()),
+        T *>>>
+    constexpr Span(Container &&container) noexcept :
+        first(container.data()), count(container.size()) {}
+
+    constexpr T *data() const noexcept {
+        return first;
+    }
+
+    constexpr std::size_t size() const noexcept {
+        return count;
+    }
+
+    constexpr bool empty() const noexcept {
+        return count == 0;
+    }
+
+    constexpr T &operator[](std::size_t i) const noexcept {
+        return first[i];
+    }
+
+    constexpr T *begin() const noexcept {
+        return first;
+    }
+
+    constexpr T *end() const noexcept {
+        return first + count;
+    }
+
+private:
+    T *first = nullptr;
+    std::size_t count = 0;
+};
+
+// 160-bit key, laid out exactly like the C API's uint8_t key[20]
+class Key {
+public:
+    constexpr Key() noexcept : bytes() {}
+
+    constexpr explicit Key(const std::array<std::uint8_t, key_size> &b)
+        noexcept : bytes(b) {}
+
+    // Copy a key from the C API
+    static Key from_bytes(const std::uint8_t key[key_size]) noexcept {
+        Key result;
+
+        std::memcpy(result.bytes.data(), key, key_size);
+        return result;
+    }
+
+    // Parse 40 hexadecimal digits, either case, the way file names spell
+    // keys
+    static constexpr Expected<Key> from_hex(std::string_view hex) noexcept {
+        Key result;
+
+        if (hex.size() != 2 * key_size) {
+            return Error::bad_key;
+        }
+
+        for (std::size_t i = 0; i < key_size; i++) {
+            int high = hex_digit(hex[2 * i]);
+            int low = hex_digit(hex[2 * i + 1]);
+
+            if (high < 0 || low < 0) {
+                return Error::bad_key;
+            }
+
+            result.bytes[i] = static_cast<std::uint8_t>(high << 4 | low);
+        }
+
+        return result;
+    }
+
+    // Slot of the key among size slots, the library's key_hash()
+    constexpr std::uint64_t hash(std::uint64_t size) const noexcept {
+        std::uint64_t result = 0;
+
+        for (std::uint8_t byte : bytes) {
+            result ^= byte;
+            result ^= result >> 33;
+            result *= 0xff51afd7ed558ccdULL;
+            result ^= result >> 33;
+            result *= 0xc4ceb9fe1a85ec53ULL;
+            result ^= result >> 33;
+        }
+
+        return result % size;
+    }
+
+    constexpr std::uint8_t *data() noexcept {
+        return bytes.data();
+    }
+
+    constexpr const std::uint8_t *data() const noexcept {
+        return bytes.data();
+    }
+
+    static constexpr std::size_t size() noexcept {
+        return key_size;
+    }
+
+    constexpr std::uint8_t &operator[](std::size_t i) noexcept {
+        return bytes[i];
+    }
+
+    constexpr const std::uint8_t &operator[](std::size_t i) const noexcept {
+        return bytes[i];
+    }
+
+    constexpr bool operator==(const Key &other) const noexcept {
+        for (std::size_t i = 0; i < key_size; i++) {
+            if (bytes[i] != other.bytes[i]) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    constexpr bool operator!=(const Key &other) const noexcept {
+        return !(*this == other);
+    }
+
+private:
+    static constexpr int hex_digit(char c) noexcept {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+
+        return -1;
+    }
+
+    std::array<std::uint8_t, key_size> bytes;
+};
+
+static_assert(sizeof(Key) == key_size, "Key must match uint8_t[20]");
+
+// Layout of a volume, copied from its superblock once so that the slot
+// and location math inlines instead of rereading the superblock
+class Geometry {
+public:
+    // Where an inode lives in the inode store
+    struct InodeLocation {
+        std::uint64_t block; // Inode store block holding the inode
+        std::uint32_t offset; // Byte offset of the inode in the block
+    };
+
+    constexpr Geometry() noexcept = default;
+
+    constexpr explicit Geometry(const ddfs_sb_info &info) noexcept :
+        inodes(info.fs_inode_count), inode_bytes(info.fs_inode_size),
+        istore_offset(info.fs_istore_offset),
+        data_blocks(info.fs_data_block_count),
+        data_offset(info.fs_data_offset),
+        flags(info.fs_flags) {}
+
+    constexpr std::uint64_t inode_count() const noexcept {
+        return inodes;
+    }
+
+    constexpr bool log_structured() const noexcept {
+        return (flags & DDFS_FS_LOG) != 0;
+    }
+
+    // Inode number a key hashes to
+    constexpr std::uint64_t inode_number(const Key &key) const noexcept {
+        return inodes != 0 ? key.hash(inodes) : 0;
+    }
+
+    constexpr InodeLocation inode_location(std::uint64_t inode_number) const
+        noexcept {
+        std::uint64_t offset = istore_offset + inode_number * inode_bytes;
+
+        return { offset / block_size,
+            static_cast<std::uint32_t>(offset % block_size) };
+    }
+
+    // Block a value with this fingerprint is stored at, on volumes that
+    // are not log-structured
+    constexpr std::uint64_t home_block(const Key &fingerprint) const
+        noexcept {
+        return data_offset / block_size +
+            (data_blocks != 0 ? fingerprint.hash(data_blocks) : 0);
+    }
+
+private:
+    std::uint64_t inodes = 0;
+    std::uint32_t inode_bytes = 0;
+    std::uint64_t istore_offset = 0;
+    std::uint64_t data_blocks = 0;
+    std::uint64_t data_offset = 0;
+    std::uint32_t flags = 0;
+};
+
+// Returns an inode to the calling thread's slab
+struct InodeRelease {
+    void operator()(ddfs_inode *inode) const noexcept {
+        put_inode(inode);
+    }
+};
+
+using Inode = std::unique_ptr<ddfs_inode, InodeRelease>;
+
+// Open volume, closed when the handle goes away. Values are exactly one
+// block; gets need room for one.
+class Volume {
+public:
+    static Expected<Volume> open(const char *path, int oflag = O_RDWR,
+        std::uint32_t flags = 0) noexcept {
+        int fd = ddfs_open(path, oflag, flags);
+
+        if (fd == -1) {
+            return Error::failed;
+        }
+
+        return Volume(fd);
+    }
+
+    static Expected<Volume> open_memory(std::uint64_t size) noexcept {
+        int fd = ddfs_open_memory(size);
+
+        if (fd == -1) {
+            return Error::failed;
+        }
+
+        return Volume(fd);
+    }
+
+    Volume(Volume &&other) noexcept : descriptor(std::exchange(
+        other.descriptor, -1)), layout(other.layout) {}
+
+    Volume &operator=(Volume &&other) noexcept {
+        if (this != &other) {
+            close();
+            descriptor = std::exchange(other.descriptor, -1);
+            layout = other.layout;
+        }
+
+        return *this;
+    }
+
+    Volume(const Volume &) = delete;
+    Volume &operator=(const Volume &) = delete;
+
+    ~Volume() {
+        close();
+    }
+
+    int fd() const noexcept {
+        return descriptor;
+    }
+
+    // Empty until the volume holds a valid superblock
+    const Geometry &geometry() const noexcept {
+        return layout;
+    }
+
+    Expected<void> format(const ddfs_geometry *geometry = nullptr) noexcept {
+        Expected<void> ret = check(format_ddfs(descriptor, geometry));
+
+        load_geometry();
+        return ret;
+    }
+
+    Expected<void> put(const Key &key, Span<const std::uint8_t> value)
+        noexcept {
+        if (value.size() != block_size) {
+            return Error::bad_size;
+        }
+
+        return check(create_kv_pair(descriptor, c_key(key),
+            const_cast<std::uint8_t *>(value.data())));
+    }
+
+    Expected<void> get(const Key &key, Span<std::uint8_t> value) noexcept {
+        if (value.size() < block_size) {
+            return Error::bad_size;
+        }
+
+        return check(get_value(descriptor, c_key(key), value.data()));
+    }
+
+    Expected<void> modify(const Key &key, Span<const std::uint8_t> value)
+        noexcept {
+        if (value.size() != block_size) {
+            return Error::bad_size;
+        }
+
+        return check(modify_value(descriptor, c_key(key),
+            const_cast<std::uint8_t *>(value.data())));
+    }
+
+    Expected<void> erase(const Key &key) noexcept {
+        return check(delete_kv_pair(descriptor, c_key(key)));
+    }
+
+    Expected<void> rename(const Key &old_key, const Key &new_key) noexcept {
+        return check(rename_key(descriptor, c_key(old_key),
+            c_key(new_key)));
+    }
+
+    // Block the key's value is stored in
+    Expected<std::uint64_t> value_block(const Key &key) noexcept {
+        std::int64_t block = get_value_block(descriptor, c_key(key));
+
+        if (block < 0) {
+            return Error::failed;
+        }
+
+        return static_cast<std::uint64_t>(block);
+    }
+
+    // Put or get keys[i] with values[i] in batches, setting status[i] for
+    // each key. Fails if any key failed.
+    Expected<void> put_batch(Span<const Key> keys,
+        Span<std::uint8_t *const> values, Span<int> status) noexcept {
+        return batch(keys, values, status, ddfs_put_batch);
+    }
+
+    Expected<void> get_batch(Span<const Key> keys,
+        Span<std::uint8_t *const> values, Span<int> status) noexcept {
+        return batch(keys, values, status, ddfs_get_batch);
+    }
+
+    // Inode in the given slot, released when the handle goes away
+    Expected<Inode> inode(std::uint64_t inode_number) noexcept {
+        ddfs_inode *inode = get_inode(descriptor, inode_number);
+
+        if (inode == nullptr) {
+            return Error::failed;
+        }
+
+        return Inode(inode);
+    }
+
+    Expected<void> sync() noexcept {
+        return check(ddfs_sync(descriptor));
+    }
+
+private:
+    explicit Volume(int fd) noexcept : descriptor(fd) {
+        load_geometry();
+    }
+
+    void close() noexcept {
+        if (descriptor != -1) {
+            ddfs_close(descriptor);
+            descriptor = -1;
+        }
+    }
+
+    void load_geometry() noexcept {
+        ddfs_superblock *sb = get_superblock(descriptor);
+
+        layout = Geometry();
+
+        if (sb != nullptr) {
+            if (check_superblock(sb) == EXIT_SUCCESS) {
+                layout = Geometry(sb->info);
+            }
+
+            put_block_buffer(sb);
+        }
+    }
+
+    // The C API takes keys as mutable arrays but leaves them unchanged
+    static std::uint8_t *c_key(const Key &key) noexcept {
+        return const_cast<std::uint8_t *>(key.data());
+    }
+
+    Expected<void> batch(Span<const Key> keys,
+        Span<std::uint8_t *const> values, Span<int> status,
+        int (*run)(int, std::uint8_t (*)[20], std::uint8_t **, std::uint32_t,
+        int *)) noexcept {
+        if (values.size() < keys.size() || status.size() < keys.size()) {
+            return Error::bad_size;
+        }
+
+        if (keys.empty()) {
+            return {};
+        }
+
+        Expected<void> ret = check(run(descriptor,
+            reinterpret_cast<std::uint8_t (*)[20]>(c_key(*keys.data())),
+            const_cast<std::uint8_t **>(values.data()),
+            static_cast<std::uint32_t>(keys.size()), status.data()));
+
+        for (std::size_t i = 0; ret && i < keys.size(); i++) {
+            if (status[i] != EXIT_SUCCESS) {
+                ret = Error::failed;
+            }
+        }
+
+        return ret;
+    }
+
+    int descriptor = -1; // Descriptor from ddfs_open(), or -1 once closed
+    Geometry layout; // Geometry of the volume when it was last formatted
+                     // or opened
+};
+
+} // namespace ddfs
+
+#endif
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ddfs_alloc.h"
+#include "ddfs_inode.h"
+
+static struct ddfs_stats stats;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void count_allocation(size_t size) {
+    __atomic_fetch_add(&stats.allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.allocated_bytes, size, __ATOMIC_RELAXED);
+}
+
+// Heap allocation wrappers that feed the allocation counters
+void *ddfs_malloc(size_t size) {
+    count_allocation(size);
+    return malloc(size);
+}
+
+void *ddfs_calloc(size_t count, size_t size) {
+    count_allocation(count * size);
+    return calloc(count, size);
+}
+
+void *ddfs_memalign(size_t alignment, size_t size) {
+    void *ptr;
+    count_allocation(size);
+
+    if (posix_memalign(&ptr, alignment, size) != 0) {
+        return NULL;
+    }
+
+    return ptr;
+}
+
+void *ddfs_realloc(void *ptr, size_t size) {
+    count_allocation(size);
+    return realloc(ptr, size);
+}
+
+void ddfs_free(void *ptr) {
+    free(ptr);
+}
+
+void ddfs_get_stats(struct ddfs_stats *result) {
+    result->allocations =
+        __atomic_load_n(&stats.allocations, __ATOMIC_RELAXED);
+    result->allocated_bytes =
+        __atomic_load_n(&stats.allocated_bytes, __ATOMIC_RELAXED);
+}
+
+struct ddfs_arena_mark arena_mark(struct ddfs_arena *arena) {
+    struct ddfs_arena_mark mark = { arena->current, 0 };
+
+    if (arena->current != NULL) {
+        mark.used = arena->current->used;
+    }
+
+    return mark;
+}
+
+// Release everything allocated since the mark. Later chunks are emptied
+// when the arena moves on to them again.
+void arena_reset(struct ddfs_arena *arena, struct ddfs_arena_mark mark) {
+    arena->current = mark.chunk != NULL ? mark.chunk : arena->head;
+
+    if (arena->current != NULL) {
+        arena->current->used = mark.used;
+    }
+}
+
+// Chunk memory starts one block after the header so block-sized
+// allocations can be block aligned
+static uint8_t *chunk_data(struct ddfs_arena_chunk *chunk) {
+    return (uint8_t *)chunk + DDFS_BLOCK_SIZE;
+}
+
+void *arena_alloc(struct ddfs_arena *arena, size_t size, size_t alignment) {
+    struct ddfs_arena_chunk *chunk = arena->current;
+
+    while (chunk != NULL) {
+        size_t offset = (chunk->used + alignment - 1) & ~(alignment - 1);
+
+        if (offset + size <= chunk->size) {
+            chunk->used = offset + size;
+            arena->current = chunk;
+            return chunk_data(chunk) + offset;
+        }
+
+        chunk = chunk->next;
+
+        if (chunk != NULL) {
+            chunk->used = 0;
+        }
+    }
+
+    size_t chunk_size = size > DDFS_ARENA_CHUNK ? size : DDFS_ARENA_CHUNK;
+    chunk = ddfs_memalign(DDFS_BLOCK_SIZE, DDFS_BLOCK_SIZE + chunk_size);
+
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    chunk->size = chunk_size;
+    chunk->used = size;
+    chunk->next = NULL;
+
+    // Append after the last chunk so every chunk is reused after a reset
+    if (arena->head == NULL) {
+        arena->head = chunk;
+    } else {
+        struct ddfs_arena_chunk *last = arena->current;
+
+        while (last->next != NULL) {
+            last = last->next;
+        }
+
+        last->next = chunk;
+    }
+
+    arena->current = chunk;
+    return chunk_data(chunk);
+}
+
+void *arena_calloc(struct ddfs_arena *arena, size_t count, size_t size) {
+    void *ptr = arena_alloc(arena, count * size, sizeof(uint64_t));
+
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+
+    return ptr;
+}
+
+void arena_destroy(struct ddfs_arena *arena) {
+    struct ddfs_arena_chunk *chunk = arena->head;
+
+    while (chunk != NULL) {
+        struct ddfs_arena_chunk *next = chunk->next;
+        ddfs_free(chunk);
+        chunk = next;
+    }
+
+    memset(arena, 0, sizeof(struct ddfs_arena));
+}
+
+void slab_pool_init(struct ddfs_slab_pool *pool, size_t object_size,
+    size_t alignment) {
+    memset(pool, 0, sizeof(struct ddfs_slab_pool));
+    pool->object_size = object_size;
+    pool->alignment = alignment;
+}
+
+// Take an object, carving a new slab when the free list is empty
+void *slab_alloc(struct ddfs_slab_pool *pool) {
+    if (pool->free_list == NULL) {
+        void **slabs = ddfs_realloc(pool->slabs,
+            (pool->slab_count + 1) * sizeof(void *));
+
+        if (slabs == NULL) {
+            return NULL;
+        }
+
+        pool->slabs = slabs;
+        uint8_t *slab = ddfs_memalign(pool->alignment,
+            pool->object_size * DDFS_SLAB_OBJECTS);
+
+        if (slab == NULL) {
+            return NULL;
+        }
+
+        pool->slabs[pool->slab_count++] = slab;
+
+        for (uint32_t i = 0; i < DDFS_SLAB_OBJECTS; i++) {
+            slab_free(pool, slab + (i * pool->object_size));
+        }
+    }
+
+    void *object = pool->free_list;
+    pool->free_list = *(void **)object;
+    return object;
+}
+
+void slab_free(struct ddfs_slab_pool *pool, void *object) {
+    if (object != NULL) {
+        *(void **)object = pool->free_list;
+        pool->free_list = object;
+    }
+}
+
+void slab_pool_destroy(struct ddfs_slab_pool *pool) {
+    for (uint32_t i = 0; i < pool->slab_count; i++) {
+        ddfs_free(pool->slabs[i]);
+    }
+
+    ddfs_free(pool->slabs);
+    memset(pool, 0, sizeof(struct ddfs_slab_pool));
+}
+
+static void destroy_scratch(void *ptr) {
+    struct ddfs_scratch *scratch = ptr;
+
+    arena_destroy(&scratch->arena);
+    slab_pool_destroy(&scratch->blocks);
+    slab_pool_destroy(&scratch->inodes);
+    ddfs_free(scratch);
+}
+
+static void create_scratch_key(void) {
+    pthread_key_create(&scratch_key, destroy_scratch);
+}
+
+// Get the scratch memory of the calling thread. Objects taken from it
+// must be released on the same thread before the thread exits.
+struct ddfs_scratch *get_scratch(void) {
+    pthread_once(&scratch_once, create_scratch_key);
+    struct ddfs_scratch *scratch = pthread_getspecific(scratch_key);
+
+    if (scratch != NULL) {
+        return scratch;
+    }
+
+    scratch = ddfs_calloc(1, sizeof(struct ddfs_scratch));
+
+    if (scratch == NULL) {
+        return NULL;
+    }
+
+    slab_pool_init(&scratch->blocks, DDFS_BLOCK_SIZE, DDFS_BLOCK_SIZE);
+    slab_pool_init(&scratch->inodes, sizeof(struct ddfs_inode),
+        sizeof(uint64_t));
+    pthread_setspecific(scratch_key, scratch);
+    return scratch;
+}
+
+// Take a block-aligned block buffer from the calling thread's pool
+uint8_t *get_block_buffer(void) {
+    struct ddfs_scratch *scratch = get_scratch();
+
+    if (scratch == NULL) {
+        return NULL;
+    }
+
+    return slab_alloc(&scratch->blocks);
+}
+
+void put_block_buffer(void *buffer) {
+    struct ddfs_scratch *scratch = get_scratch();
+
+    if (scratch != NULL) {
+        slab_free(&scratch->blocks, buffer);
+    }
+}
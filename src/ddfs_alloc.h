@@ -0,0 +1,93 @@
+#ifndef ddfs_ALLOC_H
+#define	ddfs_ALLOC_H
+
+#include "ddfs.h"
+
+#define DDFS_ARENA_CHUNK (64 * DDFS_BLOCK_SIZE) // Smallest arena chunk
+#define DDFS_SLAB_OBJECTS 64 // Objects carved from each slab
+
+// Memory statistics of the engine
+struct ddfs_stats {
+    uint64_t allocations; // Heap allocations made by the engine
+    uint64_t allocated_bytes; // Bytes requested by those allocations
+};
+
+// Chunk of arena memory, block aligned
+struct ddfs_arena_chunk {
+    struct ddfs_arena_chunk *next; // Next chunk, kept across resets
+    size_t size; // Usable bytes after the header
+    size_t used; // Bytes handed out
+};
+
+// Bump allocator for scratch memory that lives until the operation that
+// took it resets the arena. Chunks are kept after a reset, so an arena
+// stops allocating once it has grown to its high-water mark.
+struct ddfs_arena {
+    struct ddfs_arena_chunk *head; // First chunk
+    struct ddfs_arena_chunk *current; // Chunk allocations come from
+};
+
+// Position in an arena to reset it back to
+struct ddfs_arena_mark {
+    struct ddfs_arena_chunk *chunk; // Current chunk when marked
+    size_t used; // Bytes used in that chunk when marked
+};
+
+// Free list of fixed-size objects carved from slabs that are never
+// returned to the heap
+struct ddfs_slab_pool {
+    size_t object_size; // Size of each object
+    size_t alignment; // Alignment of each object
+    void *free_list; // Free objects, linked through their first bytes
+    void **slabs; // Slabs carved so far
+    uint32_t slab_count; // Number of slabs
+};
+
+// Scratch memory of one thread
+struct ddfs_scratch {
+    struct ddfs_arena arena; // Variable-size scratch
+    struct ddfs_slab_pool blocks; // Block buffers, block aligned
+    struct ddfs_slab_pool inodes; // Inode objects
+};
+
+extern void *ddfs_malloc(size_t size);
+
+extern void *ddfs_calloc(size_t count, size_t size);
+
+extern void *ddfs_memalign(size_t alignment, size_t size);
+
+extern void *ddfs_realloc(void *ptr, size_t size);
+
+extern void ddfs_free(void *ptr);
+
+extern void ddfs_get_stats(struct ddfs_stats *stats);
+
+extern struct ddfs_arena_mark arena_mark(struct ddfs_arena *arena);
+
+extern void arena_reset(struct ddfs_arena *arena,
+    struct ddfs_arena_mark mark);
+
+extern void *arena_alloc(struct ddfs_arena *arena, size_t size,
+    size_t alignment);
+
+extern void *arena_calloc(struct ddfs_arena *arena, size_t count,
+    size_t size);
+
+extern void arena_destroy(struct ddfs_arena *arena);
+
+extern void slab_pool_init(struct ddfs_slab_pool *pool, size_t object_size,
+    size_t alignment);
+
+extern void *slab_alloc(struct ddfs_slab_pool *pool);
+
+extern void slab_free(struct ddfs_slab_pool *pool, void *object);
+
+extern void slab_pool_destroy(struct ddfs_slab_pool *pool);
+
+extern struct ddfs_scratch *get_scratch(void);
+
+extern uint8_t *get_block_buffer(void);
+
+extern void put_block_buffer(void *buffer);
+
+#endif
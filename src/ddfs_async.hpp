@@ -0,0 +1,364 @@
+#ifndef ddfs_ASYNC_HPP
+#define	ddfs_ASYNC_HPP
+
+// C++20 coroutine interface to a DDFS volume. Requests from any number of
+// coroutines queue up on a store's event loop, whose threads hand every
+// request waiting at once to ddfs_get_batch() or ddfs_put_batch(), so
+// thousands of outstanding operations share a handful of threads and reach
+// the device as batched, merged and, with DDFS_OPEN_URING, queued I/O.
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <latch>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ddfs.hpp"
+
+namespace ddfs {
+
+// Value of a key, DDFS_BLOCK_SIZE bytes, or empty if the get failed
+using Value = std::vector<std::byte>;
+
+enum class Status {
+    ok,
+    error // The put failed, or its value was longer than a block
+};
+
+// Lazily started coroutine producing a T. Awaiting it runs it, and the
+// awaiting coroutine resumes wherever the task finishes.
+template <typename T>
+class task {
+public:
+    struct promise_type {
+        std::optional<T> value; // Result once the coroutine returned
+        std::exception_ptr error; // Exception the coroutine exited with
+        std::coroutine_handle<> continuation; // Coroutine awaiting it
+
+        task get_return_object() {
+            return task(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        // Hand the thread straight to the awaiting coroutine
+        struct final_awaiter {
+            bool await_ready() noexcept {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(
+                std::coroutine_handle<promise_type> handle) noexcept {
+                std::coroutine_handle<> next =
+                    handle.promise().continuation;
+
+                return next ? next : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        final_awaiter final_suspend() noexcept {
+            return {};
+        }
+
+        void return_value(T result) {
+            value = std::move(result);
+        }
+
+        void unhandled_exception() {
+            error = std::current_exception();
+        }
+    };
+
+    task(task &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+
+    task &operator=(task &&other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+
+            handle = std::exchange(other.handle, {});
+        }
+
+        return *this;
+    }
+
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    ~task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+
+    T await_resume() {
+        if (handle.promise().error) {
+            std::rethrow_exception(handle.promise().error);
+        }
+
+        return std::move(*handle.promise().value);
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> coroutine)
+        : handle(coroutine) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+
+// Coroutine that starts at once and frees itself when done, used to drive
+// tasks from threads that are not coroutines
+struct detached {
+    struct promise_type {
+        detached get_return_object() noexcept {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() noexcept {}
+
+        void unhandled_exception() noexcept {
+            std::terminate();
+        }
+    };
+};
+
+template <typename T>
+detached drive(task<T> work, T *result, std::latch *done) {
+    *result = co_await work;
+    done->count_down();
+}
+
+} // namespace detail
+
+// Run tasks at once, blocking the calling thread until all of them have
+// finished, and return their results in order
+template <typename T>
+std::vector<T> sync_wait_all(std::vector<task<T>> tasks) {
+    std::vector<T> results(tasks.size());
+    std::latch done(static_cast<std::ptrdiff_t>(tasks.size()));
+
+    for (std::size_t i = 0; i < tasks.size(); i++) {
+        detail::drive(std::move(tasks[i]), &results[i], &done);
+    }
+
+    done.wait();
+    return results;
+}
+
+template <typename T>
+T sync_wait(task<T> work) {
+    std::vector<task<T>> tasks;
+
+    tasks.push_back(std::move(work));
+    return std::move(sync_wait_all(std::move(tasks))[0]);
+}
+
+// Event loop serving coroutine gets and puts on an open volume. Requests
+// outstanding at the same time may run in either order; a coroutine that
+// awaits a put before its get always reads what it put. Coroutines resume
+// on a loop thread, so they should hand long work elsewhere.
+class Store {
+public:
+    explicit Store(int volume_fd, unsigned threads = 1) : fd(volume_fd) {
+        for (unsigned i = 0; i < (threads != 0 ? threads : 1); i++) {
+            loop_threads.emplace_back([this] { run_loop(); });
+        }
+    }
+
+    Store(const Store &) = delete;
+    Store &operator=(const Store &) = delete;
+
+    // Finish every queued request before the loop stops
+    ~Store() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+
+        wake.notify_all();
+
+        for (std::thread &thread : loop_threads) {
+            thread.join();
+        }
+    }
+
+    task<Value> get(const Key &key) {
+        Request request;
+
+        request.key = key;
+        request.value.resize(DDFS_BLOCK_SIZE);
+        co_await Submit{this, &request};
+        co_return request.status == EXIT_SUCCESS ? std::move(request.value) :
+            Value();
+    }
+
+    // Values shorter than a block are padded with zeros
+    task<Status> put(const Key &key, std::span<const std::byte> value) {
+        if (value.size() > DDFS_BLOCK_SIZE) {
+            co_return Status::error;
+        }
+
+        Request request;
+
+        request.key = key;
+        request.put = true;
+        request.value.resize(DDFS_BLOCK_SIZE);
+        std::memcpy(request.value.data(), value.data(), value.size());
+        co_await Submit{this, &request};
+        co_return request.status == EXIT_SUCCESS ? Status::ok :
+            Status::error;
+    }
+
+private:
+    // Operation waiting in the queue, living in its coroutine's frame
+    struct Request {
+        Key key; // Key of the operation
+        Value value; // Value to put, or buffer the get fills in
+        bool put = false; // Whether the request is a put
+        int status = EXIT_FAILURE; // Result of the batch entry
+        std::coroutine_handle<> waiter; // Coroutine to resume
+    };
+
+    // Queue a request and suspend until a loop thread has served it
+    struct Submit {
+        Store *store;
+        Request *request;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> waiter) {
+            request->waiter = waiter;
+
+            {
+                std::lock_guard<std::mutex> guard(store->lock);
+                store->queue.push_back(request);
+            }
+
+            store->wake.notify_one();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    // Take whatever is queued, up to a batch, serve the puts and then the
+    // gets with one batch call each and resume the waiters
+    void run_loop() {
+        std::vector<Request *> taken;
+        std::vector<Request *> puts;
+        std::vector<Request *> gets;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+
+                wake.wait(guard, [this] {
+                    return stopping || !queue.empty();
+                });
+
+                if (queue.empty()) {
+                    return;
+                }
+
+                std::size_t count = queue.size() < DDFS_BATCH_MAX ?
+                    queue.size() : DDFS_BATCH_MAX;
+
+                taken.assign(queue.begin(), queue.begin() + count);
+                queue.erase(queue.begin(), queue.begin() + count);
+            }
+
+            puts.clear();
+            gets.clear();
+
+            for (Request *request : taken) {
+                (request->put ? puts : gets).push_back(request);
+            }
+
+            serve(puts, true);
+            serve(gets, false);
+
+            for (Request *request : taken) {
+                request->waiter.resume();
+            }
+        }
+    }
+
+    void serve(std::vector<Request *> &requests, bool put) {
+        std::size_t n = requests.size();
+
+        if (n == 0) {
+            return;
+        }
+
+        std::vector<Key> keys(n);
+        std::vector<std::uint8_t *> values(n);
+        std::vector<int> status(n, EXIT_FAILURE);
+
+        for (std::size_t i = 0; i < n; i++) {
+            keys[i] = requests[i]->key;
+            values[i] = reinterpret_cast<std::uint8_t *>(
+                requests[i]->value.data());
+        }
+
+        auto key_rows = reinterpret_cast<std::uint8_t (*)[20]>(keys.data());
+
+        if (put) {
+            ddfs_put_batch(fd, key_rows, values.data(),
+                static_cast<std::uint32_t>(n), status.data());
+        } else {
+            ddfs_get_batch(fd, key_rows, values.data(),
+                static_cast<std::uint32_t>(n), status.data());
+        }
+
+        for (std::size_t i = 0; i < n; i++) {
+            requests[i]->status = status[i];
+        }
+    }
+
+    int fd; // Volume served
+    std::mutex lock; // Protects the queue and stopping
+    std::condition_variable wake; // Signaled when requests are queued
+    std::deque<Request *> queue; // Requests not taken by a loop thread
+    bool stopping = false; // Tells the loop threads to exit once idle
+    std::vector<std::thread> loop_threads; // Threads serving requests
+};
+
+} // namespace ddfs
+
+#endif
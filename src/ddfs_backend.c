@@ -0,0 +1,411 @@
+#ifdef __linux__
+#define _GNU_SOURCE // fallocate(), statx()
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#endif
+
+#include "ddfs_backend.h"
+#include "ddfs_alloc.h"
+#include "ddfs_volume.h"
+
+// Move count adjacent blocks between the descriptor and separate buffers,
+// DDFS_MAX_IOV blocks per system call. Positioned I/O leaves the file
+// offset alone, so threads can share the descriptor. Buffers direct I/O
+// cannot use are bounced through the volume's aligned buffer pool.
+static int64_t transfer_blocks(int fd, void **buffers, uint64_t block_number,
+    uint32_t count, int write) {
+    struct iovec iov[DDFS_MAX_IOV];
+    uint8_t *bounce[DDFS_MAX_IOV];
+    int64_t total = 0;
+
+    while (count > 0) {
+        uint32_t n = count < DDFS_MAX_IOV ? count : DDFS_MAX_IOV;
+
+        for (uint32_t i = 0; i < n; i++) {
+            bounce[i] = get_bounce_buffer(fd, buffers[i]);
+            iov[i].iov_base = bounce[i] ? bounce[i] : buffers[i];
+            iov[i].iov_len = DDFS_BLOCK_SIZE;
+
+            if (write && bounce[i] != NULL) {
+                memcpy(bounce[i], buffers[i], DDFS_BLOCK_SIZE);
+            }
+        }
+
+        off_t offset = (off_t)block_number * DDFS_BLOCK_SIZE;
+        ssize_t ret = write ? pwritev(fd, iov, n, offset) : 
+            preadv(fd, iov, n, offset);
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (bounce[i] != NULL) {
+                if (!write) {
+                    memcpy(buffers[i], bounce[i], DDFS_BLOCK_SIZE);
+                }
+
+                put_buffer(fd, bounce[i]);
+            }
+        }
+
+        if (ret != (ssize_t)n * DDFS_BLOCK_SIZE) {
+            return -1;
+        }
+
+        total += ret;
+        buffers += n;
+        block_number += n;
+        count -= n;
+    }
+
+    return total;
+}
+
+static int64_t file_read(int fd, void **buffers, uint64_t block_number,
+    uint32_t count) {
+    return transfer_blocks(fd, buffers, block_number, count, 0);
+}
+
+static int64_t file_write(int fd, void **buffers, uint64_t block_number,
+    uint32_t count) {
+    return transfer_blocks(fd, buffers, block_number, count, 1);
+}
+
+// Zero blocks with large writes from one zeroed buffer, for storage that
+// cannot zero a range by itself
+static int write_zeros(int fd, uint64_t block_number, uint64_t count) {
+    size_t chunk_size = (size_t)DDFS_ZERO_BLOCKS * DDFS_BLOCK_SIZE;
+    uint8_t *zeros = ddfs_memalign(DDFS_BLOCK_SIZE, chunk_size);
+
+    if (zeros == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    memset(zeros, 0, chunk_size);
+    int ret = EXIT_SUCCESS;
+
+    while (count > 0) {
+        uint64_t n = count < DDFS_ZERO_BLOCKS ? count : DDFS_ZERO_BLOCKS;
+        size_t length = (size_t)n * DDFS_BLOCK_SIZE;
+
+        if (pwrite(fd, zeros, length, (off_t)block_number * DDFS_BLOCK_SIZE) 
+            != (ssize_t)length) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        block_number += n;
+        count -= n;
+    }
+
+    ddfs_free(zeros);
+    return ret;
+}
+
+static int file_flush(int fd) {
+    return fsync(fd) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Regular image files, which may be sparse
+static int64_t file_size(int fd) {
+    struct stat stat_buf;
+
+    if (fstat(fd, &stat_buf) == -1) {
+        perror("fstat");
+        return -1;
+    }
+
+    return stat_buf.st_size;
+}
+
+// The alignment direct I/O on the file needs. st_blksize is only the
+// preferred I/O size, so it stands in when the kernel cannot report the
+// direct I/O alignment of the file's file system.
+static int64_t file_sector_size(int fd) {
+#ifdef STATX_DIOALIGN
+    struct statx statx_buf;
+
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &statx_buf) == 0 &&
+        (statx_buf.stx_mask & STATX_DIOALIGN) &&
+        statx_buf.stx_dio_mem_align != 0) {
+        uint32_t memory = statx_buf.stx_dio_mem_align;
+        uint32_t offset = statx_buf.stx_dio_offset_align;
+
+        return memory > offset ? memory : offset;
+    }
+#endif
+
+    struct stat stat_buf;
+
+    if (fstat(fd, &stat_buf) == -1) {
+        perror("fstat");
+        return -1;
+    }
+
+    return stat_buf.st_blksize;
+}
+
+// Punch a hole so the file system frees the blocks
+static int file_discard(int fd, uint64_t block_number, uint64_t count) {
+    off_t offset = (off_t)block_number * DDFS_BLOCK_SIZE;
+    off_t length = (off_t)count * DDFS_BLOCK_SIZE;
+
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+        length) == 0) {
+        return EXIT_SUCCESS;
+    }
+#elif defined(SPACECTL_DEALLOC)
+    struct spacectl_range range = { .r_offset = offset, .r_len = length };
+
+    if (fspacectl(fd, SPACECTL_DEALLOC, &range, 0, NULL) == 0) {
+        return EXIT_SUCCESS;
+    }
+#else
+    (void)offset;
+    (void)length;
+    errno = EOPNOTSUPP;
+#endif
+
+    return EXIT_FAILURE;
+}
+
+// Punch a hole, or have the file system zero the range in place
+static int file_zero(int fd, uint64_t block_number, uint64_t count) {
+    if (file_discard(fd, block_number, count) == EXIT_SUCCESS) {
+        return EXIT_SUCCESS;
+    }
+
+#if defined(FALLOC_FL_ZERO_RANGE)
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, 
+        (off_t)block_number * DDFS_BLOCK_SIZE, 
+        (off_t)count * DDFS_BLOCK_SIZE) == 0) {
+        return EXIT_SUCCESS;
+    }
+#endif
+
+    return write_zeros(fd, block_number, count);
+}
+
+// Disks and partitions
+static int64_t device_size(int fd) {
+    // Get media size in bytes
+#if defined(DIOCGMEDIASIZE)
+    off_t media_size = 0;
+    int ret = ioctl(fd, DIOCGMEDIASIZE, &media_size);
+#elif defined(BLKGETSIZE64)
+    uint64_t media_size = 0;
+    int ret = ioctl(fd, BLKGETSIZE64, &media_size);
+#else
+    int64_t media_size = lseek(fd, 0, SEEK_END);
+    int ret = media_size == -1 ? -1 : 0;
+    lseek(fd, 0, SEEK_SET);
+#endif
+
+    if (ret == -1) {
+        perror("ioctl");
+        return -1;
+    }
+
+    return media_size;
+}
+
+static int64_t device_sector_size(int fd) {
+    // Get sector size in bytes
+#if defined(DIOCGSECTORSIZE)
+    u_int sector_size = 0;
+    int ret = ioctl(fd, DIOCGSECTORSIZE, &sector_size);
+#elif defined(BLKSSZGET)
+    int sector_size = 0;
+    int ret = ioctl(fd, BLKSSZGET, &sector_size);
+#else
+    int sector_size = 512;
+    int ret = 0;
+    (void)fd;
+#endif
+
+    if (ret == -1) {
+        perror("ioctl");
+        return -1;
+    }
+
+    return sector_size;
+}
+
+// Tell the device the blocks are unused
+static int device_discard(int fd, uint64_t block_number, uint64_t count) {
+#if defined(DIOCGDELETE)
+    off_t range[2] = { (off_t)block_number * DDFS_BLOCK_SIZE,
+        (off_t)count * DDFS_BLOCK_SIZE };
+
+    if (ioctl(fd, DIOCGDELETE, range) == 0) {
+        return EXIT_SUCCESS;
+    }
+#elif defined(BLKDISCARD)
+    uint64_t range[2] = { (uint64_t)block_number * DDFS_BLOCK_SIZE,
+        (uint64_t)count * DDFS_BLOCK_SIZE };
+
+    if (ioctl(fd, BLKDISCARD, range) == 0) {
+        return EXIT_SUCCESS;
+    }
+#else
+    (void)fd;
+    (void)block_number;
+    (void)count;
+    errno = EOPNOTSUPP;
+#endif
+
+    return EXIT_FAILURE;
+}
+
+// Have the device zero the blocks, which it may do without writing them
+static int device_zero(int fd, uint64_t block_number, uint64_t count) {
+#if defined(BLKZEROOUT)
+    uint64_t range[2] = { block_number * DDFS_BLOCK_SIZE,
+        count * DDFS_BLOCK_SIZE };
+
+    if (ioctl(fd, BLKZEROOUT, range) == 0) {
+        return EXIT_SUCCESS;
+    }
+#endif
+
+    return write_zeros(fd, block_number, count);
+}
+
+// Get the in-memory image of a memory volume, or NULL if the range is
+// outside of it
+static uint8_t *memory_address(int fd, uint64_t block_number,
+    uint64_t count) {
+    struct ddfs_volume *volume = get_volume(fd);
+    size_t offset = (size_t)block_number * DDFS_BLOCK_SIZE;
+
+    if (volume == NULL || volume->map == NULL ||
+        offset + ((size_t)count * DDFS_BLOCK_SIZE) > volume->map_length) {
+        return NULL;
+    }
+
+    return volume->map + offset;
+}
+
+// Images that only exist in memory
+static int64_t memory_size(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+    return volume != NULL ? (int64_t)volume->map_length : -1;
+}
+
+static int64_t memory_read(int fd, void **buffers, uint64_t block_number,
+    uint32_t count) {
+    uint8_t *block = memory_address(fd, block_number, count);
+
+    if (block == NULL) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(buffers[i], block + ((size_t)i * DDFS_BLOCK_SIZE),
+            DDFS_BLOCK_SIZE);
+    }
+
+    return (int64_t)count * DDFS_BLOCK_SIZE;
+}
+
+static int64_t memory_write(int fd, void **buffers, uint64_t block_number,
+    uint32_t count) {
+    uint8_t *block = memory_address(fd, block_number, count);
+
+    if (block == NULL) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(block + ((size_t)i * DDFS_BLOCK_SIZE), buffers[i],
+            DDFS_BLOCK_SIZE);
+    }
+
+    return (int64_t)count * DDFS_BLOCK_SIZE;
+}
+
+static int64_t memory_sector_size(int fd) {
+    (void)fd;
+    return 1;
+}
+
+static int memory_flush(int fd) {
+    (void)fd;
+    return EXIT_SUCCESS;
+}
+
+// Give the pages back, falling back to zeroing them
+static int memory_discard(int fd, uint64_t block_number, uint64_t count) {
+    uint8_t *block = memory_address(fd, block_number, count);
+
+    if (block == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    if (file_discard(fd, block_number, count) != EXIT_SUCCESS) {
+        memset(block, 0, (size_t)count * DDFS_BLOCK_SIZE);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+const struct ddfs_backend ddfs_file_backend = {
+    .name = "file",
+    .size = file_size,
+    .sector_size = file_sector_size,
+    .read = file_read,
+    .write = file_write,
+    .flush = file_flush,
+    .discard = file_discard,
+    .zero = file_zero
+};
+
+const struct ddfs_backend ddfs_device_backend = {
+    .name = "device",
+    .size = device_size,
+    .sector_size = device_sector_size,
+    .read = file_read,
+    .write = file_write,
+    .flush = file_flush,
+    .discard = device_discard,
+    .zero = device_zero
+};
+
+const struct ddfs_backend ddfs_memory_backend = {
+    .name = "memory",
+    .size = memory_size,
+    .sector_size = memory_sector_size,
+    .read = memory_read,
+    .write = memory_write,
+    .flush = memory_flush,
+    .discard = memory_discard,
+    .zero = memory_discard
+};
+
+// Pick the backend for a descriptor from the type of file it refers to
+const struct ddfs_backend *detect_backend(int fd) {
+    struct stat stat_buf;
+
+    if (fstat(fd, &stat_buf) == 0 &&
+        (S_ISCHR(stat_buf.st_mode) || S_ISBLK(stat_buf.st_mode))) {
+        return &ddfs_device_backend;
+    }
+
+    return &ddfs_file_backend;
+}
+
+// Get the backend of a volume, or detect it for plain descriptors
+const struct ddfs_backend *get_backend(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume != NULL && volume->backend != NULL) {
+        return volume->backend;
+    }
+
+    return detect_backend(fd);
+}
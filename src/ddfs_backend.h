@@ -0,0 +1,36 @@
+#ifndef ddfs_BACKEND_H
+#define	ddfs_BACKEND_H
+
+#include "ddfs.h"
+
+#define DDFS_ZERO_BLOCKS ((4 << 20) / DDFS_BLOCK_SIZE) // Blocks per write
+                                                       // when zeroing by hand
+
+// Storage a volume lives on. Every operation takes the volume's descriptor
+// and counts in DDFS_BLOCK_SIZE blocks.
+struct ddfs_backend {
+    const char *name; // Backend name
+    int64_t (*size)(int fd); // Size of the storage in bytes
+    int64_t (*sector_size)(int fd); // Alignment direct I/O needs
+    int64_t (*read)(int fd, void **buffers, uint64_t block_number,
+        uint32_t count); // Read adjacent blocks into separate buffers
+    int64_t (*write)(int fd, void **buffers, uint64_t block_number,
+        uint32_t count); // Write separate buffers to adjacent blocks
+    int (*flush)(int fd); // Make every completed write durable
+    int (*discard)(int fd, uint64_t block_number,
+        uint64_t count); // Release blocks, whose contents become undefined
+    int (*zero)(int fd, uint64_t block_number,
+        uint64_t count); // Make blocks read back as zeros
+};
+
+extern const struct ddfs_backend ddfs_file_backend;
+
+extern const struct ddfs_backend ddfs_device_backend;
+
+extern const struct ddfs_backend ddfs_memory_backend;
+
+extern const struct ddfs_backend *detect_backend(int fd);
+
+extern const struct ddfs_backend *get_backend(int fd);
+
+#endif
@@ -0,0 +1,730 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ddfs_batch.h"
+#include "ddfs_alloc.h"
+#include "ddfs_bitmap.h"
+#include "ddfs_group.h"
+#include "ddfs_inode.h"
+#include "ddfs_lock.h"
+#include "ddfs_log.h"
+#include "ddfs_pool.h"
+#include "ddfs_refcount.h"
+#include "ddfs_uring.h"
+#include "ddfs_volume.h"
+
+// Per-key state for a batched put
+struct ddfs_batch_item {
+    uint32_t index;         // Position of the key in the batch
+    uint64_t inode_number;  // Inode slot of the key
+    uint64_t block_ptr;     // Data block of the value
+    uint64_t ifree_block;   // Free inode bitmap block of the inode
+    uint32_t ifree_byte;    // Byte holding the inode bit
+    uint8_t ifree_mask;     // Mask of the inode bit
+    uint64_t istore_block;  // Inode store block of the inode
+    uint32_t istore_offset; // Offset of the inode in its block
+    uint8_t lazy;           // Inode group is uninitialized, so the key
+                            // is absent and its blocks are not read
+    uint8_t referenced;     // Put takes a reference to block_ptr
+    uint8_t live;           // Keys referred to block_ptr before the batch
+    uint8_t collided;       // Slot holds another key, or the home block
+                            // another value, so the put fails
+    uint64_t old_block_ptr; // Block whose reference the put drops, or 0
+    uint8_t fingerprint[20]; // Fingerprint of the value
+};
+
+static int compare_block_numbers(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Start an empty set. Its memory comes from the calling thread's scratch
+// arena and is released when the caller resets the arena.
+int block_set_init(struct ddfs_block_set *set, uint32_t capacity) {
+    memset(set, 0, sizeof(struct ddfs_block_set));
+    struct ddfs_scratch *scratch = get_scratch();
+
+    if (scratch == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    set->arena = &scratch->arena;
+    set->numbers = arena_alloc(set->arena, capacity * sizeof(uint64_t), 
+        sizeof(uint64_t));
+
+    if (set->numbers == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    set->capacity = capacity;
+    return EXIT_SUCCESS;
+}
+
+// Drop a set's block memory, giving it back to the ring it was claimed
+// from; arena memory goes when the arena is reset
+static void block_set_drop_data(struct ddfs_block_set *set) {
+    uring_release_buffers(set->uring, set->data, set->claimed);
+    set->uring = NULL;
+    set->claimed = 0;
+    set->data = NULL;
+}
+
+void block_set_free(struct ddfs_block_set *set) {
+    block_set_drop_data(set);
+    memset(set, 0, sizeof(struct ddfs_block_set));
+}
+
+void block_set_add(struct ddfs_block_set *set, uint64_t block_number) {
+    if (set->count < set->capacity) {
+        set->numbers[set->count++] = block_number;
+    }
+}
+
+// Group the blocks of a set into runs of adjacent blocks, skipping
+// blocks whose flags differ from the requested ones
+static uint32_t block_set_runs(struct ddfs_block_set *set, 
+    struct ddfs_io_run *runs, uint8_t flags) {
+    uint32_t count = 0;
+    uint32_t start = 0;
+
+    while (start < set->count) {
+        if (set->flags[start] != flags) {
+            start++;
+            continue;
+        }
+
+        uint32_t end = start + 1;
+
+        while (end < set->count && set->flags[end] == flags &&
+            set->numbers[end] == set->numbers[end - 1] + 1) {
+            end++;
+        }
+
+        runs[count++] = (struct ddfs_io_run) {
+            .block_number = set->numbers[start],
+            .count = end - start,
+            .buffers = (void **)(set->buffers + start)
+        };
+
+        start = end;
+    }
+
+    return count;
+}
+
+// Mark every block of a failed run with an error
+static void block_set_fail_runs(struct ddfs_block_set *set, 
+    struct ddfs_io_run *runs, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t start = block_set_find(set, runs[i].block_number);
+
+        for (uint32_t j = start; j < start + runs[i].count; j++) {
+            set->flags[j] = runs[i].result == -1 ? DDFS_BLOCK_ERROR : 0;
+        }
+    }
+}
+
+// Sort and deduplicate the block numbers, then read each block once,
+// merging runs of adjacent blocks into single vectored reads
+int block_set_load(int fd, struct ddfs_block_set *set) {
+    uint32_t count = 0;
+
+    qsort(set->numbers, set->count, sizeof(uint64_t), compare_block_numbers);
+
+    for (uint32_t i = 0; i < set->count; i++) {
+        if (count == 0 || set->numbers[i] != set->numbers[count - 1]) {
+            set->numbers[count++] = set->numbers[i];
+        }
+    }
+
+    set->count = count;
+    struct ddfs_arena_mark mark = arena_mark(set->arena);
+    set->buffers = arena_alloc(set->arena, (count + 1) * sizeof(uint8_t *),
+        sizeof(void *));
+    set->flags = arena_calloc(set->arena, count + 1, sizeof(uint8_t));
+
+    // Block aligned so direct I/O reads and writes the buffers in place.
+    // Volumes with a ring take them from its registered region while it
+    // has room, which makes the runs fixed-buffer requests.
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume != NULL && volume->map == NULL) {
+        set->data = uring_claim_buffers(volume->uring, count);
+    }
+
+    if (set->data != NULL) {
+        set->uring = volume->uring;
+        set->claimed = count;
+    } else {
+        set->data = arena_alloc(set->arena, 
+            ((size_t)count + 1) * DDFS_BLOCK_SIZE, DDFS_BLOCK_SIZE);
+    }
+
+    if (set->buffers == NULL || set->flags == NULL || set->data == NULL) {
+        block_set_drop_data(set);
+        return EXIT_FAILURE;
+    }
+
+    // The runs are only needed for the read
+    struct ddfs_arena_mark runs_mark = arena_mark(set->arena);
+    struct ddfs_io_run *runs = arena_alloc(set->arena, 
+        (count + 1) * sizeof(struct ddfs_io_run), sizeof(void *));
+
+    if (runs == NULL) {
+        arena_reset(set->arena, mark);
+        block_set_drop_data(set);
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        set->buffers[i] = set->data + ((size_t)i * DDFS_BLOCK_SIZE);
+    }
+
+    uint32_t run_count = block_set_runs(set, runs, 0);
+    int ret = read_runs(fd, runs, run_count);
+    block_set_fail_runs(set, runs, run_count);
+
+    arena_reset(set->arena, runs_mark);
+    return ret;
+}
+
+// Get the index of a loaded block, or count if it is not in the set
+uint32_t block_set_find(struct ddfs_block_set *set, uint64_t block_number) {
+    uint32_t low = 0;
+    uint32_t high = set->count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (set->numbers[mid] < block_number) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low < set->count && set->numbers[low] == block_number) {
+        return low;
+    }
+
+    return set->count;
+}
+
+// Write back dirty blocks in ascending order, merging runs of adjacent
+// dirty blocks into single vectored writes
+int block_set_flush(int fd, struct ddfs_block_set *set) {
+    struct ddfs_arena_mark mark = arena_mark(set->arena);
+    struct ddfs_io_run *runs = arena_alloc(set->arena, 
+        (set->count + 1) * sizeof(struct ddfs_io_run), sizeof(void *));
+
+    if (runs == NULL) {
+        for (uint32_t i = 0; i < set->count; i++) {
+            if (set->flags[i] & DDFS_BLOCK_DIRTY) {
+                set->flags[i] = DDFS_BLOCK_ERROR;
+            }
+        }
+
+        return EXIT_FAILURE;
+    }
+
+    uint32_t run_count = block_set_runs(set, runs, DDFS_BLOCK_DIRTY);
+    int ret = write_runs(fd, runs, run_count);
+    block_set_fail_runs(set, runs, run_count);
+
+    arena_reset(set->arena, mark);
+    return ret;
+}
+
+// Locate the free inode bitmap and inode store blocks of a key
+static void locate_key(struct ddfs_superblock *sb, uint8_t key[20], 
+    struct ddfs_batch_item *item) {
+    item->inode_number = key_hash(key, sb->info.fs_inode_count);
+    get_bit_location((DDFS_BLOCK_SIZE * 8) + item->inode_number,
+        &item->ifree_block, &item->ifree_byte, &item->ifree_mask);
+    get_inode_location(sb, item->inode_number, &item->istore_block,
+        &item->istore_offset);
+}
+
+static int put_batch_chunk(int fd, struct ddfs_superblock *sb,
+    uint8_t keys[][20], uint8_t *values[], uint32_t n, int *status) {
+    struct ddfs_scratch *scratch = get_scratch();
+
+    if (scratch == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_arena_mark mark = arena_mark(&scratch->arena);
+    struct ddfs_batch_item *items = arena_calloc(&scratch->arena, n, 
+        sizeof(struct ddfs_batch_item));
+    struct ddfs_block_set ifree;
+    struct ddfs_block_set istore;
+    struct ddfs_block_set data;
+    struct ddfs_key_locks locks;
+    struct ddfs_lock_set stripes;
+    uint64_t *homes = arena_alloc(&scratch->arena, 
+        n * sizeof(uint64_t), sizeof(uint64_t));
+    int64_t *previous = arena_alloc(&scratch->arena, 
+        n * sizeof(int64_t), sizeof(int64_t));
+    uint64_t *released = arena_alloc(&scratch->arena, 
+        2 * n * sizeof(uint64_t), sizeof(uint64_t));
+    uint8_t **fingerprints = arena_alloc(&scratch->arena, 
+        n * sizeof(uint8_t *), sizeof(void *));
+    uint64_t *appended = arena_alloc(&scratch->arena, 
+        n * sizeof(uint64_t), sizeof(uint64_t));
+    uint8_t logged = (le32toh(sb->info.fs_flags) & DDFS_FS_LOG) != 0;
+    uint8_t pinned = 0;
+    uint8_t locked = 0;
+    int ret = EXIT_FAILURE;
+
+    key_locks_init(&locks, fd);
+    lock_set_init(&stripes, fd, DDFS_LOCK_BLOCKS);
+
+    memset(&ifree, 0, sizeof(struct ddfs_block_set));
+    memset(&istore, 0, sizeof(struct ddfs_block_set));
+    memset(&data, 0, sizeof(struct ddfs_block_set));
+
+    for (uint32_t i = 0; i < n; i++) {
+        status[i] = EXIT_FAILURE;
+    }
+
+    if (items == NULL || homes == NULL || previous == NULL ||
+        released == NULL ||
+        fingerprints == NULL || appended == NULL ||
+        block_set_init(&ifree, n) ||
+        block_set_init(&istore, n) || block_set_init(&data, n)) {
+        goto out;
+    }
+
+    // Fingerprint every value on the worker pool, then locate the blocks
+    // each put touches, initializing the inode groups the puts land in
+    for (uint32_t i = 0; i < n; i++) {
+        fingerprints[i] = items[i].fingerprint;
+    }
+
+    hash_blocks(values, fingerprints, n, DDFS_POOL_FOREGROUND);
+
+    for (uint32_t i = 0; i < n; i++) {
+        struct ddfs_batch_item *item = &items[i];
+
+        locate_key(sb, keys[i], item);
+        item->block_ptr = get_data_block(sb, item->fingerprint);
+
+        if (initialize_group(fd, sb, get_inode_group(item->inode_number)) != 
+            EXIT_SUCCESS) {
+            goto out;
+        }
+
+        block_set_add(&ifree, item->ifree_block);
+        block_set_add(&istore, item->istore_block);
+        key_locks_add(&locks, sb, item->inode_number);
+        lock_set_add(&stripes, item->ifree_block);
+
+        if (!logged) {
+            block_set_add(&data, item->block_ptr);
+            lock_set_add(&stripes, item->block_ptr);
+            homes[i] = item->block_ptr;
+        }
+    }
+
+    lock_keys(&locks, 1);
+    locked = 1;
+
+    // Log-structured volumes append the values up front, which references
+    // their blocks
+    if (logged) {
+        if (store_values(fd, sb, values, fingerprints, n, appended) != 
+            EXIT_SUCCESS) {
+            goto out;
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            items[i].block_ptr = appended[i];
+        }
+
+        pinned = 1;
+    }
+
+    // Bitmap blocks also hold bits of keys outside the batch, and home
+    // blocks are written by puts outside it too, so both stay locked until
+    // they are written back. Every home block is referenced before its
+    // data is looked at, so the collector cannot reclaim a block the batch
+    // deduplicates against. Puts that end up not keeping the reference
+    // drop it at the end.
+    lock_set_acquire(&stripes);
+
+    if (!logged) {
+        if (take_references(fd, homes, n, previous) != EXIT_SUCCESS) {
+            lock_set_release(&stripes);
+            goto out;
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            items[i].live = previous[i] > 0;
+        }
+
+        pinned = 1;
+    }
+
+    // Read each distinct bitmap, inode store and data block once
+    block_set_load(fd, &ifree);
+    block_set_load(fd, &istore);
+    block_set_load(fd, &data);
+
+    if (ifree.data == NULL || istore.data == NULL || data.data == NULL) {
+        lock_set_release(&stripes);
+        goto out;
+    }
+
+    // Apply the puts in order against the cached blocks, so repeated keys
+    // and values within a batch behave exactly as consecutive puts would
+    for (uint32_t i = 0; i < n; i++) {
+        struct ddfs_batch_item *item = &items[i];
+        uint32_t b = block_set_find(&ifree, item->ifree_block);
+        uint32_t s = block_set_find(&istore, item->istore_block);
+        uint32_t d = block_set_find(&data, item->block_ptr);
+
+        if ((ifree.flags[b] | istore.flags[s] | data.flags[d]) &
+            DDFS_BLOCK_ERROR) {
+            continue;
+        }
+
+        uint8_t *bitmap = ifree.buffers[b];
+        struct ddfs_inode *inode =
+            (struct ddfs_inode *)(istore.buffers[s] + item->istore_offset);
+        uint8_t differs = !logged && memcmp(data.buffers[d], values[i],
+            DDFS_BLOCK_SIZE) != 0;
+
+        // A home block keeps its value while keys outside the batch, or
+        // an earlier put of it, refer to it
+        if (differs && (item->live || data.flags[d] & DDFS_BLOCK_DIRTY)) {
+            item->collided = 1;
+            errno = EEXIST;
+            continue;
+        }
+
+        if (!(bitmap[item->ifree_byte] & item->ifree_mask)) {
+            memset(inode, 0, sizeof(struct ddfs_inode));
+
+            inode->info = (struct ddfs_inode_info) {
+                .i_number = item->inode_number,
+                .i_uid = getuid(),
+                .i_size = sb->info.fs_inode_size,
+                .i_mod_time = time(NULL),
+                .i_block_ptr = item->block_ptr
+            };
+
+            memcpy(inode->info.i_key, keys[i], 20);
+            bitmap[item->ifree_byte] |= item->ifree_mask;
+            ifree.flags[b] |= DDFS_BLOCK_DIRTY;
+            istore.flags[s] |= DDFS_BLOCK_DIRTY;
+            item->referenced = 1;
+        } else if (memcmp(inode->info.i_key, keys[i], 20) != 0) {
+            item->collided = 1;
+            continue;
+        } else if (inode->info.i_block_ptr != item->block_ptr) {
+            // Putting a stored key again replaces its value
+            item->old_block_ptr = inode->info.i_block_ptr;
+            inode->info.i_block_ptr = item->block_ptr;
+            inode->info.i_mod_time = time(NULL);
+            istore.flags[s] |= DDFS_BLOCK_DIRTY;
+            item->referenced = 1;
+        }
+
+        if (differs) {
+            memcpy(data.buffers[d], values[i], DDFS_BLOCK_SIZE);
+            data.flags[d] |= DDFS_BLOCK_DIRTY;
+        }
+    }
+
+    // Data first, then inodes, then bitmaps, so a set bit never refers to
+    // an inode or block that has not reached the disk
+    block_set_flush(fd, &data);
+    block_set_flush(fd, &istore);
+    block_set_flush(fd, &ifree);
+    lock_set_release(&stripes);
+
+    ret = EXIT_SUCCESS;
+
+    for (uint32_t i = 0; i < n; i++) {
+        struct ddfs_batch_item *item = &items[i];
+        uint32_t b = block_set_find(&ifree, item->ifree_block);
+        uint32_t s = block_set_find(&istore, item->istore_block);
+        uint32_t d = block_set_find(&data, item->block_ptr);
+
+        if (item->collided || (ifree.flags[b] | istore.flags[s] | 
+            data.flags[d]) & DDFS_BLOCK_ERROR) {
+            item->referenced = 0;
+            item->old_block_ptr = 0;
+            ret = EXIT_FAILURE;
+        } else {
+            status[i] = EXIT_SUCCESS;
+        }
+    }
+
+out:
+    // Drop the references the puts did not keep and the ones replaced
+    // values held, in one pass
+    if (pinned) {
+        uint32_t release_count = 0;
+
+        for (uint32_t i = 0; i < n; i++) {
+            if (!items[i].referenced) {
+                released[release_count++] = items[i].block_ptr;
+            }
+
+            if (items[i].old_block_ptr != 0) {
+                released[release_count++] = items[i].old_block_ptr;
+            }
+        }
+
+        if (release_blocks(fd, released, release_count) != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (locked) {
+        unlock_keys(&locks);
+    }
+
+    block_set_free(&ifree);
+    block_set_free(&istore);
+    block_set_free(&data);
+    arena_reset(&scratch->arena, mark);
+    return ret;
+}
+
+// Put n key-value pairs, reading and writing each metadata block once per
+// pass; status[i] receives the result of the i-th put
+int ddfs_put_batch(int fd, uint8_t keys[][20], uint8_t *values[],
+    uint32_t n, int *status) {
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        for (uint32_t i = 0; i < n; i++) {
+            status[i] = EXIT_FAILURE;
+        }
+
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_SUCCESS;
+
+    for (uint32_t start = 0; start < n; start += DDFS_BATCH_MAX) {
+        uint32_t count = n - start;
+
+        if (count > DDFS_BATCH_MAX) {
+            count = DDFS_BATCH_MAX;
+        }
+
+        if (put_batch_chunk(fd, sb, keys + start, values + start, count,
+            status + start) != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    put_block_buffer(sb);
+    return ret;
+}
+
+static int compare_pending_reads(const void *a, const void *b) {
+    const struct ddfs_batch_item *x = *(struct ddfs_batch_item * const *)a;
+    const struct ddfs_batch_item *y = *(struct ddfs_batch_item * const *)b;
+
+    return (x->block_ptr > y->block_ptr) - (x->block_ptr < y->block_ptr);
+}
+
+static int get_batch_chunk(int fd, struct ddfs_superblock *sb,
+    uint8_t keys[][20], uint8_t *values[], uint32_t n, int *status) {
+    struct ddfs_scratch *scratch = get_scratch();
+
+    if (scratch == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_arena *arena = &scratch->arena;
+    struct ddfs_arena_mark mark = arena_mark(arena);
+    struct ddfs_batch_item *items = arena_calloc(arena, n, 
+        sizeof(struct ddfs_batch_item));
+    struct ddfs_batch_item **pending = arena_alloc(arena, 
+        (n + 1) * sizeof(struct ddfs_batch_item *), sizeof(void *));
+    struct ddfs_io_run *runs = arena_alloc(arena, 
+        (n + 1) * sizeof(struct ddfs_io_run), sizeof(void *));
+    void **buffers = arena_alloc(arena, (n + 1) * sizeof(void *), 
+        sizeof(void *));
+    uint32_t *run_index = arena_alloc(arena, (n + 1) * sizeof(uint32_t), 
+        sizeof(uint32_t));
+    struct ddfs_block_set ifree;
+    struct ddfs_block_set istore;
+    struct ddfs_key_locks locks;
+    uint8_t locked = 0;
+    int ret = EXIT_FAILURE;
+
+    memset(&ifree, 0, sizeof(struct ddfs_block_set));
+    memset(&istore, 0, sizeof(struct ddfs_block_set));
+    key_locks_init(&locks, fd);
+
+    for (uint32_t i = 0; i < n; i++) {
+        status[i] = EXIT_FAILURE;
+        memset(values[i], 0, DDFS_BLOCK_SIZE);
+    }
+
+    if (items == NULL || pending == NULL || runs == NULL || 
+        buffers == NULL || run_index == NULL || 
+        block_set_init(&ifree, n) || block_set_init(&istore, n)) {
+        goto out;
+    }
+
+    // Resolve every key to its bitmap and inode store blocks. Keys in
+    // uninitialized groups are absent and cost no I/O.
+    for (uint32_t i = 0; i < n; i++) {
+        locate_key(sb, keys[i], &items[i]);
+        items[i].lazy = get_group_state(fd, sb, 
+            get_inode_group(items[i].inode_number)) != 1;
+
+        if (!items[i].lazy) {
+            block_set_add(&ifree, items[i].ifree_block);
+            block_set_add(&istore, items[i].istore_block);
+            key_locks_add(&locks, sb, items[i].inode_number);
+        }
+    }
+
+    lock_keys(&locks, 0);
+    locked = 1;
+
+    // Read each distinct metadata block once
+    block_set_load(fd, &ifree);
+    block_set_load(fd, &istore);
+
+    if (ifree.data == NULL || istore.data == NULL) {
+        goto out;
+    }
+
+    uint32_t pending_count = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        struct ddfs_batch_item *item = &items[i];
+
+        if (item->lazy) {
+            continue;
+        }
+
+        uint32_t b = block_set_find(&ifree, item->ifree_block);
+        uint32_t s = block_set_find(&istore, item->istore_block);
+
+        if ((ifree.flags[b] | istore.flags[s]) & DDFS_BLOCK_ERROR ||
+            !(ifree.buffers[b][item->ifree_byte] & item->ifree_mask)) {
+            continue;
+        }
+
+        struct ddfs_inode *inode =
+            (struct ddfs_inode *)(istore.buffers[s] + item->istore_offset);
+
+        if (memcmp(inode->info.i_key, keys[i], 20) == 0) {
+            item->block_ptr = inode->info.i_block_ptr;
+            item->index = i;
+            pending[pending_count++] = item;
+        }
+    }
+
+    // Sort the data blocks and merge adjacent ones into runs that read
+    // straight into the caller's buffers; keys sharing a block read it once
+    qsort(pending, pending_count, sizeof(struct ddfs_batch_item *),
+        compare_pending_reads);
+
+    uint32_t run_count = 0;
+    uint32_t buffer_count = 0;
+
+    for (uint32_t p = 0; p < pending_count; p++) {
+        uint64_t block_ptr = pending[p]->block_ptr;
+
+        if (p > 0 && block_ptr == pending[p - 1]->block_ptr) {
+            run_index[p] = run_index[p - 1];
+            continue;
+        }
+
+        if (run_count > 0 && block_ptr == pending[p - 1]->block_ptr + 1) {
+            runs[run_count - 1].count++;
+        } else {
+            runs[run_count++] = (struct ddfs_io_run) {
+                .block_number = block_ptr,
+                .count = 1,
+                .buffers = &buffers[buffer_count]
+            };
+        }
+
+        buffers[buffer_count++] = values[pending[p]->index];
+        run_index[p] = run_count - 1;
+    }
+
+    read_runs(fd, runs, run_count);
+    ret = EXIT_SUCCESS;
+
+    for (uint32_t p = 0; p < pending_count; p++) {
+        struct ddfs_io_run *run = &runs[run_index[p]];
+        uint32_t i = pending[p]->index;
+
+        if (run->result == -1) {
+            continue;
+        }
+
+        if (p > 0 && pending[p - 1]->block_ptr == pending[p]->block_ptr) {
+            memcpy(values[i], values[pending[p - 1]->index],
+                DDFS_BLOCK_SIZE);
+        }
+
+        status[i] = EXIT_SUCCESS;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (status[i] != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+out:
+    if (locked) {
+        unlock_keys(&locks);
+    }
+
+    block_set_free(&ifree);
+    block_set_free(&istore);
+    arena_reset(arena, mark);
+    return ret;
+}
+
+// Get the values of n keys, reading each metadata block once per pass and
+// the data blocks in ascending order with adjacent blocks merged;
+// status[i] receives the result of the i-th get
+int ddfs_get_batch(int fd, uint8_t keys[][20], uint8_t *values[],
+    uint32_t n, int *status) {
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        for (uint32_t i = 0; i < n; i++) {
+            status[i] = EXIT_FAILURE;
+        }
+
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_SUCCESS;
+
+    for (uint32_t start = 0; start < n; start += DDFS_BATCH_MAX) {
+        uint32_t count = n - start;
+
+        if (count > DDFS_BATCH_MAX) {
+            count = DDFS_BATCH_MAX;
+        }
+
+        if (get_batch_chunk(fd, sb, keys + start, values + start, count,
+            status + start) != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    put_block_buffer(sb);
+    return ret;
+}
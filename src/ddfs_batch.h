@@ -0,0 +1,45 @@
+#ifndef ddfs_BATCH_H
+#define	ddfs_BATCH_H
+
+#include "ddfs.h"
+
+struct ddfs_arena;
+struct ddfs_uring;
+
+#define DDFS_BATCH_MAX 1024 // Keys handled per batch pass
+#define DDFS_BLOCK_DIRTY 0x1 // Block must be written back
+#define DDFS_BLOCK_ERROR 0x2 // Block could not be read or written
+
+// Distinct blocks touched by a batch, sorted by block number once loaded
+struct ddfs_block_set {
+    uint32_t count;     // Number of block numbers
+    uint32_t capacity;  // Number of allocated entries
+    uint64_t *numbers;  // Block numbers
+    uint8_t **buffers;  // Block contents
+    uint8_t *flags;     // Dirty and error flags
+    uint8_t *data;      // Backing memory for the buffers
+    struct ddfs_arena *arena; // Arena the set's memory comes from
+    struct ddfs_uring *uring; // Ring data was claimed from, or NULL
+    uint32_t claimed;   // Blocks of data claimed from the ring
+};
+
+extern int block_set_init(struct ddfs_block_set *set, uint32_t capacity);
+
+extern void block_set_free(struct ddfs_block_set *set);
+
+extern void block_set_add(struct ddfs_block_set *set, uint64_t block_number);
+
+extern int block_set_load(int fd, struct ddfs_block_set *set);
+
+extern uint32_t block_set_find(struct ddfs_block_set *set,
+    uint64_t block_number);
+
+extern int block_set_flush(int fd, struct ddfs_block_set *set);
+
+extern int ddfs_put_batch(int fd, uint8_t keys[][20], uint8_t *values[],
+    uint32_t n, int *status);
+
+extern int ddfs_get_batch(int fd, uint8_t keys[][20], uint8_t *values[],
+    uint32_t n, int *status);
+
+#endif
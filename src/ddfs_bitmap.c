@@ -1,98 +1,115 @@
 #include "ddfs_bitmap.h"
+#include "ddfs_alloc.h"
+#include "ddfs_lock.h"
 
-int8_t set_bit(int fd, uint64_t bit) {
+// Locate the bitmap block, byte and bit mask holding a bit
+void get_bit_location(uint64_t bit, uint64_t *block_number, 
+    uint32_t *byte_index, uint8_t *mask) {
     uint64_t byte_number = bit / 8;
-    uint32_t block_number = byte_number / DDFS_BLOCK_SIZE;
-    uint64_t bit_index = bit % DDFS_BLOCK_SIZE;
-    uint32_t byte_index = byte_number % DDFS_BLOCK_SIZE;
-    char *buffer = malloc(DDFS_BLOCK_SIZE);
-
-    if (!buffer) {
-        return EXIT_FAILURE;
-    }
-
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
-    int ret = read_block(fd, buffer, block_number);
-
-    if (ret != DDFS_BLOCK_SIZE) {
-        free(buffer);
-        return EXIT_FAILURE;
-    }
-
-    // Set the bit at bit_index in the buffer
-    buffer[byte_index] |= (1 << (bit_index % 8));
-
-    ret = write_block(fd, buffer, block_number);
+    *block_number = byte_number / DDFS_BLOCK_SIZE;
+    *byte_index = byte_number % DDFS_BLOCK_SIZE;
+    *mask = 1 << (bit % 8);
+}
 
-    if (ret != DDFS_BLOCK_SIZE) {
-        free(buffer);
-        return EXIT_FAILURE;
+// Set a bit. Other bits of the same bitmap block change under the same
+// stripe lock, so concurrent updates are not lost.
+int8_t set_bit(int fd, uint64_t bit) {
+    uint64_t block_number;
+    uint32_t byte_index;
+    uint8_t mask;
+    get_bit_location(bit, &block_number, &byte_index, &mask);
+    lock_block(fd, block_number);
+
+    // Mapped volumes update the bit in place
+    uint8_t *block = get_block_address(fd, block_number, 1, 1);
+    int8_t ret = EXIT_FAILURE;
+
+    if (block != NULL) {
+        block[byte_index] |= mask;
+        ret = EXIT_SUCCESS;
+    } else {
+        uint8_t *buffer = get_block_buffer();
+
+        if (buffer != NULL && 
+            read_block(fd, buffer, block_number) == DDFS_BLOCK_SIZE) {
+            buffer[byte_index] |= mask;
+
+            if (write_block(fd, buffer, block_number) == DDFS_BLOCK_SIZE) {
+                ret = EXIT_SUCCESS;
+            }
+        }
+
+        put_block_buffer(buffer);
     }
 
-    free(buffer);
-    return EXIT_SUCCESS;
+    unlock_block(fd, block_number);
+    return ret;
 }
 
+// Clear a bit. Other bits of the same bitmap block change under the same
+// stripe lock, so concurrent updates are not lost.
 int8_t clear_bit(int fd, uint64_t bit) {
-    uint64_t byte_number = bit / 8;
-    uint32_t block_number = byte_number / DDFS_BLOCK_SIZE;
-    uint64_t bit_index = bit % DDFS_BLOCK_SIZE;
-    uint32_t byte_index = byte_number % DDFS_BLOCK_SIZE;
-    char *buffer = malloc(DDFS_BLOCK_SIZE);
-
-    if (!buffer) {
-        return EXIT_FAILURE;
+    uint64_t block_number;
+    uint32_t byte_index;
+    uint8_t mask;
+    get_bit_location(bit, &block_number, &byte_index, &mask);
+    lock_block(fd, block_number);
+
+    // Mapped volumes update the bit in place
+    uint8_t *block = get_block_address(fd, block_number, 1, 1);
+    int8_t ret = EXIT_FAILURE;
+
+    if (block != NULL) {
+        block[byte_index] &= ~mask;
+        ret = EXIT_SUCCESS;
+    } else {
+        uint8_t *buffer = get_block_buffer();
+
+        if (buffer != NULL && 
+            read_block(fd, buffer, block_number) == DDFS_BLOCK_SIZE) {
+            buffer[byte_index] &= ~mask;
+
+            if (write_block(fd, buffer, block_number) == DDFS_BLOCK_SIZE) {
+                ret = EXIT_SUCCESS;
+            }
+        }
+
+        put_block_buffer(buffer);
     }
 
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
-    int ret = read_block(fd, buffer, block_number);
-
-    if (ret != DDFS_BLOCK_SIZE) {
-        free(buffer);
-        return EXIT_FAILURE;
-    }
+    unlock_block(fd, block_number);
+    return ret;
+}
 
-    // Clear the bit at bit_index in the buffer
-    buffer[byte_index] &= ~(1 << (bit_index % 8));
+int8_t get_bit(int fd, uint64_t bit) {
+    uint64_t block_number;
+    uint32_t byte_index;
+    uint8_t mask;
+    get_bit_location(bit, &block_number, &byte_index, &mask);
 
-    ret = write_block(fd, buffer, block_number);
+    // Mapped volumes read the bit in place
+    uint8_t *block = get_block_address(fd, block_number, 1, 0);
 
-    if (ret != DDFS_BLOCK_SIZE) {
-        free(buffer);
-        return EXIT_FAILURE;
+    if (block != NULL) {
+        return (block[byte_index] & mask) != 0;
     }
 
-    free(buffer);
-    return EXIT_SUCCESS;
-}
-
-int8_t get_bit(int fd, uint64_t bit) {
-    uint64_t byte_number = bit / 8;
-    uint32_t block_number = byte_number / DDFS_BLOCK_SIZE;
-    uint64_t bit_index = bit % DDFS_BLOCK_SIZE;
-    uint32_t byte_index = byte_number % DDFS_BLOCK_SIZE;
-    char *buffer = malloc(DDFS_BLOCK_SIZE);
+    uint8_t *buffer = get_block_buffer();
 
     if (!buffer) {
         return -1;
     }
 
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
     int ret = read_block(fd, buffer, block_number);
 
     if (ret != DDFS_BLOCK_SIZE) {
-        free(buffer);
+        put_block_buffer(buffer);
         return -1;
     }
 
-    // Get the bit at bit_index in the buffer
-    int value = 1 & (buffer[byte_index] >> (bit_index % 8));
-
-    if (ret != DDFS_BLOCK_SIZE) {
-        free(buffer);
-        return -1;
-    }
+    // Get the bit in the buffer
+    int value = (buffer[byte_index] & mask) != 0;
 
-    free(buffer);
+    put_block_buffer(buffer);
     return value;
 }
@@ -3,6 +3,9 @@
 
 #include "ddfs.h"
 
+extern void get_bit_location(uint64_t bit, uint64_t *block_number, 
+    uint32_t *byte_index, uint8_t *mask);
+
 extern int8_t set_bit(int fd, uint64_t bit);
 
 extern int8_t clear_bit(int fd, uint64_t bit);
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ddfs_gc.h"
+#include "ddfs_alloc.h"
+#include "ddfs_refcount.h"
+#include "ddfs_volume.h"
+
+// Move up to max of the oldest queued blocks to blocks. The caller holds
+// the queue's lock.
+static uint32_t take_blocks(struct ddfs_gc *gc, uint64_t *blocks,
+    uint32_t max) {
+    uint32_t count = gc->count < max ? gc->count : max;
+
+    for (uint32_t i = 0; i < count; i++) {
+        blocks[i] = gc->queue[(gc->head + i) % DDFS_GC_QUEUE];
+    }
+
+    gc->head = (gc->head + count) % DDFS_GC_QUEUE;
+    gc->count -= count;
+    return count;
+}
+
+// Get the time a discard window that opened at start closes
+static struct timespec window_end(struct timespec start, uint32_t window) {
+    start.tv_sec += window / 1000000;
+    start.tv_nsec += (long)(window % 1000000) * 1000;
+
+    if (start.tv_nsec >= 1000000000) {
+        start.tv_sec++;
+        start.tv_nsec -= 1000000000;
+    }
+
+    return start;
+}
+
+// Reclaim everything queued in one pass, so adjacent blocks freed by
+// different deletes coalesce into one run. While the foreground keeps
+// changing reference counts, or the volume's discard window since the
+// oldest block was queued is still open, the thread waits, unless the
+// queue is filling up.
+static void *collect_blocks(void *arg) {
+    struct ddfs_volume *volume = arg;
+    struct ddfs_gc *gc = volume->gc;
+    uint64_t seen = __atomic_load_n(&gc->activity, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&gc->lock);
+
+    while (!gc->stop) {
+        if (gc->count == 0) {
+            pthread_cond_wait(&gc->wake, &gc->lock);
+            continue;
+        }
+
+        uint64_t activity = __atomic_load_n(&gc->activity, __ATOMIC_RELAXED);
+
+        if (activity != seen && gc->count < DDFS_GC_HIGH_WATER) {
+            seen = activity;
+            pthread_mutex_unlock(&gc->lock);
+            usleep(DDFS_GC_DELAY);
+            pthread_mutex_lock(&gc->lock);
+            continue;
+        }
+
+        struct timespec now;
+        struct timespec end = window_end(gc->queued_at, 
+            __atomic_load_n(&volume->discard_window, __ATOMIC_RELAXED));
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        if (gc->count < DDFS_GC_HIGH_WATER && (now.tv_sec < end.tv_sec ||
+            (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec))) {
+            pthread_cond_timedwait(&gc->wake, &gc->lock, &end);
+            continue;
+        }
+
+        uint32_t count = take_blocks(gc, gc->batch, DDFS_GC_QUEUE);
+        pthread_mutex_unlock(&gc->lock);
+        reclaim_blocks(volume->fd, gc->batch, count);
+        pthread_mutex_lock(&gc->lock);
+    }
+
+    pthread_mutex_unlock(&gc->lock);
+    return NULL;
+}
+
+// Set up the volume's reclaim queue and start its collector when it was
+// opened with DDFS_OPEN_GC. Blocks still queued are dropped, so callers
+// drain the queue first when they matter.
+int load_reclaim_queue(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL) {
+        return EXIT_SUCCESS;
+    }
+
+    free_reclaim_queue(fd);
+
+    // Without a log there is nothing formatted to collect
+    if (!(volume->flags & DDFS_OPEN_GC) || !volume->writable ||
+        volume->reflog == NULL) {
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_gc *gc = ddfs_calloc(1, sizeof(struct ddfs_gc));
+
+    if (gc == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_init(&gc->lock, NULL);
+    pthread_cond_init(&gc->wake, NULL);
+    volume->gc = gc;
+
+    if (pthread_create(&gc->thread, NULL, collect_blocks, volume) != 0) {
+        free_reclaim_queue(fd);
+        return EXIT_FAILURE;
+    }
+
+    gc->running = 1;
+    return EXIT_SUCCESS;
+}
+
+// Stop the collector and drop the queue. Queued blocks are not reclaimed;
+// they only hold data nothing refers to.
+void free_reclaim_queue(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->gc == NULL) {
+        return;
+    }
+
+    struct ddfs_gc *gc = volume->gc;
+
+    if (gc->running) {
+        pthread_mutex_lock(&gc->lock);
+        gc->stop = 1;
+        pthread_cond_signal(&gc->wake);
+        pthread_mutex_unlock(&gc->lock);
+        pthread_join(gc->thread, NULL);
+    }
+
+    pthread_cond_destroy(&gc->wake);
+    pthread_mutex_destroy(&gc->lock);
+    ddfs_free(gc);
+    volume->gc = NULL;
+}
+
+// Hand blocks nothing refers to any more to the collector. Fails when the
+// volume has no collector or its queue is full, in which case the caller
+// reclaims the blocks itself.
+int queue_reclaim(int fd, uint64_t *blocks, uint32_t count) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->gc == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_gc *gc = volume->gc;
+
+    pthread_mutex_lock(&gc->lock);
+
+    if (count > DDFS_GC_QUEUE - gc->count) {
+        pthread_mutex_unlock(&gc->lock);
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        gc->queue[(gc->head + gc->count + i) % DDFS_GC_QUEUE] = blocks[i];
+    }
+
+    if (gc->count == 0) {
+        clock_gettime(CLOCK_REALTIME, &gc->queued_at);
+    }
+
+    gc->count += count;
+    pthread_cond_signal(&gc->wake);
+    pthread_mutex_unlock(&gc->lock);
+    return EXIT_SUCCESS;
+}
+
+// Reclaim every queued block in the calling thread
+int drain_reclaim_queue(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->gc == NULL) {
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_gc *gc = volume->gc;
+    uint64_t blocks[DDFS_GC_BATCH];
+    int ret = EXIT_SUCCESS;
+
+    pthread_mutex_lock(&gc->lock);
+
+    while (gc->count != 0) {
+        uint32_t count = take_blocks(gc, blocks, DDFS_GC_BATCH);
+        pthread_mutex_unlock(&gc->lock);
+
+        if (reclaim_blocks(fd, blocks, count) != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+
+        pthread_mutex_lock(&gc->lock);
+    }
+
+    pthread_mutex_unlock(&gc->lock);
+    return ret;
+}
+
+// Record that the foreground changed reference counts, so the collector
+// holds off for a while
+void note_gc_activity(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume != NULL && volume->gc != NULL) {
+        __atomic_add_fetch(&volume->gc->activity, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Have the volume discard unreferenced runs of at least min_blocks blocks
+// instead of zeroing them, letting freed blocks wait up to window
+// microseconds for their neighbours. A min_blocks of 0 goes back to
+// zeroing.
+int set_discard_policy(int fd, uint64_t min_blocks, uint32_t window) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_reflog *log = volume->reflog;
+
+    // Runs being reclaimed see either policy as a whole
+    if (log != NULL) {
+        pthread_mutex_lock(&log->lock);
+    }
+
+    volume->discard_min = min_blocks;
+    __atomic_store_n(&volume->discard_window, window, __ATOMIC_RELAXED);
+
+    if (log != NULL) {
+        pthread_mutex_unlock(&log->lock);
+    }
+
+    return EXIT_SUCCESS;
+}
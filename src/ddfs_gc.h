@@ -0,0 +1,47 @@
+#ifndef ddfs_GC_H
+#define	ddfs_GC_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "ddfs.h"
+
+#define DDFS_GC_QUEUE 4096 // Blocks waiting to be reclaimed
+#define DDFS_GC_BATCH 256 // Blocks reclaimed per pass when draining
+#define DDFS_GC_HIGH_WATER (DDFS_GC_QUEUE / 2) // Queue length past which
+                                               // the collector stops yielding
+#define DDFS_GC_DELAY 1000 // Microseconds to wait after foreground activity
+#define DDFS_DISCARD_MIN 1 // Default shortest run of blocks discarded
+#define DDFS_DISCARD_WINDOW 100000 // Default microseconds freed blocks wait
+                                   // for neighbours before a discard
+
+// Background collector of a volume. Blocks whose last reference went away
+// wait in a ring until the collector thread zeroes them, backing off while
+// the foreground keeps changing reference counts.
+struct ddfs_gc {
+    pthread_mutex_t lock; // Protects the queue
+    pthread_cond_t wake; // Signaled when blocks are queued or on stop
+    pthread_t thread; // Collector thread
+    uint8_t running; // Whether the thread was started
+    uint8_t stop; // Tells the thread to exit
+    uint64_t queue[DDFS_GC_QUEUE]; // Ring of blocks to reclaim
+    uint64_t batch[DDFS_GC_QUEUE]; // Blocks the thread is reclaiming
+    struct timespec queued_at; // When the oldest queued block was queued
+    uint32_t head; // Oldest block in the ring
+    uint32_t count; // Number of blocks in the ring
+    uint64_t activity; // Bumped on every foreground reference change
+};
+
+extern int load_reclaim_queue(int fd);
+
+extern void free_reclaim_queue(int fd);
+
+extern int queue_reclaim(int fd, uint64_t *blocks, uint32_t count);
+
+extern int drain_reclaim_queue(int fd);
+
+extern void note_gc_activity(int fd);
+
+extern int set_discard_policy(int fd, uint64_t min_blocks, uint32_t window);
+
+#endif
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ddfs_group.h"
+#include "ddfs_alloc.h"
+#include "ddfs_volume.h"
+
+#define DDFS_GROUPS_PER_BLOCK \
+    (DDFS_BLOCK_SIZE / sizeof(struct ddfs_group_desc))
+
+// Serializes group initialization between the foreground and the
+// background zeroing threads
+static pthread_mutex_t group_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t get_inode_group(uint64_t inode_number) {
+    return inode_number / DDFS_GROUP_INODES;
+}
+
+// Locate the descriptor table block holding a group's descriptor and its
+// offset in that block
+static int get_group_location(struct ddfs_superblock *sb, uint64_t group,
+    uint64_t *block_number, uint32_t *buffer_offset) {
+    if (group >= le64toh(sb->info.fs_group_count)) {
+        return EXIT_FAILURE;
+    }
+
+    *block_number = (le64toh(sb->info.fs_group_offset) / DDFS_BLOCK_SIZE) +
+        (group / DDFS_GROUPS_PER_BLOCK);
+    *buffer_offset = (group % DDFS_GROUPS_PER_BLOCK) *
+        sizeof(struct ddfs_group_desc);
+    return EXIT_SUCCESS;
+}
+
+static int read_group_desc(int fd, struct ddfs_superblock *sb,
+    uint64_t group, struct ddfs_group_desc *desc) {
+    uint64_t block_number;
+    uint32_t buffer_offset;
+
+    if (get_group_location(sb, group, &block_number, &buffer_offset)) {
+        return EXIT_FAILURE;
+    }
+
+    uint8_t *block = get_block_address(fd, block_number, 1, 0);
+
+    // Mapped volumes read the descriptor in place
+    if (block != NULL) {
+        memcpy(desc, block + buffer_offset, sizeof(struct ddfs_group_desc));
+        return EXIT_SUCCESS;
+    }
+
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    int ret = read_block(fd, buffer, block_number);
+    memcpy(desc, buffer + buffer_offset, sizeof(struct ddfs_group_desc));
+    put_block_buffer(buffer);
+
+    return ret == DDFS_BLOCK_SIZE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int write_group_desc(int fd, struct ddfs_superblock *sb,
+    uint64_t group, struct ddfs_group_desc *desc) {
+    uint64_t block_number;
+    uint32_t buffer_offset;
+
+    if (get_group_location(sb, group, &block_number, &buffer_offset)) {
+        return EXIT_FAILURE;
+    }
+
+    uint8_t *block = get_block_address(fd, block_number, 1, 1);
+
+    // Mapped volumes update the descriptor in place
+    if (block != NULL) {
+        memcpy(block + buffer_offset, desc, sizeof(struct ddfs_group_desc));
+        return EXIT_SUCCESS;
+    }
+
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    int ret = read_block(fd, buffer, block_number);
+
+    if (ret == DDFS_BLOCK_SIZE) {
+        memcpy(buffer + buffer_offset, desc, sizeof(struct ddfs_group_desc));
+        ret = write_block(fd, buffer, block_number);
+    }
+
+    put_block_buffer(buffer);
+    return ret == DDFS_BLOCK_SIZE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Read every group's flags into the volume, so checking a group costs no
+// I/O. Descriptors without a volume read the descriptor each time.
+int load_groups(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL) {
+        return EXIT_SUCCESS;
+    }
+
+    stop_group_zeroing(fd);
+    ddfs_free(volume->groups);
+    volume->groups = NULL;
+    volume->group_count = 0;
+
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    // Nothing to load until the volume is formatted
+    if (check_superblock(sb) != EXIT_SUCCESS) {
+        put_block_buffer(sb);
+        return EXIT_SUCCESS;
+    }
+
+    uint64_t group_count = le64toh(sb->info.fs_group_count);
+    uint64_t table_block = le64toh(sb->info.fs_group_offset) /
+        DDFS_BLOCK_SIZE;
+    put_block_buffer(sb);
+
+    uint8_t *groups = ddfs_calloc(group_count, sizeof(uint8_t));
+    uint8_t *buffer = get_block_buffer();
+    int ret = EXIT_SUCCESS;
+
+    if (groups == NULL || buffer == NULL) {
+        ret = EXIT_FAILURE;
+    }
+
+    for (uint64_t g = 0; ret == EXIT_SUCCESS && g < group_count;
+        g += DDFS_GROUPS_PER_BLOCK) {
+        if (read_block(fd, buffer, table_block + (g / DDFS_GROUPS_PER_BLOCK))
+            != DDFS_BLOCK_SIZE) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        struct ddfs_group_desc *desc = (struct ddfs_group_desc *)buffer;
+
+        for (uint64_t i = 0; i < DDFS_GROUPS_PER_BLOCK &&
+            g + i < group_count; i++) {
+            groups[g + i] = le32toh(desc[i].gd_flags);
+        }
+    }
+
+    put_block_buffer(buffer);
+
+    if (ret != EXIT_SUCCESS) {
+        ddfs_free(groups);
+        return EXIT_FAILURE;
+    }
+
+    volume->groups = groups;
+    volume->group_count = group_count;
+
+    if (volume->flags & DDFS_OPEN_ZERO_GROUPS) {
+        start_group_zeroing(fd);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Get whether a group was initialized: 1 if it was, 0 if it was not and
+// -1 on error. The superblock is read when sb is NULL.
+int get_group_state(int fd, struct ddfs_superblock *sb, uint64_t group) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume != NULL && volume->groups != NULL) {
+        if (group >= volume->group_count) {
+            return -1;
+        }
+
+        return (__atomic_load_n(&volume->groups[group], __ATOMIC_ACQUIRE) &
+            DDFS_GROUP_INITIALIZED) != 0;
+    }
+
+    struct ddfs_superblock *own_sb = NULL;
+
+    if (sb == NULL && (sb = own_sb = get_superblock(fd)) == NULL) {
+        return -1;
+    }
+
+    struct ddfs_group_desc desc;
+    int ret = read_group_desc(fd, sb, group, &desc);
+    put_block_buffer(own_sb);
+
+    if (ret != EXIT_SUCCESS) {
+        return -1;
+    }
+
+    return (le32toh(desc.gd_flags) & DDFS_GROUP_INITIALIZED) != 0;
+}
+
+// Zero a group's free inode bitmap block and inode store blocks, then
+// record that it is initialized
+static int zero_group(int fd, struct ddfs_superblock *sb, uint64_t group) {
+    uint64_t inodes_per_block = DDFS_BLOCK_SIZE / sb->info.fs_inode_size;
+    uint64_t first_inode = group * DDFS_GROUP_INODES;
+    uint64_t inode_count = le64toh(sb->info.fs_inode_count) - first_inode;
+
+    if (inode_count > DDFS_GROUP_INODES) {
+        inode_count = DDFS_GROUP_INODES;
+    }
+
+    uint64_t istore_block =
+        (le64toh(sb->info.fs_istore_offset) / DDFS_BLOCK_SIZE) +
+        (first_inode / inodes_per_block);
+
+    if (zero_blocks(fd, group + 1, 1) != EXIT_SUCCESS ||
+        zero_blocks(fd, istore_block,
+        div_ceil(inode_count, inodes_per_block)) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_group_desc desc = {
+        .gd_flags = htole32(DDFS_GROUP_INITIALIZED),
+        .gd_init_time = htole64(time(NULL))
+    };
+
+    if (write_group_desc(fd, sb, group, &desc) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume != NULL && volume->groups != NULL) {
+        __atomic_store_n(&volume->groups[group], DDFS_GROUP_INITIALIZED,
+            __ATOMIC_RELEASE);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Make sure a group is initialized before anything is written to it. The
+// superblock is read when sb is NULL.
+int initialize_group(int fd, struct ddfs_superblock *sb, uint64_t group) {
+    int state = get_group_state(fd, sb, group);
+
+    if (state != 0) {
+        return state == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    struct ddfs_superblock *own_sb = NULL;
+
+    if (sb == NULL && (sb = own_sb = get_superblock(fd)) == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_lock(&group_lock);
+
+    // Another thread may have initialized the group in the meantime
+    state = get_group_state(fd, sb, group);
+    int ret = state == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (state == 0) {
+        ret = zero_group(fd, sb, group);
+    }
+
+    pthread_mutex_unlock(&group_lock);
+    put_block_buffer(own_sb);
+    return ret;
+}
+
+// Initialize the remaining groups one at a time, pausing between groups so
+// foreground I/O keeps most of the device
+static void *zero_groups(void *arg) {
+    struct ddfs_volume *volume = arg;
+
+    for (uint64_t g = 0; g < volume->group_count; g++) {
+        if (__atomic_load_n(&volume->zero_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        if (get_group_state(volume->fd, NULL, g) != 0) {
+            continue;
+        }
+
+        if (initialize_group(volume->fd, NULL, g) != EXIT_SUCCESS) {
+            break;
+        }
+
+        usleep(DDFS_GROUP_ZERO_DELAY);
+    }
+
+    return NULL;
+}
+
+// Start zeroing the volume's uninitialized groups in the background
+int start_group_zeroing(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || !volume->writable || volume->groups == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    if (volume->zeroing) {
+        return EXIT_SUCCESS;
+    }
+
+    volume->zero_stop = 0;
+
+    if (pthread_create(&volume->zero_thread, NULL, zero_groups,
+        volume) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    volume->zeroing = 1;
+    return EXIT_SUCCESS;
+}
+
+// Stop the background zeroing thread and wait for it to exit. Groups it
+// did not reach stay uninitialized.
+void stop_group_zeroing(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || !volume->zeroing) {
+        return;
+    }
+
+    __atomic_store_n(&volume->zero_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(volume->zero_thread, NULL);
+    volume->zeroing = 0;
+}
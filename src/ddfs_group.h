@@ -0,0 +1,34 @@
+#ifndef ddfs_GROUP_H
+#define	ddfs_GROUP_H
+
+#include "ddfs.h"
+
+#define DDFS_GROUP_INODES (DDFS_BLOCK_SIZE * 8) // Inodes per free inode
+                                                // bitmap block and group
+#define DDFS_GROUP_INITIALIZED 0x1 // Bitmap block and inodes were zeroed
+#define DDFS_GROUP_ZERO_DELAY 1000 // Microseconds between background zeroes
+
+// Descriptor of an inode group: one free inode bitmap block and the inode
+// store blocks it covers. Groups that were never initialized may hold
+// anything and are treated as all free without being read.
+struct ddfs_group_desc {
+    uint32_t gd_flags; // DDFS_GROUP_* flags
+    uint32_t gd_padding; // Padding to 16 bytes
+    uint64_t gd_init_time; // When the group was initialized
+};
+
+extern uint64_t get_inode_group(uint64_t inode_number);
+
+extern int load_groups(int fd);
+
+extern int get_group_state(int fd, struct ddfs_superblock *sb,
+    uint64_t group);
+
+extern int initialize_group(int fd, struct ddfs_superblock *sb,
+    uint64_t group);
+
+extern int start_group_zeroing(int fd);
+
+extern void stop_group_zeroing(int fd);
+
+#endif
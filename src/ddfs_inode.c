@@ -2,128 +2,90 @@
 #include <stdlib.h>
 
 #include "ddfs_inode.h"
+#include "ddfs_alloc.h"
 #include "ddfs_bitmap.h"
+#include "ddfs_group.h"
 
-int increment_reference_count(int fd, uint32_t inode_number) {
-    struct ddfs_superblock *sb = read_superblock(fd);
-
-    if (sb == NULL) {
-        return EXIT_FAILURE;
-    }
+// Locate the inode store block holding an inode and its offset in that block
+void get_inode_location(struct ddfs_superblock *sb, uint64_t inode_number, 
+    uint64_t *block_number, uint32_t *buffer_offset) {
+    uint64_t inode_offset = sb->info.fs_istore_offset + 
+        (inode_number * sb->info.fs_inode_size);
+    *block_number = inode_offset / DDFS_BLOCK_SIZE;
+    *buffer_offset = inode_offset % DDFS_BLOCK_SIZE;
+}
 
-    struct ddfs_inode *inode = 
-        (struct ddfs_inode*)malloc(sizeof(struct ddfs_inode));
+// Take an inode object from the calling thread's slab pool
+struct ddfs_inode *alloc_inode(void) {
+    struct ddfs_scratch *scratch = get_scratch();
 
-    if (inode == NULL) {
-        free(sb);
-        return EXIT_FAILURE;
+    if (scratch == NULL) {
+        return NULL;
     }
 
-    inode = get_inode(fd, inode_number);
+    return slab_alloc(&scratch->inodes);
+}
 
-    if (inode->info.i_ref_count != UINT16_MAX) {
-        inode->info.i_ref_count++;
-    }
+// Release an inode returned by alloc_inode(), get_inode(),
+// initialize_inode() or free_inode()
+void put_inode(struct ddfs_inode *inode) {
+    struct ddfs_scratch *scratch = get_scratch();
 
-    uint32_t inode_offset = sb->info.fs_istore_offset + 
-        (inode_number * sb->info.fs_inode_size);
-    uint32_t inode_block_number = inode_offset / DDFS_BLOCK_SIZE;
-    uint32_t inode_buffer_offset = inode_offset % inode_block_number;
-    void *buffer = malloc(DDFS_BLOCK_SIZE);
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
-    int ret = read_block(fd, buffer, inode_block_number);
-    memcpy(buffer + inode_buffer_offset, inode, sb->info.fs_inode_size);
-    ret = write_block(fd, buffer, inode_block_number);
-    
-    if (ret != DDFS_BLOCK_SIZE) {
-        free(sb);
-        free(inode);
-        return EXIT_FAILURE;
+    if (scratch != NULL) {
+        slab_free(&scratch->inodes, inode);
     }
-    
-    free(sb);
-    free(inode);
-    return EXIT_SUCCESS;
 }
 
-int decrement_reference_count(int fd, uint32_t inode_number) {
-    struct ddfs_superblock *sb = read_superblock(fd);
-
-    if (sb == NULL) {
+// Copy an inode into its slot in the inode store, initializing its group
+// first
+static int write_inode(int fd, struct ddfs_superblock *sb, 
+    uint64_t inode_number, struct ddfs_inode *inode) {
+    if (initialize_group(fd, sb, get_inode_group(inode_number)) != 
+        EXIT_SUCCESS) {
         return EXIT_FAILURE;
     }
 
-    struct ddfs_inode *inode = 
-        (struct ddfs_inode*)malloc(sizeof(struct ddfs_inode));
+    uint64_t inode_block_number;
+    uint32_t inode_buffer_offset;
+    get_inode_location(sb, inode_number, &inode_block_number, 
+        &inode_buffer_offset);
+    uint8_t *block = get_block_address(fd, inode_block_number, 1, 1);
 
-    if (inode == NULL) {
-        free(sb);
-        return EXIT_FAILURE;
+    // Mapped volumes update the inode in place
+    if (block != NULL) {
+        memcpy(block + inode_buffer_offset, inode, sb->info.fs_inode_size);
+        return EXIT_SUCCESS;
     }
 
-    inode = get_inode(fd, inode_number);
+    uint8_t *buffer = get_block_buffer();
 
-    if (inode->info.i_ref_count != 0) {
-        inode->info.i_ref_count--;
-    }
-
-    uint32_t inode_offset = sb->info.fs_istore_offset + 
-        (inode_number * sb->info.fs_inode_size);
-    uint32_t inode_block_number = inode_offset / DDFS_BLOCK_SIZE;
-    uint32_t inode_buffer_offset = inode_offset % inode_block_number;
-    void *buffer = malloc(DDFS_BLOCK_SIZE);
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
-    int ret = read_block(fd, buffer, inode_block_number);
-    memcpy(buffer + inode_buffer_offset, inode, sb->info.fs_inode_size);
-    ret = write_block(fd, buffer, inode_block_number);
-    
-    if (ret != DDFS_BLOCK_SIZE) {
-        free(sb);
-        free(inode);
+    if (buffer == NULL) {
         return EXIT_FAILURE;
     }
-    
-    free(sb);
-    free(inode);
-    return EXIT_SUCCESS;
-}
 
-int get_reference_count(int fd, uint32_t inode_number) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+    int ret = read_block(fd, buffer, inode_block_number);
 
-    if (sb == NULL) {
-        return -1;
+    if (ret == DDFS_BLOCK_SIZE) {
+        memcpy(buffer + inode_buffer_offset, inode, sb->info.fs_inode_size);
+        ret = write_block(fd, buffer, inode_block_number);
     }
 
-    struct ddfs_inode *inode = 
-        (struct ddfs_inode*)malloc(sizeof(struct ddfs_inode));
-
-    if (inode == NULL) {
-        free(sb);
-        return -1;
-    }
-
-    inode = get_inode(fd, inode_number);
-    int reference_count = inode->info.i_ref_count;
-    
-    free(sb);
-    free(inode);
-    return reference_count;
+    put_block_buffer(buffer);
+    return ret == DDFS_BLOCK_SIZE ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-struct ddfs_inode *initialize_inode(int fd, uint32_t inode_number, 
-    uint8_t key[20], uint32_t block_ptr) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+struct ddfs_inode *initialize_inode(int fd, uint64_t inode_number, 
+    uint8_t key[20], uint64_t block_ptr) {
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
         return NULL;
     }
 
-    struct ddfs_inode *inode = 
-        (struct ddfs_inode*)malloc(sizeof(struct ddfs_inode));
+    struct ddfs_inode *inode = alloc_inode();
 
     if (inode == NULL) {
-        free(sb);
+        put_block_buffer(sb);
         return NULL;
     }
 
@@ -133,7 +95,6 @@ struct ddfs_inode *initialize_inode(int fd, uint32_t inode_number,
         .i_number = inode_number,
         .i_uid = getuid(),
         .i_size = sb->info.fs_inode_size,
-        .i_ref_count = 1,
         .i_mod_time = time(NULL),
         .i_block_ptr = block_ptr
     };
@@ -142,121 +103,102 @@ struct ddfs_inode *initialize_inode(int fd, uint32_t inode_number,
         inode->info.i_key[i] = key[i];
     }
 
-    uint32_t inode_offset = sb->info.fs_istore_offset + 
-        (inode_number * sb->info.fs_inode_size);
-    uint32_t inode_block_number = inode_offset / DDFS_BLOCK_SIZE;
-    uint32_t inode_buffer_offset = inode_offset % inode_block_number;
-    void *buffer = malloc(DDFS_BLOCK_SIZE);
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
-    int ret = read_block(fd, buffer, inode_block_number);
-    memcpy(buffer + inode_buffer_offset, inode, sb->info.fs_inode_size);
-    ret = write_block(fd, buffer, inode_block_number);
-    
-    if (ret != DDFS_BLOCK_SIZE) {
-        free(sb);
-        free(inode);
-        return NULL;
-    }
+    int ret = write_inode(fd, sb, inode_number, inode);
+    put_block_buffer(sb);
 
-    if (set_inode_bit(fd, inode_number) != 0) {
-        free(sb);
-        free(inode);
+    if (ret != EXIT_SUCCESS || set_inode_bit(fd, inode_number) != 0) {
+        put_inode(inode);
         return NULL;
     }
     
-    free(sb);
-    free(inode);
     return inode;
 }
 
-struct ddfs_inode *free_inode(int fd, uint32_t inode_number) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+// Clear an inode and its bit, returning the inode as it was before
+struct ddfs_inode *free_inode(int fd, uint64_t inode_number) {
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
         return NULL;
     }
 
-    struct ddfs_inode *inode = 
-        (struct ddfs_inode*)malloc(sizeof(struct ddfs_inode));
+    struct ddfs_inode *inode = alloc_inode();
+    struct ddfs_inode *old_inode = get_inode(fd, inode_number);
 
-    if (inode == NULL) {
-        free(sb);
+    if (inode == NULL || old_inode == NULL) {
+        put_block_buffer(sb);
+        put_inode(inode);
+        put_inode(old_inode);
         return NULL;
     }
 
     memset(inode, 0, sizeof(struct ddfs_inode));
+    int ret = write_inode(fd, sb, inode_number, inode);
+    put_block_buffer(sb);
+    put_inode(inode);
 
-    uint32_t inode_offset = sb->info.fs_istore_offset + 
-        (inode_number * sb->info.fs_inode_size);
-    uint32_t inode_block_number = inode_offset / DDFS_BLOCK_SIZE;
-    uint32_t inode_buffer_offset = inode_offset % inode_block_number;
-    void *buffer = malloc(DDFS_BLOCK_SIZE);
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
-    int ret = read_block(fd, buffer, inode_block_number);
-    memcpy(buffer + inode_buffer_offset, inode, sb->info.fs_inode_size);
-    ret = write_block(fd, buffer, inode_block_number);
-    
-    if (ret != DDFS_BLOCK_SIZE) {
-        free(sb);
-        free(inode);
+    if (ret != EXIT_SUCCESS || clear_inode_bit(fd, inode_number) != 0) {
+        put_inode(old_inode);
         return NULL;
     }
+    
+    return old_inode;
+}
 
-    if (clear_inode_bit(fd, inode_number) != 0) {
-        free(sb);
-        free(inode);
+struct ddfs_inode *get_inode(int fd, uint64_t inode_number) {
+    // Free inodes, including every inode of an uninitialized group, are
+    // not read
+    if (get_inode_bit(fd, inode_number) != 1) {
         return NULL;
     }
-    
-    free(sb);
-    free(inode);
-    return inode;
-}
 
-struct ddfs_inode *get_inode(int fd, uint32_t inode_number) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
         return NULL;
     }
 
-    struct ddfs_inode *inode = 
-        (struct ddfs_inode*)malloc(sizeof(struct ddfs_inode));
+    struct ddfs_inode *inode = alloc_inode();
 
     if (inode == NULL) {
-        free(sb);
+        put_block_buffer(sb);
         return NULL;
     }
 
     memset(inode, 0, sizeof(struct ddfs_inode));
 
-    uint32_t inode_offset = sb->info.fs_istore_offset + 
-        (inode_number * sb->info.fs_inode_size);
-    uint32_t inode_block_number = inode_offset / DDFS_BLOCK_SIZE;
-    uint32_t inode_buffer_offset = inode_offset % inode_block_number;
-    void *buffer = malloc(DDFS_BLOCK_SIZE);
-    memset(buffer, 0, DDFS_BLOCK_SIZE);
-    int ret = read_block(fd, buffer, inode_block_number);
-    memcpy(inode, buffer + inode_buffer_offset, sb->info.fs_inode_size);
-    
-    if (ret != DDFS_BLOCK_SIZE) {
-        free(sb);
-        free(inode);
-        return NULL;
-    }
+    uint64_t inode_block_number;
+    uint32_t inode_buffer_offset;
+    get_inode_location(sb, inode_number, &inode_block_number, 
+        &inode_buffer_offset);
+    uint32_t inode_size = sb->info.fs_inode_size;
+    put_block_buffer(sb);
+    uint8_t *block = get_block_address(fd, inode_block_number, 1, 0);
+
+    // Mapped volumes copy only the inode out of the mapping
+    if (block != NULL) {
+        memcpy(inode, block + inode_buffer_offset, inode_size);
+    } else {
+        uint8_t *buffer = get_block_buffer();
+        int ret = -1;
+
+        if (buffer != NULL) {
+            ret = read_block(fd, buffer, inode_block_number);
+            memcpy(inode, buffer + inode_buffer_offset, inode_size);
+            put_block_buffer(buffer);
+        }
 
-    if (get_inode_bit(fd, inode_number) != 1) {
-        free(sb);
-        free(inode);
-        return NULL;
+        if (ret != DDFS_BLOCK_SIZE) {
+            put_inode(inode);
+            return NULL;
+        }
     }
     
-    free(sb);
     return inode;
 }
 
 int64_t get_next_free_inode(int fd) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
         return EXIT_FAILURE;
@@ -267,87 +209,98 @@ int64_t get_next_free_inode(int fd) {
         DDFS_BLOCK_SIZE) * 8) - 1;
 
     for (uint64_t i = start_bit; i <= end_bit; i++) {
-        if (get_bit(fd, i) == 0) {
-            free(sb);
+        if (get_inode_bit(fd, i - start_bit) == 0) {
+            put_block_buffer(sb);
             return i;
         }
     }
 
-    free(sb);
+    put_block_buffer(sb);
     return -1;
 }
 
-int set_inode_bit(int fd, uint32_t inode_number) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+int set_inode_bit(int fd, uint64_t inode_number) {
+    uint64_t bit_number = (DDFS_BLOCK_SIZE * 8) + inode_number;
 
-    if (sb == NULL) {
+    if (initialize_group(fd, NULL, get_inode_group(inode_number)) != 
+        EXIT_SUCCESS) {
         return EXIT_FAILURE;
     }
 
-    uint32_t bit_number = (DDFS_BLOCK_SIZE * 8) + inode_number;
-
-    free(sb);
     return set_bit(fd, bit_number);
 }
 
-int clear_inode_bit(int fd, uint32_t inode_number) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+int clear_inode_bit(int fd, uint64_t inode_number) {
+    uint64_t bit_number = (DDFS_BLOCK_SIZE * 8) + inode_number;
+    int state = get_group_state(fd, NULL, get_inode_group(inode_number));
 
-    if (sb == NULL) {
-        return EXIT_FAILURE;
+    // Every inode of an uninitialized group is already free
+    if (state != 1) {
+        return state == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    uint32_t bit_number = (DDFS_BLOCK_SIZE * 8) + inode_number;
-
-    free(sb);
     return clear_bit(fd, bit_number);
 }
 
-int get_inode_bit(int fd, uint32_t inode_number) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+int get_inode_bit(int fd, uint64_t inode_number) {
+    uint64_t bit_number = (DDFS_BLOCK_SIZE * 8) + inode_number;
+    int state = get_group_state(fd, NULL, get_inode_group(inode_number));
 
-    if (sb == NULL) {
-        return EXIT_FAILURE;
+    // Uninitialized groups read as all free without touching the bitmap
+    if (state != 1) {
+        return state;
     }
 
-    uint32_t bit_number = (DDFS_BLOCK_SIZE * 8) + inode_number;
-
-    free(sb);
     return get_bit(fd, bit_number);
 }
 
+// Initialize an inode the caller does not need to keep
+static int create_inode(int fd, uint64_t inode_number, uint8_t key[20], 
+    uint64_t block_ptr) {
+    struct ddfs_inode *inode = initialize_inode(fd, inode_number, key, 
+        block_ptr);
+
+    if (inode == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    put_inode(inode);
+    return EXIT_SUCCESS;
+}
+
 int initialize_superblock_inode(int fd) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
         return EXIT_FAILURE;
     }
 
     if (clear_inode_bit(fd, DDFS_BLOCK_SIZE) != 0) {
+        put_block_buffer(sb);
         return EXIT_FAILURE;
     }
 
-    int64_t free_inode_bit = DDFS_BLOCK_SIZE * 8;
     int64_t free_block_bit = DDFS_BLOCK_SIZE * 8;
     uint8_t key[20];
     memset(key, 0, 20);
     
-    if (initialize_inode(fd, free_inode_bit, key, free_block_bit) == NULL) {
-        free(sb);
+    // The superblock inode is inode 0, the inode its free bit stands for
+    if (create_inode(fd, 0, key, free_block_bit) != EXIT_SUCCESS) {
+        put_block_buffer(sb);
         return EXIT_FAILURE;
     }
 
-    if (set_bit(fd, free_inode_bit) != 0) {
-        free(sb);
+    if (set_inode_bit(fd, 0) != 0) {
+        put_block_buffer(sb);
         return EXIT_FAILURE;
     }
 
-    free(sb);
+    put_block_buffer(sb);
     return EXIT_SUCCESS;
 }
 
 int initialize_ifree_inodes(int fd) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
         return EXIT_FAILURE;
@@ -359,56 +312,57 @@ int initialize_ifree_inodes(int fd) {
     uint8_t key[20];
     memset(key, 0, 20);
 
-    for (uint32_t i = 1; i < sb->info.fs_ifree_count + 1; i++) {
+    for (uint64_t i = 1; i < sb->info.fs_ifree_count + 1; i++) {
         free_inode_bit = get_next_free_inode(fd);
         free_block_bit = get_next_free_block(fd);
     
-        if (initialize_inode(fd, free_inode_bit, key, free_block_bit) == NULL) {
-            free(sb);
+        if (create_inode(fd, free_inode_bit, key,
+            free_block_bit) != EXIT_SUCCESS) {
+            put_block_buffer(sb);
             return EXIT_FAILURE;
         }
 
         if (set_bit(fd, free_inode_bit) != 0) {
-            free(sb);
+            put_block_buffer(sb);
             return EXIT_FAILURE;
         }
 
         if (set_bit(fd, free_block_bit) != 0) {
-            free(sb);
+            put_block_buffer(sb);
             return EXIT_FAILURE;
         }
     }
 
-    free(sb);
+    put_block_buffer(sb);
     return EXIT_SUCCESS;
 }
 
 int initialize_bfree_inodes(int fd) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
         return EXIT_FAILURE;
     }
 
-    uint32_t bfree_offset = DDFS_BLOCK_SIZE * 
+    uint64_t bfree_offset = DDFS_BLOCK_SIZE * 
         (sb->info.fs_ifree_block_count + 1);
 
     uint8_t key[20];
     memset(key, 0, 20);
 
-    for (uint32_t i = bfree_offset; i < sb->info.fs_istore_offset; i++) {
-        if (initialize_inode(fd, i, key, i) == NULL) {
-            free(sb);
+    for (uint64_t i = bfree_offset; i < sb->info.fs_istore_offset; i++) {
+        if (create_inode(fd, i, key, i) != EXIT_SUCCESS) {
+            put_block_buffer(sb);
             return EXIT_FAILURE;
         }
     }
 
-    free(sb);
+    put_block_buffer(sb);
     return EXIT_SUCCESS;
 }
 
 int initialize_istore_inodes(int fd) {
-    struct ddfs_superblock *sb = read_superblock(fd);
+    struct ddfs_superblock *sb = get_superblock(fd);
 
     if (sb == NULL) {
         return EXIT_FAILURE;
@@ -419,27 +373,28 @@ int initialize_istore_inodes(int fd) {
     uint8_t key[20];
     memset(key, 0, 20);
 
-    for (uint32_t i = sb->info.fs_istore_offset; 
+    for (uint64_t i = sb->info.fs_istore_offset; 
         i < sb->info.fs_data_offset; i++) {
         free_inode_bit = get_next_free_inode(fd);
         free_block_bit = get_next_free_block(fd);
         
-        if (initialize_inode(fd, free_inode_bit, key, free_block_bit) == NULL) {
-            free(sb);
+        if (create_inode(fd, free_inode_bit, key,
+            free_block_bit) != EXIT_SUCCESS) {
+            put_block_buffer(sb);
             return EXIT_FAILURE;
         }
 
         if (set_bit(fd, free_inode_bit) != 0) {
-            free(sb);
+            put_block_buffer(sb);
             return EXIT_FAILURE;
         }
 
         if (set_bit(fd, free_block_bit) != 0) {
-            free(sb);
+            put_block_buffer(sb);
             return EXIT_FAILURE;
         }
     }
 
-    free(sb);
+    put_block_buffer(sb);
     return EXIT_SUCCESS;
 }
@@ -6,40 +6,40 @@
 struct ddfs_inode_info {
     struct	vnode  *i_vnode;   // Vnode associated with this inode
     struct 	ddfsmount *i_kvmp; // ddfsmount point associated with this inode
-    uint32_t i_number;         // Inode number
+    uint64_t i_number;         // Inode number
     uint32_t i_uid;            // Owner id
     uint32_t i_size;           // Size in bytes
     uint8_t i_key[20];         // 160-bit key
-    uint16_t i_ref_count;      // Reference count
     time_t i_mod_time;         // Modification time
-    uint32_t i_block_ptr;      // Block pointer
+    uint64_t i_block_ptr;      // Block pointer
 };
 
 struct ddfs_inode {
     struct ddfs_inode_info info;
-    char padding[52]; // Padding to match 128 bytes
+    char padding[56]; // Padding to match 128 bytes
 };
 
-extern int increment_reference_count(int fd, uint32_t inode_number);
+extern void get_inode_location(struct ddfs_superblock *sb, 
+    uint64_t inode_number, uint64_t *block_number, uint32_t *buffer_offset);
 
-extern int decrement_reference_count(int fd, uint32_t inode_number);
+extern struct ddfs_inode *alloc_inode(void);
 
-extern int get_reference_count(int fd, uint32_t inode_number);
+extern void put_inode(struct ddfs_inode *inode);
 
-extern struct ddfs_inode *initialize_inode(int fd, uint32_t inode_number, 
-    uint8_t key[20], uint32_t block_ptr);
+extern struct ddfs_inode *initialize_inode(int fd, uint64_t inode_number, 
+    uint8_t key[20], uint64_t block_ptr);
 
-extern struct ddfs_inode *free_inode(int fd, uint32_t inode_number);
+extern struct ddfs_inode *free_inode(int fd, uint64_t inode_number);
 
-extern struct ddfs_inode *get_inode(int fd, uint32_t inode_number);
+extern struct ddfs_inode *get_inode(int fd, uint64_t inode_number);
 
 extern int64_t get_next_free_inode(int fd);
 
-extern int set_inode_bit(int fd, uint32_t inode_number);
+extern int set_inode_bit(int fd, uint64_t inode_number);
 
-extern int clear_inode_bit(int fd, uint32_t inode_number);
+extern int clear_inode_bit(int fd, uint64_t inode_number);
 
-extern int get_inode_bit(int fd, uint32_t inode_number);
+extern int get_inode_bit(int fd, uint64_t inode_number);
 
 extern int initialize_superblock_inode(int fd);
 
@@ -0,0 +1,797 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ddfs_journal.h"
+#include "ddfs_alloc.h"
+#include "ddfs_backend.h"
+#include "ddfs_refcount.h"
+#include "ddfs_volume.h"
+
+// Every block a checkpoint writes fits with the table at most half full
+#define DDFS_JOURNAL_SLOTS (2 * DDFS_JOURNAL_DIRTY)
+
+static uint64_t checksum(const uint8_t *data, uint64_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (uint64_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Bytes a record of length changed bytes takes up in a transaction
+static uint64_t record_size(uint32_t length) {
+    return sizeof(struct ddfs_journal_record) + ((length + 7) & ~7U);
+}
+
+static int compare_dirty(const void *a, const void *b) {
+    uint64_t x = ((const struct ddfs_journal_block *)a)->block_number;
+    uint64_t y = ((const struct ddfs_journal_block *)b)->block_number;
+
+    return (x > y) - (x < y);
+}
+
+// Find a block's slot among the changed blocks, or the empty slot it
+// would take
+static struct ddfs_journal_block *dirty_slot(struct ddfs_journal *journal,
+    uint64_t block_number) {
+    uint64_t slot = (block_number * 0x9e3779b97f4a7c15ULL) %
+        DDFS_JOURNAL_SLOTS;
+
+    // Block 0 holds the superblock, so it marks an empty slot
+    while (journal->dirty[slot].block_number != 0 &&
+        journal->dirty[slot].block_number != block_number) {
+        slot = (slot + 1) % DDFS_JOURNAL_SLOTS;
+    }
+
+    return &journal->dirty[slot];
+}
+
+// Get a changed block, reading its home contents the first time it
+// changes. The caller makes sure there is room for another block.
+static struct ddfs_journal_block *get_dirty(int fd,
+    struct ddfs_journal *journal, uint64_t block_number) {
+    struct ddfs_journal_block *slot = dirty_slot(journal, block_number);
+
+    if (slot->block_number != 0) {
+        return slot;
+    }
+
+    uint8_t *data = ddfs_memalign(DDFS_BLOCK_SIZE, DDFS_BLOCK_SIZE);
+
+    if (data == NULL || get_backend(fd)->read(fd, (void **)&data,
+        block_number, 1) != DDFS_BLOCK_SIZE) {
+        ddfs_free(data);
+        return NULL;
+    }
+
+    slot->block_number = block_number;
+    slot->data = data;
+    journal->dirty_count++;
+    return slot;
+}
+
+// Write every changed block to its home location, a run of adjacent
+// blocks at a time, and make the writes durable
+static int write_dirty(int fd, struct ddfs_journal *journal) {
+    if (journal->dirty_count == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_journal_block *blocks = ddfs_malloc(journal->dirty_count *
+        sizeof(struct ddfs_journal_block));
+    void **buffers = ddfs_malloc(journal->dirty_count * sizeof(void *));
+    uint32_t count = 0;
+    int ret = EXIT_FAILURE;
+
+    if (blocks == NULL || buffers == NULL) {
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < DDFS_JOURNAL_SLOTS; i++) {
+        if (journal->dirty[i].block_number != 0) {
+            blocks[count++] = journal->dirty[i];
+        }
+    }
+
+    qsort(blocks, count, sizeof(struct ddfs_journal_block), compare_dirty);
+
+    for (uint32_t i = 0; i < count; i++) {
+        buffers[i] = blocks[i].data;
+    }
+
+    for (uint32_t i = 0; i < count;) {
+        uint32_t n = 1;
+
+        while (i + n < count && blocks[i + n].block_number ==
+            blocks[i].block_number + n) {
+            n++;
+        }
+
+        if (get_backend(fd)->write(fd, buffers + i, blocks[i].block_number,
+            n) != (int64_t)n * DDFS_BLOCK_SIZE) {
+            goto out;
+        }
+
+        i += n;
+    }
+
+    if (flush_volume(fd) != EXIT_SUCCESS) {
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < DDFS_JOURNAL_SLOTS; i++) {
+        ddfs_free(journal->dirty[i].data);
+        journal->dirty[i].block_number = 0;
+        journal->dirty[i].data = NULL;
+    }
+
+    journal->dirty_count = 0;
+    ret = EXIT_SUCCESS;
+
+out:
+    ddfs_free(blocks);
+    ddfs_free(buffers);
+    return ret;
+}
+
+// Start a new epoch, which empties the on-disk journal. The new first
+// block is durable before any transaction of the epoch is written, so the
+// old transactions can never be replayed over newer home blocks.
+static int reset_journal(int fd, struct ddfs_journal *journal) {
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_journal_header *header =
+        (struct ddfs_journal_header *)buffer;
+
+    memset(buffer, 0, DDFS_BLOCK_SIZE);
+    header->jh_magic = htole32(DDFS_JOURNAL_MAGIC);
+    header->jh_epoch = htole64(journal->epoch + 1);
+
+    int ret = get_backend(fd)->write(fd, (void **)&buffer,
+        journal->first_block, 1) == DDFS_BLOCK_SIZE ?
+        flush_volume(fd) : EXIT_FAILURE;
+    put_block_buffer(buffer);
+
+    if (ret != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    journal->epoch++;
+    journal->sequence = 0;
+    journal->tail = 1;
+    return EXIT_SUCCESS;
+}
+
+// Write the changed blocks home and empty the journal. The caller holds
+// the lock and has set committing.
+static int checkpoint_held(int fd, struct ddfs_journal *journal) {
+    if (journal->dirty_count == 0 && journal->tail == 1 &&
+        journal->epoch != 0) {
+        journal->committed = journal->appended;
+        return EXIT_SUCCESS;
+    }
+
+    // The home blocks may refer to data blocks whose references are
+    // still only in memory
+    if (sync_reference_log(fd) != EXIT_SUCCESS ||
+        write_dirty(fd, journal) != EXIT_SUCCESS ||
+        reset_journal(fd, journal) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    // The records not written yet are in their home blocks now
+    journal->length = 0;
+    journal->committed = journal->appended;
+    return EXIT_SUCCESS;
+}
+
+// Checkpoint once no commit is under way. The caller holds the lock.
+static int checkpoint_locked(int fd, struct ddfs_journal *journal) {
+    while (journal->committing) {
+        pthread_cond_wait(&journal->done, &journal->lock);
+    }
+
+    journal->committing = 1;
+    int ret = checkpoint_held(fd, journal);
+    journal->committing = 0;
+    pthread_cond_broadcast(&journal->done);
+    return ret;
+}
+
+// Append the records logged since the last commit as one transaction and
+// flush the volume. The caller holds the lock and has set committing; the
+// lock is let go during the I/O, so other threads keep logging into the
+// other buffer meanwhile.
+static int write_transaction(int fd, struct ddfs_journal *journal) {
+    uint8_t *records = journal->records;
+    uint64_t length = journal->length;
+    uint64_t appended = journal->appended;
+    uint32_t block_count = div_ceil(sizeof(struct ddfs_journal_header) +
+        length, DDFS_BLOCK_SIZE);
+
+    // A full journal is emptied by a checkpoint instead, which makes the
+    // records durable in their home blocks
+    if (journal->tail + block_count > DDFS_JOURNAL_BLOCKS) {
+        return checkpoint_held(fd, journal);
+    }
+
+    struct ddfs_journal_header *header =
+        (struct ddfs_journal_header *)records;
+    uint8_t *payload = records + sizeof(struct ddfs_journal_header);
+
+    *header = (struct ddfs_journal_header) {
+        .jh_magic = htole32(DDFS_JOURNAL_MAGIC),
+        .jh_blocks = htole32(block_count),
+        .jh_epoch = htole64(journal->epoch),
+        .jh_sequence = htole64(journal->sequence),
+        .jh_length = htole64(length),
+        .jh_checksum = htole64(checksum(payload, length))
+    };
+
+    memset(payload + length, 0, (size_t)block_count * DDFS_BLOCK_SIZE -
+        sizeof(struct ddfs_journal_header) - length);
+
+    uint64_t block_number = journal->first_block + journal->tail;
+    journal->records = journal->spare;
+    journal->spare = records;
+    journal->length = 0;
+    journal->tail += block_count;
+    journal->sequence++;
+    pthread_mutex_unlock(&journal->lock);
+
+    void *buffers[DDFS_JOURNAL_TRANSACTION];
+
+    for (uint32_t i = 0; i < block_count; i++) {
+        buffers[i] = records + ((size_t)i * DDFS_BLOCK_SIZE);
+    }
+
+    // The references the records rely on go first. Then one sequential
+    // append and one flush make every record logged so far durable, along
+    // with the data blocks written before them.
+    int ret = sync_reference_log(fd);
+
+    if (ret == EXIT_SUCCESS) {
+        ret = get_backend(fd)->write(fd, buffers, block_number,
+            block_count) == (int64_t)block_count * DDFS_BLOCK_SIZE ?
+            flush_volume(fd) : EXIT_FAILURE;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+
+    if (ret == EXIT_SUCCESS) {
+        journal->committed = appended;
+        return EXIT_SUCCESS;
+    }
+
+    // The changed blocks are still in memory, so they can go home instead
+    return checkpoint_held(fd, journal);
+}
+
+// Make every record logged so far durable. Threads arriving while a
+// commit is under way wait for it and, if their records missed it, commit
+// everything logged by then together. The caller holds the lock.
+static int commit_locked(int fd, struct ddfs_journal *journal) {
+    uint64_t target = journal->appended;
+
+    while (journal->committed < target) {
+        if (journal->committing) {
+            pthread_cond_wait(&journal->done, &journal->lock);
+            continue;
+        }
+
+        journal->committing = 1;
+        int ret = write_transaction(fd, journal);
+        journal->committing = 0;
+        pthread_cond_broadcast(&journal->done);
+
+        if (ret != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Log a new image of a metadata block as a record of the bytes that
+// changed. The caller holds the lock.
+static int log_change(int fd, struct ddfs_journal *journal,
+    uint64_t block_number, const uint8_t *data) {
+    // Committing or checkpointing lets go of the lock, so check again
+    // after either
+    for (;;) {
+        if (journal->length + record_size(DDFS_BLOCK_SIZE) >
+            DDFS_JOURNAL_RECORDS) {
+            if (commit_locked(fd, journal) != EXIT_SUCCESS) {
+                return EXIT_FAILURE;
+            }
+        } else if (journal->dirty_count >= DDFS_JOURNAL_DIRTY &&
+            dirty_slot(journal, block_number)->block_number == 0) {
+            if (checkpoint_locked(fd, journal) != EXIT_SUCCESS) {
+                return EXIT_FAILURE;
+            }
+        } else {
+            break;
+        }
+    }
+
+    struct ddfs_journal_block *slot = get_dirty(fd, journal, block_number);
+
+    if (slot == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    uint32_t first = 0;
+    uint32_t last = DDFS_BLOCK_SIZE;
+
+    while (first < DDFS_BLOCK_SIZE && slot->data[first] == data[first]) {
+        first++;
+    }
+
+    if (first == DDFS_BLOCK_SIZE) {
+        return EXIT_SUCCESS;
+    }
+
+    while (slot->data[last - 1] == data[last - 1]) {
+        last--;
+    }
+
+    uint8_t *position = journal->records +
+        sizeof(struct ddfs_journal_header) + journal->length;
+    struct ddfs_journal_record record = {
+        .jr_block = htole64(block_number),
+        .jr_offset = htole32(first),
+        .jr_length = htole32(last - first)
+    };
+
+    memcpy(position, &record, sizeof(struct ddfs_journal_record));
+    memcpy(position + sizeof(struct ddfs_journal_record), data + first,
+        last - first);
+    memset(position + sizeof(struct ddfs_journal_record) + last - first, 0,
+        record_size(last - first) - sizeof(struct ddfs_journal_record) -
+        (last - first));
+    memcpy(slot->data + first, data + first, last - first);
+    journal->length += record_size(last - first);
+    journal->appended++;
+    return EXIT_SUCCESS;
+}
+
+// Walk the records of a transaction, applying them to the changed blocks
+// when apply is set. Volumes opened for writing make room in memory as
+// they go. Returns EXIT_FAILURE on a malformed record.
+static int apply_records(int fd, struct ddfs_journal *journal,
+    const uint8_t *records, uint64_t length, int apply, int writable) {
+    uint64_t position = 0;
+
+    while (position < length) {
+        struct ddfs_journal_record record;
+
+        if (length - position < sizeof(struct ddfs_journal_record)) {
+            return EXIT_FAILURE;
+        }
+
+        memcpy(&record, records + position,
+            sizeof(struct ddfs_journal_record));
+
+        uint64_t block_number = le64toh(record.jr_block);
+        uint32_t offset = le32toh(record.jr_offset);
+        uint32_t change = le32toh(record.jr_length);
+
+        if (block_number < journal->start || block_number >= journal->end ||
+            change > DDFS_BLOCK_SIZE || offset > DDFS_BLOCK_SIZE - change ||
+            record_size(change) > length - position) {
+            return EXIT_FAILURE;
+        }
+
+        if (apply) {
+            if (journal->dirty_count >= DDFS_JOURNAL_DIRTY &&
+                dirty_slot(journal, block_number)->block_number == 0 &&
+                (!writable || write_dirty(fd, journal) != EXIT_SUCCESS)) {
+                return EXIT_FAILURE;
+            }
+
+            struct ddfs_journal_block *slot =
+                get_dirty(fd, journal, block_number);
+
+            if (slot == NULL) {
+                return EXIT_FAILURE;
+            }
+
+            memcpy(slot->data + offset, records + position +
+                sizeof(struct ddfs_journal_record), change);
+        }
+
+        position += record_size(change);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Read the transactions of the current epoch into the changed blocks, up
+// to the first one that is missing, torn or out of sequence
+static int replay_journal(int fd, struct ddfs_journal *journal,
+    int writable) {
+    uint8_t *buffer = journal->records;
+    struct ddfs_journal_header *header =
+        (struct ddfs_journal_header *)buffer;
+
+    if (get_backend(fd)->read(fd, (void **)&buffer, journal->first_block,
+        1) != DDFS_BLOCK_SIZE) {
+        return EXIT_FAILURE;
+    }
+
+    // A journal without a first block is started afresh
+    if (le32toh(header->jh_magic) != DDFS_JOURNAL_MAGIC) {
+        journal->epoch = 0;
+        return EXIT_SUCCESS;
+    }
+
+    journal->epoch = le64toh(header->jh_epoch);
+    journal->sequence = 0;
+    journal->tail = 1;
+
+    while (journal->tail < DDFS_JOURNAL_BLOCKS) {
+        if (get_backend(fd)->read(fd, (void **)&buffer,
+            journal->first_block + journal->tail, 1) != DDFS_BLOCK_SIZE) {
+            return EXIT_FAILURE;
+        }
+
+        uint32_t block_count = le32toh(header->jh_blocks);
+        uint64_t length = le64toh(header->jh_length);
+
+        if (le32toh(header->jh_magic) != DDFS_JOURNAL_MAGIC ||
+            le64toh(header->jh_epoch) != journal->epoch ||
+            le64toh(header->jh_sequence) != journal->sequence ||
+            block_count == 0 || block_count > DDFS_JOURNAL_TRANSACTION ||
+            journal->tail + block_count > DDFS_JOURNAL_BLOCKS ||
+            length > DDFS_JOURNAL_RECORDS ||
+            sizeof(struct ddfs_journal_header) + length >
+            (uint64_t)block_count * DDFS_BLOCK_SIZE) {
+            break;
+        }
+
+        void *buffers[DDFS_JOURNAL_TRANSACTION];
+
+        for (uint32_t i = 1; i < block_count; i++) {
+            buffers[i] = buffer + ((size_t)i * DDFS_BLOCK_SIZE);
+        }
+
+        if (block_count > 1 && get_backend(fd)->read(fd, buffers + 1,
+            journal->first_block + journal->tail + 1, block_count - 1) !=
+            (int64_t)(block_count - 1) * DDFS_BLOCK_SIZE) {
+            return EXIT_FAILURE;
+        }
+
+        const uint8_t *records = buffer + sizeof(struct ddfs_journal_header);
+
+        if (checksum(records, length) != le64toh(header->jh_checksum) ||
+            apply_records(fd, journal, records, length, 0, writable) !=
+            EXIT_SUCCESS) {
+            break;
+        }
+
+        if (apply_records(fd, journal, records, length, 1, writable) !=
+            EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+
+        journal->tail += block_count;
+        journal->sequence++;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Write the first block of a freshly zeroed journal, starting its first
+// epoch
+int initialize_journal(int fd, struct ddfs_superblock *sb) {
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_journal_header *header =
+        (struct ddfs_journal_header *)buffer;
+
+    memset(buffer, 0, DDFS_BLOCK_SIZE);
+    header->jh_magic = htole32(DDFS_JOURNAL_MAGIC);
+    header->jh_epoch = htole64(1);
+
+    int ret = write_block(fd, buffer,
+        le64toh(sb->info.fs_journal_offset) / DDFS_BLOCK_SIZE);
+    put_block_buffer(buffer);
+
+    return ret == DDFS_BLOCK_SIZE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Read the volume's journal, replaying the transactions a previous user
+// left in it. Volumes opened for writing checkpoint them right away and
+// journal their own changes when opened with DDFS_OPEN_JOURNAL; read-only
+// volumes keep the replayed blocks in memory. Plain descriptors have no
+// journal and see the home blocks only.
+int load_journal(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL) {
+        return EXIT_SUCCESS;
+    }
+
+    free_journal(fd);
+
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    // Nothing to load until the volume is formatted
+    if (check_superblock(sb) != EXIT_SUCCESS) {
+        put_block_buffer(sb);
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_journal *journal = ddfs_calloc(1,
+        sizeof(struct ddfs_journal));
+
+    if (journal == NULL) {
+        put_block_buffer(sb);
+        return EXIT_FAILURE;
+    }
+
+    // Everything between the superblock and the reference count table
+    journal->first_block = le64toh(sb->info.fs_journal_offset) /
+        DDFS_BLOCK_SIZE;
+    journal->start = 1;
+    journal->end = le64toh(sb->info.fs_ref_offset) / DDFS_BLOCK_SIZE;
+    journal->records = ddfs_memalign(DDFS_BLOCK_SIZE,
+        DDFS_JOURNAL_TRANSACTION * DDFS_BLOCK_SIZE);
+    journal->spare = ddfs_memalign(DDFS_BLOCK_SIZE,
+        DDFS_JOURNAL_TRANSACTION * DDFS_BLOCK_SIZE);
+    journal->dirty = ddfs_calloc(DDFS_JOURNAL_SLOTS,
+        sizeof(struct ddfs_journal_block));
+    journal->held = ddfs_malloc(DDFS_JOURNAL_HELD *
+        sizeof(struct ddfs_journal_hold));
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->done, NULL);
+    put_block_buffer(sb);
+
+    int ret = EXIT_FAILURE;
+
+    if (journal->records != NULL && journal->spare != NULL &&
+        journal->dirty != NULL && journal->held != NULL) {
+        ret = replay_journal(fd, journal, volume->writable);
+    }
+
+    if (ret == EXIT_SUCCESS && volume->writable) {
+        journal->committing = 1;
+        ret = checkpoint_held(fd, journal);
+        journal->committing = 0;
+    }
+
+    journal->active = volume->writable &&
+        (volume->flags & DDFS_OPEN_JOURNAL) != 0;
+    volume->journal = journal;
+
+    if (ret != EXIT_SUCCESS) {
+        free_journal(fd);
+    }
+
+    return ret;
+}
+
+// Drop a volume's journal without checkpointing it
+void free_journal(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->journal == NULL) {
+        return;
+    }
+
+    struct ddfs_journal *journal = volume->journal;
+
+    for (uint32_t i = 0; journal->dirty != NULL &&
+        i < DDFS_JOURNAL_SLOTS; i++) {
+        ddfs_free(journal->dirty[i].data);
+    }
+
+    pthread_cond_destroy(&journal->done);
+    pthread_mutex_destroy(&journal->lock);
+    ddfs_free(journal->records);
+    ddfs_free(journal->spare);
+    ddfs_free(journal->dirty);
+    ddfs_free(journal->held);
+    ddfs_free(journal);
+    volume->journal = NULL;
+}
+
+// Check whether reads or writes of count blocks have to go through the
+// volume's journal
+int journal_covers(int fd, uint64_t block_number, uint32_t count) {
+    struct ddfs_volume *volume = get_volume(fd);
+    struct ddfs_journal *journal = volume != NULL ? volume->journal : NULL;
+
+    return journal != NULL &&
+        (journal->active || journal->dirty_count != 0) &&
+        block_number < journal->end &&
+        block_number + count > journal->start;
+}
+
+// Read blocks, taking the ones changed since the last checkpoint from
+// memory. A block found unchanged is current on disk, since checkpoints
+// only take blocks out of memory once they are home.
+int64_t journal_read(int fd, void **buffers, uint64_t block_number,
+    uint32_t count) {
+    struct ddfs_journal *journal = get_volume(fd)->journal;
+    uint32_t i = 0;
+
+    while (i < count) {
+        uint32_t n = 0;
+
+        pthread_mutex_lock(&journal->lock);
+
+        for (; i < count; i++) {
+            struct ddfs_journal_block *slot =
+                dirty_slot(journal, block_number + i);
+
+            if (slot->block_number == 0) {
+                break;
+            }
+
+            memcpy(buffers[i], slot->data, DDFS_BLOCK_SIZE);
+        }
+
+        while (i + n < count &&
+            dirty_slot(journal, block_number + i + n)->block_number == 0) {
+            n++;
+        }
+
+        pthread_mutex_unlock(&journal->lock);
+
+        if (n != 0 && get_backend(fd)->read(fd, buffers + i,
+            block_number + i, n) != (int64_t)n * DDFS_BLOCK_SIZE) {
+            return -1;
+        }
+
+        i += n;
+    }
+
+    return (int64_t)count * DDFS_BLOCK_SIZE;
+}
+
+// Log writes of journaled blocks and pass the others through
+int64_t journal_write(int fd, void **buffers, uint64_t block_number,
+    uint32_t count) {
+    struct ddfs_journal *journal = get_volume(fd)->journal;
+
+    if (!journal->active) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t b = block_number + i;
+
+        if (b < journal->start || b >= journal->end) {
+            if (get_backend(fd)->write(fd, buffers + i, b, 1) !=
+                DDFS_BLOCK_SIZE) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        pthread_mutex_lock(&journal->lock);
+        int ret = log_change(fd, journal, b, buffers[i]);
+        pthread_mutex_unlock(&journal->lock);
+
+        if (ret != EXIT_SUCCESS) {
+            return -1;
+        }
+    }
+
+    return (int64_t)count * DDFS_BLOCK_SIZE;
+}
+
+// Make the metadata changes so far and every block write before them
+// durable, with one append to the journal and one flush
+int commit_journal(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+    struct ddfs_journal *journal = volume != NULL ? volume->journal : NULL;
+
+    if (journal == NULL || !journal->active) {
+        return flush_volume(fd);
+    }
+
+    pthread_mutex_lock(&journal->lock);
+
+    // Nothing logged since the last commit, but data may still need it
+    if (journal->committed == journal->appended) {
+        pthread_mutex_unlock(&journal->lock);
+        return flush_volume(fd);
+    }
+
+    int ret = commit_locked(fd, journal);
+    pthread_mutex_unlock(&journal->lock);
+    return ret;
+}
+
+// Write every changed metadata block home and empty the journal, so plain
+// descriptors see the volume as it is
+int checkpoint_journal(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+    struct ddfs_journal *journal = volume != NULL ? volume->journal : NULL;
+
+    if (journal == NULL || !volume->writable) {
+        return EXIT_SUCCESS;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    int ret = checkpoint_locked(fd, journal);
+    pthread_mutex_unlock(&journal->lock);
+    return ret;
+}
+
+// Hold the references a change drops to count data blocks until the
+// records logged so far are committed, or commit first when the held
+// blocks would not fit. Returns 1 when the blocks are held, 0 when their
+// references can go right away and -1 on error.
+int journal_hold(int fd, uint64_t *blocks, uint32_t count) {
+    struct ddfs_volume *volume = get_volume(fd);
+    struct ddfs_journal *journal = volume != NULL ? volume->journal : NULL;
+
+    if (journal == NULL || !journal->active) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    int ret = 0;
+
+    if (journal->held_count + count > DDFS_JOURNAL_HELD) {
+        ret = commit_locked(fd, journal) == EXIT_SUCCESS ? 0 : -1;
+    } else if (journal->committed != journal->appended) {
+        for (uint32_t i = 0; i < count; i++) {
+            journal->held[journal->held_count++] =
+                (struct ddfs_journal_hold) {
+                .block_number = blocks[i],
+                .mark = journal->appended
+            };
+        }
+
+        ret = 1;
+    }
+
+    pthread_mutex_unlock(&journal->lock);
+    return ret;
+}
+
+// Take up to max held blocks whose releasing changes are committed now
+uint32_t journal_take_held(int fd, uint64_t *blocks, uint32_t max) {
+    struct ddfs_volume *volume = get_volume(fd);
+    struct ddfs_journal *journal = volume != NULL ? volume->journal : NULL;
+
+    if (journal == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    uint32_t count = 0;
+
+    // Marks only grow, so the committed blocks come first
+    while (count < max && count < journal->held_count &&
+        journal->held[count].mark <= journal->committed) {
+        blocks[count] = journal->held[count].block_number;
+        count++;
+    }
+
+    journal->held_count -= count;
+    memmove(journal->held, journal->held + count,
+        journal->held_count * sizeof(struct ddfs_journal_hold));
+    pthread_mutex_unlock(&journal->lock);
+    return count;
+}
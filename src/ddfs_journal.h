@@ -0,0 +1,105 @@
+#ifndef ddfs_JOURNAL_H
+#define	ddfs_JOURNAL_H
+
+#include <pthread.h>
+
+#include "ddfs.h"
+
+#define DDFS_JOURNAL_BLOCKS ((4 << 20) / DDFS_BLOCK_SIZE) // Journal blocks,
+                                                          // header included
+#define DDFS_JOURNAL_MAGIC 0x10C5A1
+#define DDFS_JOURNAL_DIRTY ((4 << 20) / DDFS_BLOCK_SIZE) // Blocks held in
+                                                         // memory at most
+#define DDFS_JOURNAL_TRANSACTION ((1 << 20) / DDFS_BLOCK_SIZE) // Blocks per
+                                                             // transaction
+#define DDFS_JOURNAL_HELD 4096 // Released blocks held at most
+#define DDFS_JOURNAL_RECORDS (DDFS_JOURNAL_TRANSACTION * DDFS_BLOCK_SIZE - \
+    sizeof(struct ddfs_journal_header)) // Record bytes per transaction
+
+// Starts the journal's first block, which holds no records, and every
+// transaction. Transactions only count while their epoch matches the
+// first block's and their sequence numbers follow on from each other;
+// bumping the epoch after a checkpoint empties the journal.
+struct ddfs_journal_header {
+    uint32_t jh_magic; // DDFS_JOURNAL_MAGIC
+    uint32_t jh_blocks; // Blocks of the transaction, header included
+    uint64_t jh_epoch; // Epoch the block was written in
+    uint64_t jh_sequence; // Number of the transaction within its epoch
+    uint64_t jh_length; // Bytes of records after the header
+    uint64_t jh_checksum; // FNV-1a hash of the records
+};
+
+// A change to a metadata block: jr_length new bytes for jr_offset follow,
+// padded to 8 bytes
+struct ddfs_journal_record {
+    uint64_t jr_block; // Block number
+    uint32_t jr_offset; // Offset of the change in the block
+    uint32_t jr_length; // Length of the change
+};
+
+// A metadata block changed since the last checkpoint, as it stands now
+struct ddfs_journal_block {
+    uint64_t block_number; // Home block number, 0 for an empty slot
+    uint8_t *data; // Current contents
+};
+
+// A data block released by a change that is not committed yet. Its
+// reference goes once the records logged by then are durable.
+struct ddfs_journal_hold {
+    uint64_t block_number; // Block the reference is to
+    uint64_t mark; // Number of records logged when it was released
+};
+
+// Write-ahead journal of a volume's metadata blocks: the free bitmaps,
+// the inode store, the group descriptors and, on log-structured images,
+// the segment table and fingerprint index. Changes are logged as
+// records and held in memory; commits append the records since the last
+// commit as one transaction, and checkpoints write the changed blocks to
+// their home locations and empty the journal. References dropped by
+// changes that are not committed yet are held until they are, so a crash
+// never leaves a committed key on a block that was reclaimed.
+struct ddfs_journal {
+    pthread_mutex_t lock; // Protects the journal
+    pthread_cond_t done; // Signaled when a commit or checkpoint ends
+    uint64_t epoch; // Epoch of the on-disk journal
+    uint64_t sequence; // Number of the next transaction
+    uint64_t first_block; // First block of the on-disk journal
+    uint64_t start; // First journaled block
+    uint64_t end; // Block after the last journaled block
+    uint32_t tail; // Journal block the next transaction goes to
+    uint8_t active; // Whether writes go to the journal
+    uint8_t committing; // Whether a commit or checkpoint is under way
+    uint8_t *records; // Transaction being filled, header first
+    uint8_t *spare; // Transaction being written
+    uint64_t length; // Bytes of records in records
+    uint64_t appended; // Number of records logged
+    uint64_t committed; // Number of records durable
+    struct ddfs_journal_block *dirty; // Open addressed changed blocks
+    uint32_t dirty_count; // Number of blocks in dirty
+    struct ddfs_journal_hold *held; // Released blocks, oldest first
+    uint32_t held_count; // Number of blocks in held
+};
+
+extern int initialize_journal(int fd, struct ddfs_superblock *sb);
+
+extern int load_journal(int fd);
+
+extern void free_journal(int fd);
+
+extern int journal_covers(int fd, uint64_t block_number, uint32_t count);
+
+extern int64_t journal_read(int fd, void **buffers, uint64_t block_number,
+    uint32_t count);
+
+extern int64_t journal_write(int fd, void **buffers, uint64_t block_number,
+    uint32_t count);
+
+extern int commit_journal(int fd);
+
+extern int checkpoint_journal(int fd);
+
+extern int journal_hold(int fd, uint64_t *blocks, uint32_t count);
+
+extern uint32_t journal_take_held(int fd, uint64_t *blocks, uint32_t max);
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ddfs_lock.h"
+#include "ddfs_inode.h"
+#include "ddfs_volume.h"
+
+// Every descriptor shares the stripes, so plain descriptors are covered
+// as well as volumes
+static pthread_mutex_t stripes[DDFS_LOCK_CLASSES][DDFS_LOCK_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+// Sequence counters of the inode stripes, odd while a change holds one
+static uint64_t sequences[DDFS_LOCK_STRIPES];
+
+static void init_stripes(void) {
+    for (uint32_t c = 0; c < DDFS_LOCK_CLASSES; c++) {
+        for (uint32_t i = 0; i < DDFS_LOCK_STRIPES; i++) {
+            pthread_mutex_init(&stripes[c][i], NULL);
+        }
+    }
+}
+
+// Spread adjacent blocks over different stripes
+static uint32_t get_stripe(int fd, uint64_t block_number) {
+    uint64_t hash = (block_number ^ ((uint64_t)fd << 48)) *
+        0x9e3779b97f4a7c15ULL;
+
+    return (hash >> 32) % DDFS_LOCK_STRIPES;
+}
+
+void lock_set_init(struct ddfs_lock_set *set, int fd, uint32_t lock_class) {
+    pthread_once(&stripes_once, init_stripes);
+    memset(set, 0, sizeof(struct ddfs_lock_set));
+    set->fd = fd;
+    set->lock_class = lock_class;
+}
+
+void lock_set_add(struct ddfs_lock_set *set, uint64_t block_number) {
+    uint32_t stripe = get_stripe(set->fd, block_number);
+
+    set->stripes[stripe / 64] |= 1ULL << (stripe % 64);
+}
+
+// Take the stripes of a set in ascending order
+void lock_set_acquire(struct ddfs_lock_set *set) {
+    for (uint32_t i = 0; i < DDFS_LOCK_STRIPES; i++) {
+        if (set->stripes[i / 64] & (1ULL << (i % 64))) {
+            pthread_mutex_lock(&stripes[set->lock_class][i]);
+        }
+    }
+}
+
+void lock_set_release(struct ddfs_lock_set *set) {
+    for (uint32_t i = DDFS_LOCK_STRIPES; i-- > 0;) {
+        if (set->stripes[i / 64] & (1ULL << (i % 64))) {
+            pthread_mutex_unlock(&stripes[set->lock_class][i]);
+        }
+    }
+}
+
+// Lock a shared metadata block, or a value's home block, for one
+// read-modify-write
+void lock_block(int fd, uint64_t block_number) {
+    pthread_once(&stripes_once, init_stripes);
+    pthread_mutex_lock(&stripes[DDFS_LOCK_BLOCKS][get_stripe(fd,
+        block_number)]);
+}
+
+void unlock_block(int fd, uint64_t block_number) {
+    pthread_mutex_unlock(&stripes[DDFS_LOCK_BLOCKS][get_stripe(fd,
+        block_number)]);
+}
+
+// Begin or end a change to what a sequence counter guards. Only holders
+// of the counter's lock change it, and lookups order their reads after
+// its first bump.
+static void bump_sequence(uint64_t *sequence, int begin) {
+    uint64_t next = __atomic_load_n(sequence, __ATOMIC_RELAXED) + 1;
+
+    if (begin) {
+        __atomic_store_n(sequence, next, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(sequence, next, __ATOMIC_RELEASE);
+    }
+}
+
+// Bump the sequence counters of every lock a change holds
+static void bump_key_sequences(struct ddfs_key_locks *locks, int begin) {
+    if (locks->sequence != NULL) {
+        bump_sequence(locks->sequence, begin);
+    }
+
+    for (uint32_t i = 0; i < DDFS_LOCK_STRIPES; i++) {
+        if (locks->inodes.stripes[i / 64] & (1ULL << (i % 64))) {
+            bump_sequence(&sequences[i], begin);
+        }
+    }
+}
+
+void key_locks_init(struct ddfs_key_locks *locks, int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    lock_set_init(&locks->inodes, fd, DDFS_LOCK_INODES);
+    locks->volume = NULL;
+    locks->sequence = NULL;
+    locks->write = 0;
+
+    if (volume != NULL && volume->log != NULL) {
+        locks->volume = &volume->keys_lock;
+        locks->sequence = &volume->keys_sequence;
+    }
+}
+
+// Get the inode store block a key's inode lives in
+static uint64_t get_inode_block(struct ddfs_superblock *sb,
+    uint64_t inode_number) {
+    uint64_t block_number;
+    uint32_t buffer_offset;
+
+    get_inode_location(sb, inode_number, &block_number, &buffer_offset);
+    return block_number;
+}
+
+// Add the inode store block of a key's inode to the stripes to take
+void key_locks_add(struct ddfs_key_locks *locks, struct ddfs_superblock *sb,
+    uint64_t inode_number) {
+    lock_set_add(&locks->inodes, get_inode_block(sb, inode_number));
+}
+
+// Add every inode stripe, for operations on the whole index
+void key_locks_add_all(struct ddfs_key_locks *locks) {
+    memset(locks->inodes.stripes, 0xff, sizeof(locks->inodes.stripes));
+}
+
+// Lock the keys of an operation, exclusively against lookups and the
+// cleaner on log-structured volumes when the operation changes them
+void lock_keys(struct ddfs_key_locks *locks, int write) {
+    if (locks->volume != NULL) {
+        if (write) {
+            pthread_rwlock_wrlock(locks->volume);
+        } else {
+            pthread_rwlock_rdlock(locks->volume);
+        }
+    }
+
+    lock_set_acquire(&locks->inodes);
+    locks->write = write != 0;
+
+    if (locks->write) {
+        bump_key_sequences(locks, 1);
+    }
+}
+
+void unlock_keys(struct ddfs_key_locks *locks) {
+    if (locks->write) {
+        bump_key_sequences(locks, 0);
+    }
+
+    lock_set_release(&locks->inodes);
+
+    if (locks->volume != NULL) {
+        pthread_rwlock_unlock(locks->volume);
+    }
+}
+
+void key_read_init(struct ddfs_key_read *read, int fd,
+    struct ddfs_superblock *sb, uint64_t inode_number) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    read->stripe = &sequences[get_stripe(fd, get_inode_block(sb,
+        inode_number))];
+    read->volume = volume != NULL && volume->log != NULL ?
+        &volume->keys_sequence : NULL;
+}
+
+// Start a lock-free lookup, failing while a change holds the key
+int begin_key_read(struct ddfs_key_read *read) {
+    read->stripe_start = __atomic_load_n(read->stripe, __ATOMIC_ACQUIRE);
+    read->volume_start = read->volume != NULL ?
+        __atomic_load_n(read->volume, __ATOMIC_ACQUIRE) : 0;
+
+    if ((read->stripe_start | read->volume_start) & 1) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Check that no change to the key overlapped a lock-free lookup, which
+// must otherwise be retried
+int validate_key_read(struct ddfs_key_read *read) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(read->stripe, __ATOMIC_RELAXED) !=
+        read->stripe_start || (read->volume != NULL &&
+        __atomic_load_n(read->volume, __ATOMIC_RELAXED) !=
+        read->volume_start)) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
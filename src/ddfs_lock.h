@@ -0,0 +1,78 @@
+#ifndef ddfs_LOCK_H
+#define	ddfs_LOCK_H
+
+#include <pthread.h>
+
+#include "ddfs.h"
+
+#define DDFS_LOCK_STRIPES 1024 // Locks each class is striped over
+#define DDFS_LOCK_INODES 0 // Inode store blocks, held for a key operation
+#define DDFS_LOCK_BLOCKS 1 // Other shared metadata blocks and the home
+                           // blocks values are written to, held for one
+                           // read-modify-write and never nested in another
+#define DDFS_LOCK_CLASSES 2
+#define DDFS_LOCK_READ_TRIES 4 // Lock-free attempts of a lookup before it
+                               // takes the key's locks
+
+// Stripes of one class to take together. Stripes are always taken in
+// ascending order, inode stripes before block stripes, so operations
+// locking several of them cannot deadlock.
+struct ddfs_lock_set {
+    int fd; // Descriptor the blocks belong to
+    uint32_t lock_class; // DDFS_LOCK_* class of the stripes
+    uint64_t stripes[DDFS_LOCK_STRIPES / 64]; // Bit per stripe to take
+};
+
+// Locks held by an operation on one or more keys. Log-structured volumes
+// also serialize key changes against lookups and the segment cleaner,
+// which rewrites inodes and reuses the segments lookups read from.
+struct ddfs_key_locks {
+    struct ddfs_lock_set inodes; // Stripes of the keys' inode blocks
+    pthread_rwlock_t *volume; // Volume lock taken, or NULL
+    uint64_t *sequence; // Sequence counter of the volume lock, or NULL
+    uint8_t write; // Whether the keys are locked for a change
+};
+
+// Lock-free lookup of one key. Operations changing keys make the sequence
+// counters of their inode stripes, and of the volume lock, odd while they
+// hold them; a lookup that started with both even and finds them unchanged
+// afterwards read a consistent inode and value.
+struct ddfs_key_read {
+    uint64_t *stripe; // Sequence counter of the key's inode stripe
+    uint64_t *volume; // Sequence counter of the volume lock, or NULL
+    uint64_t stripe_start; // Counters when the lookup started
+    uint64_t volume_start;
+};
+
+extern void lock_set_init(struct ddfs_lock_set *set, int fd,
+    uint32_t lock_class);
+
+extern void lock_set_add(struct ddfs_lock_set *set, uint64_t block_number);
+
+extern void lock_set_acquire(struct ddfs_lock_set *set);
+
+extern void lock_set_release(struct ddfs_lock_set *set);
+
+extern void lock_block(int fd, uint64_t block_number);
+
+extern void unlock_block(int fd, uint64_t block_number);
+
+extern void key_locks_init(struct ddfs_key_locks *locks, int fd);
+
+extern void key_locks_add(struct ddfs_key_locks *locks,
+    struct ddfs_superblock *sb, uint64_t inode_number);
+
+extern void key_locks_add_all(struct ddfs_key_locks *locks);
+
+extern void lock_keys(struct ddfs_key_locks *locks, int write);
+
+extern void unlock_keys(struct ddfs_key_locks *locks);
+
+extern void key_read_init(struct ddfs_key_read *read, int fd,
+    struct ddfs_superblock *sb, uint64_t inode_number);
+
+extern int begin_key_read(struct ddfs_key_read *read);
+
+extern int validate_key_read(struct ddfs_key_read *read);
+
+#endif
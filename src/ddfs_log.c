@@ -0,0 +1,963 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ddfs_log.h"
+#include "ddfs_alloc.h"
+#include "ddfs_group.h"
+#include "ddfs_inode.h"
+#include "ddfs_journal.h"
+#include "ddfs_lock.h"
+#include "ddfs_pool.h"
+#include "ddfs_refcount.h"
+#include "ddfs_volume.h"
+
+// Blocks appended to the head segment but not written yet, all adjacent
+struct ddfs_log_run {
+    uint64_t first; // First block of the run
+    uint32_t count; // Number of blocks in the run
+    void *buffers[DDFS_MAX_IOV]; // Contents of each block
+};
+
+// A live block the cleaner moves out of a victim segment
+struct ddfs_relocation {
+    uint64_t old_block; // Block in the victim
+    uint64_t new_block; // Block in the head segment
+    int64_t count; // References moved with it
+    uint8_t *data; // Contents of the block
+};
+
+// Full segment considered by the cleaner
+struct ddfs_victim {
+    uint64_t segment; // Segment number
+    double score; // Benefit over cost of cleaning it
+};
+
+static int compare_relocations(const void *a, const void *b) {
+    const struct ddfs_relocation *x = a;
+    const struct ddfs_relocation *y = b;
+
+    return (x->old_block > y->old_block) - (x->old_block < y->old_block);
+}
+
+static int compare_segments(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int read_segment(int fd, struct ddfs_log *log, uint64_t segment,
+    struct ddfs_segment *entry) {
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_FAILURE;
+
+    if (read_block(fd, buffer, log->table_block +
+        (segment / DDFS_SEGMENTS_PER_BLOCK)) == DDFS_BLOCK_SIZE) {
+        *entry = ((struct ddfs_segment *)buffer)
+            [segment % DDFS_SEGMENTS_PER_BLOCK];
+        ret = EXIT_SUCCESS;
+    }
+
+    put_block_buffer(buffer);
+    return ret;
+}
+
+static int write_segment(int fd, struct ddfs_log *log, uint64_t segment,
+    uint32_t state, uint32_t used) {
+    uint64_t block_number = log->table_block +
+        (segment / DDFS_SEGMENTS_PER_BLOCK);
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_FAILURE;
+
+    if (read_block(fd, buffer, block_number) == DDFS_BLOCK_SIZE) {
+        struct ddfs_segment *entry = (struct ddfs_segment *)buffer +
+            (segment % DDFS_SEGMENTS_PER_BLOCK);
+
+        entry->sg_write_time = htole64(time(NULL));
+        entry->sg_state = htole32(state);
+        entry->sg_used = htole32(used);
+
+        if (write_block(fd, buffer, block_number) == DDFS_BLOCK_SIZE) {
+            ret = EXIT_SUCCESS;
+        }
+    }
+
+    put_block_buffer(buffer);
+    return ret;
+}
+
+// Fill in the append state of a log-structured volume from its superblock
+// and segment table
+static int init_log(int fd, struct ddfs_superblock *sb,
+    struct ddfs_log *log) {
+    if (!(le32toh(sb->info.fs_flags) & DDFS_FS_LOG) ||
+        le32toh(sb->info.fs_segment_blocks) != DDFS_SEGMENT_BLOCKS) {
+        errno = EINVAL;
+        return EXIT_FAILURE;
+    }
+
+    log->table_block = le64toh(sb->info.fs_segment_offset) / DDFS_BLOCK_SIZE;
+    log->index_block = le64toh(sb->info.fs_index_offset) / DDFS_BLOCK_SIZE;
+    log->index_slots = le64toh(sb->info.fs_index_slots);
+    log->first_block = le64toh(sb->info.fs_data_offset) / DDFS_BLOCK_SIZE;
+    log->segment_count = le64toh(sb->info.fs_segment_count);
+    log->free_count = 0;
+    log->free_hint = 0;
+    log->cleaning = 0;
+    log->taken = NULL;
+    log->taken_count = 0;
+
+    // Until a segment is opened, the first append opens one
+    log->head = log->segment_count;
+    log->used = DDFS_SEGMENT_BLOCKS;
+
+    uint8_t *buffer = get_block_buffer();
+    log->free_map = ddfs_calloc(div_ceil(log->segment_count + 1, 64),
+        sizeof(uint64_t));
+
+    if (buffer == NULL || log->free_map == NULL) {
+        put_block_buffer(buffer);
+        ddfs_free(log->free_map);
+        log->free_map = NULL;
+        return EXIT_FAILURE;
+    }
+
+    for (uint64_t s = 0; s < log->segment_count; s++) {
+        uint32_t index = s % DDFS_SEGMENTS_PER_BLOCK;
+
+        if (index == 0 && read_block(fd, buffer, log->table_block +
+            (s / DDFS_SEGMENTS_PER_BLOCK)) != DDFS_BLOCK_SIZE) {
+            put_block_buffer(buffer);
+            ddfs_free(log->free_map);
+            log->free_map = NULL;
+            return EXIT_FAILURE;
+        }
+
+        struct ddfs_segment *entry = (struct ddfs_segment *)buffer + index;
+
+        if (le32toh(entry->sg_state) == DDFS_SEGMENT_FREE) {
+            log->free_map[s / 64] |= 1ULL << (s % 64);
+            log->free_count++;
+        } else if (le32toh(entry->sg_state) == DDFS_SEGMENT_OPEN) {
+            log->head = s;
+            log->used = le32toh(entry->sg_used);
+        }
+    }
+
+    put_block_buffer(buffer);
+    return EXIT_SUCCESS;
+}
+
+// Attach the append state to a volume opened on a log-structured image.
+// Other images and plain descriptors have none.
+int load_log(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->log != NULL) {
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    if (!(le32toh(sb->info.fs_flags) & DDFS_FS_LOG)) {
+        put_block_buffer(sb);
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_log *log = ddfs_calloc(1, sizeof(struct ddfs_log));
+
+    if (log == NULL || init_log(fd, sb, log) != EXIT_SUCCESS) {
+        ddfs_free(log);
+        put_block_buffer(sb);
+        return EXIT_FAILURE;
+    }
+
+    put_block_buffer(sb);
+    pthread_mutex_init(&log->lock, NULL);
+    volume->log = log;
+    return EXIT_SUCCESS;
+}
+
+// The segment table is kept up to date on every append, so there is
+// nothing to write back
+void free_log(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->log == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&volume->log->lock);
+    ddfs_free(volume->log->free_map);
+    ddfs_free(volume->log);
+    volume->log = NULL;
+}
+
+// Whether the image appends its data blocks to log segments
+int log_structured(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume != NULL) {
+        return volume->log != NULL;
+    }
+
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        return 0;
+    }
+
+    int ret = (le32toh(sb->info.fs_flags) & DDFS_FS_LOG) != 0;
+    put_block_buffer(sb);
+    return ret;
+}
+
+// Get a volume's append state with its lock held. Plain descriptors load
+// theirs into local, which the segment table keeps in step with other
+// descriptors.
+static struct ddfs_log *lock_log(int fd, struct ddfs_superblock *sb,
+    struct ddfs_log *local) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume != NULL && volume->log != NULL) {
+        pthread_mutex_lock(&volume->log->lock);
+        return volume->log;
+    }
+
+    return init_log(fd, sb, local) == EXIT_SUCCESS ? local : NULL;
+}
+
+static void unlock_log(struct ddfs_log *log, struct ddfs_log *local) {
+    if (log != NULL && log != local) {
+        pthread_mutex_unlock(&log->lock);
+    } else if (log != NULL) {
+        ddfs_free(local->free_map);
+        local->free_map = NULL;
+    }
+}
+
+// Write the pending run with a single request and record how far the
+// head segment is filled
+static int flush_run(int fd, struct ddfs_log *log,
+    struct ddfs_log_run *run) {
+    if (run->count == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    uint32_t count = run->count;
+    run->count = 0;
+
+    if (write_blocks(fd, run->buffers, run->first, count) !=
+        (int64_t)count * DDFS_BLOCK_SIZE) {
+        return EXIT_FAILURE;
+    }
+
+    return write_segment(fd, log, log->head, DDFS_SEGMENT_OPEN, log->used);
+}
+
+static int64_t clean_locked(int fd, struct ddfs_superblock *sb,
+    struct ddfs_log *log, uint32_t count, uint64_t closed);
+
+// Mark the head segment full and leave the log without a head
+static int close_head(int fd, struct ddfs_log *log) {
+    if (log->head >= log->segment_count) {
+        return EXIT_SUCCESS;
+    }
+
+    if (write_segment(fd, log, log->head, DDFS_SEGMENT_FULL, log->used) !=
+        EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    log->head = log->segment_count;
+    return EXIT_SUCCESS;
+}
+
+// Close the full head segment and open the next free one. Appends other
+// than the cleaner's leave the last DDFS_LOG_RESERVE free segments to it
+// and run the cleaner when only those are left. The cleaner leaves the
+// segment just closed alone: it holds the appends in progress.
+static int advance_head(int fd, struct ddfs_superblock *sb,
+    struct ddfs_log *log) {
+    uint64_t closed = log->head;
+
+    if (close_head(fd, log) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    if (!log->cleaning && log->free_count <= DDFS_LOG_RESERVE) {
+        clean_locked(fd, sb, log, DDFS_LOG_CLEAN_BATCH, closed);
+
+        // Appends carry on in the head the relocated blocks went to
+        if (log->head < log->segment_count &&
+            log->used < DDFS_SEGMENT_BLOCKS) {
+            return EXIT_SUCCESS;
+        }
+
+        if (close_head(fd, log) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (log->free_count == 0 ||
+        (!log->cleaning && log->free_count <= DDFS_LOG_RESERVE)) {
+        errno = ENOSPC;
+        return EXIT_FAILURE;
+    }
+
+    // The first free segment is taken, so appends fill the media front
+    // to back
+    for (uint64_t w = log->free_hint / 64;
+        w < div_ceil(log->segment_count, 64); w++) {
+        if (log->free_map[w] == 0) {
+            continue;
+        }
+
+        uint64_t s = (w * 64) + (uint64_t)__builtin_ctzll(log->free_map[w]);
+
+        if (write_segment(fd, log, s, DDFS_SEGMENT_OPEN, 0) !=
+            EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+
+        log->free_map[w] &= ~(1ULL << (s % 64));
+        log->free_hint = s + 1;
+        log->head = s;
+        log->used = 0;
+        log->free_count--;
+        return EXIT_SUCCESS;
+    }
+
+    errno = ENOSPC;
+    return EXIT_FAILURE;
+}
+
+// Append a block to the head segment, returning its block number. The
+// data is written when the run is flushed, which happens here whenever
+// the run is full or the head moves on.
+static int64_t append_block(int fd, struct ddfs_superblock *sb,
+    struct ddfs_log *log, struct ddfs_log_run *run, void *buffer) {
+    if (run->count == DDFS_MAX_IOV || log->used == DDFS_SEGMENT_BLOCKS) {
+        if (flush_run(fd, log, run) != EXIT_SUCCESS) {
+            return -1;
+        }
+    }
+
+    if (log->used == DDFS_SEGMENT_BLOCKS &&
+        advance_head(fd, sb, log) != EXIT_SUCCESS) {
+        return -1;
+    }
+
+    uint64_t block_number = log->first_block +
+        (log->head * DDFS_SEGMENT_BLOCKS) + log->used++;
+
+    if (run->count == 0) {
+        run->first = block_number;
+    }
+
+    run->buffers[run->count++] = buffer;
+    return block_number;
+}
+
+// Whether a block lies in the part of a segment that was appended to
+static int block_appended(int fd, struct ddfs_log *log,
+    uint64_t block_number) {
+    if (block_number < log->first_block) {
+        return 0;
+    }
+
+    uint64_t segment = (block_number - log->first_block) /
+        DDFS_SEGMENT_BLOCKS;
+    struct ddfs_segment entry;
+
+    if (segment == log->head) {
+        return (block_number - log->first_block) % DDFS_SEGMENT_BLOCKS <
+            log->used;
+    }
+
+    if (segment >= log->segment_count ||
+        read_segment(fd, log, segment, &entry) != EXIT_SUCCESS) {
+        return 0;
+    }
+
+    return le32toh(entry.sg_state) == DDFS_SEGMENT_FULL;
+}
+
+// Read or write the index slot of a fingerprint. Writes only replace the
+// slot when it still holds old_block, so a cleaner relocating a block does
+// not clobber a slot that was since taken by another value.
+static int access_index(int fd, struct ddfs_log *log,
+    uint8_t fingerprint[20], struct ddfs_index_slot *slot, int write,
+    uint64_t old_block) {
+    uint64_t slot_number = key_hash(fingerprint, log->index_slots);
+    uint64_t block_number = log->index_block +
+        (slot_number / DDFS_INDEX_PER_BLOCK);
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    if (read_block(fd, buffer, block_number) != DDFS_BLOCK_SIZE) {
+        put_block_buffer(buffer);
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_index_slot *stored = (struct ddfs_index_slot *)buffer +
+        (slot_number % DDFS_INDEX_PER_BLOCK);
+    int ret = EXIT_SUCCESS;
+
+    if (!write) {
+        *slot = *stored;
+    } else if (old_block == 0 || (le64toh(stored->is_block) == old_block &&
+        memcmp(stored->is_fingerprint, fingerprint, 20) == 0)) {
+        *stored = *slot;
+
+        if (write_block(fd, buffer, block_number) != DDFS_BLOCK_SIZE) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    put_block_buffer(buffer);
+    return ret;
+}
+
+// Find an appended block holding value through the index, or return 0.
+// The slot may be stale, so the block is compared with the value: blocks
+// still in the pending run in memory, others after reading them.
+static int64_t lookup_value(int fd, struct ddfs_log *log,
+    struct ddfs_log_run *run, uint8_t *value, uint8_t fingerprint[20]) {
+    struct ddfs_index_slot slot;
+
+    if (access_index(fd, log, fingerprint, &slot, 0, 0) != EXIT_SUCCESS) {
+        return -1;
+    }
+
+    uint64_t block_number = le64toh(slot.is_block);
+
+    if (block_number == 0 ||
+        memcmp(slot.is_fingerprint, fingerprint, 20) != 0 ||
+        !block_appended(fd, log, block_number)) {
+        return 0;
+    }
+
+    if (run != NULL && block_number >= run->first &&
+        block_number < run->first + run->count) {
+        return memcmp(run->buffers[block_number - run->first], value,
+            DDFS_BLOCK_SIZE) == 0 ? (int64_t)block_number : 0;
+    }
+
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    int64_t ret = -1;
+
+    if (read_block(fd, buffer, block_number) == DDFS_BLOCK_SIZE) {
+        ret = memcmp(buffer, value, DDFS_BLOCK_SIZE) == 0 ?
+            (int64_t)block_number : 0;
+    }
+
+    put_block_buffer(buffer);
+    return ret;
+}
+
+// Take a reference to a block holding each of count values on a
+// log-structured volume. Values the index finds share their block, the
+// others are appended to the head segment in runs of adjacent blocks and
+// entered in the index. blocks[i] receives the block of values[i].
+int store_values(int fd, struct ddfs_superblock *sb, uint8_t *values[],
+    uint8_t *fingerprints[], uint32_t count, uint64_t *blocks) {
+    struct ddfs_scratch *scratch = get_scratch();
+
+    if (scratch == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_arena_mark mark = arena_mark(&scratch->arena);
+    struct ddfs_ref_delta *pins = arena_alloc(&scratch->arena,
+        count * sizeof(struct ddfs_ref_delta), sizeof(uint64_t));
+    struct ddfs_log_run *run = arena_alloc(&scratch->arena,
+        sizeof(struct ddfs_log_run), sizeof(uint64_t));
+    struct ddfs_log local;
+    struct ddfs_log *log = NULL;
+    uint32_t pinned = 0;
+    int ret = EXIT_FAILURE;
+
+    if (pins == NULL || run == NULL ||
+        (log = lock_log(fd, sb, &local)) == NULL) {
+        goto out;
+    }
+
+    // A cleaner run by an append leaves the segments of the blocks taken
+    // so far alone, since blocks[] and the caller keep their numbers
+    run->count = 0;
+    log->taken = pins;
+    log->taken_count = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        int64_t block_number = lookup_value(fd, log, run, values[i],
+            fingerprints[i]);
+
+        if (block_number == 0) {
+            struct ddfs_index_slot slot;
+
+            block_number = append_block(fd, sb, log, run, values[i]);
+            memset(&slot, 0, sizeof(struct ddfs_index_slot));
+            memcpy(slot.is_fingerprint, fingerprints[i], 20);
+            slot.is_block = htole64(block_number);
+
+            if (block_number != -1 && access_index(fd, log,
+                fingerprints[i], &slot, 1, 0) != EXIT_SUCCESS) {
+                block_number = -1;
+            }
+        }
+
+        if (block_number == -1) {
+            goto out;
+        }
+
+        // The reference is taken right away, so a cleaner run by a later
+        // append sees the block as live
+        pins[pinned].rd_block = block_number;
+        pins[pinned].rd_delta = 1;
+
+        if (adjust_reference_counts(fd, &pins[pinned], 1) != EXIT_SUCCESS) {
+            goto out;
+        }
+
+        blocks[i] = block_number;
+        log->taken_count = ++pinned;
+    }
+
+    ret = flush_run(fd, log, run);
+
+out:
+    if (log != NULL) {
+        log->taken = NULL;
+        log->taken_count = 0;
+    }
+
+    // Blocks that were appended but end up without a reference are dead
+    // and left to the cleaner
+    if (ret != EXIT_SUCCESS && pinned != 0) {
+        for (uint32_t i = 0; i < pinned; i++) {
+            pins[i].rd_delta = -1;
+        }
+
+        adjust_reference_counts(fd, pins, pinned);
+    }
+
+    unlock_log(log, &local);
+    arena_reset(&scratch->arena, mark);
+    return ret;
+}
+
+int store_value(int fd, struct ddfs_superblock *sb, uint8_t *value,
+    uint8_t fingerprint[20], uint64_t *block_ptr) {
+    return store_values(fd, sb, &value, &fingerprint, 1, block_ptr);
+}
+
+// Get the block of a log-structured volume holding value, 0 if the index
+// knows of none or -1 on error
+int64_t find_value(int fd, uint8_t *value, uint8_t fingerprint[20]) {
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        return -1;
+    }
+
+    struct ddfs_log local;
+    struct ddfs_log *log = lock_log(fd, sb, &local);
+    int64_t ret = -1;
+
+    if (log != NULL) {
+        ret = lookup_value(fd, log, NULL, value, fingerprint);
+    }
+
+    unlock_log(log, &local);
+    put_block_buffer(sb);
+    return ret;
+}
+
+// Pick up to count full segments to clean by cost-benefit: cleaning a
+// segment with utilization u reads it and writes u of it back to free
+// 1 - u of it, and older segments are less likely to lose more blocks
+// soon, so segments are ranked by (1 - u) * age / (1 + u). Live blocks
+// are counted from the reference count table, and full segments are not
+// worth cleaning. Segments holding a block a view pins are left alone,
+// since the view reads the block in place, and so are the busy_count
+// segments in busy, sorted, which a store in progress appends to.
+static uint32_t pick_victims(int fd, struct ddfs_log *log,
+    struct ddfs_victim *victims, uint32_t count, const uint64_t *busy,
+    uint32_t busy_count) {
+    struct ddfs_segment entry;
+    uint32_t victim_count = 0;
+    time_t now = time(NULL);
+
+    for (uint64_t s = 0; s < log->segment_count; s++) {
+        if (read_segment(fd, log, s, &entry) != EXIT_SUCCESS) {
+            return 0;
+        }
+
+        if (le32toh(entry.sg_state) != DDFS_SEGMENT_FULL ||
+            bsearch(&s, busy, busy_count, sizeof(uint64_t),
+            compare_segments) != NULL) {
+            continue;
+        }
+
+        uint64_t first = log->first_block + (s * DDFS_SEGMENT_BLOCKS);
+        int64_t live = count_live_blocks(fd, first, DDFS_SEGMENT_BLOCKS);
+
+        if (live == -1) {
+            return 0;
+        }
+
+        if (live == DDFS_SEGMENT_BLOCKS ||
+            blocks_pinned(fd, first, DDFS_SEGMENT_BLOCKS)) {
+            continue;
+        }
+
+        double utilization = (double)live / DDFS_SEGMENT_BLOCKS;
+        double age = 1.0 + difftime(now,
+            (time_t)le64toh(entry.sg_write_time));
+        double score = (1.0 - utilization) * (age > 1.0 ? age : 1.0) /
+            (1.0 + utilization);
+        uint32_t i = victim_count < count ? victim_count++ : count;
+
+        // Keep the victims sorted by descending score
+        while (i > 0 && victims[i - 1].score < score) {
+            if (i < count) {
+                victims[i] = victims[i - 1];
+            }
+
+            i--;
+        }
+
+        if (i < count) {
+            victims[i].segment = s;
+            victims[i].score = score;
+        }
+    }
+
+    return victim_count;
+}
+
+// Point the inodes of every initialized group at the relocated blocks.
+// Blocks are shared between keys and nothing maps a block back to its
+// keys, so the cleaner relocates in batches and scans the inode store once
+// per batch.
+static int rewrite_inodes(int fd, struct ddfs_superblock *sb,
+    struct ddfs_relocation *moves, uint32_t count) {
+    uint32_t inodes_per_block = DDFS_BLOCK_SIZE / sizeof(struct ddfs_inode);
+    uint64_t istore_block = le64toh(sb->info.fs_istore_offset) /
+        DDFS_BLOCK_SIZE;
+    uint64_t istore_block_count = le64toh(sb->info.fs_istore_block_count);
+    uint64_t group_count = le64toh(sb->info.fs_group_count);
+    uint64_t group_blocks = DDFS_GROUP_INODES / inodes_per_block;
+    uint8_t *buffer = get_block_buffer();
+    int ret = EXIT_SUCCESS;
+
+    if (buffer == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (uint64_t g = 0; g < group_count && ret == EXIT_SUCCESS; g++) {
+        int state = get_group_state(fd, sb, g);
+
+        if (state == -1) {
+            ret = EXIT_FAILURE;
+        }
+
+        if (state != 1) {
+            continue;
+        }
+
+        uint64_t first = g * group_blocks;
+        uint64_t last = first + group_blocks < istore_block_count ?
+            first + group_blocks : istore_block_count;
+
+        for (uint64_t b = first; b < last && ret == EXIT_SUCCESS; b++) {
+            uint8_t dirty = 0;
+
+            if (read_block(fd, buffer, istore_block + b) != DDFS_BLOCK_SIZE) {
+                ret = EXIT_FAILURE;
+                break;
+            }
+
+            for (uint32_t i = 0; i < inodes_per_block; i++) {
+                struct ddfs_inode *inode = (struct ddfs_inode *)buffer + i;
+                struct ddfs_relocation key = {
+                    .old_block = inode->info.i_block_ptr
+                };
+                struct ddfs_relocation *move = bsearch(&key, moves, count,
+                    sizeof(struct ddfs_relocation), compare_relocations);
+
+                if (move != NULL) {
+                    inode->info.i_block_ptr = move->new_block;
+                    dirty = 1;
+                }
+            }
+
+            if (dirty && write_block(fd, buffer, istore_block + b) !=
+                DDFS_BLOCK_SIZE) {
+                ret = EXIT_FAILURE;
+            }
+        }
+    }
+
+    put_block_buffer(buffer);
+    return ret;
+}
+
+// Clean up to count segments other than closed: append their live blocks
+// to the head, move the keys and references over, and free the victims.
+// The caller holds the log's lock and the volume's key lock for writing.
+// Returns the number of segments freed.
+static int64_t clean_locked(int fd, struct ddfs_superblock *sb,
+    struct ddfs_log *log, uint32_t count, uint64_t closed) {
+    struct ddfs_scratch *scratch = get_scratch();
+
+    if (scratch == NULL) {
+        return -1;
+    }
+
+    struct ddfs_arena_mark mark = arena_mark(&scratch->arena);
+    struct ddfs_victim *victims = arena_alloc(&scratch->arena,
+        count * sizeof(struct ddfs_victim), sizeof(uint64_t));
+    struct ddfs_relocation *moves = arena_alloc(&scratch->arena,
+        (size_t)count * DDFS_SEGMENT_BLOCKS * sizeof(struct ddfs_relocation),
+        sizeof(uint64_t));
+    struct ddfs_ref_delta *changes = arena_alloc(&scratch->arena,
+        (size_t)count * DDFS_SEGMENT_BLOCKS * 2 *
+        sizeof(struct ddfs_ref_delta), sizeof(uint64_t));
+    struct ddfs_index_slot *slots = arena_calloc(&scratch->arena,
+        (size_t)count * DDFS_SEGMENT_BLOCKS, sizeof(struct ddfs_index_slot));
+    uint8_t **hashed = arena_alloc(&scratch->arena,
+        (size_t)count * DDFS_SEGMENT_BLOCKS * 2 * sizeof(uint8_t *),
+        sizeof(void *));
+    struct ddfs_log_run *run = arena_alloc(&scratch->arena,
+        sizeof(struct ddfs_log_run), sizeof(uint64_t));
+    uint64_t *busy = arena_alloc(&scratch->arena,
+        ((size_t)log->taken_count + 1) * sizeof(uint64_t), sizeof(uint64_t));
+    uint32_t busy_count = 0;
+    uint32_t move_count = 0;
+    uint32_t victim_count = 0;
+    int64_t ret = -1;
+
+    if (victims == NULL || moves == NULL || changes == NULL ||
+        slots == NULL || hashed == NULL || run == NULL || busy == NULL) {
+        goto out;
+    }
+
+    // The references the journal holds for uncommitted releases are
+    // dropped from the old block numbers once committed, so they are
+    // dropped before the counts are read rather than moved with the blocks
+    if (commit_journal(fd) != EXIT_SUCCESS ||
+        release_held_blocks(fd) != EXIT_SUCCESS) {
+        goto out;
+    }
+
+    // The store in progress keeps the numbers of the blocks it took, so
+    // their segments stay put, and so does the head it just filled
+    if (closed < log->segment_count) {
+        busy[busy_count++] = closed;
+    }
+
+    for (uint32_t i = 0; i < log->taken_count; i++) {
+        busy[busy_count++] = (log->taken[i].rd_block - log->first_block) /
+            DDFS_SEGMENT_BLOCKS;
+    }
+
+    qsort(busy, busy_count, sizeof(uint64_t), compare_segments);
+    victim_count = pick_victims(fd, log, victims, count, busy, busy_count);
+    run->count = 0;
+    log->cleaning = 1;
+
+    // Read each victim's live blocks and append them to the head
+    for (uint32_t v = 0; v < victim_count; v++) {
+        uint64_t first = log->first_block +
+            (victims[v].segment * DDFS_SEGMENT_BLOCKS);
+
+        for (uint64_t b = first; b < first + DDFS_SEGMENT_BLOCKS; b++) {
+            int64_t references = get_reference_count(fd, b);
+
+            if (references == -1) {
+                goto out;
+            }
+
+            if (references == 0) {
+                continue;
+            }
+
+            struct ddfs_relocation *move = &moves[move_count++];
+
+            move->old_block = b;
+            move->count = references;
+            move->data = arena_alloc(&scratch->arena, DDFS_BLOCK_SIZE,
+                DDFS_BLOCK_SIZE);
+
+            if (move->data == NULL ||
+                read_block(fd, move->data, b) != DDFS_BLOCK_SIZE) {
+                goto out;
+            }
+
+            int64_t block_number = append_block(fd, sb, log, run,
+                move->data);
+
+            if (block_number == -1) {
+                goto out;
+            }
+
+            move->new_block = block_number;
+        }
+    }
+
+    if (flush_run(fd, log, run) != EXIT_SUCCESS) {
+        goto out;
+    }
+
+    // The data and its references are in place before any key points at
+    // it
+    qsort(moves, move_count, sizeof(struct ddfs_relocation),
+        compare_relocations);
+
+    for (uint32_t i = 0; i < move_count; i++) {
+        changes[i].rd_block = moves[i].new_block;
+        changes[i].rd_delta = moves[i].count;
+        changes[move_count + i].rd_block = moves[i].old_block;
+        changes[move_count + i].rd_delta = -moves[i].count;
+    }
+
+    if (adjust_reference_counts(fd, changes, move_count) != EXIT_SUCCESS ||
+        (move_count != 0 &&
+        rewrite_inodes(fd, sb, moves, move_count) != EXIT_SUCCESS)) {
+        goto out;
+    }
+
+    // The keys have to leave the victims for good before the victims can
+    // be reused, or a crash would roll a journaled volume back onto
+    // segments written over since
+    if (commit_journal(fd) != EXIT_SUCCESS ||
+        adjust_reference_counts(fd, changes + move_count, move_count) !=
+        EXIT_SUCCESS) {
+        goto out;
+    }
+
+    // Index slots follow their blocks; a slot that is lost only costs
+    // deduplication. The moved blocks are fingerprinted on the worker
+    // pool as maintenance work.
+    for (uint32_t i = 0; i < move_count; i++) {
+        hashed[i] = moves[i].data;
+        hashed[move_count + i] = slots[i].is_fingerprint;
+    }
+
+    hash_blocks(hashed, hashed + move_count, move_count,
+        DDFS_POOL_BACKGROUND);
+
+    for (uint32_t i = 0; i < move_count; i++) {
+        slots[i].is_block = htole64(moves[i].new_block);
+        access_index(fd, log, slots[i].is_fingerprint, &slots[i], 1,
+            moves[i].old_block);
+    }
+
+    struct ddfs_volume *volume = get_volume(fd);
+
+    for (uint32_t v = 0; v < victim_count; v++) {
+        if (write_segment(fd, log, victims[v].segment, DDFS_SEGMENT_FREE,
+            0) != EXIT_SUCCESS) {
+            goto out;
+        }
+
+        log->free_map[victims[v].segment / 64] |=
+            1ULL << (victims[v].segment % 64);
+        log->free_count++;
+
+        if (victims[v].segment < log->free_hint) {
+            log->free_hint = victims[v].segment;
+        }
+
+        // Storage that cannot discard keeps the stale blocks, which the
+        // index no longer leads to
+        if (volume != NULL && volume->discard_min != 0) {
+            discard_blocks(fd, log->first_block +
+                (victims[v].segment * DDFS_SEGMENT_BLOCKS),
+                DDFS_SEGMENT_BLOCKS);
+        }
+    }
+
+    ret = victim_count;
+
+out:
+    log->cleaning = 0;
+    arena_reset(&scratch->arena, mark);
+    return ret;
+}
+
+// Clean up to count segments of a log-structured volume, returning the
+// number freed or -1 on error. Appends run the cleaner on their own when
+// free segments run low. Key operations are held off while it runs, since
+// it repoints inodes and frees the segments lookups read from.
+int64_t clean_segments(int fd, uint32_t count) {
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        return -1;
+    }
+
+    struct ddfs_key_locks locks;
+    key_locks_init(&locks, fd);
+    lock_keys(&locks, 1);
+
+    struct ddfs_log local;
+    struct ddfs_log *log = lock_log(fd, sb, &local);
+    int64_t ret = -1;
+
+    if (log != NULL) {
+        ret = clean_locked(fd, sb, log, count, log->segment_count);
+    }
+
+    unlock_log(log, &local);
+    unlock_keys(&locks);
+    put_block_buffer(sb);
+    return ret;
+}
+
+// Get the number of free segments of a log-structured volume, the head
+// excluded, or -1 on error
+int64_t get_free_segments(int fd) {
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        return -1;
+    }
+
+    struct ddfs_log local;
+    struct ddfs_log *log = lock_log(fd, sb, &local);
+    int64_t ret = -1;
+
+    if (log != NULL) {
+        ret = log->free_count;
+    }
+
+    unlock_log(log, &local);
+    put_block_buffer(sb);
+    return ret;
+}
@@ -0,0 +1,77 @@
+#ifndef ddfs_LOG_H
+#define	ddfs_LOG_H
+
+#include <pthread.h>
+
+#include "ddfs.h"
+
+struct ddfs_ref_delta;
+
+#define DDFS_SEGMENT_BLOCKS ((1 << 20) / DDFS_BLOCK_SIZE) // Blocks per segment
+#define DDFS_SEGMENT_FREE 0 // Segment holds no live blocks
+#define DDFS_SEGMENT_OPEN 1 // Segment blocks are being appended to
+#define DDFS_SEGMENT_FULL 2 // Segment was filled and awaits cleaning
+#define DDFS_SEGMENTS_PER_BLOCK (DDFS_BLOCK_SIZE / sizeof(struct ddfs_segment))
+#define DDFS_INDEX_PER_BLOCK (DDFS_BLOCK_SIZE / sizeof(struct ddfs_index_slot))
+#define DDFS_LOG_RESERVE 2 // Free segments only the cleaner may fill
+#define DDFS_LOG_CLEAN_BATCH 4 // Victims cleaned when segments run low
+
+// Entry of the segment table of a log-structured volume
+struct ddfs_segment {
+    uint64_t sg_write_time; // When a block was last appended
+    uint32_t sg_state; // DDFS_SEGMENT_* state
+    uint32_t sg_used; // Blocks appended since the segment was opened
+};
+
+// Entry of the fingerprint index of a log-structured volume. The index is
+// direct mapped: a value whose slot holds another fingerprint is simply
+// not deduplicated against, and a slot whose block was cleaned since is
+// caught by hashing the block.
+struct ddfs_index_slot {
+    uint8_t is_fingerprint[20]; // Fingerprint of the value
+    uint32_t is_padding; // Padding to 32 bytes
+    uint64_t is_block; // Block holding the value, 0 for an empty slot
+};
+
+// Append state of a log-structured volume. Data blocks are appended to the
+// head segment; when it fills, the next free segment becomes the head and
+// the cleaner relocates the live blocks of mostly dead segments to free
+// them again. Free segments are tracked in memory, so moving the head
+// reads nothing.
+struct ddfs_log {
+    pthread_mutex_t lock; // Serializes appends and cleaning
+    uint64_t table_block; // First block of the segment table
+    uint64_t index_block; // First block of the fingerprint index
+    uint64_t index_slots; // Number of fingerprint index slots
+    uint64_t first_block; // First block of segment 0
+    uint64_t segment_count; // Number of segments
+    uint64_t head; // Segment blocks are appended to
+    uint32_t used; // Blocks of the head already appended
+    uint64_t free_count; // Number of free segments, head excluded
+    uint64_t *free_map; // Bit per segment, set while it is free
+    uint64_t free_hint; // No segment before this one is free
+    uint8_t cleaning; // Whether the cleaner is appending
+    struct ddfs_ref_delta *taken; // References the store in progress took
+    uint32_t taken_count; // Number of references in taken
+};
+
+extern int load_log(int fd);
+
+extern void free_log(int fd);
+
+extern int log_structured(int fd);
+
+extern int store_values(int fd, struct ddfs_superblock *sb,
+    uint8_t *values[], uint8_t *fingerprints[], uint32_t count,
+    uint64_t *blocks);
+
+extern int store_value(int fd, struct ddfs_superblock *sb, uint8_t *value,
+    uint8_t fingerprint[20], uint64_t *block_ptr);
+
+extern int64_t find_value(int fd, uint8_t *value, uint8_t fingerprint[20]);
+
+extern int64_t clean_segments(int fd, uint32_t count);
+
+extern int64_t get_free_segments(int fd);
+
+#endif
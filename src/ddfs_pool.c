@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ddfs_pool.h"
+#include "ddfs_alloc.h"
+
+// Range of a parallel_for() run as one task
+struct ddfs_range {
+    struct ddfs_task task; // Task running the range
+    int (*run)(void *arg, uint32_t start, uint32_t end); // Loop body
+    void *arg; // Argument of run
+    uint32_t start; // First index of the range
+    uint32_t end; // Index after the range
+};
+
+static struct ddfs_worker workers[DDFS_POOL_MAX_WORKERS];
+static uint32_t worker_count; // Workers running, 0 to run tasks inline
+static uint32_t deque_count; // Workers ever started, whose deques may
+                             // still hold tasks
+static uint32_t next_worker; // Worker outside submissions go to next
+static uint64_t queued; // Tasks sitting in deques
+static uint8_t stopping; // Tells the workers to exit once idle
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; // Guards
+                                                              // sleeping
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER; // Tasks queued
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER; // Group finished
+static pthread_mutex_t resize_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t worker_key; // Worker of the calling thread, or NULL
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static int push_task(struct ddfs_deque *deque, struct ddfs_task *task) {
+    int ret = EXIT_FAILURE;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom - deque->top < DDFS_POOL_DEQUE) {
+        deque->tasks[deque->bottom % DDFS_POOL_DEQUE] = task;
+        deque->bottom++;
+        ret = EXIT_SUCCESS;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return ret;
+}
+
+// Take the newest task of a deque, or the oldest one when stealing
+static struct ddfs_task *take_task(struct ddfs_deque *deque, int steal) {
+    struct ddfs_task *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom != deque->top) {
+        if (steal) {
+            task = deque->tasks[deque->top % DDFS_POOL_DEQUE];
+            deque->top++;
+        } else {
+            deque->bottom--;
+            task = deque->tasks[deque->bottom % DDFS_POOL_DEQUE];
+        }
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+// Find a task of at most the given class, foreground first: the calling
+// worker's own newest one, or else the oldest one of another worker
+static struct ddfs_task *find_task(struct ddfs_worker *self,
+    uint32_t max_class) {
+    uint32_t count = __atomic_load_n(&deque_count, __ATOMIC_ACQUIRE);
+    uint32_t first = self != NULL ? self->index + 1 : 0;
+
+    if (__atomic_load_n(&queued, __ATOMIC_ACQUIRE) == 0) {
+        return NULL;
+    }
+
+    for (uint32_t c = 0; c <= max_class; c++) {
+        struct ddfs_task *task = NULL;
+
+        if (self != NULL) {
+            task = take_task(&self->deques[c], 0);
+        }
+
+        for (uint32_t i = 0; task == NULL && i < count; i++) {
+            struct ddfs_worker *victim = &workers[(first + i) % count];
+
+            if (victim != self) {
+                task = take_task(&victim->deques[c], 1);
+            }
+        }
+
+        if (task != NULL) {
+            __atomic_sub_fetch(&queued, 1, __ATOMIC_ACQ_REL);
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+// Run a task and wake the threads waiting for groups if it was the last
+// of its group. The group may be gone as soon as pending drops to zero.
+static void run_task(struct ddfs_task *task) {
+    struct ddfs_task_group *group = task->group;
+
+    if (task->run(task->arg) != EXIT_SUCCESS) {
+        __atomic_store_n(&group->ret, EXIT_FAILURE, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&pool_lock);
+        pthread_cond_broadcast(&done);
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+// Run queued tasks, foreground ones first, sleeping while there are none.
+// Workers told to stop still finish every queued task.
+static void *run_worker(void *arg) {
+    struct ddfs_worker *self = arg;
+
+    pthread_setspecific(worker_key, self);
+
+    while (1) {
+        struct ddfs_task *task = find_task(self, DDFS_POOL_BACKGROUND);
+
+        if (task != NULL) {
+            run_task(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool_lock);
+
+        uint64_t waiting = __atomic_load_n(&queued, __ATOMIC_ACQUIRE);
+
+        while (!stopping && waiting == 0) {
+            pthread_cond_wait(&wake, &pool_lock);
+            waiting = __atomic_load_n(&queued, __ATOMIC_ACQUIRE);
+        }
+
+        if (stopping && waiting == 0) {
+            pthread_mutex_unlock(&pool_lock);
+            break;
+        }
+
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    return NULL;
+}
+
+static int start_workers(uint32_t count) {
+    uint32_t started = 0;
+
+    if (count > DDFS_POOL_MAX_WORKERS) {
+        count = DDFS_POOL_MAX_WORKERS;
+    }
+
+    for (; started < count; started++) {
+        workers[started].index = started;
+
+        if (pthread_create(&workers[started].thread, NULL, run_worker,
+            &workers[started]) != 0) {
+            break;
+        }
+    }
+
+    if (started > deque_count) {
+        __atomic_store_n(&deque_count, started, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&worker_count, started, __ATOMIC_RELEASE);
+    return started == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Set up the deques and start a worker per online processor but one, as
+// the thread waiting for tasks runs them too
+static void init_pool(void) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+
+    pthread_key_create(&worker_key, NULL);
+
+    for (uint32_t i = 0; i < DDFS_POOL_MAX_WORKERS; i++) {
+        for (uint32_t c = 0; c < DDFS_POOL_CLASSES; c++) {
+            pthread_mutex_init(&workers[i].deques[c].lock, NULL);
+        }
+    }
+
+    start_workers(processors > 1 ? processors - 1 : 0);
+}
+
+// Replace the pool's workers with count new ones, 0 running every task on
+// the thread that submits it. Meant to be called between operations; a
+// task queued while the old workers exit is run here.
+int ddfs_set_workers(uint32_t count) {
+    pthread_once(&pool_once, init_pool);
+    pthread_mutex_lock(&resize_lock);
+
+    uint32_t old_count = __atomic_load_n(&worker_count, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_lock(&pool_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (uint32_t i = 0; i < old_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    __atomic_store_n(&worker_count, 0, __ATOMIC_RELEASE);
+    stopping = 0;
+
+    struct ddfs_task *task;
+
+    while ((task = find_task(NULL, DDFS_POOL_BACKGROUND)) != NULL) {
+        run_task(task);
+    }
+
+    int ret = start_workers(count);
+
+    pthread_mutex_unlock(&resize_lock);
+    return ret;
+}
+
+uint32_t ddfs_get_workers(void) {
+    pthread_once(&pool_once, init_pool);
+    return __atomic_load_n(&worker_count, __ATOMIC_ACQUIRE);
+}
+
+void task_group_init(struct ddfs_task_group *group, uint32_t priority) {
+    pthread_once(&pool_once, init_pool);
+    group->priority = priority;
+    group->pending = 0;
+    group->ret = EXIT_SUCCESS;
+}
+
+// Queue a task on the calling worker's deque, or spread tasks from other
+// threads over the workers. Without workers, or with a full deque, the
+// task runs right away.
+void submit_task(struct ddfs_task_group *group, struct ddfs_task *task) {
+    struct ddfs_worker *self = pthread_getspecific(worker_key);
+    uint32_t count = __atomic_load_n(&worker_count, __ATOMIC_ACQUIRE);
+
+    task->group = group;
+    __atomic_add_fetch(&group->pending, 1, __ATOMIC_ACQ_REL);
+
+    if (count == 0) {
+        run_task(task);
+        return;
+    }
+
+    if (self == NULL) {
+        self = &workers[__atomic_fetch_add(&next_worker, 1,
+            __ATOMIC_RELAXED) % count];
+    }
+
+    // Counted before it is visible, so thieves never take the count below
+    // zero
+    __atomic_add_fetch(&queued, 1, __ATOMIC_ACQ_REL);
+
+    if (push_task(&self->deques[group->priority], task) != EXIT_SUCCESS) {
+        __atomic_sub_fetch(&queued, 1, __ATOMIC_ACQ_REL);
+        run_task(task);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Wait until every task of a group has run, running queued tasks of the
+// group's class or a more urgent one meanwhile
+int wait_task_group(struct ddfs_task_group *group) {
+    struct ddfs_worker *self = pthread_getspecific(worker_key);
+
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) != 0) {
+        struct ddfs_task *task = find_task(self, group->priority);
+
+        if (task != NULL) {
+            run_task(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool_lock);
+
+        if (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) != 0) {
+            pthread_cond_wait(&done, &pool_lock);
+        }
+
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    return __atomic_load_n(&group->ret, __ATOMIC_RELAXED);
+}
+
+static int run_range(void *arg) {
+    struct ddfs_range *range = arg;
+
+    return range->run(range->arg, range->start, range->end);
+}
+
+// Run run over [0, count) in ranges of at least grain indices spread over
+// the pool, the calling thread taking the first range. Fails if any range
+// failed.
+int parallel_for(uint32_t count, uint32_t grain, uint32_t priority,
+    int (*run)(void *arg, uint32_t start, uint32_t end), void *arg) {
+    uint32_t threads = ddfs_get_workers() + 1;
+    uint32_t ranges = grain != 0 ? div_ceil(count, grain) : count;
+
+    if (ranges > threads * DDFS_POOL_SPLIT) {
+        ranges = threads * DDFS_POOL_SPLIT;
+    }
+
+    if (threads == 1 || ranges <= 1) {
+        return run(arg, 0, count);
+    }
+
+    struct ddfs_scratch *scratch = get_scratch();
+
+    if (scratch == NULL) {
+        return run(arg, 0, count);
+    }
+
+    struct ddfs_arena_mark mark = arena_mark(&scratch->arena);
+    struct ddfs_range *range = arena_alloc(&scratch->arena,
+        ranges * sizeof(struct ddfs_range), sizeof(void *));
+    struct ddfs_task_group group;
+
+    if (range == NULL) {
+        arena_reset(&scratch->arena, mark);
+        return run(arg, 0, count);
+    }
+
+    task_group_init(&group, priority);
+
+    for (uint32_t r = 0; r < ranges; r++) {
+        range[r] = (struct ddfs_range) {
+            .task = { .run = run_range, .arg = &range[r] },
+            .run = run,
+            .arg = arg,
+            .start = (uint64_t)count * r / ranges,
+            .end = (uint64_t)count * (r + 1) / ranges
+        };
+    }
+
+    for (uint32_t r = 1; r < ranges; r++) {
+        submit_task(&group, &range[r].task);
+    }
+
+    int ret = run(arg, range[0].start, range[0].end);
+
+    if (wait_task_group(&group) != EXIT_SUCCESS) {
+        ret = EXIT_FAILURE;
+    }
+
+    arena_reset(&scratch->arena, mark);
+    return ret;
+}
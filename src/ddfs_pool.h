@@ -0,0 +1,70 @@
+#ifndef ddfs_POOL_H
+#define	ddfs_POOL_H
+
+#include <pthread.h>
+
+#include "ddfs.h"
+
+#define DDFS_POOL_MAX_WORKERS 64 // Worker threads the pool runs at most
+#define DDFS_POOL_DEQUE 256 // Tasks a worker's deque of one class holds
+#define DDFS_POOL_FOREGROUND 0 // Tasks of client calls
+#define DDFS_POOL_BACKGROUND 1 // Maintenance tasks, run when no foreground
+                               // task is waiting
+#define DDFS_POOL_CLASSES 2
+#define DDFS_POOL_SPLIT 4 // Ranges parallel_for() makes per thread, so
+                          // idle threads have work left to steal
+#define DDFS_POOL_HASH_GRAIN 16 // Blocks a hashing task fingerprints at least
+#define DDFS_POOL_ZERO_BLOCKS ((8 << 20) / DDFS_BLOCK_SIZE) // Blocks a
+                                                            // zeroing task
+                                                            // writes
+
+struct ddfs_task_group;
+
+// Unit of work run on the pool. Tasks must not block on locks, since the
+// thread waiting for them may hold any lock while it helps run them.
+struct ddfs_task {
+    int (*run)(void *arg); // Work to do, returning EXIT_SUCCESS or failure
+    void *arg; // Argument of run
+    struct ddfs_task_group *group; // Group the task is waited for with
+};
+
+// Tasks submitted together and waited for with wait_task_group()
+struct ddfs_task_group {
+    uint32_t priority; // DDFS_POOL_* class of the tasks
+    uint32_t pending; // Tasks not finished yet
+    int ret; // EXIT_FAILURE once a task failed
+};
+
+// Bounded deque of tasks of one class. Its worker pushes and pops at the
+// bottom, so it runs the tasks it queued last while their data is still
+// in its cache; other threads steal the oldest tasks from the top.
+struct ddfs_deque {
+    pthread_mutex_t lock; // Protects the deque
+    struct ddfs_task *tasks[DDFS_POOL_DEQUE]; // Ring of queued tasks
+    uint32_t top; // Oldest task, counting up without wrapping the ring
+    uint32_t bottom; // Slot after the newest task
+};
+
+// Worker thread of the pool
+struct ddfs_worker {
+    pthread_t thread; // Thread running the worker
+    uint32_t index; // Position in the pool
+    struct ddfs_deque deques[DDFS_POOL_CLASSES]; // Queued tasks per class
+};
+
+extern int ddfs_set_workers(uint32_t count);
+
+extern uint32_t ddfs_get_workers(void);
+
+extern void task_group_init(struct ddfs_task_group *group,
+    uint32_t priority);
+
+extern void submit_task(struct ddfs_task_group *group,
+    struct ddfs_task *task);
+
+extern int wait_task_group(struct ddfs_task_group *group);
+
+extern int parallel_for(uint32_t count, uint32_t grain, uint32_t priority,
+    int (*run)(void *arg, uint32_t start, uint32_t end), void *arg);
+
+#endif
@@ -0,0 +1,1064 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ddfs_refcount.h"
+#include "ddfs_alloc.h"
+#include "ddfs_gc.h"
+#include "ddfs_journal.h"
+#include "ddfs_log.h"
+#include "ddfs_volume.h"
+
+// Every delta the log holds fits with the table at most half full
+#define DDFS_REFLOG_SLOTS (2 * DDFS_REFLOG_BLOCKS * DDFS_REFLOG_ENTRIES)
+
+// Plain descriptors have no log, so their tables change under one lock
+// they all share
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int compare_blocks(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int compare_deltas(const void *a, const void *b) {
+    uint64_t x = ((const struct ddfs_ref_delta *)a)->rd_block;
+    uint64_t y = ((const struct ddfs_ref_delta *)b)->rd_block;
+
+    return (x > y) - (x < y);
+}
+
+// Get the lock reference counts change under
+static pthread_mutex_t *count_lock(struct ddfs_reflog *log) {
+    return log != NULL ? &log->lock : &table_lock;
+}
+
+// Find where a block's pin is, or would go, in a volume's pins. The
+// caller holds the pin lock.
+static uint32_t pin_index(struct ddfs_volume *volume, uint64_t block_number) {
+    uint32_t low = 0;
+    uint32_t high = volume->pin_count;
+
+    while (low < high) {
+        uint32_t middle = low + ((high - low) / 2);
+
+        if (volume->pins[middle].block_number < block_number) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+// Get the number of views pinning a block. Volumes without pins, and
+// plain descriptors, which have none, skip the lock.
+static uint32_t get_pins(struct ddfs_volume *volume, uint64_t block_number) {
+    if (volume == NULL ||
+        __atomic_load_n(&volume->pin_count, __ATOMIC_ACQUIRE) == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&volume->pin_lock);
+
+    uint32_t i = pin_index(volume, block_number);
+    uint32_t pins = i < volume->pin_count &&
+        volume->pins[i].block_number == block_number ?
+        volume->pins[i].count : 0;
+
+    pthread_mutex_unlock(&volume->pin_lock);
+    return pins;
+}
+
+// Get the epoch stamp at the end of a table block
+static uint64_t *table_epoch(uint8_t *block) {
+    return (uint64_t *)(block + DDFS_BLOCK_SIZE - sizeof(uint64_t));
+}
+
+// Add sorted deltas to the table, reading and writing each table block
+// once. Counts saturate at zero and UINT32_MAX. Deltas of a log's epoch
+// stamp the blocks they change with it and skip blocks already stamped,
+// so applying a log again after a crash counts no delta twice; epoch 0
+// applies the deltas unconditionally.
+static int table_adjust(int fd, uint64_t table_block,
+    struct ddfs_ref_delta *deltas, uint32_t count, uint64_t epoch) {
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_SUCCESS;
+    uint32_t i = 0;
+
+    while (ret == EXIT_SUCCESS && i < count) {
+        uint64_t block_number = table_block +
+            (deltas[i].rd_block / DDFS_REFS_PER_BLOCK);
+        uint32_t *counts = (uint32_t *)buffer;
+
+        if (read_block(fd, buffer, block_number) != DDFS_BLOCK_SIZE) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        int applied = epoch != 0 && le64toh(*table_epoch(buffer)) >= epoch;
+
+        for (; i < count && table_block +
+            (deltas[i].rd_block / DDFS_REFS_PER_BLOCK) == block_number;
+            i++) {
+            if (applied) {
+                continue;
+            }
+
+            uint32_t index = deltas[i].rd_block % DDFS_REFS_PER_BLOCK;
+            int64_t value = (int64_t)le32toh(counts[index]) +
+                deltas[i].rd_delta;
+
+            if (value < 0) {
+                value = 0;
+            } else if (value > UINT32_MAX) {
+                value = UINT32_MAX;
+            }
+
+            counts[index] = htole32((uint32_t)value);
+        }
+
+        if (applied) {
+            continue;
+        }
+
+        if (epoch != 0) {
+            *table_epoch(buffer) = htole64(epoch);
+        }
+
+        if (write_block(fd, buffer, block_number) != DDFS_BLOCK_SIZE) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    put_block_buffer(buffer);
+    return ret;
+}
+
+static int64_t table_get(int fd, uint64_t table_block,
+    uint64_t block_number) {
+    uint64_t table_number = table_block +
+        (block_number / DDFS_REFS_PER_BLOCK);
+    uint32_t index = block_number % DDFS_REFS_PER_BLOCK;
+    uint8_t *block = get_block_address(fd, table_number, 1, 0);
+
+    // Mapped volumes read the count in place
+    if (block != NULL) {
+        return le32toh(((uint32_t *)block)[index]);
+    }
+
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    int64_t value = -1;
+
+    if (read_block(fd, buffer, table_number) == DDFS_BLOCK_SIZE) {
+        value = le32toh(((uint32_t *)buffer)[index]);
+    }
+
+    put_block_buffer(buffer);
+    return value;
+}
+
+static struct ddfs_ref_delta *pending_slot(struct ddfs_reflog *log,
+    uint64_t block_number) {
+    uint64_t slot = (block_number * 0x9e3779b97f4a7c15ULL) %
+        DDFS_REFLOG_SLOTS;
+
+    // Block 0 holds the superblock, so it marks an empty slot
+    while (log->pending[slot].rd_block != 0 &&
+        log->pending[slot].rd_block != block_number) {
+        slot = (slot + 1) % DDFS_REFLOG_SLOTS;
+    }
+
+    return &log->pending[slot];
+}
+
+static void pending_add(struct ddfs_reflog *log, uint64_t block_number,
+    int64_t delta) {
+    struct ddfs_ref_delta *slot = pending_slot(log, block_number);
+
+    if (slot->rd_block == 0) {
+        slot->rd_block = block_number;
+        log->pending_count++;
+    }
+
+    slot->rd_delta += delta;
+}
+
+static void reset_block(struct ddfs_reflog *log) {
+    struct ddfs_reflog_header *header =
+        (struct ddfs_reflog_header *)log->block;
+
+    memset(log->block, 0, DDFS_BLOCK_SIZE);
+    header->rl_magic = htole32(DDFS_REFLOG_MAGIC);
+    header->rl_epoch = htole64(log->epoch);
+}
+
+// Write the delta block being filled to its place in the on-disk log
+static int write_log_block(int fd, struct ddfs_reflog *log) {
+    return write_block(fd, log->block, log->first_block + log->tail) ==
+        DDFS_BLOCK_SIZE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Fold every pending delta into the table, then start a new epoch, which
+// empties the on-disk log. The caller holds the log's lock.
+static int apply_locked(int fd, struct ddfs_reflog *log) {
+    if (log->pending_count == 0 && log->tail <= 1) {
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_ref_delta *deltas = ddfs_malloc((log->pending_count + 1) *
+        sizeof(struct ddfs_ref_delta));
+
+    if (deltas == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < DDFS_REFLOG_SLOTS; i++) {
+        if (log->pending[i].rd_block != 0 && log->pending[i].rd_delta != 0) {
+            deltas[count++] = log->pending[i];
+        }
+    }
+
+    qsort(deltas, count, sizeof(struct ddfs_ref_delta), compare_deltas);
+
+    // The table must be on disk before the new epoch drops the log. A
+    // crash in between replays the log over blocks already stamped with
+    // its epoch, which skip it.
+    int ret = table_adjust(fd, log->table_block, deltas, count, log->epoch);
+    ddfs_free(deltas);
+
+    if (ret != EXIT_SUCCESS || flush_volume(fd) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    log->epoch++;
+    log->tail = 0;
+    reset_block(log);
+
+    if (write_log_block(fd, log) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    memset(log->pending, 0, DDFS_REFLOG_SLOTS *
+        sizeof(struct ddfs_ref_delta));
+    log->pending_count = 0;
+    log->tail = 1;
+
+    // Every delta is in the flushed table; losing the new first block
+    // only replays the old log over it
+    log->unsynced = 0;
+    return EXIT_SUCCESS;
+}
+
+// Write the first block of a freshly zeroed log, starting its first epoch
+int initialize_reference_log(int fd, struct ddfs_superblock *sb) {
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_reflog_header *header = (struct ddfs_reflog_header *)buffer;
+
+    memset(buffer, 0, DDFS_BLOCK_SIZE);
+    header->rl_magic = htole32(DDFS_REFLOG_MAGIC);
+    header->rl_epoch = htole64(1);
+
+    int ret = write_block(fd, buffer, 
+        le64toh(sb->info.fs_reflog_offset) / DDFS_BLOCK_SIZE);
+    put_block_buffer(buffer);
+
+    return ret == DDFS_BLOCK_SIZE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Read the volume's reference log, replaying the deltas a previous user
+// left in it. Plain descriptors have no log and update the table directly.
+int load_reference_log(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL) {
+        return EXIT_SUCCESS;
+    }
+
+    free_reference_log(fd);
+
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    // Nothing to load until the volume is formatted
+    if (check_superblock(sb) != EXIT_SUCCESS) {
+        put_block_buffer(sb);
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_reflog *log = ddfs_calloc(1, sizeof(struct ddfs_reflog));
+
+    if (log == NULL) {
+        put_block_buffer(sb);
+        return EXIT_FAILURE;
+    }
+
+    log->first_block = le64toh(sb->info.fs_reflog_offset) / DDFS_BLOCK_SIZE;
+    log->table_block = le64toh(sb->info.fs_ref_offset) / DDFS_BLOCK_SIZE;
+    log->block_count = le64toh(sb->info.fs_block_count);
+    log->block = ddfs_memalign(DDFS_BLOCK_SIZE, DDFS_BLOCK_SIZE);
+    log->pending = ddfs_calloc(DDFS_REFLOG_SLOTS,
+        sizeof(struct ddfs_ref_delta));
+    pthread_mutex_init(&log->lock, NULL);
+    put_block_buffer(sb);
+
+    struct ddfs_reflog_header *header =
+        (struct ddfs_reflog_header *)log->block;
+    struct ddfs_ref_delta *deltas = (struct ddfs_ref_delta *)(header + 1);
+    int ret = EXIT_FAILURE;
+
+    if (log->block != NULL && log->pending != NULL &&
+        read_block(fd, log->block, log->first_block) == DDFS_BLOCK_SIZE &&
+        le32toh(header->rl_magic) == DDFS_REFLOG_MAGIC) {
+        log->epoch = le64toh(header->rl_epoch);
+        ret = EXIT_SUCCESS;
+    }
+
+    // Delta blocks of the current epoch run up to the first stale one
+    for (log->tail = 1; ret == EXIT_SUCCESS &&
+        log->tail < DDFS_REFLOG_BLOCKS; log->tail++) {
+        if (read_block(fd, log->block, log->first_block + log->tail) !=
+            DDFS_BLOCK_SIZE) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        if (le32toh(header->rl_magic) != DDFS_REFLOG_MAGIC ||
+            le64toh(header->rl_epoch) != log->epoch) {
+            break;
+        }
+
+        uint32_t count = le32toh(header->rl_count);
+
+        for (uint32_t i = 0; i < count && i < DDFS_REFLOG_ENTRIES; i++) {
+            pending_add(log, le64toh(deltas[i].rd_block),
+                (int64_t)le64toh(deltas[i].rd_delta));
+        }
+    }
+
+    if (ret != EXIT_SUCCESS) {
+        pthread_mutex_destroy(&log->lock);
+        ddfs_free(log->block);
+        ddfs_free(log->pending);
+        ddfs_free(log);
+        return EXIT_FAILURE;
+    }
+
+    volume->reflog = log;
+
+    // Read-only volumes keep the replayed deltas in memory
+    if (volume->writable && apply_locked(fd, log) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    reset_block(log);
+    return EXIT_SUCCESS;
+}
+
+// Drop a volume's log without applying it
+void free_reference_log(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->reflog == NULL) {
+        return;
+    }
+
+    // The collector works on the log
+    free_reclaim_queue(fd);
+    pthread_mutex_destroy(&volume->reflog->lock);
+    ddfs_free(volume->reflog->block);
+    ddfs_free(volume->reflog->pending);
+    ddfs_free(volume->reflog);
+    volume->reflog = NULL;
+}
+
+// Write the deltas still in memory to the on-disk log
+int flush_reference_log(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->reflog == NULL || !volume->writable) {
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_reflog *log = volume->reflog;
+    int ret = EXIT_SUCCESS;
+
+    pthread_mutex_lock(&log->lock);
+
+    if (((struct ddfs_reflog_header *)log->block)->rl_count != 0) {
+        ret = write_log_block(fd, log);
+    }
+
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
+
+// Make the deltas logged so far durable. Journaled volumes do so before
+// they commit or checkpoint metadata that refers to the blocks.
+int sync_reference_log(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->reflog == NULL || !volume->writable) {
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_reflog *log = volume->reflog;
+    int ret = EXIT_SUCCESS;
+
+    pthread_mutex_lock(&log->lock);
+
+    if (log->unsynced) {
+        if (((struct ddfs_reflog_header *)log->block)->rl_count != 0) {
+            ret = write_log_block(fd, log);
+        }
+
+        if (ret == EXIT_SUCCESS) {
+            ret = flush_volume(fd);
+        }
+
+        log->unsynced = ret != EXIT_SUCCESS;
+    }
+
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
+
+// Fold the volume's logged deltas into the reference count table
+int apply_reference_log(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->reflog == NULL || !volume->writable) {
+        return EXIT_SUCCESS;
+    }
+
+    pthread_mutex_lock(&volume->reflog->lock);
+    int ret = apply_locked(fd, volume->reflog);
+    pthread_mutex_unlock(&volume->reflog->lock);
+    return ret;
+}
+
+// Append count changes to a volume's log, applying the log to the table
+// once it fills. The caller holds the log's lock.
+static int append_locked(int fd, struct ddfs_reflog *log,
+    struct ddfs_ref_delta *changes, uint32_t count) {
+    struct ddfs_reflog_header *header =
+        (struct ddfs_reflog_header *)log->block;
+    struct ddfs_ref_delta *deltas = (struct ddfs_ref_delta *)(header + 1);
+
+    for (uint32_t i = 0; i < count; i++) {
+        // A full log goes to the table before it takes more deltas
+        if (log->tail == DDFS_REFLOG_BLOCKS && 
+            apply_locked(fd, log) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+
+        uint32_t entry = le32toh(header->rl_count);
+
+        pending_add(log, changes[i].rd_block, changes[i].rd_delta);
+        deltas[entry].rd_block = htole64(changes[i].rd_block);
+        deltas[entry].rd_delta = (int64_t)htole64(
+            (uint64_t)changes[i].rd_delta);
+        header->rl_count = htole32(++entry);
+        log->unsynced = 1;
+
+        // A full block goes to the log. Its deltas stay pending in
+        // memory, so a failed write only costs crash recovery.
+        if (entry == DDFS_REFLOG_ENTRIES) {
+            int ret = write_log_block(fd, log);
+
+            log->tail++;
+            reset_block(log);
+
+            if (ret != EXIT_SUCCESS) {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Apply count reference count changes. Volumes append them to their log
+// and apply the log to the table once it fills; plain descriptors sort
+// them and update each table block once.
+int adjust_reference_counts(int fd, struct ddfs_ref_delta *changes,
+    uint32_t count) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->reflog == NULL) {
+        struct ddfs_superblock *sb = get_superblock(fd);
+
+        if (sb == NULL) {
+            return EXIT_FAILURE;
+        }
+
+        uint64_t table_block = le64toh(sb->info.fs_ref_offset) /
+            DDFS_BLOCK_SIZE;
+        uint64_t block_count = le64toh(sb->info.fs_block_count);
+        put_block_buffer(sb);
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (changes[i].rd_block == 0 ||
+                changes[i].rd_block >= block_count) {
+                return EXIT_FAILURE;
+            }
+        }
+
+        qsort(changes, count, sizeof(struct ddfs_ref_delta), compare_deltas);
+        pthread_mutex_lock(&table_lock);
+        int ret = table_adjust(fd, table_block, changes, count, 0);
+        pthread_mutex_unlock(&table_lock);
+        return ret;
+    }
+
+    struct ddfs_reflog *log = volume->reflog;
+
+    if (!volume->writable) {
+        return EXIT_FAILURE;
+    }
+
+    note_gc_activity(fd);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (changes[i].rd_block == 0 ||
+            changes[i].rd_block >= log->block_count) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    pthread_mutex_lock(&log->lock);
+    int ret = append_locked(fd, log, changes, count);
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
+
+// Add delta to a block's reference count
+int adjust_reference_count(int fd, uint64_t block_number, int64_t delta) {
+    struct ddfs_ref_delta change = {
+        .rd_block = block_number,
+        .rd_delta = delta
+    };
+
+    return adjust_reference_counts(fd, &change, 1);
+}
+
+int increment_reference_count(int fd, uint64_t block_number) {
+    return adjust_reference_count(fd, block_number, 1);
+}
+
+int decrement_reference_count(int fd, uint64_t block_number) {
+    return adjust_reference_count(fd, block_number, -1);
+}
+
+// Find where a descriptor's reference counts live and how many blocks
+// they cover. log is NULL for plain descriptors.
+static int locate_table(int fd, struct ddfs_reflog **log,
+    uint64_t *table_block, uint64_t *block_count) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    *log = volume != NULL ? volume->reflog : NULL;
+
+    if (*log != NULL) {
+        *table_block = (*log)->table_block;
+        *block_count = (*log)->block_count;
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    *table_block = le64toh(sb->info.fs_ref_offset) / DDFS_BLOCK_SIZE;
+    *block_count = le64toh(sb->info.fs_block_count);
+    put_block_buffer(sb);
+    return EXIT_SUCCESS;
+}
+
+// Get a block's count from the table and the pending deltas. The caller
+// holds the log's lock.
+static int64_t count_locked(int fd, struct ddfs_reflog *log,
+    uint64_t table_block, uint64_t block_number) {
+    int64_t value = table_get(fd, table_block, block_number);
+
+    if (value == -1) {
+        return -1;
+    }
+
+    if (log != NULL) {
+        value += pending_slot(log, block_number)->rd_delta;
+    }
+
+    return value < 0 ? 0 : value > UINT32_MAX ? UINT32_MAX : value;
+}
+
+// Get a block's reference count including the deltas not applied yet, or
+// -1 on error
+int64_t get_reference_count(int fd, uint64_t block_number) {
+    struct ddfs_reflog *log;
+    uint64_t table_block, block_count;
+
+    if (locate_table(fd, &log, &table_block, &block_count) != 
+        EXIT_SUCCESS || block_number == 0 || block_number >= block_count) {
+        return -1;
+    }
+
+    pthread_mutex_lock(count_lock(log));
+
+    int64_t value = count_locked(fd, log, table_block, block_number);
+
+    pthread_mutex_unlock(count_lock(log));
+
+    return value;
+}
+
+// Take a reference to each of count blocks, setting previous[i] to the
+// count blocks[i] had before plus the views pinning it, so a block a view
+// still reads is not taken for unused. The counts are read and changed in
+// one hold of the lock counts change under, so a block found unreferenced
+// cannot be reclaimed before the caller has written it.
+int take_references(int fd, uint64_t *blocks, uint32_t count,
+    int64_t *previous) {
+    struct ddfs_volume *volume = get_volume(fd);
+    struct ddfs_scratch *scratch = get_scratch();
+    struct ddfs_reflog *log;
+    uint64_t table_block, block_count;
+
+    if (count == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    if (scratch == NULL || locate_table(fd, &log, &table_block,
+        &block_count) != EXIT_SUCCESS ||
+        (log != NULL && !volume->writable)) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_arena_mark mark = arena_mark(&scratch->arena);
+    struct ddfs_ref_delta *changes = arena_alloc(&scratch->arena, 
+        count * sizeof(struct ddfs_ref_delta), sizeof(uint64_t));
+    int ret = changes != NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    for (uint32_t i = 0; ret == EXIT_SUCCESS && i < count; i++) {
+        if (blocks[i] == 0 || blocks[i] >= block_count) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        changes[i].rd_block = blocks[i];
+        changes[i].rd_delta = 1;
+    }
+
+    if (ret != EXIT_SUCCESS) {
+        arena_reset(&scratch->arena, mark);
+        return EXIT_FAILURE;
+    }
+
+    if (log != NULL) {
+        note_gc_activity(fd);
+    } else {
+        qsort(changes, count, sizeof(struct ddfs_ref_delta), compare_deltas);
+    }
+
+    pthread_mutex_lock(count_lock(log));
+
+    // Every count is read before any changes, so a block listed twice
+    // reports its count from before the call both times
+    for (uint32_t i = 0; i < count; i++) {
+        previous[i] = count_locked(fd, log, table_block, blocks[i]);
+
+        if (previous[i] == -1) {
+            ret = EXIT_FAILURE;
+        } else {
+            previous[i] += get_pins(volume, blocks[i]);
+        }
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        ret = log != NULL ? append_locked(fd, log, changes, count) :
+            table_adjust(fd, table_block, changes, count, 0);
+    }
+
+    pthread_mutex_unlock(count_lock(log));
+    arena_reset(&scratch->arena, mark);
+    return ret;
+}
+
+// Count the blocks among count adjacent ones that keys refer to, reading
+// each table block they span once
+int64_t count_live_blocks(int fd, uint64_t block_number, uint64_t count) {
+    struct ddfs_reflog *log;
+    uint64_t table_block, block_count;
+
+    if (locate_table(fd, &log, &table_block, &block_count) != 
+        EXIT_SUCCESS || block_number == 0 || count > block_count ||
+        block_number > block_count - count) {
+        return -1;
+    }
+
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(count_lock(log));
+
+    int64_t live = 0;
+    uint32_t *counts = NULL;
+
+    for (uint64_t b = block_number; b < block_number + count; b++) {
+        uint32_t index = b % DDFS_REFS_PER_BLOCK;
+
+        if (counts == NULL || index == 0) {
+            uint64_t table_number = table_block + (b / DDFS_REFS_PER_BLOCK);
+
+            counts = (uint32_t *)get_block_address(fd, table_number, 1, 0);
+
+            if (counts == NULL) {
+                if (read_block(fd, buffer, table_number) != 
+                    DDFS_BLOCK_SIZE) {
+                    live = -1;
+                    break;
+                }
+
+                counts = (uint32_t *)buffer;
+            }
+        }
+
+        int64_t value = le32toh(counts[index]);
+
+        if (log != NULL) {
+            value += pending_slot(log, b)->rd_delta;
+        }
+
+        if (value > 0) {
+            live++;
+        }
+    }
+
+    pthread_mutex_unlock(count_lock(log));
+
+    put_block_buffer(buffer);
+    return live;
+}
+
+// Hand the blocks among count data blocks that nothing refers to any more
+// to the volume's reclaim queue, or reclaim them right away when there is
+// none. Log-structured volumes leave dead blocks to the segment cleaner.
+static int reclaim_unused(int fd, uint64_t *blocks, uint32_t count) {
+    struct ddfs_scratch *scratch = get_scratch();
+
+    if (count == 0 || log_structured(fd)) {
+        return EXIT_SUCCESS;
+    }
+
+    if (scratch == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_arena_mark mark = arena_mark(&scratch->arena);
+    uint64_t *unused = arena_alloc(&scratch->arena, 
+        count * sizeof(uint64_t), sizeof(uint64_t));
+    uint32_t unused_count = 0;
+    int ret = unused != NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    for (uint32_t i = 0; unused != NULL && i < count; i++) {
+        int64_t value = get_reference_count(fd, blocks[i]);
+
+        if (value == 0) {
+            unused[unused_count++] = blocks[i];
+        } else if (value == -1) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (unused_count != 0 && 
+        queue_reclaim(fd, unused, unused_count) != EXIT_SUCCESS &&
+        reclaim_blocks(fd, unused, unused_count) != EXIT_SUCCESS) {
+        ret = EXIT_FAILURE;
+    }
+
+    arena_reset(&scratch->arena, mark);
+    return ret;
+}
+
+// Drop one reference to each of count data blocks, reclaiming the blocks
+// nothing refers to any more
+static int drop_references(int fd, uint64_t *blocks, uint32_t count) {
+    struct ddfs_scratch *scratch = get_scratch();
+
+    if (count == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    if (scratch == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_arena_mark mark = arena_mark(&scratch->arena);
+    struct ddfs_ref_delta *changes = arena_alloc(&scratch->arena, 
+        count * sizeof(struct ddfs_ref_delta), sizeof(uint64_t));
+    int ret = EXIT_FAILURE;
+
+    if (changes != NULL) {
+        for (uint32_t i = 0; i < count; i++) {
+            changes[i].rd_block = blocks[i];
+            changes[i].rd_delta = -1;
+        }
+
+        if (adjust_reference_counts(fd, changes, count) == EXIT_SUCCESS) {
+            ret = reclaim_unused(fd, blocks, count);
+        }
+    }
+
+    arena_reset(&scratch->arena, mark);
+    return ret;
+}
+
+// Drop the references the journal held for changes committed since
+int release_held_blocks(int fd) {
+    uint64_t blocks[256];
+    uint32_t count;
+    int ret = EXIT_SUCCESS;
+
+    do {
+        count = journal_take_held(fd, blocks, 256);
+
+        if (drop_references(fd, blocks, count) != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+    } while (count == 256);
+
+    return ret;
+}
+
+// Drop one reference to each of count data blocks a change no longer
+// refers to. While the change is not committed, the journal holds the
+// references, so the blocks outlive a crash that rolls the change back.
+int release_blocks(int fd, uint64_t *blocks, uint32_t count) {
+    if (count == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    int held = journal_hold(fd, blocks, count);
+
+    if (held == -1 || release_held_blocks(fd) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    return held == 1 ? EXIT_SUCCESS : drop_references(fd, blocks, count);
+}
+
+// Drop a reference to a data block
+int release_block(int fd, uint64_t block_number) {
+    return release_blocks(fd, &block_number, 1);
+}
+
+// Return a run of unreferenced blocks to the storage. Volumes with a
+// discard policy discard runs of at least their minimum extent and leave
+// shorter runs, or storage that cannot discard, as they are: stale data
+// only ever matches its own fingerprint, so a later put of the same value
+// finds it intact and anything else overwrites it. Other volumes zero the
+// run.
+static int reclaim_run(int fd, uint64_t block_number, uint64_t count) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->discard_min == 0) {
+        return zero_blocks(fd, block_number, count);
+    }
+
+    if (count >= volume->discard_min) {
+        discard_blocks(fd, block_number, count);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Reclaim the blocks among count data blocks that no key refers to and no
+// view pins, a run of adjacent blocks at a time. The lock counts change
+// under is held from a run's checks until it is reclaimed, so no
+// reference can be taken in between, and is let go between runs. Pinned
+// blocks are reclaimed when their last pin goes. blocks is sorted in
+// place.
+int reclaim_blocks(int fd, uint64_t *blocks, uint32_t count) {
+    struct ddfs_volume *volume = get_volume(fd);
+    struct ddfs_reflog *log;
+    uint64_t table_block, block_count;
+
+    if (locate_table(fd, &log, &table_block, &block_count) != 
+        EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    qsort(blocks, count, sizeof(uint64_t), compare_blocks);
+
+    int ret = EXIT_SUCCESS;
+    uint32_t i = 0;
+
+    while (i < count) {
+        pthread_mutex_lock(count_lock(log));
+
+        // Find the next block nothing refers to, skipping duplicates
+        while (i < count && ((i != 0 && blocks[i] == blocks[i - 1]) ||
+            blocks[i] == 0 || blocks[i] >= block_count ||
+            count_locked(fd, log, table_block, blocks[i]) != 0 ||
+            get_pins(volume, blocks[i]) != 0)) {
+            i++;
+        }
+
+        uint64_t run_start = i < count ? blocks[i] : 0;
+        uint64_t run_length = i < count ? 1 : 0;
+
+        // Extend the run over the adjacent blocks that follow it
+        for (i++; i < count; i++) {
+            if (blocks[i] == blocks[i - 1]) {
+                continue;
+            }
+
+            if (blocks[i] != run_start + run_length || 
+                blocks[i] >= block_count ||
+                count_locked(fd, log, table_block, blocks[i]) != 0 ||
+                get_pins(volume, blocks[i]) != 0) {
+                break;
+            }
+
+            run_length++;
+        }
+
+        if (run_length != 0 && 
+            reclaim_run(fd, run_start, run_length) != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+
+        pthread_mutex_unlock(count_lock(log));
+    }
+
+    return ret;
+}
+
+// Pin a data block for a view. The caller holds the locks of a key that
+// refers to the block, so the block cannot be reclaimed before the pin is
+// in place. Only volumes opened with ddfs_open() or ddfs_open_memory()
+// keep pins.
+int pin_block(int fd, uint64_t block_number) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL) {
+        errno = EINVAL;
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_lock(&volume->pin_lock);
+
+    uint32_t i = pin_index(volume, block_number);
+    int ret = EXIT_SUCCESS;
+
+    if (i < volume->pin_count &&
+        volume->pins[i].block_number == block_number) {
+        volume->pins[i].count++;
+        pthread_mutex_unlock(&volume->pin_lock);
+        return EXIT_SUCCESS;
+    }
+
+    if (volume->pin_count == volume->pin_capacity) {
+        struct ddfs_pin *pins = ddfs_realloc(volume->pins,
+            (volume->pin_capacity + 64) * sizeof(struct ddfs_pin));
+
+        if (pins != NULL) {
+            volume->pins = pins;
+            volume->pin_capacity += 64;
+        } else {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        memmove(&volume->pins[i + 1], &volume->pins[i],
+            (volume->pin_count - i) * sizeof(struct ddfs_pin));
+        volume->pins[i].block_number = block_number;
+        volume->pins[i].count = 1;
+        __atomic_store_n(&volume->pin_count, volume->pin_count + 1,
+            __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&volume->pin_lock);
+    return ret;
+}
+
+// Drop a view's pin of a data block. A block that lost its last key while
+// pinned is reclaimed once its last pin goes.
+int unpin_block(int fd, uint64_t block_number) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL) {
+        errno = EINVAL;
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_lock(&volume->pin_lock);
+
+    uint32_t i = pin_index(volume, block_number);
+    int unpinned = 0;
+
+    if (i < volume->pin_count &&
+        volume->pins[i].block_number == block_number &&
+        --volume->pins[i].count == 0) {
+        memmove(&volume->pins[i], &volume->pins[i + 1],
+            (volume->pin_count - i - 1) * sizeof(struct ddfs_pin));
+        __atomic_store_n(&volume->pin_count, volume->pin_count - 1,
+            __ATOMIC_RELEASE);
+        unpinned = 1;
+    }
+
+    pthread_mutex_unlock(&volume->pin_lock);
+
+    if (!unpinned || !volume->writable) {
+        return EXIT_SUCCESS;
+    }
+
+    return reclaim_unused(fd, &block_number, 1);
+}
+
+// Check whether views pin any of count adjacent blocks
+int blocks_pinned(int fd, uint64_t block_number, uint64_t count) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL ||
+        __atomic_load_n(&volume->pin_count, __ATOMIC_ACQUIRE) == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&volume->pin_lock);
+
+    uint32_t i = pin_index(volume, block_number);
+    int pinned = i < volume->pin_count &&
+        volume->pins[i].block_number < block_number + count;
+
+    pthread_mutex_unlock(&volume->pin_lock);
+    return pinned;
+}
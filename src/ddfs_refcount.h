@@ -0,0 +1,100 @@
+#ifndef ddfs_REFCOUNT_H
+#define	ddfs_REFCOUNT_H
+
+#include <pthread.h>
+
+#include "ddfs.h"
+
+#define DDFS_REFS_PER_BLOCK ((DDFS_BLOCK_SIZE - sizeof(uint64_t)) / \
+    sizeof(uint32_t)) // Counts per table block, which ends in the epoch
+                      // of the last log applied to it
+#define DDFS_REFLOG_BLOCKS ((256 << 10) / DDFS_BLOCK_SIZE) // Log blocks,
+                                                          // header included
+#define DDFS_REFLOG_MAGIC 0x5EF106
+#define DDFS_REFLOG_ENTRIES ((DDFS_BLOCK_SIZE - \
+    sizeof(struct ddfs_reflog_header)) / sizeof(struct ddfs_ref_delta))
+
+// Starts the log's first block, which holds no deltas, and every delta
+// block. Delta blocks only count while their epoch matches the first
+// block's; bumping it after the deltas reach the table empties the log.
+struct ddfs_reflog_header {
+    uint32_t rl_magic; // DDFS_REFLOG_MAGIC
+    uint32_t rl_count; // Number of deltas in the block
+    uint64_t rl_epoch; // Epoch the block was written in
+};
+
+// A change to one block's reference count
+struct ddfs_ref_delta {
+    uint64_t rd_block; // Physical block number
+    int64_t rd_delta; // Change to its reference count
+};
+
+// A data block views hold in memory. Pins are not references: they are
+// never written, so a crash cannot leak them, but a pinned block is not
+// reclaimed, overwritten or moved until the last pin goes.
+struct ddfs_pin {
+    uint64_t block_number; // Block the views read
+    uint32_t count; // Number of views holding it
+};
+
+// Reference count deltas of a volume that have not reached the table yet.
+// The newest deltas sit in block until it fills and is appended to the
+// on-disk log; pending sums every delta, logged or not, per block.
+struct ddfs_reflog {
+    pthread_mutex_t lock; // Serializes changes to the log
+    uint64_t epoch; // Epoch of the on-disk log
+    uint64_t first_block; // First block of the on-disk log
+    uint64_t table_block; // First block of the reference count table
+    uint64_t block_count; // Number of blocks the table covers
+    uint32_t tail; // Log block the next full delta block goes to
+    uint8_t *block; // Delta block being filled
+    struct ddfs_ref_delta *pending; // Open addressed net deltas by block
+    uint32_t pending_count; // Number of blocks in pending
+    uint8_t unsynced; // Whether deltas were logged since the last flush
+};
+
+extern int initialize_reference_log(int fd, struct ddfs_superblock *sb);
+
+extern int load_reference_log(int fd);
+
+extern void free_reference_log(int fd);
+
+extern int flush_reference_log(int fd);
+
+extern int sync_reference_log(int fd);
+
+extern int apply_reference_log(int fd);
+
+extern int adjust_reference_counts(int fd, struct ddfs_ref_delta *changes,
+    uint32_t count);
+
+extern int adjust_reference_count(int fd, uint64_t block_number,
+    int64_t delta);
+
+extern int increment_reference_count(int fd, uint64_t block_number);
+
+extern int decrement_reference_count(int fd, uint64_t block_number);
+
+extern int64_t get_reference_count(int fd, uint64_t block_number);
+
+extern int take_references(int fd, uint64_t *blocks, uint32_t count,
+    int64_t *previous);
+
+extern int64_t count_live_blocks(int fd, uint64_t block_number,
+    uint64_t count);
+
+extern int release_blocks(int fd, uint64_t *blocks, uint32_t count);
+
+extern int release_block(int fd, uint64_t block_number);
+
+extern int release_held_blocks(int fd);
+
+extern int reclaim_blocks(int fd, uint64_t *blocks, uint32_t count);
+
+extern int pin_block(int fd, uint64_t block_number);
+
+extern int unpin_block(int fd, uint64_t block_number);
+
+extern int blocks_pinned(int fd, uint64_t block_number, uint64_t count);
+
+#endif
@@ -0,0 +1,1033 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ddfs_snapshot.h"
+#include "ddfs_alloc.h"
+#include "ddfs_group.h"
+#include "ddfs_inode.h"
+#include "ddfs_lock.h"
+#include "ddfs_refcount.h"
+#include "ddfs_volume.h"
+
+#define DDFS_SNAPSHOT_INODES (DDFS_BLOCK_SIZE / sizeof(struct ddfs_inode))
+#define DDFS_SNAPSHOT_BITS (DDFS_BLOCK_SIZE * 8) // Pool pages per bitmap
+                                                  // block
+
+// Blocks the snapshot region of an index of istore_block_count blocks and
+// a pool of pool_pages pages takes: the table, the pool bitmap, the maps
+// and the pool
+uint64_t get_snapshot_block_count(uint64_t istore_block_count,
+    uint64_t pool_pages) {
+    return 1 + div_ceil(pool_pages, DDFS_SNAPSHOT_BITS) +
+        (DDFS_SNAPSHOT_MAX * div_ceil(istore_block_count,
+        DDFS_SNAPSHOT_MAP_ENTRIES)) + pool_pages;
+}
+
+static struct ddfs_snapshots *get_snapshots(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    return volume != NULL ? volume->snapshots : NULL;
+}
+
+// Write an empty snapshot table to a freshly zeroed snapshot region
+int initialize_snapshots(int fd, struct ddfs_superblock *sb) {
+    if (le64toh(sb->info.fs_snapshot_block_count) == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_snapshot_table *table =
+        (struct ddfs_snapshot_table *)get_block_buffer();
+
+    if (table == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    memset(table, 0, DDFS_BLOCK_SIZE);
+    table->st_magic = htole32(DDFS_SNAPSHOT_MAGIC);
+    table->st_next_id = htole64(1);
+
+    int ret = write_block(fd, table,
+        le64toh(sb->info.fs_snapshot_offset) / DDFS_BLOCK_SIZE);
+
+    put_block_buffer(table);
+    return ret == DDFS_BLOCK_SIZE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int page_shared(struct ddfs_snapshots *snapshots, uint64_t page) {
+    return (__atomic_load_n(&snapshots->shared[page / 64],
+        __ATOMIC_ACQUIRE) >> (page % 64)) & 1;
+}
+
+static void set_page_shared(struct ddfs_snapshots *snapshots,
+    uint64_t page, int shared) {
+    if (shared) {
+        __atomic_fetch_or(&snapshots->shared[page / 64],
+            1ULL << (page % 64), __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_and(&snapshots->shared[page / 64],
+            ~(1ULL << (page % 64)), __ATOMIC_RELEASE);
+    }
+}
+
+// Get the table slot of a snapshot, or -1
+static int find_slot(struct ddfs_snapshots *snapshots, uint64_t id) {
+    for (int i = 0; id != 0 && i < DDFS_SNAPSHOT_MAX; i++) {
+        if (le64toh(snapshots->table->st_entries[i].se_id) == id) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Get the slot of the oldest snapshot newer than a slot's, or of the
+// newest snapshot when slot is -1, or -1 if there is none
+static int newer_slot(struct ddfs_snapshots *snapshots, int slot) {
+    uint64_t id = slot != -1 ?
+        le64toh(snapshots->table->st_entries[slot].se_id) : 0;
+    int found = -1;
+
+    for (int i = 0; i < DDFS_SNAPSHOT_MAX; i++) {
+        uint64_t other = le64toh(snapshots->table->st_entries[i].se_id);
+
+        if (other == 0 || (slot != -1 && other <= id)) {
+            continue;
+        }
+
+        uint64_t best = found != -1 ?
+            le64toh(snapshots->table->st_entries[found].se_id) : 0;
+
+        if (found == -1 || (slot != -1 ? other < best : other > best)) {
+            found = i;
+        }
+    }
+
+    return found;
+}
+
+// Get the slot of the newest snapshot older than a slot's, or -1
+static int older_slot(struct ddfs_snapshots *snapshots, int slot) {
+    uint64_t id = le64toh(snapshots->table->st_entries[slot].se_id);
+    int found = -1;
+
+    for (int i = 0; i < DDFS_SNAPSHOT_MAX; i++) {
+        uint64_t other = le64toh(snapshots->table->st_entries[i].se_id);
+
+        if (other != 0 && other < id && (found == -1 || other >
+            le64toh(snapshots->table->st_entries[found].se_id))) {
+            found = i;
+        }
+    }
+
+    return found;
+}
+
+static int write_table(int fd, struct ddfs_snapshots *snapshots) {
+    return write_block(fd, snapshots->table, snapshots->table_block) ==
+        DDFS_BLOCK_SIZE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Get the map block holding a page's entry in a slot's map
+static uint64_t get_map_block(struct ddfs_snapshots *snapshots, int slot,
+    uint64_t page) {
+    return snapshots->map_block + (slot * snapshots->map_blocks) +
+        (page / DDFS_SNAPSHOT_MAP_ENTRIES);
+}
+
+static int read_map_entry(int fd, struct ddfs_snapshots *snapshots,
+    int slot, uint64_t page, uint32_t *entry) {
+    uint32_t *map = (uint32_t *)get_block_buffer();
+
+    if (map == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    int ret = read_block(fd, map, get_map_block(snapshots, slot, page));
+    *entry = le32toh(map[page % DDFS_SNAPSHOT_MAP_ENTRIES]);
+    put_block_buffer(map);
+
+    return ret == DDFS_BLOCK_SIZE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int write_map_entry(int fd, struct ddfs_snapshots *snapshots,
+    int slot, uint64_t page, uint32_t entry) {
+    uint64_t block_number = get_map_block(snapshots, slot, page);
+    uint32_t *map = (uint32_t *)get_block_buffer();
+    int ret = -1;
+
+    if (map != NULL && read_block(fd, map, block_number) ==
+        DDFS_BLOCK_SIZE) {
+        map[page % DDFS_SNAPSHOT_MAP_ENTRIES] = htole32(entry);
+        ret = write_block(fd, map, block_number);
+    }
+
+    put_block_buffer(map);
+    return ret == DDFS_BLOCK_SIZE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Write the pool bitmap block holding a page's bit
+static int write_pool_bit(int fd, struct ddfs_snapshots *snapshots,
+    uint64_t page) {
+    uint64_t bitmap_block = page / DDFS_SNAPSHOT_BITS;
+
+    return write_block(fd, snapshots->pool_used +
+        (bitmap_block * DDFS_BLOCK_SIZE), snapshots->bitmap_block +
+        bitmap_block) == DDFS_BLOCK_SIZE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Take a free pool page, or return -1 when the pool is full
+static int64_t alloc_pool_page(int fd, struct ddfs_snapshots *snapshots) {
+    for (uint64_t i = 0; i < snapshots->pool_pages; i++) {
+        uint64_t page = (snapshots->pool_hint + i) % snapshots->pool_pages;
+        uint8_t mask = 1 << (page % 8);
+
+        if (snapshots->pool_used[page / 8] & mask) {
+            continue;
+        }
+
+        snapshots->pool_used[page / 8] |= mask;
+
+        if (write_pool_bit(fd, snapshots, page) != EXIT_SUCCESS) {
+            snapshots->pool_used[page / 8] &= ~mask;
+            return -1;
+        }
+
+        snapshots->pool_hint = page + 1;
+        snapshots->pool_used_count++;
+        return page;
+    }
+
+    errno = ENOSPC;
+    return -1;
+}
+
+static int free_pool_page(int fd, struct ddfs_snapshots *snapshots,
+    uint64_t page) {
+    snapshots->pool_used[page / 8] &= ~(1 << (page % 8));
+    snapshots->pool_used_count--;
+    return write_pool_bit(fd, snapshots, page);
+}
+
+// Collect the data blocks the keys of an inode store block refer to.
+// Inode 0 belongs to the superblock and is skipped.
+static uint32_t get_page_blocks(struct ddfs_snapshots *snapshots,
+    uint64_t page, uint8_t *buffer, uint64_t *blocks) {
+    struct ddfs_inode *inodes = (struct ddfs_inode *)buffer;
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < DDFS_SNAPSHOT_INODES; i++) {
+        uint64_t inode_number = (page * DDFS_SNAPSHOT_INODES) + i;
+
+        if (inode_number != 0 && inode_number < snapshots->inode_count &&
+            inodes[i].info.i_block_ptr != 0) {
+            blocks[count++] = inodes[i].info.i_block_ptr;
+        }
+    }
+
+    return count;
+}
+
+static int compare_blocks(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Take a reference to each of count blocks with one delta per distinct
+// block. Values shared by several keys of a page often repeat.
+static int reference_blocks(int fd, uint64_t *blocks, uint32_t count) {
+    struct ddfs_ref_delta changes[DDFS_SNAPSHOT_INODES];
+    uint32_t change_count = 0;
+
+    qsort(blocks, count, sizeof(uint64_t), compare_blocks);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (change_count != 0 &&
+            changes[change_count - 1].rd_block == blocks[i]) {
+            changes[change_count - 1].rd_delta++;
+            continue;
+        }
+
+        changes[change_count].rd_block = blocks[i];
+        changes[change_count++].rd_delta = 1;
+    }
+
+    return adjust_reference_counts(fd, changes, change_count);
+}
+
+// Drop a pool page, releasing the references its keys held
+static int drop_pool_page(int fd, struct ddfs_snapshots *snapshots,
+    uint64_t page, uint64_t pool_page, uint8_t *buffer) {
+    uint64_t blocks[DDFS_SNAPSHOT_INODES];
+
+    if (read_block(fd, buffer, snapshots->pool_block + pool_page) !=
+        DDFS_BLOCK_SIZE) {
+        return EXIT_FAILURE;
+    }
+
+    uint32_t count = get_page_blocks(snapshots, page, buffer, blocks);
+
+    if (release_blocks(fd, blocks, count) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    return free_pool_page(fd, snapshots, pool_page);
+}
+
+// Copy an inode store block the newest snapshot shares to the pool before
+// it changes. A block without keys is only marked empty in the map, so
+// the pool holds nothing but pages with keys. The caller holds the lock.
+static int preserve_locked(int fd, struct ddfs_snapshots *snapshots,
+    uint64_t page) {
+    if (!page_shared(snapshots, page)) {
+        return EXIT_SUCCESS;
+    }
+
+    int state = get_group_state(fd, NULL,
+        get_inode_group(page * DDFS_SNAPSHOT_INODES));
+    uint8_t *buffer = get_block_buffer();
+    uint64_t blocks[DDFS_SNAPSHOT_INODES];
+    uint32_t count = 0;
+    uint32_t entry = DDFS_SNAPSHOT_EMPTY;
+    int64_t pool_page = -1;
+
+    // An uninitialized group holds no keys, whatever its blocks hold
+    if (state == -1 || buffer == NULL || (state == 1 && read_block(fd,
+        buffer, snapshots->istore_block + page) != DDFS_BLOCK_SIZE)) {
+        put_block_buffer(buffer);
+        return EXIT_FAILURE;
+    }
+
+    if (state == 1) {
+        count = get_page_blocks(snapshots, page, buffer, blocks);
+    }
+
+    if (count != 0) {
+        // The page is written before the bitmap and map name it, and a
+        // crash in between only leaks a pool page. The snapshot region is
+        // not journaled, so the page's references are made durable before
+        // the map names it, or a crash would leave the map on blocks a
+        // later delete can reclaim.
+        if ((pool_page = alloc_pool_page(fd, snapshots)) == -1 ||
+            write_block(fd, buffer, snapshots->pool_block + pool_page) !=
+            DDFS_BLOCK_SIZE || reference_blocks(fd, blocks, count) !=
+            EXIT_SUCCESS) {
+            if (pool_page != -1) {
+                free_pool_page(fd, snapshots, pool_page);
+            }
+
+            put_block_buffer(buffer);
+            return EXIT_FAILURE;
+        }
+
+        entry = pool_page + 1;
+
+        if (sync_reference_log(fd) != EXIT_SUCCESS) {
+            release_blocks(fd, blocks, count);
+            free_pool_page(fd, snapshots, pool_page);
+            put_block_buffer(buffer);
+            return EXIT_FAILURE;
+        }
+    }
+
+    put_block_buffer(buffer);
+
+    if (write_map_entry(fd, snapshots, newer_slot(snapshots, -1), page,
+        entry) != EXIT_SUCCESS) {
+        if (pool_page != -1) {
+            release_blocks(fd, blocks, count);
+            free_pool_page(fd, snapshots, pool_page);
+        }
+
+        return EXIT_FAILURE;
+    }
+
+    set_page_shared(snapshots, page, 0);
+    return EXIT_SUCCESS;
+}
+
+// Preserve the inode store blocks among count blocks about to be written
+// that the newest snapshot still shares. Volumes without snapshots only
+// pay for a check of the snapshot count.
+int preserve_index_pages(int fd, uint64_t block_number, uint64_t count) {
+    struct ddfs_snapshots *snapshots = get_snapshots(fd);
+
+    if (snapshots == NULL ||
+        __atomic_load_n(&snapshots->count, __ATOMIC_ACQUIRE) == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    uint64_t first = snapshots->istore_block;
+    uint64_t end = first + snapshots->istore_block_count;
+
+    if (block_number > first) {
+        first = block_number;
+    }
+
+    if (block_number + count < end) {
+        end = block_number + count;
+    }
+
+    int ret = EXIT_SUCCESS;
+
+    for (uint64_t b = first; ret == EXIT_SUCCESS && b < end; b++) {
+        uint64_t page = b - snapshots->istore_block;
+
+        if (page_shared(snapshots, page)) {
+            pthread_mutex_lock(&snapshots->lock);
+            ret = preserve_locked(fd, snapshots, page);
+            pthread_mutex_unlock(&snapshots->lock);
+        }
+    }
+
+    return ret;
+}
+
+// Mark the pages the newest snapshot shares with the live index, those
+// its map has no entry for, or none when there are no snapshots
+static int load_shared(int fd, struct ddfs_snapshots *snapshots) {
+    int slot = newer_slot(snapshots, -1);
+    uint32_t *map = (uint32_t *)get_block_buffer();
+    int ret = map != NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    for (uint64_t p = 0; ret == EXIT_SUCCESS &&
+        p < snapshots->istore_block_count; p++) {
+        if (slot == -1) {
+            set_page_shared(snapshots, p, 0);
+            continue;
+        }
+
+        if (p % DDFS_SNAPSHOT_MAP_ENTRIES == 0 && read_block(fd, map,
+            get_map_block(snapshots, slot, p)) != DDFS_BLOCK_SIZE) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        set_page_shared(snapshots, p,
+            map[p % DDFS_SNAPSHOT_MAP_ENTRIES] == 0);
+    }
+
+    put_block_buffer(map);
+    return ret;
+}
+
+// Read a volume's snapshot table and pool bitmap and find the pages its
+// newest snapshot shares. Log-structured volumes have no snapshots, since
+// the cleaner moves the values they would refer to.
+int load_snapshots(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->snapshots != NULL) {
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_superblock *sb = get_superblock(fd);
+
+    if (sb == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    // Nothing to load until the volume is formatted
+    if (check_superblock(sb) != EXIT_SUCCESS ||
+        le64toh(sb->info.fs_snapshot_block_count) == 0) {
+        put_block_buffer(sb);
+        return EXIT_SUCCESS;
+    }
+
+    struct ddfs_snapshots *snapshots = ddfs_calloc(1,
+        sizeof(struct ddfs_snapshots));
+
+    if (snapshots == NULL) {
+        put_block_buffer(sb);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t pool_pages = le64toh(sb->info.fs_snapshot_pages);
+    uint64_t bitmap_blocks = div_ceil(pool_pages, DDFS_SNAPSHOT_BITS);
+
+    snapshots->istore_block = le64toh(sb->info.fs_istore_offset) /
+        DDFS_BLOCK_SIZE;
+    snapshots->istore_block_count =
+        le64toh(sb->info.fs_istore_block_count);
+    snapshots->inode_count = le64toh(sb->info.fs_inode_count);
+    snapshots->table_block = le64toh(sb->info.fs_snapshot_offset) /
+        DDFS_BLOCK_SIZE;
+    snapshots->bitmap_block = snapshots->table_block + 1;
+    snapshots->map_block = snapshots->bitmap_block + bitmap_blocks;
+    snapshots->map_blocks = div_ceil(snapshots->istore_block_count,
+        DDFS_SNAPSHOT_MAP_ENTRIES);
+    snapshots->pool_block = snapshots->map_block +
+        (DDFS_SNAPSHOT_MAX * snapshots->map_blocks);
+    snapshots->pool_pages = pool_pages;
+    snapshots->table = ddfs_memalign(DDFS_BLOCK_SIZE, DDFS_BLOCK_SIZE);
+    snapshots->pool_used = ddfs_memalign(DDFS_BLOCK_SIZE,
+        bitmap_blocks * DDFS_BLOCK_SIZE);
+    snapshots->shared = ddfs_calloc(
+        div_ceil(snapshots->istore_block_count, 64), sizeof(uint64_t));
+    put_block_buffer(sb);
+    pthread_mutex_init(&snapshots->lock, NULL);
+    volume->snapshots = snapshots;
+
+    int ret = EXIT_FAILURE;
+
+    if (snapshots->table != NULL && snapshots->pool_used != NULL &&
+        snapshots->shared != NULL && read_block(fd, snapshots->table,
+        snapshots->table_block) == DDFS_BLOCK_SIZE &&
+        le32toh(snapshots->table->st_magic) == DDFS_SNAPSHOT_MAGIC) {
+        ret = EXIT_SUCCESS;
+    }
+
+    for (uint64_t b = 0; ret == EXIT_SUCCESS && b < bitmap_blocks; b++) {
+        if (read_block(fd, snapshots->pool_used + (b * DDFS_BLOCK_SIZE),
+            snapshots->bitmap_block + b) != DDFS_BLOCK_SIZE) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    for (uint64_t p = 0; ret == EXIT_SUCCESS && p < pool_pages; p++) {
+        if (snapshots->pool_used[p / 8] & (1 << (p % 8))) {
+            snapshots->pool_used_count++;
+        }
+    }
+
+    for (int i = 0; ret == EXIT_SUCCESS && i < DDFS_SNAPSHOT_MAX; i++) {
+        if (snapshots->table->st_entries[i].se_id != 0) {
+            snapshots->count++;
+        }
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        ret = load_shared(fd, snapshots);
+    }
+
+    if (ret != EXIT_SUCCESS) {
+        free_snapshots(fd);
+    }
+
+    return ret;
+}
+
+// The table, the bitmap and the maps are written as they change, so there
+// is nothing to write back
+void free_snapshots(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->snapshots == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&volume->snapshots->lock);
+    ddfs_free(volume->snapshots->table);
+    ddfs_free(volume->snapshots->pool_used);
+    ddfs_free(volume->snapshots->shared);
+    ddfs_free(volume->snapshots);
+    volume->snapshots = NULL;
+}
+
+// Get a writable volume's snapshot state, or NULL with errno set
+static struct ddfs_snapshots *get_writable_snapshots(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->snapshots == NULL) {
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+
+    if (!volume->writable) {
+        errno = EROFS;
+        return NULL;
+    }
+
+    return volume->snapshots;
+}
+
+// Freeze the key index and return the new snapshot's id, or -1. Key
+// changes are held off while the snapshot is recorded, which only clears
+// its map and marks every page shared, so it takes the same time whatever
+// the number of keys; pages are copied as they change afterwards.
+int64_t create_snapshot(int fd) {
+    struct ddfs_snapshots *snapshots = get_writable_snapshots(fd);
+
+    if (snapshots == NULL) {
+        return -1;
+    }
+
+    struct ddfs_key_locks locks;
+    key_locks_init(&locks, fd);
+    key_locks_add_all(&locks);
+    lock_keys(&locks, 0);
+    pthread_mutex_lock(&snapshots->lock);
+
+    int64_t id = -1;
+    int slot;
+
+    for (slot = 0; slot < DDFS_SNAPSHOT_MAX; slot++) {
+        if (snapshots->table->st_entries[slot].se_id == 0) {
+            break;
+        }
+    }
+
+    if (slot == DDFS_SNAPSHOT_MAX) {
+        errno = ENOSPC;
+    } else if (zero_blocks(fd, get_map_block(snapshots, slot, 0),
+        snapshots->map_blocks) == EXIT_SUCCESS) {
+        struct ddfs_snapshot_entry *entry =
+            &snapshots->table->st_entries[slot];
+        uint64_t next_id = le64toh(snapshots->table->st_next_id);
+
+        entry->se_id = htole64(next_id);
+        entry->se_create_time = htole64(time(NULL));
+        snapshots->table->st_next_id = htole64(next_id + 1);
+
+        if (write_table(fd, snapshots) == EXIT_SUCCESS) {
+            for (uint64_t p = 0; p < snapshots->istore_block_count; p++) {
+                set_page_shared(snapshots, p, 1);
+            }
+
+            __atomic_store_n(&snapshots->count, snapshots->count + 1,
+                __ATOMIC_RELEASE);
+            id = next_id;
+        } else {
+            memset(entry, 0, sizeof(struct ddfs_snapshot_entry));
+            snapshots->table->st_next_id = htole64(next_id);
+        }
+    }
+
+    pthread_mutex_unlock(&snapshots->lock);
+    unlock_keys(&locks);
+    return id;
+}
+
+// Hand the pages the next older snapshot reads through a snapshot down to
+// it, writing each older map block before anything else changes. Pages
+// the older map already names were handed down by an earlier try. The
+// newest snapshot also records in shared which pages the older one will
+// share with the live index. The caller holds the lock.
+static int hand_down_pages(int fd, struct ddfs_snapshots *snapshots,
+    int slot, int older, uint64_t *shared) {
+    uint32_t *map = (uint32_t *)get_block_buffer();
+    uint32_t *older_map = (uint32_t *)get_block_buffer();
+    int ret = map != NULL && older_map != NULL ?
+        EXIT_SUCCESS : EXIT_FAILURE;
+
+    for (uint64_t m = 0; ret == EXIT_SUCCESS && m < snapshots->map_blocks;
+        m++) {
+        uint64_t first = m * DDFS_SNAPSHOT_MAP_ENTRIES;
+        int dirty = 0;
+
+        if (read_block(fd, map, get_map_block(snapshots, slot, first)) !=
+            DDFS_BLOCK_SIZE || (older != -1 && read_block(fd, older_map,
+            get_map_block(snapshots, older, first)) != DDFS_BLOCK_SIZE)) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        for (uint32_t i = 0; i < DDFS_SNAPSHOT_MAP_ENTRIES &&
+            first + i < snapshots->istore_block_count; i++) {
+            if (older != -1 && map[i] != 0 && older_map[i] == 0) {
+                older_map[i] = map[i];
+                dirty = 1;
+            }
+
+            if (shared != NULL && older != -1 && older_map[i] == 0) {
+                shared[(first + i) / 64] |= 1ULL << ((first + i) % 64);
+            }
+        }
+
+        if (dirty && write_block(fd, older_map, get_map_block(snapshots,
+            older, first)) != DDFS_BLOCK_SIZE) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    put_block_buffer(map);
+    put_block_buffer(older_map);
+    return ret;
+}
+
+// Drop the pool pages a deleted snapshot kept for itself, releasing the
+// references of their keys. Pages handed down to the older snapshot are
+// named by its map too and are left alone. The slot is free by now, so a
+// failure only leaks pages and is never retried. The caller holds the
+// lock.
+static int drop_snapshot_pages(int fd, struct ddfs_snapshots *snapshots,
+    int slot, int older) {
+    uint32_t *map = (uint32_t *)get_block_buffer();
+    uint32_t *older_map = (uint32_t *)get_block_buffer();
+    uint8_t *buffer = get_block_buffer();
+    int loaded = map != NULL && older_map != NULL && buffer != NULL;
+    int ret = loaded ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    // A page that cannot be dropped does not keep the others
+    for (uint64_t m = 0; loaded && m < snapshots->map_blocks; m++) {
+        uint64_t first = m * DDFS_SNAPSHOT_MAP_ENTRIES;
+
+        if (read_block(fd, map, get_map_block(snapshots, slot, first)) !=
+            DDFS_BLOCK_SIZE || (older != -1 && read_block(fd, older_map,
+            get_map_block(snapshots, older, first)) != DDFS_BLOCK_SIZE)) {
+            ret = EXIT_FAILURE;
+            continue;
+        }
+
+        for (uint32_t i = 0; i < DDFS_SNAPSHOT_MAP_ENTRIES &&
+            first + i < snapshots->istore_block_count; i++) {
+            uint32_t entry = le32toh(map[i]);
+
+            if (entry == 0 || entry == DDFS_SNAPSHOT_EMPTY ||
+                (older != -1 && older_map[i] == map[i])) {
+                continue;
+            }
+
+            if (drop_pool_page(fd, snapshots, first + i, entry - 1,
+                buffer) != EXIT_SUCCESS) {
+                ret = EXIT_FAILURE;
+            }
+        }
+    }
+
+    put_block_buffer(map);
+    put_block_buffer(older_map);
+    put_block_buffer(buffer);
+    return ret;
+}
+
+// Delete a snapshot. Pages the next older snapshot reads through this one
+// are handed down to it; the others go back to the pool and their keys'
+// references are released, so values only the snapshot kept are
+// reclaimed. The older map is written before the table entry goes, and
+// pages are only dropped after that, so a failure leaves the snapshot
+// whole and a retry hands down and drops each page once.
+int delete_snapshot(int fd, uint64_t id) {
+    struct ddfs_snapshots *snapshots = get_writable_snapshots(fd);
+
+    if (snapshots == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_lock(&snapshots->lock);
+
+    int slot = find_slot(snapshots, id);
+
+    if (slot == -1) {
+        pthread_mutex_unlock(&snapshots->lock);
+        errno = ENOENT;
+        return EXIT_FAILURE;
+    }
+
+    int older = older_slot(snapshots, slot);
+    int newest = newer_slot(snapshots, slot) == -1;
+    uint64_t *shared = newest ? ddfs_calloc(
+        div_ceil(snapshots->istore_block_count, 64), sizeof(uint64_t)) : NULL;
+    int ret = EXIT_FAILURE;
+
+    if ((!newest || shared != NULL) &&
+        hand_down_pages(fd, snapshots, slot, older, shared) ==
+        EXIT_SUCCESS) {
+        struct ddfs_snapshot_entry entry = snapshots->table->st_entries[slot];
+
+        memset(&snapshots->table->st_entries[slot], 0,
+            sizeof(struct ddfs_snapshot_entry));
+        ret = write_table(fd, snapshots);
+
+        if (ret != EXIT_SUCCESS) {
+            snapshots->table->st_entries[slot] = entry;
+        }
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        __atomic_store_n(&snapshots->count, snapshots->count - 1,
+            __ATOMIC_RELEASE);
+
+        // The older snapshot becomes the newest
+        for (uint64_t p = 0; newest && p < snapshots->istore_block_count;
+            p++) {
+            set_page_shared(snapshots, p, (shared[p / 64] >> (p % 64)) & 1);
+        }
+
+        ret = drop_snapshot_pages(fd, snapshots, slot, older);
+    }
+
+    pthread_mutex_unlock(&snapshots->lock);
+    ddfs_free(shared);
+    return ret;
+}
+
+// Get the ids of up to max snapshots, oldest first, and return how many
+// snapshots there are, or -1
+int64_t list_snapshots(int fd, uint64_t *ids, uint32_t max) {
+    struct ddfs_snapshots *snapshots = get_snapshots(fd);
+
+    if (snapshots == NULL) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    pthread_mutex_lock(&snapshots->lock);
+
+    uint32_t count = 0;
+
+    for (int slot = newer_slot(snapshots, -1); slot != -1;
+        slot = older_slot(snapshots, slot)) {
+        count++;
+    }
+
+    int slot = newer_slot(snapshots, -1);
+
+    for (uint32_t i = count; i-- > 0; slot = older_slot(snapshots, slot)) {
+        if (i < max) {
+            ids[i] = le64toh(snapshots->table->st_entries[slot].se_id);
+        }
+    }
+
+    pthread_mutex_unlock(&snapshots->lock);
+    return count;
+}
+
+// Find where a snapshot's copy of a page lives: the map entry of the first
+// snapshot from slot on that has one, or 0 when the page is still the live
+// one
+static int resolve_page(int fd, struct ddfs_snapshots *snapshots, int slot,
+    uint64_t page, uint32_t *entry) {
+    *entry = 0;
+
+    for (; slot != -1 && *entry == 0; slot = newer_slot(snapshots, slot)) {
+        if (read_map_entry(fd, snapshots, slot, page, entry) !=
+            EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Read a key's value as it was when a snapshot was taken. The lock keeps
+// the page from being copied, and so from changing, until the value is
+// read.
+int get_snapshot_value(int fd, uint64_t id, uint8_t key[20],
+    uint8_t *value) {
+    struct ddfs_snapshots *snapshots = get_snapshots(fd);
+    struct ddfs_superblock *sb = get_superblock(fd);
+    uint8_t *buffer = get_block_buffer();
+    int ret = EXIT_FAILURE;
+
+    memset(value, 0, DDFS_BLOCK_SIZE);
+
+    if (snapshots == NULL || sb == NULL || buffer == NULL) {
+        put_block_buffer(sb);
+        put_block_buffer(buffer);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t inode_number = key_hash(key, sb->info.fs_inode_count);
+    uint64_t block_number;
+    uint32_t buffer_offset;
+    get_inode_location(sb, inode_number, &block_number, &buffer_offset);
+    put_block_buffer(sb);
+
+    uint64_t page = block_number - snapshots->istore_block;
+    struct ddfs_inode *inode = (struct ddfs_inode *)(buffer + buffer_offset);
+    uint32_t entry;
+
+    pthread_mutex_lock(&snapshots->lock);
+
+    int slot = find_slot(snapshots, id);
+    int found = 0;
+
+    if (slot == -1) {
+        errno = ENOENT;
+        entry = DDFS_SNAPSHOT_EMPTY;
+    } else if (resolve_page(fd, snapshots, slot, page, &entry) !=
+        EXIT_SUCCESS) {
+        entry = DDFS_SNAPSHOT_EMPTY;
+    }
+
+    if (entry != 0 && entry != DDFS_SNAPSHOT_EMPTY) {
+        found = read_block(fd, buffer, snapshots->pool_block + entry - 1) ==
+            DDFS_BLOCK_SIZE;
+    } else if (entry == 0) {
+        // A page still shared is the live one, read as lookups do
+        found = get_group_state(fd, NULL,
+            get_inode_group(inode_number)) == 1 &&
+            read_block(fd, buffer, block_number) == DDFS_BLOCK_SIZE;
+    }
+
+    if (found && inode_number != 0 && inode->info.i_block_ptr != 0 &&
+        memcmp(inode->info.i_key, key, 20) == 0 &&
+        read_block(fd, value, inode->info.i_block_ptr) == DDFS_BLOCK_SIZE) {
+        ret = EXIT_SUCCESS;
+    }
+
+    pthread_mutex_unlock(&snapshots->lock);
+    put_block_buffer(buffer);
+    return ret;
+}
+
+// Set the free inode bits of a page's slots whose keys come or go
+static int update_inode_bits(int fd, struct ddfs_snapshots *snapshots,
+    uint64_t page, uint8_t *current, uint8_t *target) {
+    struct ddfs_inode *old_inodes = (struct ddfs_inode *)current;
+    struct ddfs_inode *new_inodes = (struct ddfs_inode *)target;
+
+    for (uint32_t i = 0; i < DDFS_SNAPSHOT_INODES; i++) {
+        uint64_t inode_number = (page * DDFS_SNAPSHOT_INODES) + i;
+        int had_key = old_inodes[i].info.i_block_ptr != 0;
+        int has_key = new_inodes[i].info.i_block_ptr != 0;
+
+        if (inode_number == 0 || inode_number >= snapshots->inode_count ||
+            had_key == has_key) {
+            continue;
+        }
+
+        if ((has_key ? set_inode_bit(fd, inode_number) :
+            clear_inode_bit(fd, inode_number)) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Make one page of the live index what a snapshot holds, target. The keys
+// it gains take their references before the page is written and the keys
+// it loses release theirs after.
+static int restore_page(int fd, struct ddfs_snapshots *snapshots,
+    uint64_t page, uint8_t *current, uint8_t *target) {
+    uint64_t group = get_inode_group(page * DDFS_SNAPSHOT_INODES);
+    uint64_t blocks[DDFS_SNAPSHOT_INODES];
+    int state = get_group_state(fd, NULL, group);
+
+    if (state == -1 || (state == 1 && read_block(fd, current,
+        snapshots->istore_block + page) != DDFS_BLOCK_SIZE)) {
+        return EXIT_FAILURE;
+    }
+
+    if (state == 0) {
+        memset(current, 0, DDFS_BLOCK_SIZE);
+    }
+
+    // The superblock inode stays as it is
+    if (page == 0) {
+        memcpy(target, current, sizeof(struct ddfs_inode));
+    }
+
+    if (memcmp(current, target, DDFS_BLOCK_SIZE) == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    uint32_t count = get_page_blocks(snapshots, page, target, blocks);
+
+    if (preserve_locked(fd, snapshots, page) != EXIT_SUCCESS ||
+        (count != 0 && reference_blocks(fd, blocks, count) !=
+        EXIT_SUCCESS) || initialize_group(fd, NULL, group) !=
+        EXIT_SUCCESS || write_block(fd, target, snapshots->istore_block +
+        page) != DDFS_BLOCK_SIZE ||
+        update_inode_bits(fd, snapshots, page, current, target) !=
+        EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    count = get_page_blocks(snapshots, page, current, blocks);
+    return release_blocks(fd, blocks, count);
+}
+
+// Turn the live index into a writable clone of a snapshot. Only the pages
+// that changed since the snapshot are written back, and the values the
+// clone shares with the snapshot are referenced, not copied. The snapshot
+// itself, and any newer one, stays as it was.
+int clone_snapshot(int fd, uint64_t id) {
+    struct ddfs_snapshots *snapshots = get_writable_snapshots(fd);
+
+    if (snapshots == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_key_locks locks;
+    key_locks_init(&locks, fd);
+    key_locks_add_all(&locks);
+    lock_keys(&locks, 1);
+    pthread_mutex_lock(&snapshots->lock);
+
+    int chain[DDFS_SNAPSHOT_MAX];
+    uint32_t chain_length = 0;
+    uint32_t *maps = ddfs_memalign(DDFS_BLOCK_SIZE,
+        DDFS_SNAPSHOT_MAX * DDFS_BLOCK_SIZE);
+    uint8_t *current = get_block_buffer();
+    uint8_t *target = get_block_buffer();
+    int ret = maps != NULL && current != NULL && target != NULL ?
+        EXIT_SUCCESS : EXIT_FAILURE;
+
+    // The snapshot reads pages it has no copy of through newer ones
+    for (int slot = find_slot(snapshots, id); slot != -1;
+        slot = newer_slot(snapshots, slot)) {
+        chain[chain_length++] = slot;
+    }
+
+    if (chain_length == 0) {
+        errno = ENOENT;
+        ret = EXIT_FAILURE;
+    }
+
+    for (uint64_t m = 0; ret == EXIT_SUCCESS && m < snapshots->map_blocks;
+        m++) {
+        uint64_t first = m * DDFS_SNAPSHOT_MAP_ENTRIES;
+
+        for (uint32_t c = 0; ret == EXIT_SUCCESS && c < chain_length; c++) {
+            if (read_block(fd, maps + (c * DDFS_SNAPSHOT_MAP_ENTRIES),
+                get_map_block(snapshots, chain[c], first)) !=
+                DDFS_BLOCK_SIZE) {
+                ret = EXIT_FAILURE;
+            }
+        }
+
+        for (uint32_t i = 0; ret == EXIT_SUCCESS &&
+            i < DDFS_SNAPSHOT_MAP_ENTRIES &&
+            first + i < snapshots->istore_block_count; i++) {
+            uint32_t entry = 0;
+
+            for (uint32_t c = 0; entry == 0 && c < chain_length; c++) {
+                entry = le32toh(maps[(c * DDFS_SNAPSHOT_MAP_ENTRIES) + i]);
+            }
+
+            // Pages the live index still shares are already the clone's
+            if (entry == 0) {
+                continue;
+            }
+
+            if (entry == DDFS_SNAPSHOT_EMPTY) {
+                memset(target, 0, DDFS_BLOCK_SIZE);
+            } else if (read_block(fd, target, snapshots->pool_block +
+                entry - 1) != DDFS_BLOCK_SIZE) {
+                ret = EXIT_FAILURE;
+                break;
+            }
+
+            ret = restore_page(fd, snapshots, first + i, current, target);
+        }
+    }
+
+    pthread_mutex_unlock(&snapshots->lock);
+    unlock_keys(&locks);
+    ddfs_free(maps);
+    put_block_buffer(current);
+    put_block_buffer(target);
+    return ret;
+}
+
+// Get the number of pool pages the snapshots of a volume take up, or -1
+int64_t get_snapshot_pages(int fd) {
+    struct ddfs_snapshots *snapshots = get_snapshots(fd);
+
+    if (snapshots == NULL) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    pthread_mutex_lock(&snapshots->lock);
+
+    int64_t pages = snapshots->pool_used_count;
+
+    pthread_mutex_unlock(&snapshots->lock);
+    return pages;
+}
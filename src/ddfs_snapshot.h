@@ -0,0 +1,84 @@
+#ifndef ddfs_SNAPSHOT_H
+#define	ddfs_SNAPSHOT_H
+
+#include <pthread.h>
+
+#include "ddfs.h"
+
+#define DDFS_SNAPSHOT_MAGIC 0x5A9507
+#define DDFS_SNAPSHOT_MAX 16 // Snapshots a volume holds at once
+#define DDFS_SNAPSHOT_SHARE 4 // Default pool is one page per this many
+                              // inode store blocks
+#define DDFS_SNAPSHOT_MIN_PAGES 16 // Smallest default pool
+#define DDFS_SNAPSHOT_EMPTY UINT32_MAX // Map entry of a page with no keys
+#define DDFS_SNAPSHOT_MAP_ENTRIES (DDFS_BLOCK_SIZE / sizeof(uint32_t))
+
+// A frozen copy of the key index
+struct ddfs_snapshot_entry {
+    uint64_t se_id; // Snapshot id, increasing with age, 0 for a free slot
+    uint64_t se_create_time; // When the snapshot was taken
+};
+
+// First block of the snapshot region. The table is followed by the pool
+// bitmap, one map per table slot with an entry per inode store block and
+// the pool of preserved pages. A map entry of 0 means the page is the same
+// as in the next newer snapshot, or in the live index for the newest one,
+// DDFS_SNAPSHOT_EMPTY that it held no keys and anything else names pool
+// page entry - 1.
+struct ddfs_snapshot_table {
+    uint32_t st_magic; // DDFS_SNAPSHOT_MAGIC
+    uint32_t st_padding; // Padding to 8 bytes
+    uint64_t st_next_id; // Id the next snapshot gets
+    struct ddfs_snapshot_entry st_entries[DDFS_SNAPSHOT_MAX];
+};
+
+// Snapshot state of an in-place volume. An inode store block is copied to
+// the pool the first time it changes after a snapshot, and the values of
+// its keys take a reference each, so untouched pages and the data blocks
+// are never copied. shared has a bit per inode store block the newest
+// snapshot still shares with the live index.
+struct ddfs_snapshots {
+    pthread_mutex_t lock; // Serializes page copies and snapshot changes
+    uint64_t table_block; // Block of the snapshot table
+    uint64_t bitmap_block; // First block of the pool bitmap
+    uint64_t map_block; // First block of the first slot's map
+    uint64_t map_blocks; // Map blocks per slot
+    uint64_t pool_block; // First pool page
+    uint64_t pool_pages; // Number of pool pages
+    uint64_t pool_hint; // Pool page the search for a free one starts at
+    uint64_t pool_used_count; // Number of pool pages in use
+    uint64_t istore_block; // First inode store block
+    uint64_t istore_block_count; // Number of inode store blocks
+    uint64_t inode_count; // Number of inodes
+    uint32_t count; // Number of snapshots, read without the lock
+    struct ddfs_snapshot_table *table; // Copy of the table block
+    uint8_t *pool_used; // Copy of the pool bitmap, bit set when used
+    uint64_t *shared; // Bit per inode store block, see above
+};
+
+extern uint64_t get_snapshot_block_count(uint64_t istore_block_count,
+    uint64_t pool_pages);
+
+extern int initialize_snapshots(int fd, struct ddfs_superblock *sb);
+
+extern int load_snapshots(int fd);
+
+extern void free_snapshots(int fd);
+
+extern int preserve_index_pages(int fd, uint64_t block_number,
+    uint64_t count);
+
+extern int64_t create_snapshot(int fd);
+
+extern int delete_snapshot(int fd, uint64_t id);
+
+extern int64_t list_snapshots(int fd, uint64_t *ids, uint32_t max);
+
+extern int get_snapshot_value(int fd, uint64_t id, uint8_t key[20],
+    uint8_t *value);
+
+extern int clone_snapshot(int fd, uint64_t id);
+
+extern int64_t get_snapshot_pages(int fd);
+
+#endif
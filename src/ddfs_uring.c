@@ -0,0 +1,471 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "ddfs_uring.h"
+#include "ddfs_alloc.h"
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Submission and completion rings shared with the kernel
+struct ddfs_uring {
+    int fd; // Descriptor of the image or device
+    int ring_fd; // Descriptor of the ring
+    uint32_t entries; // Submission queue entries
+    uint8_t fixed_file; // Whether fd is registered as fixed file 0
+    unsigned *sq_head; // Submission queue head, advanced by the kernel
+    unsigned *sq_tail; // Submission queue tail, advanced by us
+    unsigned *sq_mask; // Submission queue index mask
+    unsigned *sq_array; // Submission queue indirection array
+    struct io_uring_sqe *sqes; // Submission queue entries
+    unsigned *cq_head; // Completion queue head, advanced by us
+    unsigned *cq_tail; // Completion queue tail, advanced by the kernel
+    unsigned *cq_mask; // Completion queue index mask
+    struct io_uring_cqe *cqes; // Completion queue entries
+    void *sq_ring; // Mapping of the submission ring
+    void *cq_ring; // Mapping of the completion ring
+    size_t sq_ring_size; // Length of the submission ring mapping
+    size_t cq_ring_size; // Length of the completion ring mapping
+    size_t sqes_size; // Length of the submission entries mapping
+    uint8_t *buffers; // Registered buffer region, or NULL
+    uint64_t claimed[DDFS_URING_BUFFERS / 64]; // Blocks of the region in
+                                               // use, one bit each
+    pthread_mutex_t lock; // Serializes threads sharing the rings
+    pthread_mutex_t claim_lock; // Protects claimed
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, 
+    unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, 
+        flags, NULL, 0);
+}
+
+static int io_uring_register(int ring_fd, unsigned opcode, void *arg, 
+    unsigned nr_args) {
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// Set up a ring for fd with the descriptor and a buffer region registered,
+// or return NULL when io_uring is unavailable
+struct ddfs_uring *uring_create(int fd, uint32_t entries) {
+    struct ddfs_uring *uring = ddfs_calloc(1, sizeof(struct ddfs_uring));
+    struct io_uring_params params;
+
+    if (uring == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&uring->lock, NULL);
+    pthread_mutex_init(&uring->claim_lock, NULL);
+    memset(&params, 0, sizeof(struct io_uring_params));
+    uring->fd = fd;
+    uring->ring_fd = io_uring_setup(entries, &params);
+
+    if (uring->ring_fd < 0) {
+        pthread_mutex_destroy(&uring->lock);
+        pthread_mutex_destroy(&uring->claim_lock);
+        ddfs_free(uring);
+        return NULL;
+    }
+
+    uring->entries = params.sq_entries;
+    uring->sq_ring_size = params.sq_off.array + 
+        params.sq_entries * sizeof(unsigned);
+    uring->cq_ring_size = params.cq_off.cqes + 
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cq_ring_size > uring->sq_ring_size) {
+            uring->sq_ring_size = uring->cq_ring_size;
+        }
+
+        uring->cq_ring_size = uring->sq_ring_size;
+    }
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, 
+        MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+
+    if (uring->sq_ring == MAP_FAILED) {
+        close(uring->ring_fd);
+        pthread_mutex_destroy(&uring->lock);
+        pthread_mutex_destroy(&uring->claim_lock);
+        ddfs_free(uring);
+        return NULL;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_ring = uring->sq_ring;
+    } else {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_size, 
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+            uring->ring_fd, IORING_OFF_CQ_RING);
+    }
+
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, 
+        MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+
+    if (uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+        if (uring->cq_ring == MAP_FAILED) {
+            uring->cq_ring = NULL;
+        }
+
+        if (uring->sqes == MAP_FAILED) {
+            uring->sqes = NULL;
+        }
+
+        uring_destroy(uring);
+        return NULL;
+    }
+
+    uint8_t *sq = uring->sq_ring;
+    uint8_t *cq = uring->cq_ring;
+    uring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    uring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    uring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    uring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    uring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Fixed files and buffers save a descriptor lookup and page pinning
+    // per request; without them requests still work, only slower
+    uring->fixed_file = io_uring_register(uring->ring_fd, 
+        IORING_REGISTER_FILES, &fd, 1) == 0;
+
+    struct iovec region;
+    region.iov_len = DDFS_URING_BUFFERS * DDFS_BLOCK_SIZE;
+
+    region.iov_base = ddfs_memalign(DDFS_BLOCK_SIZE, region.iov_len);
+
+    if (region.iov_base != NULL) {
+        if (io_uring_register(uring->ring_fd, IORING_REGISTER_BUFFERS, 
+            &region, 1) == 0) {
+            uring->buffers = region.iov_base;
+        } else {
+            ddfs_free(region.iov_base);
+        }
+    }
+
+    return uring;
+}
+
+void uring_destroy(struct ddfs_uring *uring) {
+    if (uring == NULL) {
+        return;
+    }
+
+    if (uring->sqes != NULL) {
+        munmap(uring->sqes, uring->sqes_size);
+    }
+
+    if (uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring) {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+
+    munmap(uring->sq_ring, uring->sq_ring_size);
+    close(uring->ring_fd);
+    ddfs_free(uring->buffers);
+    pthread_mutex_destroy(&uring->lock);
+    pthread_mutex_destroy(&uring->claim_lock);
+    ddfs_free(uring);
+}
+
+// Check whether a block of the registered region is claimed. The caller
+// holds the claim lock.
+static int is_claimed(struct ddfs_uring *uring, uint32_t index) {
+    return (uring->claimed[index / 64] >> (index % 64)) & 1;
+}
+
+// Claim count consecutive blocks of the registered buffer region, or
+// return NULL when there is no region or no room in it. Runs whose
+// buffers are consecutive blocks of the region skip per-request page
+// pinning.
+uint8_t *uring_claim_buffers(struct ddfs_uring *uring, uint32_t count) {
+    if (uring == NULL || uring->buffers == NULL || count == 0 ||
+        count > DDFS_URING_BUFFERS) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&uring->claim_lock);
+    uint32_t start = 0;
+    uint32_t length = 0;
+
+    // First fit
+    for (uint32_t i = 0; i < DDFS_URING_BUFFERS && length < count; i++) {
+        if (is_claimed(uring, i)) {
+            start = i + 1;
+            length = 0;
+        } else {
+            length++;
+        }
+    }
+
+    uint8_t *buffers = NULL;
+
+    if (length == count) {
+        for (uint32_t i = start; i < start + count; i++) {
+            uring->claimed[i / 64] |= 1ULL << (i % 64);
+        }
+
+        buffers = uring->buffers + ((size_t)start * DDFS_BLOCK_SIZE);
+    }
+
+    pthread_mutex_unlock(&uring->claim_lock);
+    return buffers;
+}
+
+// Give back count blocks claimed from the registered buffer region
+void uring_release_buffers(struct ddfs_uring *uring, uint8_t *buffers,
+    uint32_t count) {
+    if (uring == NULL || buffers == NULL) {
+        return;
+    }
+
+    uint32_t start = (buffers - uring->buffers) / DDFS_BLOCK_SIZE;
+
+    pthread_mutex_lock(&uring->claim_lock);
+
+    for (uint32_t i = start; i < start + count; i++) {
+        uring->claimed[i / 64] &= ~(1ULL << (i % 64));
+    }
+
+    pthread_mutex_unlock(&uring->claim_lock);
+}
+
+// Check whether a run's buffers are consecutive registered blocks
+static int run_is_fixed(struct ddfs_uring *uring, struct ddfs_io_run *run) {
+    uint8_t *first = run->buffers[0];
+
+    if (uring->buffers == NULL || first < uring->buffers || 
+        first + ((size_t)run->count * DDFS_BLOCK_SIZE) > 
+        uring->buffers + (DDFS_URING_BUFFERS * DDFS_BLOCK_SIZE)) {
+        return 0;
+    }
+
+    for (uint32_t i = 1; i < run->count; i++) {
+        if ((uint8_t *)run->buffers[i] != 
+            first + ((size_t)i * DDFS_BLOCK_SIZE)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Transfer a run with plain synchronous I/O
+static int64_t transfer_run(int fd, struct ddfs_io_run *run, int write) {
+    if (write) {
+        return write_blocks(fd, run->buffers, run->block_number, run->count);
+    }
+
+    return read_blocks(fd, run->buffers, run->block_number, run->count);
+}
+
+// Record the results of all posted completions
+static uint32_t reap_completions(struct ddfs_uring *uring, 
+    struct ddfs_io_run *runs, uint8_t *completed) {
+    unsigned head = *uring->cq_head;
+    uint32_t reaped = 0;
+
+    while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+        struct ddfs_io_run *run = &runs[cqe->user_data];
+
+        if (cqe->res == (int32_t)(run->count * DDFS_BLOCK_SIZE)) {
+            run->result = cqe->res;
+        } else {
+            run->result = -1;
+        }
+
+        completed[cqe->user_data] = 1;
+        head++;
+        reaped++;
+    }
+
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+// Submit every run at once, keeping up to a full ring of requests in
+// flight, and record each run's result as its completion arrives. If the
+// ring fails, the runs it has not completed go through plain I/O.
+int uring_submit_runs(struct ddfs_uring *uring, struct ddfs_io_run *runs, 
+    uint32_t count, int write) {
+    uint32_t total = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        total += runs[i].count;
+    }
+
+    struct ddfs_scratch *scratch = get_scratch();
+
+    if (scratch == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct ddfs_arena_mark mark = arena_mark(&scratch->arena);
+    struct iovec *iov = arena_alloc(&scratch->arena, 
+        (total + 1) * sizeof(struct iovec), sizeof(void *));
+    uint8_t *completed = arena_calloc(&scratch->arena, count + 1, 
+        sizeof(uint8_t));
+
+    if (iov == NULL || completed == NULL) {
+        arena_reset(&scratch->arena, mark);
+        return EXIT_FAILURE;
+    }
+
+    uint32_t next = 0;
+    uint32_t next_iov = 0;
+    uint32_t inflight = 0;
+    int failed = 0;
+
+    // Completions are matched to runs by index, so one thread at a time
+    // owns the rings
+    pthread_mutex_lock(&uring->lock);
+
+    while (!failed && (next < count || inflight > 0)) {
+        unsigned tail = *uring->sq_tail;
+        unsigned submit = 0;
+
+        while (next < count && inflight + submit < uring->entries) {
+            struct ddfs_io_run *run = &runs[next];
+
+            // Runs longer than one vectored request go synchronously
+            if (run->count > DDFS_MAX_IOV) {
+                run->result = transfer_run(uring->fd, run, write);
+                completed[next++] = 1;
+                continue;
+            }
+
+            unsigned index = (tail + submit) & *uring->sq_mask;
+            struct io_uring_sqe *sqe = &uring->sqes[index];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+            if (run_is_fixed(uring, run)) {
+                sqe->opcode = write ? IORING_OP_WRITE_FIXED : 
+                    IORING_OP_READ_FIXED;
+                sqe->addr = (uintptr_t)run->buffers[0];
+                sqe->len = run->count * DDFS_BLOCK_SIZE;
+                sqe->buf_index = 0;
+            } else {
+                for (uint32_t i = 0; i < run->count; i++) {
+                    iov[next_iov + i].iov_base = run->buffers[i];
+                    iov[next_iov + i].iov_len = DDFS_BLOCK_SIZE;
+                }
+
+                sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+                sqe->addr = (uintptr_t)&iov[next_iov];
+                sqe->len = run->count;
+                next_iov += run->count;
+            }
+
+            sqe->fd = uring->fixed_file ? 0 : uring->fd;
+            sqe->flags = uring->fixed_file ? IOSQE_FIXED_FILE : 0;
+            sqe->off = (uint64_t)run->block_number * DDFS_BLOCK_SIZE;
+            sqe->user_data = next;
+            uring->sq_array[index] = index;
+            submit++;
+            next++;
+        }
+
+        if (submit == 0 && inflight == 0) {
+            continue;
+        }
+
+        __atomic_store_n(uring->sq_tail, tail + submit, __ATOMIC_RELEASE);
+
+        int entered;
+
+        do {
+            entered = io_uring_enter(uring->ring_fd, submit, 1, 
+                IORING_ENTER_GETEVENTS);
+        } while (entered == -1 && errno == EINTR);
+
+        if (entered == -1) {
+            // Take back the requests the kernel did not accept
+            __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+            failed = 1;
+        } else {
+            inflight += submit;
+        }
+
+        inflight -= reap_completions(uring, runs, completed);
+    }
+
+    // Drain requests still in flight before their buffers go away
+    while (inflight > 0) {
+        if (io_uring_enter(uring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) 
+            == -1 && errno != EINTR) {
+            break;
+        }
+
+        inflight -= reap_completions(uring, runs, completed);
+    }
+
+    pthread_mutex_unlock(&uring->lock);
+    int ret = EXIT_SUCCESS;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!completed[i]) {
+            runs[i].result = transfer_run(uring->fd, &runs[i], write);
+        }
+
+        if (runs[i].result == -1) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    arena_reset(&scratch->arena, mark);
+    return ret;
+}
+
+#else
+
+struct ddfs_uring *uring_create(int fd, uint32_t entries) {
+    (void)fd;
+    (void)entries;
+    return NULL;
+}
+
+void uring_destroy(struct ddfs_uring *uring) {
+    (void)uring;
+}
+
+uint8_t *uring_claim_buffers(struct ddfs_uring *uring, uint32_t count) {
+    (void)uring;
+    (void)count;
+    return NULL;
+}
+
+void uring_release_buffers(struct ddfs_uring *uring, uint8_t *buffers,
+    uint32_t count) {
+    (void)uring;
+    (void)buffers;
+    (void)count;
+}
+
+int uring_submit_runs(struct ddfs_uring *uring, struct ddfs_io_run *runs, 
+    uint32_t count, int write) {
+    (void)uring;
+    (void)runs;
+    (void)count;
+    (void)write;
+    return EXIT_FAILURE;
+}
+
+#endif
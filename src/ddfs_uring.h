@@ -0,0 +1,24 @@
+#ifndef ddfs_URING_H
+#define	ddfs_URING_H
+
+#include "ddfs.h"
+
+#define DDFS_URING_ENTRIES 128 // Submission queue entries per ring
+#define DDFS_URING_BUFFERS 256 // Blocks in the registered buffer region
+
+struct ddfs_uring;
+
+extern struct ddfs_uring *uring_create(int fd, uint32_t entries);
+
+extern void uring_destroy(struct ddfs_uring *uring);
+
+extern uint8_t *uring_claim_buffers(struct ddfs_uring *uring,
+    uint32_t count);
+
+extern void uring_release_buffers(struct ddfs_uring *uring,
+    uint8_t *buffers, uint32_t count);
+
+extern int uring_submit_runs(struct ddfs_uring *uring, 
+    struct ddfs_io_run *runs, uint32_t count, int write);
+
+#endif
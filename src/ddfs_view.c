@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#elif defined(__FreeBSD__)
+#include <sys/socket.h>
+#endif
+
+#include "ddfs_view.h"
+#include "ddfs_alloc.h"
+#include "ddfs_refcount.h"
+#include "ddfs_volume.h"
+
+// Copy a key's value into a view where its block cannot be pinned
+static int borrow_copy(int fd, uint8_t key[20],
+    struct ddfs_value_view *view) {
+    uint8_t *copy = ddfs_memalign(DDFS_BLOCK_SIZE, DDFS_BLOCK_SIZE);
+
+    if (copy == NULL || get_value(fd, key, copy) != EXIT_SUCCESS) {
+        ddfs_free(copy);
+        return EXIT_FAILURE;
+    }
+
+    view->data = copy;
+    view->length = DDFS_BLOCK_SIZE;
+    view->copy = copy;
+    return EXIT_SUCCESS;
+}
+
+// Map a key's data block read-only instead of copying it out. The view
+// points straight into the page cache and stays valid until released.
+// Mapped volumes lend a pointer into the volume's own mapping. The view
+// pins the block in memory, so deleting or modifying the key, or the
+// segment cleaner, leaves it in place. Plain descriptors keep no pins, so
+// they copy the value out instead.
+int ddfs_borrow_value(int fd, uint8_t key[20], 
+    struct ddfs_value_view *view) {
+    memset(view, 0, sizeof(struct ddfs_value_view));
+    view->fd = fd;
+
+    if (get_volume(fd) == NULL) {
+        return borrow_copy(fd, key, view);
+    }
+
+    int64_t block_ptr = pin_value_block(fd, key);
+
+    if (block_ptr == -1) {
+        return EXIT_FAILURE;
+    }
+
+    view->block = block_ptr;
+
+    uint8_t *block = get_block_address(fd, block_ptr, 1, 0);
+
+    if (block != NULL) {
+        view->data = block;
+        view->length = DDFS_BLOCK_SIZE;
+        return EXIT_SUCCESS;
+    }
+
+    off_t page_size = sysconf(_SC_PAGESIZE);
+    off_t offset = (off_t)block_ptr * DDFS_BLOCK_SIZE;
+    off_t map_offset = offset - (offset % page_size);
+    size_t map_length = (offset - map_offset) + DDFS_BLOCK_SIZE;
+    void *mapping = mmap(NULL, map_length, PROT_READ, MAP_SHARED, fd, 
+        map_offset);
+
+    if (mapping == MAP_FAILED) {
+        ddfs_release_value(view);
+        return EXIT_FAILURE;
+    }
+
+    view->data = (const uint8_t *)mapping + (offset - map_offset);
+    view->length = DDFS_BLOCK_SIZE;
+    view->mapping = mapping;
+    view->mapping_length = map_length;
+    return EXIT_SUCCESS;
+}
+
+// Let go of a view and of its pin
+void ddfs_release_value(struct ddfs_value_view *view) {
+    if (view->mapping != NULL) {
+        munmap(view->mapping, view->mapping_length);
+    }
+
+    if (view->block != 0) {
+        unpin_block(view->fd, view->block);
+    }
+
+    ddfs_free(view->copy);
+    memset(view, 0, sizeof(struct ddfs_value_view));
+}
+
+// Copy a value to out_fd through a bounce buffer, reading the block at
+// offset, or the key's value under its locks when offset is -1
+static int64_t copy_value(int fd, uint8_t key[20], off_t offset,
+    int out_fd) {
+    uint8_t *buffer = get_block_buffer();
+
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    if (offset == -1 ? get_value(fd, key, buffer) != EXIT_SUCCESS :
+        pread(fd, buffer, DDFS_BLOCK_SIZE, offset) != DDFS_BLOCK_SIZE) {
+        put_block_buffer(buffer);
+        return -1;
+    }
+
+    int64_t total = 0;
+
+    while (total < DDFS_BLOCK_SIZE) {
+        ssize_t ret = write(out_fd, buffer + total, DDFS_BLOCK_SIZE - total);
+
+        if (ret == -1) {
+            put_block_buffer(buffer);
+            return -1;
+        }
+
+        total += ret;
+    }
+
+    put_block_buffer(buffer);
+    return total;
+}
+
+// Send a key's value to a socket or pipe without copying it through user
+// space, falling back to a buffered copy where sendfile() cannot be used.
+// The block is pinned like a borrowed one while it is sent.
+int64_t ddfs_send_value(int fd, uint8_t key[20], int out_fd) {
+    if (get_volume(fd) == NULL) {
+        return copy_value(fd, key, -1, out_fd);
+    }
+
+    int64_t block_ptr = pin_value_block(fd, key);
+
+    if (block_ptr == -1) {
+        return -1;
+    }
+
+    off_t offset = (off_t)block_ptr * DDFS_BLOCK_SIZE;
+    int64_t total = 0;
+
+#if defined(__linux__)
+    while (total < DDFS_BLOCK_SIZE) {
+        ssize_t ret = sendfile(out_fd, fd, &offset, DDFS_BLOCK_SIZE - total);
+
+        if (ret <= 0) {
+            break;
+        }
+
+        total += ret;
+    }
+#elif defined(__FreeBSD__)
+    off_t sent = 0;
+
+    if (sendfile(fd, out_fd, offset, DDFS_BLOCK_SIZE, NULL, &sent, 0) == 0) {
+        total = sent;
+    }
+#endif
+
+    if (total == 0) {
+        total = copy_value(fd, key, offset, out_fd);
+    } else if (total != DDFS_BLOCK_SIZE) {
+        total = -1;
+    }
+
+    unpin_block(fd, block_ptr);
+    return total;
+}
@@ -0,0 +1,25 @@
+#ifndef ddfs_VIEW_H
+#define	ddfs_VIEW_H
+
+#include "ddfs.h"
+
+// Read-only view of a value, valid until released. The value stays as it
+// was meanwhile, whatever happens to the key.
+struct ddfs_value_view {
+    const uint8_t *data; // Value contents
+    uint32_t length; // Length of the value in bytes
+    void *mapping; // Mapping pinned by the view
+    size_t mapping_length; // Length of the mapping in bytes
+    int fd; // Volume the value was borrowed from
+    uint64_t block; // Data block the view pins, or 0
+    uint8_t *copy; // Copy of the value, where its block cannot be pinned
+};
+
+extern int ddfs_borrow_value(int fd, uint8_t key[20], 
+    struct ddfs_value_view *view);
+
+extern void ddfs_release_value(struct ddfs_value_view *view);
+
+extern int64_t ddfs_send_value(int fd, uint8_t key[20], int out_fd);
+
+#endif
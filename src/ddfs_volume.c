@@ -0,0 +1,398 @@
+#ifdef __linux__
+#define _GNU_SOURCE // O_DIRECT, memfd_create()
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "ddfs_volume.h"
+#include "ddfs_alloc.h"
+#include "ddfs_backend.h"
+#include "ddfs_gc.h"
+#include "ddfs_group.h"
+#include "ddfs_journal.h"
+#include "ddfs_log.h"
+#include "ddfs_refcount.h"
+#include "ddfs_snapshot.h"
+#include "ddfs_uring.h"
+
+#if DDFS_POOL_BUFFERS > 64
+#error "DDFS_POOL_BUFFERS must fit the 64-bit pool_free mask"
+#endif
+
+static struct ddfs_volume *volumes[DDFS_MAX_VOLUMES];
+
+// Map the whole image and hint the kernel about how each region is used:
+// bitmaps and the inode store are hot and read ahead, data is random
+static int map_volume(struct ddfs_volume *volume) {
+    int64_t size = volume->backend->size(volume->fd);
+
+    if (size < DDFS_BLOCK_SIZE) {
+        return EXIT_FAILURE;
+    }
+
+    int prot = PROT_READ | (volume->writable ? PROT_WRITE : 0);
+    void *map = mmap(NULL, size, prot, MAP_SHARED, volume->fd, 0);
+
+    if (map == MAP_FAILED) {
+        return EXIT_FAILURE;
+    }
+
+    volume->map = map;
+    volume->map_length = size;
+
+    struct ddfs_superblock *sb = map;
+    size_t data_offset = sb->info.fs_data_offset;
+
+    if (check_superblock(sb) != EXIT_SUCCESS || data_offset == 0 ||
+        data_offset > volume->map_length) {
+        return EXIT_SUCCESS;
+    }
+
+    madvise(volume->map, data_offset, MADV_WILLNEED);
+    madvise(volume->map + data_offset, volume->map_length - data_offset, 
+        MADV_RANDOM);
+
+    if (volume->flags & DDFS_OPEN_POPULATE) {
+#ifdef MADV_HUGEPAGE
+        madvise(volume->map, data_offset, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_POPULATE_READ
+        madvise(volume->map, data_offset, volume->writable ? 
+            MADV_POPULATE_WRITE : MADV_POPULATE_READ);
+#else
+        // Touch one byte per page to fault the metadata in
+        volatile uint8_t sum = 0;
+
+        for (size_t i = 0; i < data_offset; i += DDFS_BLOCK_SIZE) {
+            sum += volume->map[i];
+        }
+#endif
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Set up direct I/O for a volume opened with O_DIRECT: find the alignment
+// the device needs and carve the aligned buffer pool. Devices whose sectors
+// are larger than a block cannot do block-sized direct I/O, so they go back
+// through the page cache.
+static void setup_direct(struct ddfs_volume *volume) {
+#ifdef O_DIRECT
+    int oflag = fcntl(volume->fd, F_GETFL);
+
+    if (oflag == -1 || !(oflag & O_DIRECT)) {
+        return;
+    }
+
+    int64_t sector_size = get_disk_sector_size(volume->fd);
+
+    if (sector_size <= 0 || sector_size > DDFS_BLOCK_SIZE ||
+        DDFS_BLOCK_SIZE % sector_size != 0) {
+        fcntl(volume->fd, F_SETFL, oflag & ~O_DIRECT);
+        return;
+    }
+
+    volume->alignment = sector_size;
+    volume->pool = ddfs_memalign(DDFS_BLOCK_SIZE,
+        DDFS_POOL_BUFFERS * DDFS_BLOCK_SIZE);
+
+    if (volume->pool == NULL) {
+        return;
+    }
+
+    volume->pool_free = ~0ULL >> (64 - DDFS_POOL_BUFFERS);
+#else
+    (void)volume;
+#endif
+}
+
+// Detach a volume from its descriptor and free it, without writing
+// anything back
+static void free_volume(int fd) {
+    struct ddfs_volume *volume = volumes[fd];
+
+    stop_group_zeroing(fd);
+    free_reference_log(fd);
+    free_journal(fd);
+    free_log(fd);
+    free_snapshots(fd);
+
+    if (volume->map != NULL) {
+        munmap(volume->map, volume->map_length);
+    }
+
+    uring_destroy(volume->uring);
+    ddfs_free(volume->pool);
+    ddfs_free(volume->groups);
+    ddfs_free(volume->pins);
+    pthread_mutex_destroy(&volume->pin_lock);
+    pthread_rwlock_destroy(&volume->keys_lock);
+    ddfs_free(volume);
+    volumes[fd] = NULL;
+}
+
+// Open an image or device and attach the requested I/O backends to its
+// descriptor. Backends that cannot be set up fall back to plain I/O. A
+// volume whose journal, groups, logs or snapshots cannot be loaded is not
+// opened: writing it without them would go around the journal's newer
+// blocks or lose track of references.
+int ddfs_open(const char *path, int oflag, uint32_t flags) {
+#ifdef O_DIRECT
+    if (flags & DDFS_OPEN_DIRECT) {
+        oflag |= O_DIRECT;
+    }
+#endif
+
+    int fd = open(path, oflag, 0);
+
+#ifdef O_DIRECT
+    // Some file systems refuse O_DIRECT outright
+    if (fd == -1 && (oflag & O_DIRECT) && errno == EINVAL) {
+        fd = open(path, oflag & ~O_DIRECT, 0);
+    }
+#endif
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    // A descriptor past the table could hold no volume, and handing it
+    // back without one would drop every flag
+    if (fd >= DDFS_MAX_VOLUMES) {
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    struct ddfs_volume *volume = ddfs_calloc(1, sizeof(struct ddfs_volume));
+
+    if (volume == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    volume->fd = fd;
+    volume->flags = flags;
+    pthread_rwlock_init(&volume->keys_lock, NULL);
+    pthread_mutex_init(&volume->pin_lock, NULL);
+    volume->writable = (oflag & O_ACCMODE) != O_RDONLY;
+    volume->backend = detect_backend(fd);
+
+    if (flags & DDFS_OPEN_DISCARD) {
+        volume->discard_min = DDFS_DISCARD_MIN;
+        volume->discard_window = DDFS_DISCARD_WINDOW;
+    }
+
+    if (flags & DDFS_OPEN_DIRECT) {
+        setup_direct(volume);
+    }
+
+    if (flags & DDFS_OPEN_MMAP) {
+        map_volume(volume);
+    }
+
+    if (flags & DDFS_OPEN_URING) {
+        volume->uring = uring_create(fd, DDFS_URING_ENTRIES);
+    }
+
+    volumes[fd] = volume;
+
+    if (load_journal(fd) != EXIT_SUCCESS ||
+        load_groups(fd) != EXIT_SUCCESS ||
+        load_reference_log(fd) != EXIT_SUCCESS ||
+        load_reclaim_queue(fd) != EXIT_SUCCESS ||
+        load_log(fd) != EXIT_SUCCESS ||
+        load_snapshots(fd) != EXIT_SUCCESS) {
+        int saved = errno != 0 ? errno : EIO;
+
+        free_volume(fd);
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    return fd;
+}
+
+// Create an empty image of size bytes that only exists in memory. The
+// image is backed by anonymous shared memory, so it has a descriptor like
+// any other volume and is gone once closed.
+int ddfs_open_memory(uint64_t size) {
+#if defined(__linux__)
+    int fd = memfd_create("ddfs", 0);
+#elif defined(SHM_ANON)
+    int fd = shm_open(SHM_ANON, O_RDWR, 0600);
+#else
+    int fd = -1;
+    errno = EOPNOTSUPP;
+#endif
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    size -= size % DDFS_BLOCK_SIZE;
+    struct ddfs_volume *volume = NULL;
+
+    if (fd >= DDFS_MAX_VOLUMES) {
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    if (size < DDFS_BLOCK_SIZE || ftruncate(fd, size) != 0 ||
+        (volume = ddfs_calloc(1, sizeof(struct ddfs_volume))) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        ddfs_free(volume);
+        close(fd);
+        return -1;
+    }
+
+    volume->fd = fd;
+    volume->flags = DDFS_OPEN_MMAP;
+    pthread_rwlock_init(&volume->keys_lock, NULL);
+    pthread_mutex_init(&volume->pin_lock, NULL);
+    volume->writable = 1;
+    volume->backend = &ddfs_memory_backend;
+    volume->map = map;
+    volume->map_length = size;
+    volumes[fd] = volume;
+    return fd;
+}
+
+int ddfs_close(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume != NULL) {
+        stop_group_zeroing(fd);
+
+        // Committing releases the blocks the journal holds, in time for
+        // the collector to reclaim them
+        ddfs_sync(fd);
+        drain_reclaim_queue(fd);
+        free_reclaim_queue(fd);
+        apply_reference_log(fd);
+        checkpoint_journal(fd);
+        ddfs_sync(fd);
+        free_volume(fd);
+    }
+
+    return close(fd);
+}
+
+// Make the volume's writes durable, including the reference count deltas
+// still in memory. Journaled volumes commit their metadata changes with
+// the same flush, then drop the references the changes released.
+int ddfs_sync(int fd) {
+    if (flush_reference_log(fd) != EXIT_SUCCESS ||
+        commit_journal(fd) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    return release_held_blocks(fd);
+}
+
+// Make the volume's block writes durable
+int flush_volume(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL) {
+        return fsync(fd) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (volume->map != NULL && volume->backend != &ddfs_memory_backend) {
+        if (!volume->writable) {
+            return EXIT_SUCCESS;
+        }
+
+        if (msync(volume->map, volume->map_length, MS_SYNC) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return volume->backend->flush(fd);
+}
+
+// Get the volume attached to a descriptor, or NULL for plain descriptors
+struct ddfs_volume *get_volume(int fd) {
+    if (fd < 0 || fd >= DDFS_MAX_VOLUMES) {
+        return NULL;
+    }
+
+    return volumes[fd];
+}
+
+// Take an aligned block buffer from the volume's pool, or from the calling
+// thread's pool when the volume's is empty or the descriptor has no volume.
+// Threads claim pool buffers by clearing their bit, without a lock.
+uint8_t *get_buffer(int fd) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->pool == NULL) {
+        return get_block_buffer();
+    }
+
+    uint64_t mask = __atomic_load_n(&volume->pool_free, __ATOMIC_RELAXED);
+
+    while (mask != 0) {
+        uint64_t bit = mask & -mask;
+
+        if (__atomic_compare_exchange_n(&volume->pool_free, &mask,
+            mask & ~bit, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return volume->pool + 
+                (size_t)__builtin_ctzll(bit) * DDFS_BLOCK_SIZE;
+        }
+    }
+
+    return get_block_buffer();
+}
+
+// Return a buffer from get_buffer() to the pool it came from
+void put_buffer(int fd, uint8_t *buffer) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (buffer == NULL) {
+        return;
+    }
+
+    if (volume != NULL && volume->pool != NULL && buffer >= volume->pool &&
+        buffer < volume->pool + DDFS_POOL_BUFFERS * DDFS_BLOCK_SIZE) {
+        uint64_t index = (buffer - volume->pool) / DDFS_BLOCK_SIZE;
+
+        __atomic_fetch_or(&volume->pool_free, 1ULL << index,
+            __ATOMIC_RELEASE);
+        return;
+    }
+
+    put_block_buffer(buffer);
+}
+
+// Check whether a buffer can be handed to the volume's I/O calls as is
+int buffer_is_aligned(int fd, const void *buffer) {
+    struct ddfs_volume *volume = get_volume(fd);
+
+    if (volume == NULL || volume->alignment == 0) {
+        return 1;
+    }
+
+    return (uintptr_t)buffer % volume->alignment == 0;
+}
+
+// Get a pool buffer to stand in for a caller buffer that direct I/O cannot
+// use, or NULL when the caller buffer can be used directly
+uint8_t *get_bounce_buffer(int fd, const void *buffer) {
+    if (buffer_is_aligned(fd, buffer)) {
+        return NULL;
+    }
+
+    return get_buffer(fd);
+}
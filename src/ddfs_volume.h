@@ -0,0 +1,83 @@
+#ifndef ddfs_VOLUME_H
+#define	ddfs_VOLUME_H
+
+#include <pthread.h>
+
+#include "ddfs.h"
+
+#define DDFS_MAX_VOLUMES 1024 // Highest descriptor that can hold a volume
+#define DDFS_OPEN_URING 0x1 // Submit batched block I/O through io_uring
+#define DDFS_OPEN_MMAP 0x2 // Access blocks through a mapping of the image
+#define DDFS_OPEN_POPULATE 0x4 // Prefault the mapped metadata regions
+#define DDFS_OPEN_DIRECT 0x8 // Bypass the page cache with O_DIRECT
+#define DDFS_OPEN_ZERO_GROUPS 0x10 // Zero unused inode groups in background
+#define DDFS_OPEN_GC 0x20 // Reclaim unreferenced blocks in background
+#define DDFS_OPEN_DISCARD 0x40 // Discard unreferenced blocks, not zero them
+#define DDFS_OPEN_JOURNAL 0x80 // Journal metadata writes, commit on sync
+#define DDFS_POOL_BUFFERS 64 // Aligned block buffers kept per volume,
+                             // one bit each in pool_free
+
+struct ddfs_backend;
+struct ddfs_gc;
+struct ddfs_journal;
+struct ddfs_log;
+struct ddfs_pin;
+struct ddfs_reflog;
+struct ddfs_snapshots;
+struct ddfs_uring;
+
+// Per-descriptor state of a volume opened with ddfs_open()
+struct ddfs_volume {
+    int fd; // Descriptor of the image or device
+    uint32_t flags; // DDFS_OPEN_* flags the volume was opened with
+    uint8_t writable; // Whether the volume was opened for writing
+    const struct ddfs_backend *backend; // Storage the volume lives on
+    struct ddfs_uring *uring; // io_uring backend, or NULL for plain I/O
+    uint8_t *map; // Mapping of the whole image, or NULL
+    size_t map_length; // Length of the mapping in bytes
+    uint32_t alignment; // Buffer alignment direct I/O needs, or 0
+    uint8_t *pool; // Backing memory of the aligned buffer pool
+    uint64_t pool_free; // Bit i set while pool buffer i is unused
+    uint8_t *groups; // Flags of every inode group, or NULL
+    uint64_t group_count; // Number of inode groups
+    pthread_t zero_thread; // Thread zeroing uninitialized groups
+    uint8_t zeroing; // Whether the zeroing thread is running
+    uint8_t zero_stop; // Tells the zeroing thread to exit
+    struct ddfs_reflog *reflog; // Reference count delta log, or NULL
+    struct ddfs_journal *journal; // Metadata journal, or NULL
+    struct ddfs_gc *gc; // Background block collector, or NULL
+    struct ddfs_log *log; // Segment append state, or NULL if in place
+    struct ddfs_snapshots *snapshots; // Snapshot state, or NULL if the
+                                      // volume is log-structured
+    uint64_t discard_min; // Shortest run of blocks discarded, 0 to zero
+    uint32_t discard_window; // Microseconds freed blocks wait to coalesce
+    pthread_rwlock_t keys_lock; // Taken by key operations on
+                                // log-structured volumes, see lock_keys()
+    uint64_t keys_sequence; // Odd while keys_lock is held for writing
+    pthread_mutex_t pin_lock; // Protects pins
+    struct ddfs_pin *pins; // Blocks views hold, by block number
+    uint32_t pin_count; // Number of blocks in pins
+    uint32_t pin_capacity; // Blocks pins has room for
+};
+
+extern int ddfs_open(const char *path, int oflag, uint32_t flags);
+
+extern int ddfs_open_memory(uint64_t size);
+
+extern int ddfs_close(int fd);
+
+extern int ddfs_sync(int fd);
+
+extern int flush_volume(int fd);
+
+extern struct ddfs_volume *get_volume(int fd);
+
+extern uint8_t *get_buffer(int fd);
+
+extern void put_buffer(int fd, uint8_t *buffer);
+
+extern int buffer_is_aligned(int fd, const void *buffer);
+
+extern uint8_t *get_bounce_buffer(int fd, const void *buffer);
+
+#endif
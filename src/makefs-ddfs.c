@@ -1,13 +1,100 @@
 #include "../src/ddfs.h"
+#include "../src/ddfs_alloc.h"
 #include "../src/ddfs_bitmap.h"
 #include "../src/ddfs_inode.h"
 
+// Parse a size with an optional K, M, G or T suffix, returning 0 when it is
+// not a valid size
+static uint64_t parse_size(const char *str) {
+    char *end;
+    uint64_t size = strtoull(str, &end, 10);
+    uint32_t shift = 0;
+
+    switch (*end) {
+        case 'k': case 'K': shift = 10; break;
+        case 'm': case 'M': shift = 20; break;
+        case 'g': case 'G': shift = 30; break;
+        case 't': case 'T': shift = 40; break;
+        case '\0': break;
+        default: return 0;
+    }
+
+    if (end == str || (*end != '\0' && end[1] != '\0') ||
+        size > (UINT64_MAX >> shift)) {
+        return 0;
+    }
+
+    return size << shift;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: ./makefs-ddfs [-b block-size] "
+        "[-i bytes-per-key | -n key-count] [-l load-factor] "
+        "[-L | -s snapshot-pages] <image-file>\n");
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: ./makefs-ddfs <image-file>\n");
+    struct ddfs_geometry geometry;
+    int opt;
+
+    memset(&geometry, 0, sizeof(struct ddfs_geometry));
+
+    while ((opt = getopt(argc, argv, "b:i:n:l:s:L")) != -1) {
+        // Log-structured layout, the only option without a value
+        if (opt == 'L') {
+            geometry.flags |= DDFS_FS_LOG;
+            continue;
+        }
+
+        uint64_t value = optarg != NULL ? parse_size(optarg) : 0;
+
+        if (value == 0) {
+            usage();
+            return EXIT_FAILURE;
+        }
+
+        switch (opt) {
+            case 'b':
+                // The block size is fixed when the tools are built
+                if (value != DDFS_BLOCK_SIZE) {
+                    fprintf(stderr, "makefs-ddfs: built for %u-byte "
+                        "blocks, rebuild with make BLOCK_SIZE=%lu\n", 
+                        DDFS_BLOCK_SIZE, value);
+                    return EXIT_FAILURE;
+                }
+
+                geometry.block_size = value;
+                break;
+            case 'i':
+                geometry.inode_ratio = value;
+                break;
+            case 'n':
+                geometry.key_count = value;
+                break;
+            case 'l':
+                if (value > 100) {
+                    fprintf(stderr, "makefs-ddfs: the load factor is a "
+                        "percentage\n");
+                    return EXIT_FAILURE;
+                }
+
+                geometry.load_factor = value;
+                break;
+            case 's':
+                geometry.snapshot_pages = value;
+                break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage();
         return EXIT_FAILURE;
     }
 
+    argv += optind - 1;
     int fd = open(argv[1], O_RDWR, 0);
 
     if (fd == -1) {
@@ -24,7 +111,7 @@ int main(int argc, char **argv) {
     if (sb == NULL) {
         perror("read_superblock()");
         close(fd);
-        free(sb);
+        ddfs_free(sb);
         return EXIT_FAILURE;
     }
 
@@ -38,34 +125,26 @@ int main(int argc, char **argv) {
 
         if (answer == 'n' || answer == 'N') {
             close(fd);
-            free(sb);
+            ddfs_free(sb);
             return EXIT_SUCCESS;
         } else if (!(answer == 'y' || answer == 'Y')) {
             close(fd);
-            free(sb);
+            ddfs_free(sb);
             return EXIT_SUCCESS;
         }
 
         disk_already_formatted = 1;
     }
 
-    erase_ifree_blocks(fd);
-    erase_bfree_blocks(fd);
-    erase_inode_store(fd);
+    ddfs_free(sb);
 
-    // Write superblock (block 0)
-    sb = write_superblock(fd);
-    
-    if (sb == NULL) {
-        perror("write_superblock()");
+    // Write the superblock and lay out the regions it describes
+    if (format_ddfs(fd, &geometry) != EXIT_SUCCESS) {
+        perror("format_ddfs()");
         close(fd);
-        free(sb);
         return EXIT_FAILURE;
     }
 
-    initialize_ddfs(fd);
-    free(sb);
-
     if (disk_already_formatted) {
         printf("Disk %s has been reformatted.\n", argv[1]);
     } else {
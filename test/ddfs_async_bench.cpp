@@ -0,0 +1,168 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/ddfs_async.hpp"
+
+extern "C" {
+#include "../src/ddfs_volume.h"
+}
+
+#define BENCH_VOLUME (256ULL << 20) // Volume the benchmark runs on, at least
+#define BENCH_LOOP_THREADS 2 // Loop threads serving the coroutines
+
+// Put or get the keys from first to end one after another, counting the
+// operations that failed
+static ddfs::task<std::uint32_t> run_client(ddfs::Store &store,
+    const std::vector<ddfs::Key> &keys,
+    const std::vector<ddfs::Value> &values, std::uint32_t first,
+    std::uint32_t end, bool get) {
+    std::uint32_t failed = 0;
+
+    for (std::uint32_t i = first; i < end; i++) {
+        if (get) {
+            if ((co_await store.get(keys[i])).empty()) {
+                failed++;
+            }
+        } else if (co_await store.put(keys[i], values[i]) !=
+            ddfs::Status::ok) {
+            failed++;
+        }
+    }
+
+    co_return failed;
+}
+
+// Open and format the volume of a round, on the image with io_uring if one
+// was given
+static int open_volume(const char *path, std::uint64_t size) {
+    int fd = path != NULL ? ddfs_open(path, O_RDWR, DDFS_OPEN_URING) :
+        ddfs_open_memory(size);
+
+    if (fd != -1 && format_ddfs(fd, NULL) != EXIT_SUCCESS) {
+        ddfs_close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Keep outstanding operations in flight, either as one blocking thread per
+// outstanding request or as coroutines on a few loop threads, and put and
+// then get count keys
+static int bench_async(const char *path, std::uint32_t count,
+    std::uint32_t outstanding) {
+    std::vector<ddfs::Key> keys(count);
+    std::vector<ddfs::Value> values(count);
+    std::uint64_t size = 2ULL * count * DDFS_BLOCK_SIZE;
+    const char *models[] = { "thread per request", "coroutines" };
+    const char *rounds[] = { "puts", "gets" };
+
+    for (std::uint32_t i = 0; i < count; i++) {
+        values[i].resize(DDFS_BLOCK_SIZE);
+
+        auto data = reinterpret_cast<std::uint8_t *>(values[i].data());
+        std::uint8_t *result = keys[i].data();
+
+        for (std::uint32_t j = 0; j < DDFS_BLOCK_SIZE; j++) {
+            data[j] = rand();
+        }
+
+        keys[i] = ddfs::Key();
+        hash_block(data, &result);
+    }
+
+    for (int model = 0; model < 2; model++) {
+        int fd = open_volume(path, size > BENCH_VOLUME ? size :
+            BENCH_VOLUME);
+
+        if (fd == -1) {
+            return EXIT_FAILURE;
+        }
+
+        for (int round = 0; round < 2; round++) {
+            bool get = round != 0;
+            std::uint32_t failed = 0;
+            auto start = std::chrono::steady_clock::now();
+
+            if (model == 0) {
+                std::vector<std::thread> threads;
+                std::vector<std::uint32_t> results(outstanding);
+                std::vector<std::uint8_t> buffer(DDFS_BLOCK_SIZE *
+                    outstanding);
+
+                for (std::uint32_t t = 0; t < outstanding; t++) {
+                    threads.emplace_back([&, t] {
+                        std::uint8_t *data = &buffer[DDFS_BLOCK_SIZE * t];
+
+                        for (std::uint32_t i = (std::uint64_t)count * t /
+                            outstanding; i < (std::uint64_t)count * (t + 1) /
+                            outstanding; i++) {
+                            std::uint8_t *key = keys[i].data();
+                            auto value = reinterpret_cast<std::uint8_t *>(
+                                values[i].data());
+
+                            if ((get ? get_value(fd, key, data) :
+                                create_kv_pair(fd, key, value)) != 0) {
+                                results[t]++;
+                            }
+                        }
+                    });
+                }
+
+                for (std::uint32_t t = 0; t < outstanding; t++) {
+                    threads[t].join();
+                    failed += results[t];
+                }
+            } else {
+                ddfs::Store store(fd, BENCH_LOOP_THREADS);
+                std::vector<ddfs::task<std::uint32_t>> clients;
+
+                for (std::uint32_t t = 0; t < outstanding; t++) {
+                    clients.push_back(run_client(store, keys, values,
+                        (std::uint64_t)count * t / outstanding,
+                        (std::uint64_t)count * (t + 1) / outstanding, get));
+                }
+
+                for (std::uint32_t result :
+                    ddfs::sync_wait_all(std::move(clients))) {
+                    failed += result;
+                }
+            }
+
+            std::chrono::duration<double> seconds =
+                std::chrono::steady_clock::now() - start;
+
+            printf("%s, %u outstanding: %u %s in %.3f s (%.0f %s/s, "
+                "%u failed)\n", models[model], outstanding, count,
+                rounds[round], seconds.count(), count / seconds.count(),
+                rounds[round], failed);
+        }
+
+        ddfs_close(fd);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && std::string(argv[1]) == "-h") {
+        fprintf(stderr,
+            "Usage: ./ddfs_async_bench [count] [outstanding] [image-file]\n");
+        return EXIT_FAILURE;
+    }
+
+    std::uint32_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+    std::uint32_t outstanding = argc > 2 ? strtoul(argv[2], NULL, 10) :
+        1000;
+
+    if (outstanding == 0 || outstanding > count) {
+        outstanding = count;
+    }
+
+    srand(time(NULL));
+    return bench_async(argc > 3 ? argv[3] : NULL, count, outstanding);
+}
@@ -0,0 +1,168 @@
+#include <cstdio>
+#include <vector>
+
+#include "../src/ddfs_async.hpp"
+
+extern "C" {
+#include "../src/ddfs_alloc.h"
+#include "../src/ddfs_inode.h"
+#include "../src/ddfs_volume.h"
+}
+
+#define ASYNC_KEYS 2048 // Keys the async test puts, several batches' worth,
+                        // or an eighth of the volume's blocks if fewer
+#define ASYNC_THREADS 2 // Loop threads of the async test's store
+
+// Fill values from their seeds, nudging each seed until no two values
+// share a home block
+static void distinct_values(struct ddfs_superblock *sb,
+    std::vector<ddfs::Value> &values) {
+    std::vector<std::uint8_t> used(sb->info.fs_block_count);
+
+    for (std::uint32_t v = 0; v < values.size(); v++) {
+        std::uint32_t seed = v + 1;
+        std::uint64_t slot;
+
+        values[v].resize(DDFS_BLOCK_SIZE);
+
+        do {
+            auto data = reinterpret_cast<std::uint8_t *>(values[v].data());
+            std::uint8_t fingerprint[20] = { 0 };
+            std::uint8_t *result = fingerprint;
+
+            std::memset(data, seed, DDFS_BLOCK_SIZE);
+            std::memcpy(data, &seed, sizeof(seed));
+            hash_block(data, &result);
+            slot = get_data_block(sb, fingerprint);
+            seed += values.size();
+        } while (used[slot]);
+
+        used[slot] = 1;
+    }
+}
+
+// Fill keys from their numbers, nudged until no two share an inode slot
+static void distinct_keys(struct ddfs_superblock *sb,
+    std::vector<ddfs::Key> &keys) {
+    std::vector<std::uint8_t> used(sb->info.fs_inode_count);
+
+    for (std::uint32_t i = 0; i < keys.size(); i++) {
+        std::uint64_t slot;
+
+        keys[i] = ddfs::Key();
+        std::memcpy(keys[i].data(), &i, sizeof(i));
+
+        // Inode 0 belongs to the superblock
+        while ((slot = key_hash(keys[i].data(),
+            sb->info.fs_inode_count)) == 0 || used[slot]) {
+            keys[i][19]++;
+        }
+
+        used[slot] = 1;
+    }
+}
+
+// Put a value and read it straight back
+static ddfs::task<int> put_then_get(ddfs::Store &store, const ddfs::Key &key,
+    const ddfs::Value &value) {
+    if (co_await store.put(key, value) != ddfs::Status::ok) {
+        co_return EXIT_FAILURE;
+    }
+
+    ddfs::Value read = co_await store.get(key);
+
+    co_return read == value ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main() {
+    int fd = ddfs_open_memory(64 * 1024 * 1024);
+    struct ddfs_superblock *sb = NULL;
+    std::vector<ddfs::Key> keys;
+    std::vector<ddfs::Value> values;
+    int ret = EXIT_SUCCESS;
+
+    if (fd == -1 || format_ddfs(fd, NULL) != 0 ||
+        (sb = get_superblock(fd)) == NULL) {
+        printf("Test ddfs::Store setup unsuccessful\n\n");
+        return EXIT_FAILURE;
+    }
+
+    std::uint32_t count = sb->info.fs_block_count / 8 < ASYNC_KEYS ?
+        sb->info.fs_block_count / 8 : ASYNC_KEYS;
+
+    keys.resize(count);
+    values.resize(count);
+    distinct_values(sb, values);
+    distinct_keys(sb, keys);
+    put_block_buffer(sb);
+
+    {
+        ddfs::Store store(fd, ASYNC_THREADS);
+        std::vector<ddfs::task<ddfs::Status>> puts;
+        std::vector<ddfs::task<ddfs::Value>> gets;
+
+        // A missing key reads as empty, an oversized value fails, a short
+        // one is padded and a coroutine reads its own put. The keys are
+        // deleted again, freeing their blocks for the values below.
+        ddfs::Key missing = keys[0];
+        ddfs::Value oversized(DDFS_BLOCK_SIZE + 1);
+        ddfs::Value padded = values[1];
+
+        missing[19] ^= 0x80;
+        std::memset(padded.data() + DDFS_BLOCK_SIZE / 2, 0,
+            DDFS_BLOCK_SIZE / 2);
+
+        if (!ddfs::sync_wait(store.get(missing)).empty() ||
+            ddfs::sync_wait(store.put(missing, oversized)) !=
+            ddfs::Status::error ||
+            ddfs::sync_wait(store.put(missing, std::span(padded.data(),
+            DDFS_BLOCK_SIZE / 2))) != ddfs::Status::ok ||
+            ddfs::sync_wait(store.get(missing)) != padded ||
+            delete_kv_pair(fd, missing.data()) != 0 ||
+            ddfs::sync_wait(put_then_get(store, keys[0], values[0])) != 0 ||
+            delete_kv_pair(fd, keys[0].data()) != 0) {
+            ret = EXIT_FAILURE;
+        }
+
+        if (ret == EXIT_SUCCESS) {
+            printf("Test ddfs::Store edge cases successful\n\n");
+        } else {
+            printf("Test ddfs::Store edge cases unsuccessful\n\n");
+        }
+
+        ret = EXIT_SUCCESS;
+
+        // Every put is outstanding at once, spanning several batches
+        for (std::uint32_t i = 0; i < count; i++) {
+            puts.push_back(store.put(keys[i], values[i]));
+        }
+
+        for (ddfs::Status status : ddfs::sync_wait_all(std::move(puts))) {
+            if (status != ddfs::Status::ok) {
+                ret = EXIT_FAILURE;
+            }
+        }
+
+        for (std::uint32_t i = 0; i < count; i++) {
+            gets.push_back(store.get(keys[i]));
+        }
+
+        std::vector<ddfs::Value> read = ddfs::sync_wait_all(std::move(gets));
+
+        for (std::uint32_t i = 0; i < count; i++) {
+            if (read[i] != values[i]) {
+                ret = EXIT_FAILURE;
+            }
+        }
+
+        if (ret == EXIT_SUCCESS) {
+            printf("Test ddfs::Store outstanding operations successful\n\n");
+        } else {
+            printf("Test ddfs::Store outstanding operations "
+                "unsuccessful\n\n");
+        }
+    }
+
+    ddfs_close(fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,776 @@
+#include <pthread.h>
+
+#include "../src/ddfs.h"
+#include "../src/ddfs_alloc.h"
+#include "../src/ddfs_batch.h"
+#include "../src/ddfs_bitmap.h"
+#include "../src/ddfs_inode.h"
+#include "../src/ddfs_pool.h"
+#include "../src/ddfs_uring.h"
+#include "../src/ddfs_volume.h"
+
+#define BENCH_SEEK_US 8000 // Average seek and rotation of a modelled disk
+#define BENCH_DISK_MBPS 150 // Streaming bandwidth of a modelled disk
+#define BENCH_LOG_BATCH 256 // Puts per batch and sync in the log benchmark
+#define BENCH_SKIP_BLOCKS 8 // Forward skip a modelled disk streams over
+#define BENCH_POOL_BATCH 512 // Puts per batch in the worker pool benchmark
+#define BENCH_THREAD_VOLUME (256ULL << 20) // Memory volume of the thread
+                                           // benchmark, at least
+
+// Keys one thread of the thread benchmark puts or gets
+struct bench_thread {
+    int fd; // Volume under test
+    uint8_t (*keys)[20]; // Keys of the thread
+    uint8_t **values; // Values of the keys
+    uint32_t count; // Number of keys
+    uint8_t get; // Whether to get the keys rather than put them
+    uint8_t *stop; // Set to stop a writer changing the keys, or NULL
+};
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) +
+        (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Fill values with random data and derive each key from its value
+static void generate_pairs(uint8_t keys[][20], uint8_t **values,
+    uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < DDFS_BLOCK_SIZE; j++) {
+            values[i][j] = rand();
+        }
+
+        memset(keys[i], 0, 20);
+        uint8_t *result = keys[i];
+        hash_block(values[i], &result);
+    }
+}
+
+// Compare one create_kv_pair() per key with ddfs_put_batch() at increasing
+// batch sizes
+static int bench_put(int fd, uint32_t count) {
+    uint32_t batch_sizes[] = { 1, 8, 64, 512, 4096 };
+    uint8_t (*keys)[20] = malloc(count * sizeof(*keys));
+    uint8_t **values = malloc(count * sizeof(uint8_t *));
+    int *status = malloc(count * sizeof(int));
+    struct timespec start;
+    struct timespec end;
+
+    if (keys == NULL || values == NULL || status == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        values[i] = malloc(DDFS_BLOCK_SIZE);
+
+        if (values[i] == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    generate_pairs(keys, values, count);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (uint32_t i = 0; i < count; i++) {
+        create_kv_pair(fd, keys[i], values[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("create_kv_pair: %u puts in %.3f s (%.0f puts/s)\n", count,
+        elapsed_seconds(&start, &end),
+        count / elapsed_seconds(&start, &end));
+
+    for (uint8_t b = 0; b < sizeof(batch_sizes) / sizeof(uint32_t); b++) {
+        uint32_t batch_size = batch_sizes[b];
+        uint32_t failures = 0;
+
+        generate_pairs(keys, values, count);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (uint32_t i = 0; i < count; i += batch_size) {
+            uint32_t n = count - i < batch_size ? count - i : batch_size;
+            ddfs_put_batch(fd, keys + i, values + i, n, status + i);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        for (uint32_t i = 0; i < count; i++) {
+            failures += status[i] != EXIT_SUCCESS;
+        }
+
+        printf("ddfs_put_batch(%u): %u puts in %.3f s (%.0f puts/s), "
+            "%u failed\n", batch_size, count, elapsed_seconds(&start, &end),
+            count / elapsed_seconds(&start, &end), failures);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        free(values[i]);
+    }
+
+    free(keys);
+    free(values);
+    free(status);
+    return EXIT_SUCCESS;
+}
+
+// Compare one get_value() per key with ddfs_get_batch() at increasing batch
+// sizes, fetching the keys in random order, then through a mapped volume
+// and with O_DIRECT
+static int bench_get(int fd, const char *path, uint32_t count) {
+    uint32_t batch_sizes[] = { 1, 8, 64, 512, 4096 };
+    uint8_t (*keys)[20] = malloc(count * sizeof(*keys));
+    uint8_t **values = malloc(count * sizeof(uint8_t *));
+    int *status = malloc(count * sizeof(int));
+    struct timespec start;
+    struct timespec end;
+
+    if (keys == NULL || values == NULL || status == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        values[i] = malloc(DDFS_BLOCK_SIZE);
+
+        if (values[i] == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    generate_pairs(keys, values, count);
+    ddfs_put_batch(fd, keys, values, count, status);
+
+    for (uint32_t i = count - 1; i > 0; i--) {
+        uint32_t j = rand() % (i + 1);
+        uint8_t key[20];
+
+        memcpy(key, keys[i], 20);
+        memcpy(keys[i], keys[j], 20);
+        memcpy(keys[j], key, 20);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (uint32_t i = 0; i < count; i++) {
+        get_value(fd, keys[i], values[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("get_value: %u gets in %.3f s (%.0f gets/s)\n", count,
+        elapsed_seconds(&start, &end),
+        count / elapsed_seconds(&start, &end));
+
+    for (uint8_t b = 0; b < sizeof(batch_sizes) / sizeof(uint32_t); b++) {
+        uint32_t batch_size = batch_sizes[b];
+        uint32_t failures = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (uint32_t i = 0; i < count; i += batch_size) {
+            uint32_t n = count - i < batch_size ? count - i : batch_size;
+            ddfs_get_batch(fd, keys + i, values + i, n, status + i);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        for (uint32_t i = 0; i < count; i++) {
+            failures += status[i] != EXIT_SUCCESS;
+        }
+
+        printf("ddfs_get_batch(%u): %u gets in %.3f s (%.0f gets/s), "
+            "%u failed\n", batch_size, count, elapsed_seconds(&start, &end),
+            count / elapsed_seconds(&start, &end), failures);
+    }
+
+    int map_fd = ddfs_open(path, O_RDONLY, DDFS_OPEN_MMAP | DDFS_OPEN_POPULATE);
+    struct ddfs_volume *volume = get_volume(map_fd);
+
+    if (volume != NULL && volume->map != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (uint32_t i = 0; i < count; i++) {
+            get_value(map_fd, keys[i], values[i]);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("get_value (mmap): %u gets in %.3f s (%.0f gets/s)\n", count,
+            elapsed_seconds(&start, &end),
+            count / elapsed_seconds(&start, &end));
+    }
+
+    if (map_fd != -1) {
+        ddfs_close(map_fd);
+    }
+
+    int direct_fd = ddfs_open(path, O_RDONLY, DDFS_OPEN_DIRECT);
+    volume = get_volume(direct_fd);
+
+    if (volume != NULL && volume->alignment != 0) {
+        uint8_t *buffer = get_buffer(direct_fd);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (uint32_t i = 0; i < count; i++) {
+            get_value(direct_fd, keys[i], buffer);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        put_buffer(direct_fd, buffer);
+        printf("get_value (O_DIRECT): %u gets in %.3f s (%.0f gets/s)\n", 
+            count, elapsed_seconds(&start, &end),
+            count / elapsed_seconds(&start, &end));
+    }
+
+    if (direct_fd != -1) {
+        ddfs_close(direct_fd);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        free(values[i]);
+    }
+
+    free(keys);
+    free(values);
+    free(status);
+    return EXIT_SUCCESS;
+}
+
+// Random block reads across the image, first one synchronous read at a
+// time, then as batches of runs through the io_uring backend at
+// increasing queue depths
+static int bench_queue_depth(int fd, const char *path, uint32_t count) {
+    uint32_t depths[] = { 1, 4, 16, 64, 128 };
+    struct ddfs_io_run runs[128];
+    void *buffers[128];
+    struct timespec start;
+    struct timespec end;
+    int uring_fd = ddfs_open(path, O_RDONLY, DDFS_OPEN_URING);
+    struct ddfs_volume *volume = get_volume(uring_fd);
+    uint64_t block_count = lseek(fd, 0, SEEK_END) / DDFS_BLOCK_SIZE;
+
+    if (uring_fd == -1 || block_count == 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (volume == NULL || volume->uring == NULL) {
+        printf("io_uring unavailable, using synchronous I/O\n");
+    }
+
+    uint8_t *region = volume != NULL ?
+        uring_claim_buffers(volume->uring, 128) : NULL;
+
+    for (uint32_t i = 0; i < 128; i++) {
+        buffers[i] = region != NULL ? 
+            region + ((size_t)i * DDFS_BLOCK_SIZE) : NULL;
+
+        if (buffers[i] == NULL && 
+            posix_memalign(&buffers[i], DDFS_BLOCK_SIZE, DDFS_BLOCK_SIZE)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (uint32_t i = 0; i < count; i++) {
+        read_block(fd, buffers[0], rand() % block_count);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("read_block: %u reads in %.3f s (%.0f IOPS, %.1f us latency)\n", 
+        count, elapsed_seconds(&start, &end), 
+        count / elapsed_seconds(&start, &end),
+        elapsed_seconds(&start, &end) * 1e6 / count);
+
+    for (uint8_t d = 0; d < sizeof(depths) / sizeof(uint32_t); d++) {
+        uint32_t depth = depths[d];
+        uint32_t failures = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (uint32_t i = 0; i < count; i += depth) {
+            for (uint32_t j = 0; j < depth; j++) {
+                runs[j] = (struct ddfs_io_run) {
+                    .block_number = rand() % block_count,
+                    .count = 1,
+                    .buffers = &buffers[j]
+                };
+            }
+
+            read_runs(uring_fd, runs, depth);
+
+            for (uint32_t j = 0; j < depth; j++) {
+                failures += runs[j].result == -1;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        // Every request of a batch waits for the whole batch, so the batch
+        // time is the per-request latency at this queue depth
+        uint32_t reads = ((count + depth - 1) / depth) * depth;
+        printf("read_runs(QD %u): %u reads in %.3f s (%.0f IOPS, "
+            "%.1f us latency), %u failed\n", depth, reads, 
+            elapsed_seconds(&start, &end), 
+            reads / elapsed_seconds(&start, &end),
+            elapsed_seconds(&start, &end) * 1e6 * depth / reads, failures);
+    }
+
+    for (uint32_t i = 0; region == NULL && i < 128; i++) {
+        free(buffers[i]);
+    }
+
+    uring_release_buffers(volume != NULL ? volume->uring : NULL, region, 128);
+
+    ddfs_close(uring_fd);
+    return EXIT_SUCCESS;
+}
+
+// Time durable puts: create_kv_pair() followed by ddfs_sync() every
+// group_size puts, without and with the metadata journal
+static int bench_sync(const char *path, uint32_t count) {
+    uint32_t group_sizes[] = { 1, 16, 256 };
+    uint32_t flags[] = { 0, DDFS_OPEN_JOURNAL };
+    uint8_t (*keys)[20] = malloc(count * sizeof(*keys));
+    uint8_t **values = malloc(count * sizeof(uint8_t *));
+    struct timespec start;
+    struct timespec end;
+
+    if (keys == NULL || values == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        values[i] = malloc(DDFS_BLOCK_SIZE);
+
+        if (values[i] == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (uint8_t f = 0; f < sizeof(flags) / sizeof(uint32_t); f++) {
+        for (uint8_t g = 0; g < sizeof(group_sizes) / sizeof(uint32_t); g++) {
+            uint32_t group_size = group_sizes[g];
+            int fd = ddfs_open(path, O_RDWR, flags[f]);
+
+            if (fd == -1) {
+                return EXIT_FAILURE;
+            }
+
+            generate_pairs(keys, values, count);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            for (uint32_t i = 0; i < count; i++) {
+                create_kv_pair(fd, keys[i], values[i]);
+
+                if (i % group_size == group_size - 1 || i == count - 1) {
+                    ddfs_sync(fd);
+                }
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            printf("%s, sync every %u: %u puts in %.3f s (%.0f puts/s)\n",
+                flags[f] ? "journal" : "no journal", group_size, count,
+                elapsed_seconds(&start, &end),
+                count / elapsed_seconds(&start, &end));
+            ddfs_close(fd);
+        }
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        free(values[i]);
+    }
+
+    free(keys);
+    free(values);
+    return EXIT_SUCCESS;
+}
+
+// Time formatting the whole image
+static int compare_blocks(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Ingest random keys into the image formatted in place, then
+// log-structured. Both journal their metadata and bypass the page cache,
+// so they differ in where the data blocks land. The measured rate is the
+// image's own, which stands for an SSD; for a disk, a seek is charged for
+// every data write that lands before the previous one or more than
+// BENCH_SKIP_BLOCKS past it, with each batch's writes in ascending order
+// as they are issued. The short skips are holes left by puts that failed
+// on a taken inode slot.
+static int bench_log(const char *path, uint32_t count) {
+    uint32_t layouts[] = { 0, DDFS_FS_LOG };
+    uint8_t (*keys)[20] = malloc(count * sizeof(*keys));
+    uint8_t **values = malloc(count * sizeof(uint8_t *));
+    uint64_t *blocks = malloc(BENCH_LOG_BATCH * sizeof(uint64_t));
+    int status[BENCH_LOG_BATCH];
+    struct timespec start;
+    struct timespec end;
+
+    if (keys == NULL || values == NULL || blocks == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        values[i] = malloc(DDFS_BLOCK_SIZE);
+
+        if (values[i] == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (uint8_t l = 0; l < sizeof(layouts) / sizeof(uint32_t); l++) {
+        struct ddfs_geometry geometry = { .flags = layouts[l] };
+        int fd = ddfs_open(path, O_RDWR, 
+            DDFS_OPEN_DIRECT | DDFS_OPEN_JOURNAL);
+
+        if (fd == -1 || format_ddfs(fd, &geometry) != EXIT_SUCCESS) {
+            fprintf(stderr, "format_ddfs() failed\n");
+            return EXIT_FAILURE;
+        }
+
+        uint32_t failures = 0;
+        generate_pairs(keys, values, count);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (uint32_t i = 0; i < count; i += BENCH_LOG_BATCH) {
+            uint32_t n = count - i < BENCH_LOG_BATCH ? 
+                count - i : BENCH_LOG_BATCH;
+
+            ddfs_put_batch(fd, keys + i, values + i, n, status);
+            ddfs_sync(fd);
+
+            for (uint32_t j = 0; j < n; j++) {
+                failures += status[j] != EXIT_SUCCESS;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        uint64_t seeks = 0;
+        int64_t previous = -1;
+
+        for (uint32_t i = 0; i < count; i += BENCH_LOG_BATCH) {
+            uint32_t n = 0;
+
+            for (uint32_t j = i; j < count && j < i + BENCH_LOG_BATCH; j++) {
+                int64_t block = get_value_block(fd, keys[j]);
+
+                if (block != -1) {
+                    blocks[n++] = block;
+                }
+            }
+
+            qsort(blocks, n, sizeof(uint64_t), compare_blocks);
+
+            for (uint32_t j = 0; j < n; j++) {
+                if (previous == -1 || blocks[j] <= (uint64_t)previous ||
+                    blocks[j] > (uint64_t)previous + BENCH_SKIP_BLOCKS) {
+                    seeks++;
+                }
+
+                previous = blocks[j];
+            }
+        }
+
+        double seconds = elapsed_seconds(&start, &end);
+        double disk_seconds = seeks * (BENCH_SEEK_US / 1e6) + 
+            (double)count * DDFS_BLOCK_SIZE / (BENCH_DISK_MBPS * 1e6);
+
+        printf("%s: %u puts in %.3f s (%.0f puts/s), %u failed\n",
+            layouts[l] ? "log-structured" : "in place", count, seconds, 
+            count / seconds, failures);
+        printf("%s: %lu data seeks, modelled disk %.3f s (%.0f puts/s)\n",
+            layouts[l] ? "log-structured" : "in place", seeks, 
+            disk_seconds, count / disk_seconds);
+        ddfs_close(fd);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        free(values[i]);
+    }
+
+    free(keys);
+    free(values);
+    free(blocks);
+    return EXIT_SUCCESS;
+}
+
+// Put or get the keys of one thread, or keep giving them each other's
+// values until told to stop
+static void *bench_thread_run(void *arg) {
+    struct bench_thread *thread = arg;
+    uint8_t *buffer = get_block_buffer();
+
+    for (uint32_t i = 0; thread->stop != NULL &&
+        !__atomic_load_n(thread->stop, __ATOMIC_ACQUIRE); i++) {
+        modify_value(thread->fd, thread->keys[i % thread->count],
+            thread->values[(i + 1) % thread->count]);
+    }
+
+    for (uint32_t i = 0; thread->stop == NULL && buffer != NULL &&
+        i < thread->count; i++) {
+        if (thread->get) {
+            get_value(thread->fd, thread->keys[i], buffer);
+        } else {
+            create_kv_pair(thread->fd, thread->keys[i], thread->values[i]);
+        }
+    }
+
+    put_block_buffer(buffer);
+    return NULL;
+}
+
+// Time puts and then gets of disjoint keys on a memory volume, split over
+// a doubling number of threads up to the number of online processors, and
+// the gets again while one more thread keeps changing the keys
+static int bench_threads(uint32_t count) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t max_threads = processors > 1 ? processors : 1;
+    uint64_t size = (uint64_t)count * DDFS_BLOCK_SIZE * 4;
+    uint8_t (*keys)[20] = malloc(count * sizeof(*keys));
+    uint8_t **values = malloc(count * sizeof(uint8_t *));
+    pthread_t *threads = malloc((max_threads + 1) * sizeof(pthread_t));
+    struct bench_thread *args = malloc((max_threads + 1) *
+        sizeof(struct bench_thread));
+    const char *rounds[] = { "puts", "gets", "gets with a writer" };
+    uint8_t stop;
+    struct ddfs_geometry geometry = { 0 };
+    struct timespec start;
+    struct timespec end;
+
+    if (keys == NULL || values == NULL || threads == NULL || args == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        values[i] = malloc(DDFS_BLOCK_SIZE);
+
+        if (values[i] == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    generate_pairs(keys, values, count);
+
+    // The last round always runs every processor
+    for (uint32_t n = 1; n != 0; n = n == max_threads ? 0 :
+        n * 2 < max_threads ? n * 2 : max_threads) {
+        int fd = ddfs_open_memory(size > BENCH_THREAD_VOLUME ? size :
+            BENCH_THREAD_VOLUME);
+
+        if (fd == -1 || format_ddfs(fd, &geometry) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+
+        for (uint8_t round = 0; round < 3; round++) {
+            uint8_t writer = round == 2;
+
+            stop = 0;
+
+            if (writer) {
+                args[n] = (struct bench_thread) {
+                    .fd = fd,
+                    .keys = keys,
+                    .values = values,
+                    .count = count,
+                    .stop = &stop
+                };
+                pthread_create(&threads[n], NULL, bench_thread_run,
+                    &args[n]);
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            for (uint32_t t = 0; t < n; t++) {
+                uint32_t first = (uint64_t)count * t / n;
+
+                args[t] = (struct bench_thread) {
+                    .fd = fd,
+                    .keys = keys + first,
+                    .values = values + first,
+                    .count = (uint64_t)count * (t + 1) / n - first,
+                    .get = round != 0
+                };
+                pthread_create(&threads[t], NULL, bench_thread_run,
+                    &args[t]);
+            }
+
+            for (uint32_t t = 0; t < n; t++) {
+                pthread_join(threads[t], NULL);
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+
+            if (writer) {
+                pthread_join(threads[n], NULL);
+            }
+
+            printf("%u thread%s: %u %s in %.3f s (%.0f %s/s)\n", n,
+                n == 1 ? "" : "s", count, rounds[round],
+                elapsed_seconds(&start, &end),
+                count / elapsed_seconds(&start, &end),
+                round != 0 ? "gets" : "puts");
+        }
+
+        ddfs_close(fd);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        free(values[i]);
+    }
+
+    free(keys);
+    free(values);
+    free(threads);
+    free(args);
+    return EXIT_SUCCESS;
+}
+
+// Time fingerprinting, formatting a memory volume and batched puts on
+// the calling thread alone and then with the default worker pool
+static int bench_pool(uint32_t count) {
+    uint32_t worker_counts[] = { 0, ddfs_get_workers() };
+    uint64_t size = (uint64_t)count * DDFS_BLOCK_SIZE * 4;
+    uint8_t (*keys)[20] = malloc(count * sizeof(*keys));
+    uint8_t **values = malloc(count * sizeof(uint8_t *));
+    uint8_t **fingerprints = malloc(count * sizeof(uint8_t *));
+    int *status = malloc(count * sizeof(int));
+    struct timespec start;
+    struct timespec end;
+
+    if (keys == NULL || values == NULL || fingerprints == NULL ||
+        status == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        values[i] = malloc(DDFS_BLOCK_SIZE);
+        fingerprints[i] = keys[i];
+
+        if (values[i] == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    generate_pairs(keys, values, count);
+
+    for (uint8_t w = 0; w < sizeof(worker_counts) / sizeof(uint32_t); w++) {
+        int fd = ddfs_open_memory(size > BENCH_THREAD_VOLUME ? size :
+            BENCH_THREAD_VOLUME);
+
+        if (fd == -1 || ddfs_set_workers(worker_counts[w]) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+
+        memset(keys, 0, count * sizeof(*keys));
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        hash_blocks(values, fingerprints, count, DDFS_POOL_FOREGROUND);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%u workers, hash_blocks(): %u blocks in %.3f s "
+            "(%.0f MB/s)\n", worker_counts[w], count,
+            elapsed_seconds(&start, &end), (double)count * DDFS_BLOCK_SIZE /
+            (1 << 20) / elapsed_seconds(&start, &end));
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (initialize_ddfs(fd) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%u workers, initialize_ddfs(): %ld bytes in %.3f s\n",
+            worker_counts[w], (long)get_disk_media_size(fd),
+            elapsed_seconds(&start, &end));
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (uint32_t i = 0; i < count; i += BENCH_POOL_BATCH) {
+            uint32_t n = count - i < BENCH_POOL_BATCH ? count - i :
+                BENCH_POOL_BATCH;
+            ddfs_put_batch(fd, keys + i, values + i, n, status + i);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%u workers, ddfs_put_batch(%u): %u puts in %.3f s "
+            "(%.0f puts/s)\n", worker_counts[w], BENCH_POOL_BATCH, count,
+            elapsed_seconds(&start, &end),
+            count / elapsed_seconds(&start, &end));
+        ddfs_close(fd);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        free(values[i]);
+    }
+
+    free(keys);
+    free(values);
+    free(fingerprints);
+    free(status);
+    return EXIT_SUCCESS;
+}
+
+static int bench_format(int fd) {
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = initialize_ddfs(fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (ret != EXIT_SUCCESS) {
+        fprintf(stderr, "initialize_ddfs() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("initialize_ddfs(): %ld bytes in %.3f s\n", 
+        (long)get_disk_media_size(fd), elapsed_seconds(&start, &end));
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr,
+            "Usage: ./ddfs_bench <image-file> "
+            "<put|get|qd|sync|log|threads|pool|mkfs> [count]\n");
+        return EXIT_FAILURE;
+    }
+
+    uint32_t count = argc > 3 ? strtoul(argv[3], NULL, 10) : 10000;
+    int fd = open(argv[1], O_RDWR, 0);
+
+    if (fd == -1) {
+        char str[80];
+        sprintf(str, "open(): %s", argv[1]);
+        perror(str);
+        return EXIT_FAILURE;
+    }
+
+    srand(time(NULL));
+    int ret;
+
+    if (strcmp(argv[2], "put") == 0) {
+        ret = bench_put(fd, count);
+    } else if (strcmp(argv[2], "get") == 0) {
+        ret = bench_get(fd, argv[1], count);
+    } else if (strcmp(argv[2], "qd") == 0) {
+        ret = bench_queue_depth(fd, argv[1], count);
+    } else if (strcmp(argv[2], "sync") == 0) {
+        ret = bench_sync(argv[1], count);
+    } else if (strcmp(argv[2], "log") == 0) {
+        ret = bench_log(argv[1], count);
+    } else if (strcmp(argv[2], "threads") == 0) {
+        ret = bench_threads(count);
+    } else if (strcmp(argv[2], "pool") == 0) {
+        ret = bench_pool(count);
+    } else if (strcmp(argv[2], "mkfs") == 0) {
+        ret = bench_format(fd);
+    } else {
+        fprintf(stderr, "Unknown benchmark: %s\n", argv[2]);
+        ret = EXIT_FAILURE;
+    }
+
+    close(fd);
+    return ret;
+}
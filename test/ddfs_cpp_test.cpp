@@ -0,0 +1,139 @@
+#include <cstdio>
+#include <vector>
+
+#include "../src/ddfs.hpp"
+
+// Keys parse at compile time
+static_assert(ddfs::Key::from_hex(
+    "00112233445566778899aabbccddeeffAABBCCDD").has_value());
+static_assert(ddfs::Key::from_hex(
+    "00112233445566778899aabbccddeeffAABBCCDD").value()[19] == 0xdd);
+static_assert(ddfs::Key::from_hex(
+    "00112233445566778899aabbccddeeffAABBCCD").error() ==
+    ddfs::Error::bad_key);
+static_assert(ddfs::Key::from_hex(
+    "00112233445566778899aabbccddeeffAABBCCDx").error() ==
+    ddfs::Error::bad_key);
+
+int main() {
+    char file_name[] = "0123456789abcdef0123456789ABCDEF01234567";
+    std::uint8_t c_key[20];
+    int ret = EXIT_SUCCESS;
+
+    // The parser agrees with file_name_to_key() and the inlined geometry
+    // with the library's
+    file_name_to_key(file_name, c_key);
+
+    ddfs::Key key = ddfs::Key::from_hex(file_name).value();
+    ddfs::Expected<ddfs::Volume> opened = ddfs::Volume::open_memory(
+        64 * 1024 * 1024);
+
+    if (key != ddfs::Key::from_bytes(c_key) || !opened ||
+        opened->geometry().inode_count() != 0 || !opened->format()) {
+        printf("Test ddfs::Key and ddfs::Volume setup unsuccessful\n\n");
+        return EXIT_FAILURE;
+    }
+
+    ddfs::Volume volume = std::move(opened.value());
+    ddfs_superblock *sb = get_superblock(volume.fd());
+    const ddfs::Geometry &geometry = volume.geometry();
+
+    if (sb == nullptr) {
+        return EXIT_FAILURE;
+    }
+
+    for (std::uint32_t i = 0; i < 256; i++) {
+        std::uint64_t block;
+        std::uint32_t offset;
+
+        key[0] = i;
+        get_inode_location(sb, key_hash(key.data(), sb->info.fs_inode_count),
+            &block, &offset);
+
+        ddfs::Geometry::InodeLocation location =
+            geometry.inode_location(geometry.inode_number(key));
+
+        if (geometry.inode_number(key) != key_hash(key.data(),
+            sb->info.fs_inode_count) || location.block != block ||
+            location.offset != offset ||
+            geometry.home_block(key) != get_data_block(sb, key.data())) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    put_block_buffer(sb);
+
+    if (ret == EXIT_SUCCESS) {
+        printf("Test ddfs::Key and ddfs::Geometry successful\n\n");
+    } else {
+        printf("Test ddfs::Key and ddfs::Geometry unsuccessful\n\n");
+    }
+
+    // Key operations through spans, with sizes checked up front
+    std::vector<std::uint8_t> value(ddfs::block_size, 0x5a);
+    std::vector<std::uint8_t> other(ddfs::block_size, 0xa5);
+    std::vector<std::uint8_t> read(ddfs::block_size);
+    std::uint8_t small[16];
+    ddfs::Key renamed = key;
+
+    renamed[1] ^= 0xff;
+    ret = EXIT_SUCCESS;
+
+    if (volume.put(key, ddfs::Span<const std::uint8_t>(value.data(), 16))
+        .error() != ddfs::Error::bad_size ||
+        volume.get(key, small).error() != ddfs::Error::bad_size ||
+        volume.get(key, read) || !volume.put(key, value) ||
+        !volume.get(key, read) || read != value ||
+        !volume.value_block(key)) {
+        ret = EXIT_FAILURE;
+    }
+
+    // Inodes go back to their slab with their handle
+    ddfs::Expected<ddfs::Inode> inode = volume.inode(
+        geometry.inode_number(key));
+
+    if (!inode || std::memcmp((*inode)->info.i_key, key.data(), 20) != 0) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (!volume.modify(key, other) ||
+        !volume.get(key, read) || read != other ||
+        !volume.rename(key, renamed) || volume.get(key, read) ||
+        !volume.erase(renamed) || volume.get(renamed, read)) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        printf("Test ddfs::Volume key operations successful\n\n");
+    } else {
+        printf("Test ddfs::Volume key operations unsuccessful\n\n");
+    }
+
+    // Batches fail as a whole if any key did
+    std::vector<std::uint8_t> read_other(ddfs::block_size);
+    ddfs::Key keys[2] = { key, renamed };
+    std::uint8_t *values[2] = { value.data(), other.data() };
+    std::uint8_t *results[2] = { read.data(), read_other.data() };
+    int status[2];
+
+    ret = EXIT_SUCCESS;
+
+    if (!volume.put_batch(keys, values, status) ||
+        !volume.get_batch(keys, results, status) || read != value ||
+        read_other != other ||
+        !volume.erase(renamed) ||
+        volume.get_batch(keys, results, status) ||
+        status[0] != EXIT_SUCCESS || status[1] == EXIT_SUCCESS ||
+        volume.put_batch(keys, ddfs::Span<std::uint8_t *const>(values, 1),
+        status).error() != ddfs::Error::bad_size) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        printf("Test ddfs::Volume batches successful\n\n");
+    } else {
+        printf("Test ddfs::Volume batches unsuccessful\n\n");
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -1,6 +1,274 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
 #include "../src/ddfs.h"
+#include "../src/ddfs_alloc.h"
+#include "../src/ddfs_batch.h"
 #include "../src/ddfs_bitmap.h"
+#include "../src/ddfs_gc.h"
+#include "../src/ddfs_group.h"
 #include "../src/ddfs_inode.h"
+#include "../src/ddfs_journal.h"
+#include "../src/ddfs_log.h"
+#include "../src/ddfs_pool.h"
+#include "../src/ddfs_refcount.h"
+#include "../src/ddfs_snapshot.h"
+#include "../src/ddfs_view.h"
+#include "../src/ddfs_volume.h"
+
+#define STRESS_THREADS 4 // Threads of the concurrency test
+#define STRESS_KEYS 128 // Keys each thread of the concurrency test owns
+#define STRESS_VALUES 16 // Values the threads' keys share, twice over
+#define STRESS_BATCH 32 // Keys per ddfs_put_batch() of the concurrency test
+#define SNAPSHOT_KEYS 64 // Keys of the snapshot test
+#define URING_KEYS 32 // Keys of the io_uring test
+
+// Keys one thread of the concurrency test works on
+struct stress_args {
+    int fd; // Volume under test
+    uint8_t (*keys)[20]; // STRESS_KEYS keys of the thread
+    uint8_t **values; // 2 * STRESS_VALUES values shared by every thread
+    int ret; // Result of the thread
+};
+
+// Fill values from their seeds, nudging each seed until no two values
+// share a home block, or an index slot on log-structured volumes
+static int distinct_values(struct ddfs_superblock *sb, uint8_t **values,
+    uint32_t count, int log) {
+    uint8_t *used = calloc(sb->info.fs_block_count, 1);
+
+    if (used == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t v = 0; v < count; v++) {
+        uint8_t fingerprint[20];
+        uint32_t seed = v + 1;
+        uint64_t slot;
+
+        do {
+            memset(values[v], seed, DDFS_BLOCK_SIZE);
+            memcpy(values[v], &seed, sizeof(seed));
+            memset(fingerprint, 0, 20);
+            uint8_t *result = fingerprint;
+            hash_block(values[v], &result);
+            slot = log ? key_hash(fingerprint, sb->info.fs_index_slots) :
+                get_data_block(sb, fingerprint);
+            seed += count;
+        } while (used[slot]);
+
+        used[slot] = 1;
+    }
+
+    free(used);
+    return EXIT_SUCCESS;
+}
+
+// Fill two different values whose fingerprints hash to the same home
+// block
+static int colliding_values(struct ddfs_superblock *sb, uint8_t *first,
+    uint8_t *second) {
+    uint64_t data_offset = sb->info.fs_data_offset / DDFS_BLOCK_SIZE;
+    uint32_t *seeds = calloc(sb->info.fs_data_block_count, sizeof(uint32_t));
+
+    if (seeds == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t seed = 1; seed != 0; seed++) {
+        uint8_t fingerprint[20];
+        uint8_t *result = fingerprint;
+
+        memset(second, seed, DDFS_BLOCK_SIZE);
+        memcpy(second, &seed, sizeof(seed));
+        memset(fingerprint, 0, 20);
+        hash_block(second, &result);
+
+        uint64_t slot = get_data_block(sb, fingerprint) - data_offset;
+
+        if (seeds[slot] != 0) {
+            memset(first, seeds[slot], DDFS_BLOCK_SIZE);
+            memcpy(first, &seeds[slot], sizeof(seeds[slot]));
+            free(seeds);
+            return EXIT_SUCCESS;
+        }
+
+        seeds[slot] = seed;
+    }
+
+    free(seeds);
+    return EXIT_FAILURE;
+}
+
+// Check whether the kernel has io_uring at all. Rings it refuses for
+// other reasons still leave DDFS_OPEN_URING volumes on plain I/O.
+static int uring_supported(void) {
+#ifdef __linux__
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = syscall(__NR_io_uring_setup, 1, &params);
+
+    if (ring_fd >= 0) {
+        close(ring_fd);
+        return 1;
+    }
+
+    return errno != ENOSYS;
+#else
+    return 0;
+#endif
+}
+
+// Fill keys from their numbers, nudged until no two share an inode slot
+static int distinct_keys(struct ddfs_superblock *sb, uint8_t (*keys)[20],
+    uint32_t count) {
+    uint8_t *used = calloc(sb->info.fs_inode_count, 1);
+
+    if (used == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t slot;
+
+        memset(keys[i], 0, 20);
+        memcpy(keys[i], &i, sizeof(i));
+
+        // Inode 0 belongs to the superblock
+        while ((slot = key_hash(keys[i], sb->info.fs_inode_count)) == 0 ||
+            used[slot]) {
+            keys[i][19]++;
+        }
+
+        used[slot] = 1;
+    }
+
+    free(used);
+    return EXIT_SUCCESS;
+}
+
+// Put every key, half one at a time and half in batches, read them back,
+// give the odd keys their second value and delete every fourth key
+static void *stress_worker(void *arg) {
+    struct stress_args *args = arg;
+    uint8_t *buffer = get_block_buffer();
+    uint8_t *batch_values[STRESS_BATCH];
+    int status[STRESS_BATCH];
+    int ret = buffer == NULL ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    for (uint32_t i = 0; ret == 0 && i < STRESS_KEYS / 2; i++) {
+        ret = create_kv_pair(args->fd, args->keys[i],
+            args->values[i % STRESS_VALUES]);
+    }
+
+    for (uint32_t i = STRESS_KEYS / 2; ret == 0 && i < STRESS_KEYS;
+        i += STRESS_BATCH) {
+        for (uint32_t j = 0; j < STRESS_BATCH; j++) {
+            batch_values[j] = args->values[(i + j) % STRESS_VALUES];
+        }
+
+        ret = ddfs_put_batch(args->fd, args->keys + i, batch_values,
+            STRESS_BATCH, status);
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < STRESS_KEYS; i++) {
+        if (get_value(args->fd, args->keys[i], buffer) != 0 ||
+            memcmp(buffer, args->values[i % STRESS_VALUES],
+            DDFS_BLOCK_SIZE) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    for (uint32_t i = 1; ret == 0 && i < STRESS_KEYS; i += 2) {
+        ret = modify_value(args->fd, args->keys[i],
+            args->values[STRESS_VALUES + (i % STRESS_VALUES)]);
+    }
+
+    for (uint32_t i = 2; ret == 0 && i < STRESS_KEYS; i += 4) {
+        ret = delete_kv_pair(args->fd, args->keys[i]);
+    }
+
+    put_block_buffer(buffer);
+    args->ret = ret;
+    return NULL;
+}
+
+#define FLIP_KEYS 16 // Keys of the lock-free lookup test
+#define FLIP_ROUNDS 64 // Times the lock-free lookup test changes each key
+
+// Keys a writer of the lock-free lookup test keeps changing
+struct flip_args {
+    int fd; // Volume under test
+    uint8_t (*keys)[20]; // FLIP_KEYS keys
+    uint8_t **values; // Two values per key, key i holding 2 * i or 2 * i + 1
+    uint8_t done; // Set once the writer is finished
+    int ret; // Result of the writer
+};
+
+// Switch every key between its two values, round after round
+static void *flip_worker(void *arg) {
+    struct flip_args *args = arg;
+    int ret = EXIT_SUCCESS;
+
+    for (uint32_t r = 1; ret == 0 && r <= FLIP_ROUNDS; r++) {
+        for (uint32_t i = 0; ret == 0 && i < FLIP_KEYS; i++) {
+            ret = modify_value(args->fd, args->keys[i],
+                args->values[2 * i + (r % 2)]);
+        }
+    }
+
+    args->ret = ret;
+    __atomic_store_n(&args->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+#define POOL_WORKERS 3 // Workers of the worker pool test
+#define POOL_COUNT 10000 // Indices of the worker pool test's loops
+#define POOL_BLOCKS 64 // Blocks the worker pool test fingerprints per range
+#define POOL_RANGES ((POOL_WORKERS + 1) * DDFS_POOL_SPLIT) // Ranges of a
+                                                          // loop at most
+
+// Loop of the worker pool test: count every index once, fail the range
+// holding fail if it is set, and fingerprint blocks from inside the range
+struct pool_loop {
+    uint32_t *seen; // Times each index was run
+    uint32_t fail; // Index whose range fails, or POOL_COUNT
+    uint8_t **blocks; // POOL_BLOCKS blocks to fingerprint
+    uint8_t (*fingerprints)[POOL_BLOCKS][20]; // Fingerprints per range
+    uint32_t ranges; // Ranges run so far
+};
+
+static int pool_range(void *arg, uint32_t start, uint32_t end) {
+    struct pool_loop *loop = arg;
+    uint32_t range = __atomic_fetch_add(&loop->ranges, 1, __ATOMIC_RELAXED);
+    uint8_t *results[POOL_BLOCKS];
+
+    for (uint32_t i = start; i < end; i++) {
+        __atomic_add_fetch(&loop->seen[i], 1, __ATOMIC_RELAXED);
+    }
+
+    // Nested loops queue their ranges on the worker running this one
+    for (uint32_t b = 0; b < POOL_BLOCKS; b++) {
+        results[b] = loop->fingerprints[range][b];
+        memset(results[b], 0, 20);
+    }
+
+    hash_blocks(loop->blocks, results, POOL_BLOCKS, DDFS_POOL_FOREGROUND);
+    return loop->fail >= start && loop->fail < end ? EXIT_FAILURE :
+        EXIT_SUCCESS;
+}
+
+static int pool_task(void *arg) {
+    __atomic_add_fetch((uint32_t *)arg, 1, __ATOMIC_RELAXED);
+    return EXIT_SUCCESS;
+}
 
 int main(int argc, char **argv) {
     if (argc != 2) {
@@ -32,18 +300,23 @@ int main(int argc, char **argv) {
     printf("Testing read_superblock()\n");
     printf("Magic number: %d\n", sb->info.fs_magic_num);
     printf("Media size: %lu\n", sb->info.fs_media_size);
+    printf("Revision: %d\n", sb->info.fs_revision);
     printf("Block size: %d\n", sb->info.fs_block_size);
-    printf("Block count: %d\n", sb->info.fs_block_count);
-    printf("ifree block count: %d\n", sb->info.fs_ifree_block_count);
-    printf("bfree block count: %d\n", sb->info.fs_bfree_block_count);
-    printf("istore block count: %d\n", sb->info.fs_istore_block_count);
-    printf("Data block count: %d\n", sb->info.fs_data_block_count);
+    printf("Block count: %lu\n", sb->info.fs_block_count);
+    printf("ifree block count: %lu\n", sb->info.fs_ifree_block_count);
+    printf("bfree block count: %lu\n", sb->info.fs_bfree_block_count);
+    printf("istore block count: %lu\n", sb->info.fs_istore_block_count);
+    printf("Data block count: %lu\n", sb->info.fs_data_block_count);
     printf("inode size: %d\n", sb->info.fs_inode_size);
-    printf("inode count: %d\n", sb->info.fs_inode_count);
-    printf("ifree count: %d\n", sb->info.fs_ifree_count);
-    printf("bfree count: %d\n", sb->info.fs_bfree_count);
-    printf("istore offset: %d\n", sb->info.fs_istore_offset);
-    printf("Data offset: %d\n", sb->info.fs_data_offset);
+    printf("inode count: %lu\n", sb->info.fs_inode_count);
+    printf("ifree count: %lu\n", sb->info.fs_ifree_count);
+    printf("bfree count: %lu\n", sb->info.fs_bfree_count);
+    printf("istore offset: %lu\n", sb->info.fs_istore_offset);
+    printf("Data offset: %lu\n", sb->info.fs_data_offset);
+    printf("Group count: %lu\n", sb->info.fs_group_count);
+    printf("Load factor: %d\n", sb->info.fs_load_factor);
+    printf("Inode ratio: %lu\n", sb->info.fs_inode_ratio);
+    printf("Key count: %lu\n", sb->info.fs_key_count);
     printf("File system uid: %d\n", sb->info.fs_uid);
     printf("File system name: ");
     for (int i = 0; i < 4; i++) {
@@ -67,7 +340,7 @@ int main(int argc, char **argv) {
     srand((unsigned) time(&t));
     
     printf("Test data: \n");
-    for (uint16_t i = 0; i < DDFS_BLOCK_SIZE; i++) {
+    for (uint32_t i = 0; i < DDFS_BLOCK_SIZE; i++) {
         data[i] = rand();
         printf("%x", data[i]);
     }
@@ -92,7 +365,7 @@ int main(int argc, char **argv) {
     if (get_value(fd, key, data) == 0) {
         printf("Test get_value() successful\n\n");
         printf("Get data from ddfs: \n");
-        for (uint16_t i = 0; i < DDFS_BLOCK_SIZE; i++) {
+        for (uint32_t i = 0; i < DDFS_BLOCK_SIZE; i++) {
             printf("%x", data[i]);
         }
         printf("\n");
@@ -102,17 +375,13 @@ int main(int argc, char **argv) {
 
     printf("\n");
 
-    uint32_t inode_number = key_hash(key, sb->info.fs_inode_count);
-    int reference_count = get_reference_count(fd, inode_number);
-
     uint8_t arr[20];
+    memset(arr, 0, 20);
+    result = arr;
     hash_block(data, &result);
-
-    for (uint16_t c = 0; c < 20; c++) {
-        arr[c] = result[c];
-    }
     
-    uint32_t block_ptr = key_hash(arr, sb->info.fs_block_count);
+    uint64_t block_ptr = get_data_block(sb, arr);
+    int64_t reference_count = get_reference_count(fd, block_ptr);
 
     ret = block_exists(fd, data);
 
@@ -122,8 +391,8 @@ int main(int argc, char **argv) {
         printf("Block exists\n\n");
     }
     
-    printf("Block number: %d\n", block_ptr);
-    printf("Reference count: %d\n", reference_count);
+    printf("Block number: %lu\n", block_ptr);
+    printf("Reference count: %ld\n", reference_count);
     printf("\n");
 
     ret = create_kv_pair(fd, key, data);
@@ -134,10 +403,10 @@ int main(int argc, char **argv) {
         printf("Test create_kv_pair() unsuccessful\n\n");
     }
 
-    reference_count = get_reference_count(fd, inode_number);
+    reference_count = get_reference_count(fd, block_ptr);
 
-    printf("Block number: %d\n", block_ptr);
-    printf("Reference count: %d\n", reference_count);
+    printf("Block number: %lu\n", block_ptr);
+    printf("Reference count: %ld\n", reference_count);
     printf("\n");
 
     ret = delete_kv_pair(fd, key);
@@ -148,10 +417,10 @@ int main(int argc, char **argv) {
         printf("Test delete_kv_pair() unsuccessful\n\n");
     }
 
-    reference_count = get_reference_count(fd, inode_number);
+    reference_count = get_reference_count(fd, block_ptr);
 
-    printf("Block number: %d\n", block_ptr);
-    printf("Reference count: %d\n", reference_count);
+    printf("Block number: %lu\n", block_ptr);
+    printf("Reference count: %ld\n", reference_count);
     printf("\n");
 
     ret = delete_kv_pair(fd, key);
@@ -162,10 +431,2201 @@ int main(int argc, char **argv) {
         printf("Test delete_kv_pair() unsuccessful\n\n");
     }
 
-    reference_count = get_reference_count(fd, inode_number);
+    reference_count = get_reference_count(fd, block_ptr);
+
+    printf("Block number: %lu\n", block_ptr);
+    printf("Reference count: %ld\n", reference_count);
+    printf("\n");
+
+    uint8_t batch_keys[8][20];
+    uint8_t *batch_values[8];
+    int batch_status[8];
+
+    for (uint8_t i = 0; i < 8; i++) {
+        batch_values[i] = malloc(DDFS_BLOCK_SIZE);
+
+        for (uint32_t j = 0; j < DDFS_BLOCK_SIZE; j++) {
+            batch_values[i][j] = rand();
+        }
+
+        memset(batch_keys[i], 0, 20);
+        uint8_t *batch_result = batch_keys[i];
+        hash_block(batch_values[i], &batch_result);
+    }
+
+    ret = ddfs_put_batch(fd, batch_keys, batch_values, 8, batch_status);
+
+    if (ret == 0) {
+        printf("Test ddfs_put_batch() successful\n\n");
+    } else {
+        printf("Test ddfs_put_batch() unsuccessful\n\n");
+    }
+
+    for (uint8_t i = 0; i < 8; i++) {
+        if (batch_status[i] != 0 || get_value(fd, batch_keys[i], data) != 0 ||
+            memcmp(data, batch_values[i], DDFS_BLOCK_SIZE) != 0) {
+            printf("Batch key %d unsuccessful\n", i);
+        }
+    }
+
+    uint8_t *batch_results[8];
+
+    for (uint8_t i = 0; i < 8; i++) {
+        batch_results[i] = malloc(DDFS_BLOCK_SIZE);
+    }
+
+    ret = ddfs_get_batch(fd, batch_keys, batch_results, 8, batch_status);
+
+    for (uint8_t i = 0; i < 8; i++) {
+        if (batch_status[i] != 0 || 
+            memcmp(batch_results[i], batch_values[i], DDFS_BLOCK_SIZE) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (ret == 0) {
+        printf("Test ddfs_get_batch() successful\n\n");
+    } else {
+        printf("Test ddfs_get_batch() unsuccessful\n\n");
+    }
+
+    uint8_t new_key[20];
+    memcpy(new_key, batch_keys[0], 20);
+    new_key[19] ^= 0xff;
+
+    if (rename_key(fd, batch_keys[0], new_key) == 0 && 
+        get_value(fd, batch_keys[0], data) != 0 &&
+        get_value(fd, new_key, data) == 0 &&
+        memcmp(data, batch_values[0], DDFS_BLOCK_SIZE) == 0 &&
+        rename_key(fd, new_key, batch_keys[0]) == 0) {
+        printf("Test rename_key() successful\n\n");
+    } else {
+        printf("Test rename_key() unsuccessful\n\n");
+    }
+
+    // A key moving off a block it shares leaves the other key's value,
+    // and a value whose home block holds another live value is refused
+    uint8_t *modify_values[2] = { malloc(DDFS_BLOCK_SIZE),
+        malloc(DDFS_BLOCK_SIZE) };
+    int64_t shared_block = -1;
+
+    if (modify_value(fd, batch_keys[0], batch_values[1]) == 0 && 
+        get_value(fd, batch_keys[0], data) == 0 &&
+        memcmp(data, batch_values[1], DDFS_BLOCK_SIZE) == 0 &&
+        get_value(fd, batch_keys[1], data) == 0 &&
+        memcmp(data, batch_values[1], DDFS_BLOCK_SIZE) == 0 &&
+        (shared_block = get_value_block(fd, batch_keys[1])) ==
+        get_value_block(fd, batch_keys[0]) &&
+        get_reference_count(fd, shared_block) == 2 &&
+        modify_value(fd, batch_keys[0], batch_values[0]) == 0 &&
+        get_reference_count(fd, shared_block) == 1 &&
+        get_value(fd, batch_keys[1], data) == 0 &&
+        memcmp(data, batch_values[1], DDFS_BLOCK_SIZE) == 0 &&
+        get_value(fd, batch_keys[0], data) == 0 &&
+        memcmp(data, batch_values[0], DDFS_BLOCK_SIZE) == 0 &&
+        modify_values[0] != NULL && modify_values[1] != NULL &&
+        colliding_values(sb, modify_values[0], modify_values[1]) == 0 &&
+        create_kv_pair(fd, new_key, modify_values[0]) == 0 &&
+        modify_value(fd, batch_keys[0], modify_values[1]) != 0 &&
+        errno == EEXIST &&
+        get_value(fd, batch_keys[0], data) == 0 &&
+        memcmp(data, batch_values[0], DDFS_BLOCK_SIZE) == 0 &&
+        get_value(fd, new_key, data) == 0 &&
+        memcmp(data, modify_values[0], DDFS_BLOCK_SIZE) == 0 &&
+        delete_kv_pair(fd, new_key) == 0) {
+        printf("Test modify_value() successful\n\n");
+    } else {
+        printf("Test modify_value() unsuccessful\n\n");
+    }
+
+    free(modify_values[0]);
+    free(modify_values[1]);
+
+    struct ddfs_value_view view;
+
+    if (ddfs_borrow_value(fd, batch_keys[2], &view) == 0 &&
+        view.length == DDFS_BLOCK_SIZE &&
+        memcmp(view.data, batch_values[2], DDFS_BLOCK_SIZE) == 0) {
+        printf("Test ddfs_borrow_value() successful\n\n");
+    } else {
+        printf("Test ddfs_borrow_value() unsuccessful\n\n");
+    }
+
+    ddfs_release_value(&view);
+
+    // A view keeps its value while the key is deleted, which would
+    // otherwise zero the block right away, and while another value
+    // hashing to the block is put. Its pin takes no reference, so the
+    // block is only reclaimed once the view goes.
+    int pinned_fd = ddfs_open_memory(64 * 1024 * 1024);
+    uint8_t pinned_key[20] = { 0x71, 0xe3 };
+    uint8_t other_key[20] = { 0x3c, 0x95 };
+    uint8_t *pinned_value = get_block_buffer();
+    uint8_t *other_value = get_block_buffer();
+    uint8_t *pinned_buffer = get_block_buffer();
+    struct ddfs_superblock *pinned_sb = NULL;
+    int64_t pinned_block = -1;
+    ret = EXIT_FAILURE;
+
+    if (pinned_fd != -1 && pinned_value != NULL && other_value != NULL &&
+        pinned_buffer != NULL && initialize_ddfs(pinned_fd) == 0 &&
+        (pinned_sb = get_superblock(pinned_fd)) != NULL &&
+        colliding_values(pinned_sb, pinned_value, other_value) == 0 &&
+        create_kv_pair(pinned_fd, pinned_key, pinned_value) == 0) {
+        pinned_block = get_value_block(pinned_fd, pinned_key);
+    }
+
+    put_block_buffer(pinned_sb);
+
+    if (pinned_block > 0 &&
+        ddfs_borrow_value(pinned_fd, pinned_key, &view) == 0 &&
+        delete_kv_pair(pinned_fd, pinned_key) == 0 &&
+        drain_reclaim_queue(pinned_fd) == 0 &&
+        get_reference_count(pinned_fd, pinned_block) == 0 &&
+        create_kv_pair(pinned_fd, other_key, other_value) != 0 &&
+        errno == EEXIST &&
+        memcmp(view.data, pinned_value, DDFS_BLOCK_SIZE) == 0) {
+        ddfs_release_value(&view);
+        memset(pinned_buffer, 0xff, DDFS_BLOCK_SIZE);
+
+        if (drain_reclaim_queue(pinned_fd) == 0 &&
+            read_block(pinned_fd, pinned_buffer, pinned_block) ==
+            DDFS_BLOCK_SIZE && pinned_buffer[0] == 0 &&
+            memcmp(pinned_buffer, pinned_buffer + 1,
+            DDFS_BLOCK_SIZE - 1) == 0 &&
+            create_kv_pair(pinned_fd, other_key, other_value) == 0) {
+            ret = EXIT_SUCCESS;
+        }
+    }
+
+    ddfs_release_value(&view);
+
+    if (ret == 0) {
+        printf("Test ddfs_borrow_value() pinning successful\n\n");
+    } else {
+        printf("Test ddfs_borrow_value() pinning unsuccessful\n\n");
+    }
+
+    put_block_buffer(pinned_value);
+    put_block_buffer(other_value);
+    put_block_buffer(pinned_buffer);
+
+    if (pinned_fd != -1) {
+        ddfs_close(pinned_fd);
+    }
+
+    int map_fd = ddfs_open(argv[1], O_RDONLY, DDFS_OPEN_MMAP);
+
+    if (get_value(map_fd, batch_keys[2], data) == 0 &&
+        memcmp(data, batch_values[2], DDFS_BLOCK_SIZE) == 0 &&
+        ddfs_borrow_value(map_fd, batch_keys[2], &view) == 0 &&
+        view.data == get_block_address(map_fd, 
+        get_value_block(map_fd, batch_keys[2]), 1, 0)) {
+        printf("Test DDFS_OPEN_MMAP successful\n\n");
+    } else {
+        printf("Test DDFS_OPEN_MMAP unsuccessful\n\n");
+    }
+
+    ddfs_release_value(&view);
+    ddfs_close(map_fd);
+
+    int direct_fd = ddfs_open(argv[1], O_RDONLY, DDFS_OPEN_DIRECT);
+    int direct_status[2];
+    memset(data, 0, DDFS_BLOCK_SIZE);
+
+    // data is not block aligned, so the first read goes through a bounce
+    // buffer, while the batch reads into its own aligned buffers
+    if (get_value(direct_fd, batch_keys[4], data) == 0 &&
+        memcmp(data, batch_values[4], DDFS_BLOCK_SIZE) == 0 &&
+        ddfs_get_batch(direct_fd, batch_keys + 5, batch_results + 5, 2,
+        direct_status) == 0 &&
+        memcmp(batch_results[5], batch_values[5], DDFS_BLOCK_SIZE) == 0 &&
+        memcmp(batch_results[6], batch_values[6], DDFS_BLOCK_SIZE) == 0) {
+        printf("Test DDFS_OPEN_DIRECT successful\n\n");
+    } else {
+        printf("Test DDFS_OPEN_DIRECT unsuccessful\n\n");
+    }
+
+    ddfs_close(direct_fd);
+
+    // Puts and gets round-trip through io_uring, the put batch's blocks
+    // coming from the ring's registered buffers, and read back without it
+    char uring_path[] = "/tmp/ddfs-uring-XXXXXX";
+    int uring_tmp = mkstemp(uring_path);
+    uint8_t (*uring_keys)[20] = calloc(URING_KEYS, 20);
+    uint8_t *uring_data = ddfs_memalign(DDFS_BLOCK_SIZE,
+        2 * URING_KEYS * DDFS_BLOCK_SIZE);
+    uint8_t *uring_values[URING_KEYS];
+    uint8_t *uring_results[URING_KEYS];
+    int uring_status[URING_KEYS];
+    int uring_fd = -1;
+    ret = EXIT_FAILURE;
+
+    for (uint32_t i = 0; uring_data != NULL && i < URING_KEYS; i++) {
+        uring_values[i] = uring_data + ((size_t)i * DDFS_BLOCK_SIZE);
+        uring_results[i] = uring_data +
+            ((size_t)(URING_KEYS + i) * DDFS_BLOCK_SIZE);
+    }
+
+    if (uring_supported() && uring_tmp != -1 && uring_keys != NULL &&
+        uring_data != NULL && ftruncate(uring_tmp, 64 * 1024 * 1024) == 0) {
+        uring_fd = ddfs_open(uring_path, O_RDWR, 0);
+    }
+
+    if (uring_fd != -1 && initialize_ddfs(uring_fd) == 0) {
+        struct ddfs_superblock *uring_sb = get_superblock(uring_fd);
+
+        if (uring_sb != NULL &&
+            distinct_values(uring_sb, uring_values, URING_KEYS, 0) == 0 &&
+            distinct_keys(uring_sb, uring_keys, URING_KEYS) == 0) {
+            ret = EXIT_SUCCESS;
+        }
+
+        put_block_buffer(uring_sb);
+    }
+
+    if (uring_fd != -1) {
+        ddfs_close(uring_fd);
+        uring_fd = ret == 0 ?
+            ddfs_open(uring_path, O_RDWR, DDFS_OPEN_URING) : -1;
+    }
+
+    struct ddfs_volume *uring_volume = get_volume(uring_fd);
+
+    if (uring_volume == NULL || uring_volume->uring == NULL ||
+        create_kv_pair(uring_fd, uring_keys[0], uring_values[0]) != 0 ||
+        ddfs_put_batch(uring_fd, uring_keys + 1, uring_values + 1,
+        URING_KEYS - 1, uring_status) != 0 ||
+        ddfs_get_batch(uring_fd, uring_keys, uring_results, URING_KEYS,
+        uring_status) != 0) {
+        ret = EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < URING_KEYS; i++) {
+        if (memcmp(uring_results[i], uring_values[i], DDFS_BLOCK_SIZE) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (uring_fd != -1) {
+        ddfs_close(uring_fd);
+        uring_fd = ret == 0 ? ddfs_open(uring_path, O_RDONLY, 0) : -1;
+    }
+
+    if (uring_fd == -1) {
+        ret = EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; uring_fd != -1 && ret == 0 && i < URING_KEYS; 
+        i++) {
+        if (get_value(uring_fd, uring_keys[i], uring_results[i]) != 0 ||
+            memcmp(uring_results[i], uring_values[i], DDFS_BLOCK_SIZE) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (!uring_supported()) {
+        printf("Test DDFS_OPEN_URING skipped, io_uring is unavailable\n\n");
+    } else if (ret == 0) {
+        printf("Test DDFS_OPEN_URING successful\n\n");
+    } else {
+        printf("Test DDFS_OPEN_URING unsuccessful\n\n");
+    }
+
+    if (uring_fd != -1) {
+        ddfs_close(uring_fd);
+    }
+
+    free(uring_keys);
+    ddfs_free(uring_data);
+
+    if (uring_tmp != -1) {
+        close(uring_tmp);
+        unlink(uring_path);
+    }
+
+    int pipe_fds[2];
+    memset(data, 0, DDFS_BLOCK_SIZE);
+
+    if (pipe(pipe_fds) == 0 && 
+        ddfs_send_value(fd, batch_keys[3], pipe_fds[1]) == DDFS_BLOCK_SIZE &&
+        read(pipe_fds[0], data, DDFS_BLOCK_SIZE) == DDFS_BLOCK_SIZE &&
+        memcmp(data, batch_values[3], DDFS_BLOCK_SIZE) == 0) {
+        printf("Test ddfs_send_value() successful\n\n");
+    } else {
+        printf("Test ddfs_send_value() unsuccessful\n\n");
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    int memory_fd = ddfs_open_memory(64 * 1024 * 1024);
+    memset(data, 0, DDFS_BLOCK_SIZE);
+
+    if (initialize_ddfs(memory_fd) == 0 &&
+        create_kv_pair(memory_fd, batch_keys[7], batch_values[7]) == 0 &&
+        get_value(memory_fd, batch_keys[7], data) == 0 &&
+        memcmp(data, batch_values[7], DDFS_BLOCK_SIZE) == 0 &&
+        delete_kv_pair(memory_fd, batch_keys[7]) == 0) {
+        printf("Test ddfs_open_memory() successful\n\n");
+    } else {
+        printf("Test ddfs_open_memory() unsuccessful\n\n");
+    }
+
+    ddfs_close(memory_fd);
+
+    // A sparse 8 TiB image puts the inode store and the data region far
+    // past what 32-bit byte offsets can reach
+    char sparse_path[] = "/tmp/ddfs-sparse-XXXXXX";
+    int sparse_fd = mkstemp(sparse_path);
+    ret = EXIT_FAILURE;
+
+    if (sparse_fd != -1 && ftruncate(sparse_fd, (off_t)8 << 40) == 0 &&
+        initialize_ddfs(sparse_fd) == 0 &&
+        create_kv_pair(sparse_fd, batch_keys[5], batch_values[5]) == 0 &&
+        get_value(sparse_fd, batch_keys[5], data) == 0 &&
+        memcmp(data, batch_values[5], DDFS_BLOCK_SIZE) == 0) {
+        struct ddfs_superblock *sparse_sb = read_superblock(sparse_fd);
+        off_t offset =
+            (off_t)get_value_block(sparse_fd, batch_keys[5]) * DDFS_BLOCK_SIZE;
+
+        // The value must sit at its full 64-bit byte offset
+        if (sparse_sb != NULL &&
+            sparse_sb->info.fs_data_offset > UINT32_MAX &&
+            pread(sparse_fd, data, DDFS_BLOCK_SIZE, offset) ==
+                DDFS_BLOCK_SIZE &&
+            memcmp(data, batch_values[5], DDFS_BLOCK_SIZE) == 0 &&
+            delete_kv_pair(sparse_fd, batch_keys[5]) == 0) {
+            ret = EXIT_SUCCESS;
+        }
+
+        free(sparse_sb);
+    }
+
+    if (ret == 0) {
+        printf("Test 64-bit block addressing successful\n\n");
+    } else {
+        printf("Test 64-bit block addressing unsuccessful\n\n");
+    }
+
+    if (sparse_fd != -1) {
+        close(sparse_fd);
+        unlink(sparse_path);
+    }
+
+    // Formatting must reserve the metadata regions in the free block bitmap,
+    // while inode groups holding stale data are left for lazy initialization
+    char format_path[] = "/tmp/ddfs-format-XXXXXX";
+    int format_fd = mkstemp(format_path);
+    // Halfway through the inode store at any block size
+    uint64_t stale_block = (((uint64_t)1 << 40) / DDFS_BLOCK_SIZE) * 64 /
+        DDFS_BLOCK_SIZE;
+    memset(data, 0xff, DDFS_BLOCK_SIZE);
+    ret = EXIT_FAILURE;
+
+    if (format_fd != -1 && ftruncate(format_fd, (off_t)1 << 40) == 0 &&
+        write_block(format_fd, data, 1) == DDFS_BLOCK_SIZE &&
+        write_block(format_fd, data, stale_block) == DDFS_BLOCK_SIZE &&
+        initialize_ddfs(format_fd) == 0) {
+        struct ddfs_superblock *format_sb = read_superblock(format_fd);
+        uint8_t zeros[DDFS_BLOCK_SIZE] = { 0 };
+
+        if (format_sb != NULL) {
+            uint64_t bfree_bit = (format_sb->info.fs_ifree_block_count + 1) *
+                DDFS_BLOCK_SIZE * 8;
+            uint64_t data_block =
+                format_sb->info.fs_data_offset / DDFS_BLOCK_SIZE;
+            uint64_t stale_inode = (stale_block - 
+                (format_sb->info.fs_istore_offset / DDFS_BLOCK_SIZE)) *
+                (DDFS_BLOCK_SIZE / format_sb->info.fs_inode_size);
+
+            if (get_inode_bit(format_fd, 1) == 0 &&
+                get_group_state(format_fd, NULL, 0) == 1 &&
+                get_group_state(format_fd, NULL, 
+                get_inode_group(stale_inode)) == 0 &&
+                get_inode_bit(format_fd, stale_inode) == 0 &&
+                read_block(format_fd, data, stale_block) == DDFS_BLOCK_SIZE &&
+                memcmp(data, zeros, DDFS_BLOCK_SIZE) != 0 &&
+                get_bit(format_fd, bfree_bit + data_block - 1) == 1 &&
+                get_bit(format_fd, bfree_bit + data_block) == 0) {
+                ret = EXIT_SUCCESS;
+            }
+        }
+
+        free(format_sb);
+    }
+
+    if (ret == 0) {
+        printf("Test initialize_ddfs() successful\n\n");
+    } else {
+        printf("Test initialize_ddfs() unsuccessful\n\n");
+    }
+
+    if (format_fd != -1) {
+        close(format_fd);
+        unlink(format_path);
+    }
+
+    // The background zeroer initializes every group left after the format
+    char lazy_path[] = "/tmp/ddfs-lazy-XXXXXX";
+    int lazy_tmp = mkstemp(lazy_path);
+    int lazy_fd = -1;
+    ret = EXIT_FAILURE;
+
+    if (lazy_tmp != -1 && ftruncate(lazy_tmp, (off_t)1 << 32) == 0) {
+        lazy_fd = ddfs_open(lazy_path, O_RDWR, DDFS_OPEN_ZERO_GROUPS);
+    }
+
+    if (lazy_fd != -1 && initialize_ddfs(lazy_fd) == 0 &&
+        create_kv_pair(lazy_fd, batch_keys[7], batch_values[7]) == 0 &&
+        get_value(lazy_fd, batch_keys[7], data) == 0 &&
+        memcmp(data, batch_values[7], DDFS_BLOCK_SIZE) == 0) {
+        struct ddfs_volume *lazy_volume = get_volume(lazy_fd);
+        uint64_t last_group = lazy_volume->group_count - 1;
+
+        // Give the zeroer up to five seconds
+        for (int i = 0; i < 5000; i++) {
+            if (get_group_state(lazy_fd, NULL, last_group) == 1) {
+                ret = EXIT_SUCCESS;
+                break;
+            }
+
+            usleep(1000);
+        }
+    }
+
+    if (ret == 0) {
+        printf("Test DDFS_OPEN_ZERO_GROUPS successful\n\n");
+    } else {
+        printf("Test DDFS_OPEN_ZERO_GROUPS unsuccessful\n\n");
+    }
+
+    if (lazy_fd != -1) {
+        ddfs_close(lazy_fd);
+    }
+
+    if (lazy_tmp != -1) {
+        close(lazy_tmp);
+        unlink(lazy_path);
+    }
+
+    // 1000 expected keys at a load factor of 50 percent take 2000 slots
+    struct ddfs_geometry geometry = {
+        .block_size = DDFS_BLOCK_SIZE,
+        .load_factor = 50,
+        .key_count = 1000
+    };
+    struct ddfs_geometry bad_geometry = {
+        .block_size = DDFS_BLOCK_SIZE * 2
+    };
+    int geometry_fd = ddfs_open_memory(64 * 1024 * 1024);
+    struct ddfs_superblock *geometry_sb = NULL;
+    memset(data, 0, DDFS_BLOCK_SIZE);
+
+    if (format_ddfs(geometry_fd, &bad_geometry) != 0 &&
+        format_ddfs(geometry_fd, &geometry) == 0 &&
+        (geometry_sb = read_superblock(geometry_fd)) != NULL &&
+        geometry_sb->info.fs_inode_count == 2000 &&
+        geometry_sb->info.fs_load_factor == 50 &&
+        geometry_sb->info.fs_key_count == 1000 &&
+        create_kv_pair(geometry_fd, batch_keys[7], batch_values[7]) == 0 &&
+        get_value(geometry_fd, batch_keys[7], data) == 0 &&
+        memcmp(data, batch_values[7], DDFS_BLOCK_SIZE) == 0) {
+        printf("Test format_ddfs() successful\n\n");
+    } else {
+        printf("Test format_ddfs() unsuccessful\n\n");
+    }
+
+    free(geometry_sb);
+    ddfs_close(geometry_fd);
+
+    // Three keys share one block, whose count comes from the table plus
+    // the deltas still in the log, and the block is zeroed with the last
+    uint8_t ref_keys[3][20];
+    int ref_fd = ddfs_open_memory(64 * 1024 * 1024);
+    uint64_t ref_block = 0;
+    ret = initialize_ddfs(ref_fd);
+
+    for (uint8_t i = 0; i < 3; i++) {
+        memcpy(ref_keys[i], batch_keys[7], 20);
+        ref_keys[i][0] ^= i + 1;
+
+        if (create_kv_pair(ref_fd, ref_keys[i], batch_values[7]) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (ret == 0) {
+        ref_block = get_value_block(ref_fd, ref_keys[0]);
+    }
+
+    if (ret == 0 && get_reference_count(ref_fd, ref_block) == 3 &&
+        apply_reference_log(ref_fd) == 0 &&
+        get_reference_count(ref_fd, ref_block) == 3 &&
+        delete_kv_pair(ref_fd, ref_keys[0]) == 0 &&
+        delete_kv_pair(ref_fd, ref_keys[1]) == 0 &&
+        get_value(ref_fd, ref_keys[2], data) == 0 &&
+        memcmp(data, batch_values[7], DDFS_BLOCK_SIZE) == 0 &&
+        delete_kv_pair(ref_fd, ref_keys[2]) == 0 &&
+        get_reference_count(ref_fd, ref_block) == 0 &&
+        read_block(ref_fd, data, ref_block) == DDFS_BLOCK_SIZE &&
+        data[0] == 0 && memcmp(data, data + 1, DDFS_BLOCK_SIZE - 1) == 0) {
+        ret = EXIT_SUCCESS;
+    } else {
+        ret = EXIT_FAILURE;
+    }
+
+    // Enough changes to fill the log several times over, applied in
+    // batches as it fills
+    uint32_t ref_changes = 3 * DDFS_REFLOG_BLOCKS * DDFS_REFLOG_ENTRIES;
+
+    for (uint32_t i = 0; ret == 0 && i < ref_changes; i++) {
+        ret = increment_reference_count(ref_fd, ref_block);
+    }
+
+    if (ret == 0 && get_reference_count(ref_fd, ref_block) == ref_changes &&
+        apply_reference_log(ref_fd) == 0 &&
+        get_reference_count(ref_fd, ref_block) == ref_changes) {
+        printf("Test reference count table successful\n\n");
+    } else {
+        printf("Test reference count table unsuccessful\n\n");
+    }
+
+    ddfs_close(ref_fd);
+
+    // A value whose home block holds another live value is refused
+    // without touching the stored one, and takes the block once it is
+    // free again
+    uint8_t *home_values[2] = { malloc(DDFS_BLOCK_SIZE),
+        malloc(DDFS_BLOCK_SIZE) };
+    int home_fd = ddfs_open_memory(64 * 1024 * 1024);
+    struct ddfs_superblock *home_sb = NULL;
+    uint64_t home_block = 0;
+    ret = EXIT_FAILURE;
+
+    if (home_values[0] != NULL && home_values[1] != NULL &&
+        home_fd != -1 && initialize_ddfs(home_fd) == 0 &&
+        (home_sb = get_superblock(home_fd)) != NULL &&
+        colliding_values(home_sb, home_values[0], home_values[1]) == 0 &&
+        create_kv_pair(home_fd, ref_keys[0], home_values[0]) == 0) {
+        home_block = get_value_block(home_fd, ref_keys[0]);
+        errno = 0;
+
+        if (create_kv_pair(home_fd, ref_keys[1], home_values[1]) != 0 &&
+            errno == EEXIST &&
+            get_value(home_fd, ref_keys[1], data) != 0 &&
+            get_value(home_fd, ref_keys[0], data) == 0 &&
+            memcmp(data, home_values[0], DDFS_BLOCK_SIZE) == 0 &&
+            get_reference_count(home_fd, home_block) == 1 &&
+            delete_kv_pair(home_fd, ref_keys[0]) == 0 &&
+            create_kv_pair(home_fd, ref_keys[1], home_values[1]) == 0 &&
+            get_value(home_fd, ref_keys[1], data) == 0 &&
+            memcmp(data, home_values[1], DDFS_BLOCK_SIZE) == 0 &&
+            get_value_block(home_fd, ref_keys[1]) == (int64_t)home_block &&
+            get_reference_count(home_fd, home_block) == 1) {
+            ret = EXIT_SUCCESS;
+        }
+    }
+
+    if (ret == 0) {
+        printf("Test home block collisions successful\n\n");
+    } else {
+        printf("Test home block collisions unsuccessful\n\n");
+    }
+
+    // Within a batch the first put to claim a free home block keeps it,
+    // and a put against a live block fails on its own
+    uint8_t home_keys[2][20];
+    int home_status[2];
+
+    memcpy(home_keys[0], ref_keys[0], 20);
+    memcpy(home_keys[1], ref_keys[2], 20);
+
+    if (ret == 0 && (ddfs_put_batch(home_fd, home_keys, home_values, 2,
+        home_status) == 0 || home_status[0] == 0 || home_status[1] != 0 ||
+        get_value(home_fd, ref_keys[1], data) != 0 ||
+        memcmp(data, home_values[1], DDFS_BLOCK_SIZE) != 0 ||
+        get_reference_count(home_fd, home_block) != 2 ||
+        delete_kv_pair(home_fd, ref_keys[1]) != 0 ||
+        delete_kv_pair(home_fd, ref_keys[2]) != 0 ||
+        ddfs_put_batch(home_fd, home_keys, home_values, 2,
+        home_status) == 0 || home_status[0] != 0 || home_status[1] == 0 ||
+        get_value(home_fd, ref_keys[0], data) != 0 ||
+        memcmp(data, home_values[0], DDFS_BLOCK_SIZE) != 0 ||
+        get_value(home_fd, ref_keys[2], data) == 0 ||
+        get_reference_count(home_fd, home_block) != 1)) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (ret == 0) {
+        printf("Test ddfs_put_batch() home block collisions "
+            "successful\n\n");
+    } else {
+        printf("Test ddfs_put_batch() home block collisions "
+            "unsuccessful\n\n");
+    }
+
+    put_block_buffer(home_sb);
+
+    if (home_fd != -1) {
+        ddfs_close(home_fd);
+    }
+
+    free(home_values[0]);
+    free(home_values[1]);
+
+    // Deltas synced to the on-disk log are replayed by the next open
+    char reflog_path[] = "/tmp/ddfs-reflog-XXXXXX";
+    int reflog_tmp = mkstemp(reflog_path);
+    int reflog_fd = -1;
+    int reflog_reader = -1;
+    ret = EXIT_FAILURE;
+
+    if (reflog_tmp != -1 && ftruncate(reflog_tmp, 64 * 1024 * 1024) == 0) {
+        reflog_fd = ddfs_open(reflog_path, O_RDWR, 0);
+    }
+
+    if (reflog_fd != -1 && initialize_ddfs(reflog_fd) == 0 &&
+        create_kv_pair(reflog_fd, batch_keys[7], batch_values[7]) == 0 &&
+        ddfs_sync(reflog_fd) == 0) {
+        ref_block = get_value_block(reflog_fd, batch_keys[7]);
+        reflog_reader = ddfs_open(reflog_path, O_RDONLY, 0);
+
+        if (get_reference_count(reflog_tmp, ref_block) == 0 &&
+            get_reference_count(reflog_reader, ref_block) == 1) {
+            ret = EXIT_SUCCESS;
+        }
+    }
+
+    if (reflog_reader != -1) {
+        ddfs_close(reflog_reader);
+    }
+
+    // A crash after the table took the log's deltas but before the log
+    // moved on to its next epoch leaves the log to be applied again, which
+    // must not count its deltas twice
+    size_t reflog_size = DDFS_REFLOG_BLOCKS * DDFS_BLOCK_SIZE;
+    uint8_t *reflog_saved = malloc(reflog_size);
+    struct ddfs_superblock *reflog_sb = reflog_fd != -1 ?
+        get_superblock(reflog_fd) : NULL;
+    off_t reflog_offset = reflog_sb != NULL ?
+        (off_t)le64toh(reflog_sb->info.fs_reflog_offset) : 0;
+
+    if (ret == 0 && (reflog_saved == NULL || reflog_sb == NULL ||
+        pread(reflog_tmp, reflog_saved, reflog_size, reflog_offset) !=
+        (ssize_t)reflog_size)) {
+        ret = EXIT_FAILURE;
+    }
+
+    put_block_buffer(reflog_sb);
+
+    if (reflog_fd != -1) {
+        ddfs_close(reflog_fd);
+    }
+
+    if (ret == 0 && (get_reference_count(reflog_tmp, ref_block) != 1 ||
+        pwrite(reflog_tmp, reflog_saved, reflog_size, reflog_offset) !=
+        (ssize_t)reflog_size ||
+        (reflog_fd = ddfs_open(reflog_path, O_RDWR, 0)) == -1 ||
+        ddfs_close(reflog_fd) != 0)) {
+        ret = EXIT_FAILURE;
+    }
+
+    free(reflog_saved);
+
+    if (ret == 0 && get_reference_count(reflog_tmp, ref_block) == 1) {
+        printf("Test reference count log replay successful\n\n");
+    } else {
+        printf("Test reference count log replay unsuccessful\n\n");
+    }
+
+    if (reflog_tmp != -1) {
+        close(reflog_tmp);
+        unlink(reflog_path);
+    }
+
+    // A block whose last key is deleted keeps its data until the
+    // collector gets to it
+    char gc_path[] = "/tmp/ddfs-gc-XXXXXX";
+    int gc_tmp = mkstemp(gc_path);
+    int gc_fd = -1;
+    uint8_t *gc_buffer = get_block_buffer();
+    ret = EXIT_FAILURE;
+
+    if (gc_tmp != -1 && gc_buffer != NULL &&
+        ftruncate(gc_tmp, 64 * 1024 * 1024) == 0) {
+        gc_fd = ddfs_open(gc_path, O_RDWR, DDFS_OPEN_GC);
+    }
+
+    if (gc_fd != -1 && initialize_ddfs(gc_fd) == 0 &&
+        create_kv_pair(gc_fd, batch_keys[6], batch_values[6]) == 0) {
+        ref_block = get_value_block(gc_fd, batch_keys[6]);
+
+        if (delete_kv_pair(gc_fd, batch_keys[6]) == 0 &&
+            get_reference_count(gc_fd, ref_block) == 0) {
+            ret = EXIT_SUCCESS;
+        }
+    }
+
+    // Poll for up to five seconds
+    for (uint32_t i = 0; ret == 0 && i < 500; i++) {
+        if (read_block(gc_fd, gc_buffer, ref_block) != DDFS_BLOCK_SIZE) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        uint8_t nonzero = 0;
+
+        for (uint32_t j = 0; j < DDFS_BLOCK_SIZE; j++) {
+            nonzero |= gc_buffer[j];
+        }
+
+        if (!nonzero) {
+            break;
+        }
+
+        ret = i == 499 ? EXIT_FAILURE : EXIT_SUCCESS;
+        usleep(10000);
+    }
+
+    if (gc_fd != -1) {
+        ddfs_close(gc_fd);
+    }
+
+    if (ret == 0) {
+        printf("Test DDFS_OPEN_GC successful\n\n");
+    } else {
+        printf("Test DDFS_OPEN_GC unsuccessful\n\n");
+    }
+
+    // Runs shorter than the minimum extent keep their data, longer ones
+    // are punched out of the image
+    char discard_path[] = "/tmp/ddfs-discard-XXXXXX";
+    int discard_tmp = mkstemp(discard_path);
+    int discard_fd = -1;
+    struct stat discard_before;
+    struct stat discard_after;
+    ret = EXIT_FAILURE;
+
+    if (discard_tmp != -1 && gc_buffer != NULL &&
+        ftruncate(discard_tmp, 64 * 1024 * 1024) == 0) {
+        discard_fd = ddfs_open(discard_path, O_RDWR, 
+            DDFS_OPEN_GC | DDFS_OPEN_DISCARD);
+    }
+
+    if (discard_fd != -1 && initialize_ddfs(discard_fd) == 0 &&
+        set_discard_policy(discard_fd, 2, 0) == 0 &&
+        create_kv_pair(discard_fd, batch_keys[5], batch_values[5]) == 0) {
+        ref_block = get_value_block(discard_fd, batch_keys[5]);
+
+        if (delete_kv_pair(discard_fd, batch_keys[5]) == 0 &&
+            drain_reclaim_queue(discard_fd) == 0 &&
+            read_block(discard_fd, gc_buffer, ref_block) == 
+            DDFS_BLOCK_SIZE &&
+            memcmp(gc_buffer, batch_values[5], DDFS_BLOCK_SIZE) == 0) {
+            ret = EXIT_SUCCESS;
+        }
+    }
+
+    if (ret == 0 && (set_discard_policy(discard_fd, 1, 0) != 0 ||
+        create_kv_pair(discard_fd, batch_keys[4], batch_values[4]) != 0 ||
+        fstat(discard_tmp, &discard_before) != 0)) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (ret == 0) {
+        ref_block = get_value_block(discard_fd, batch_keys[4]);
+
+        if (delete_kv_pair(discard_fd, batch_keys[4]) != 0 ||
+            drain_reclaim_queue(discard_fd) != 0 ||
+            fstat(discard_tmp, &discard_after) != 0 ||
+            discard_after.st_blocks >= discard_before.st_blocks ||
+            read_block(discard_fd, gc_buffer, ref_block) != 
+            DDFS_BLOCK_SIZE) {
+            ret = EXIT_FAILURE;
+        }
+
+        for (uint32_t j = 0; ret == 0 && j < DDFS_BLOCK_SIZE; j++) {
+            ret = gc_buffer[j] == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (discard_fd != -1) {
+        ddfs_close(discard_fd);
+    }
+
+    if (ret == 0) {
+        printf("Test DDFS_OPEN_DISCARD successful\n\n");
+    } else {
+        printf("Test DDFS_OPEN_DISCARD unsuccessful\n\n");
+    }
+
+    if (discard_tmp != -1) {
+        close(discard_tmp);
+        unlink(discard_path);
+    }
+
+    put_block_buffer(gc_buffer);
+
+    if (gc_tmp != -1) {
+        close(gc_tmp);
+        unlink(gc_path);
+    }
+
+    // Metadata committed to the journal survives a crash: a child puts
+    // keys, syncs and exits without closing the volume
+    char journal_path[] = "/tmp/ddfs-journal-XXXXXX";
+    int journal_tmp = mkstemp(journal_path);
+    int journal_fd = -1;
+    uint32_t journal_count = 1500;
+    uint8_t (*journal_keys)[20] = malloc(journal_count * 20);
+    uint8_t *journal_value = get_block_buffer();
+    uint8_t *journal_buffer = get_block_buffer();
+    uint8_t *journal_found = calloc(journal_count, 1);
+    int journal_pipe[2] = { -1, -1 };
+    ret = EXIT_FAILURE;
+
+    if (journal_tmp != -1 && journal_keys != NULL && 
+        journal_value != NULL && journal_buffer != NULL &&
+        journal_found != NULL && pipe(journal_pipe) == 0 &&
+        ftruncate(journal_tmp, 256 * 1024 * 1024) == 0) {
+        journal_fd = ddfs_open(journal_path, O_RDWR, 0);
+    }
+
+    if (journal_fd != -1 && initialize_ddfs(journal_fd) == 0) {
+        ddfs_close(journal_fd);
+
+        for (uint32_t i = 0; i < journal_count; i++) {
+            memset(journal_value, i, DDFS_BLOCK_SIZE);
+            memcpy(journal_value, &i, sizeof(i));
+            memset(journal_keys[i], 0, 20);
+            uint8_t *journal_result = journal_keys[i];
+            hash_block(journal_value, &journal_result);
+        }
+
+        pid_t child = fork();
+
+        if (child == 0) {
+            int child_fd = ddfs_open(journal_path, O_RDWR, 
+                DDFS_OPEN_JOURNAL);
+
+            for (uint32_t i = 0; child_fd != -1 && i < journal_count; i++) {
+                memset(journal_value, i, DDFS_BLOCK_SIZE);
+                memcpy(journal_value, &i, sizeof(i));
+                create_kv_pair(child_fd, journal_keys[i], journal_value);
+
+                if (i % 100 == 99) {
+                    ddfs_sync(child_fd);
+                }
+            }
+
+            // Report the keys that read back, then crash
+            for (uint32_t i = 0; child_fd != -1 && i < journal_count; i++) {
+                memset(journal_value, i, DDFS_BLOCK_SIZE);
+                memcpy(journal_value, &i, sizeof(i));
+                journal_found[i] = ddfs_sync(child_fd) == 0 &&
+                    get_value(child_fd, journal_keys[i], journal_buffer) == 0 &&
+                    memcmp(journal_buffer, journal_value, 
+                    DDFS_BLOCK_SIZE) == 0;
+            }
+
+            ssize_t written = write(journal_pipe[1], journal_found, 
+                journal_count);
+            _exit(written == (ssize_t)journal_count ? 0 : 1);
+        }
+
+        int child_status = 0;
+
+        if (child != -1 && read(journal_pipe[0], journal_found, 
+            journal_count) == (ssize_t)journal_count &&
+            waitpid(child, &child_status, 0) == child && 
+            WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0) {
+            ret = EXIT_SUCCESS;
+        }
+    }
+
+    uint32_t journal_matches[3] = { 0, 0, 0 };
+    uint32_t journal_expected = 0;
+
+    // Plain descriptors only see the home blocks, which miss what the child
+    // committed since its last checkpoint; a read-only volume replays the
+    // journal in memory and one opened for writing checkpoints it
+    for (uint32_t pass = 0; ret == 0 && pass < 3; pass++) {
+        int reader = pass == 0 ? journal_tmp :
+            ddfs_open(journal_path, pass == 1 ? O_RDONLY : O_RDWR, 0);
+
+        if (pass == 2 && reader != -1) {
+            ddfs_close(reader);
+            reader = journal_tmp;
+        }
+
+        for (uint32_t i = 0; reader != -1 && i < journal_count; i++) {
+            memset(journal_value, i, DDFS_BLOCK_SIZE);
+            memcpy(journal_value, &i, sizeof(i));
+            journal_expected += pass == 0 && journal_found[i];
+
+            if (journal_found[i] && 
+                get_value(reader, journal_keys[i], journal_buffer) == 0 &&
+                memcmp(journal_buffer, journal_value, DDFS_BLOCK_SIZE) == 0) {
+                journal_matches[pass]++;
+            }
+        }
+
+        if (pass == 1 && reader != -1) {
+            ddfs_close(reader);
+        }
+    }
+
+    if (ret == 0 && journal_expected > journal_count / 2 &&
+        journal_matches[0] < journal_expected &&
+        journal_matches[1] == journal_expected &&
+        journal_matches[2] == journal_expected) {
+        printf("Test DDFS_OPEN_JOURNAL successful\n\n");
+    } else {
+        printf("Test DDFS_OPEN_JOURNAL unsuccessful\n\n");
+    }
+
+    for (uint32_t i = 0; i < 2; i++) {
+        if (journal_pipe[i] != -1) {
+            close(journal_pipe[i]);
+        }
+    }
+
+    free(journal_keys);
+    free(journal_found);
+    put_block_buffer(journal_value);
+    put_block_buffer(journal_buffer);
+
+    if (journal_tmp != -1) {
+        close(journal_tmp);
+        unlink(journal_path);
+    }
+
+    // A delete the journal has not committed keeps its block's reference:
+    // the child gets the counts and the collector to disk, then crashes,
+    // and the key comes back with its value. Committing lets it go.
+    char held_path[] = "/tmp/ddfs-held-XXXXXX";
+    int held_tmp = mkstemp(held_path);
+    uint8_t held_key[20] = { 0x4e, 0x1d };
+    uint8_t *held_value = get_block_buffer();
+    uint8_t *held_buffer = get_block_buffer();
+    int held_fd = -1;
+    ret = EXIT_FAILURE;
+
+    if (held_tmp != -1 && held_value != NULL && held_buffer != NULL &&
+        ftruncate(held_tmp, 64 * 1024 * 1024) == 0) {
+        memset(held_value, 0x5a, DDFS_BLOCK_SIZE);
+        held_fd = ddfs_open(held_path, O_RDWR, 0);
+    }
+
+    if (held_fd != -1 && initialize_ddfs(held_fd) == 0) {
+        ddfs_close(held_fd);
+
+        pid_t child = fork();
+
+        if (child == 0) {
+            int child_fd = ddfs_open(held_path, O_RDWR, DDFS_OPEN_JOURNAL);
+            int held = child_fd != -1 &&
+                create_kv_pair(child_fd, held_key, held_value) == 0 &&
+                ddfs_sync(child_fd) == 0 &&
+                delete_kv_pair(child_fd, held_key) == 0 &&
+                apply_reference_log(child_fd) == 0 &&
+                drain_reclaim_queue(child_fd) == 0;
+
+            _exit(held ? 0 : 1);
+        }
+
+        int child_status = 0;
+        held_fd = -1;
+
+        if (child != -1 && waitpid(child, &child_status, 0) == child &&
+            WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0) {
+            held_fd = ddfs_open(held_path, O_RDWR, DDFS_OPEN_JOURNAL);
+        }
+
+        int64_t held_block = held_fd != -1 ?
+            get_value_block(held_fd, held_key) : -1;
+
+        if (held_block > 0 &&
+            get_value(held_fd, held_key, held_buffer) == 0 &&
+            memcmp(held_buffer, held_value, DDFS_BLOCK_SIZE) == 0 &&
+            get_reference_count(held_fd, held_block) == 1 &&
+            delete_kv_pair(held_fd, held_key) == 0 &&
+            get_reference_count(held_fd, held_block) == 1 &&
+            ddfs_sync(held_fd) == 0 &&
+            get_reference_count(held_fd, held_block) == 0) {
+            ret = EXIT_SUCCESS;
+        }
+
+        if (held_fd != -1) {
+            ddfs_close(held_fd);
+        }
+    }
+
+    if (ret == 0) {
+        printf("Test journal held releases successful\n\n");
+    } else {
+        printf("Test journal held releases unsuccessful\n\n");
+    }
+
+    put_block_buffer(held_value);
+    put_block_buffer(held_buffer);
+
+    if (held_tmp != -1) {
+        close(held_tmp);
+        unlink(held_path);
+    }
+
+    // A volume whose journal cannot be read is not opened at all, rather
+    // than written around the journal
+    char broken_path[] = "/tmp/ddfs-broken-XXXXXX";
+    int broken_tmp = mkstemp(broken_path);
+    int broken_fd = -1;
+    ret = EXIT_FAILURE;
+
+    if (broken_tmp != -1 && ftruncate(broken_tmp, 64 * 1024 * 1024) == 0) {
+        broken_fd = ddfs_open(broken_path, O_RDWR, 0);
+    }
+
+    if (broken_fd != -1 && initialize_ddfs(broken_fd) == 0) {
+        ddfs_close(broken_fd);
+
+        struct ddfs_superblock *broken_sb = get_superblock(broken_tmp);
+
+        if (broken_sb != NULL && ftruncate(broken_tmp,
+            (off_t)le64toh(broken_sb->info.fs_journal_offset)) == 0 &&
+            ddfs_open(broken_path, O_RDWR, DDFS_OPEN_JOURNAL) == -1) {
+            ret = EXIT_SUCCESS;
+        }
+
+        put_block_buffer(broken_sb);
+    }
+
+    if (ret == 0) {
+        printf("Test ddfs_open() load failures successful\n\n");
+    } else {
+        printf("Test ddfs_open() load failures unsuccessful\n\n");
+    }
+
+    if (broken_tmp != -1) {
+        close(broken_tmp);
+        unlink(broken_path);
+    }
+
+    // Once every descriptor the volume table covers is taken, ddfs_open()
+    // fails rather than hand back a descriptor without a volume
+    struct rlimit files;
+    int *spares = calloc(DDFS_MAX_VOLUMES, sizeof(int));
+    int spare_count = 0;
+    int spare = -1;
+    ret = EXIT_FAILURE;
+
+    if (spares != NULL && getrlimit(RLIMIT_NOFILE, &files) == 0 &&
+        files.rlim_cur < 2 * DDFS_MAX_VOLUMES &&
+        files.rlim_max > DDFS_MAX_VOLUMES) {
+        files.rlim_cur = files.rlim_max < 2 * DDFS_MAX_VOLUMES ?
+            files.rlim_max : 2 * DDFS_MAX_VOLUMES;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    while (spares != NULL &&
+        (spare = open("/dev/null", O_RDONLY)) != -1 &&
+        spare < DDFS_MAX_VOLUMES) {
+        spares[spare_count++] = spare;
+    }
+
+    if (spare != -1 || errno == EMFILE) {
+        if (spare != -1) {
+            close(spare);
+        }
+
+        errno = 0;
+
+        if (ddfs_open(argv[1], O_RDWR, DDFS_OPEN_JOURNAL) == -1 &&
+            errno == EMFILE) {
+            ret = EXIT_SUCCESS;
+        }
+    }
+
+    while (spare_count > 0) {
+        close(spares[--spare_count]);
+    }
+
+    free(spares);
+
+    if (ret == 0) {
+        printf("Test ddfs_open() past the volume table successful\n\n");
+    } else {
+        printf("Test ddfs_open() past the volume table unsuccessful\n\n");
+    }
+
+    // Log-structured volumes append new values one after the other and
+    // the cleaner moves the live blocks out of a mostly dead segment
+    char log_path[] = "/tmp/ddfs-log-XXXXXX";
+    int log_tmp = mkstemp(log_path);
+    int log_fd = -1;
+    uint32_t log_count = 2 * DDFS_SEGMENT_BLOCKS;
+    uint32_t log_half = DDFS_SEGMENT_BLOCKS;
+    uint8_t (*log_keys)[20] = malloc((log_count + 1) * 20);
+    uint8_t **log_values = calloc(log_count, sizeof(uint8_t *));
+    uint64_t *log_blocks = calloc(log_count, sizeof(uint64_t));
+    int *log_status = calloc(log_count, sizeof(int));
+    uint8_t *log_buffer = get_block_buffer();
+    struct ddfs_geometry log_geometry = { .flags = DDFS_FS_LOG };
+    struct ddfs_superblock *log_sb = NULL;
+    int64_t log_free = -1;
+    ret = EXIT_FAILURE;
+
+    if (log_tmp != -1 && log_keys != NULL && log_values != NULL &&
+        log_blocks != NULL && log_status != NULL && log_buffer != NULL &&
+        ftruncate(log_tmp, 64 * 1024 * 1024) == 0) {
+        log_fd = ddfs_open(log_path, O_RDWR, 0);
+        ret = EXIT_SUCCESS;
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < log_count; i++) {
+        log_values[i] = malloc(DDFS_BLOCK_SIZE);
+
+        if (log_values[i] == NULL) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        // An all-zero value would hash to the superblock inode's slot
+        uint32_t log_seed = i + 1;
+
+        memset(log_values[i], log_seed * 7, DDFS_BLOCK_SIZE);
+        memcpy(log_values[i], &log_seed, sizeof(log_seed));
+    }
+
+    if (ret == 0 && (log_fd == -1 ||
+        format_ddfs(log_fd, &log_geometry) != 0 ||
+        (log_sb = get_superblock(log_fd)) == NULL)) {
+        ret = EXIT_FAILURE;
+    }
+
+    // Keys are the values' fingerprints, nudged until no two share an
+    // inode slot; the last one is a second key for the first value
+    for (uint32_t i = 0; ret == 0 && i <= log_count; i++) {
+        memset(log_keys[i], 0, 20);
+        uint8_t *log_result = log_keys[i];
+        hash_block(log_values[i < log_count ? i : 0], &log_result);
+
+        uint32_t j = 0;
+
+        while (j < i) {
+            if (key_hash(log_keys[i], log_sb->info.fs_inode_count) ==
+                key_hash(log_keys[j], log_sb->info.fs_inode_count)) {
+                log_keys[i][19]++;
+                j = 0;
+            } else {
+                j++;
+            }
+        }
+    }
+
+    put_block_buffer(log_sb);
+
+    // The first segment goes in one put at a time, the second in a batch
+
+    for (uint32_t i = 0; ret == 0 && i < log_half; i++) {
+        ret = create_kv_pair(log_fd, log_keys[i], log_values[i]);
+    }
+
+    if (ret == 0) {
+        ret = ddfs_put_batch(log_fd, log_keys + log_half,
+            log_values + log_half, log_count - log_half, log_status);
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < log_count; i++) {
+        log_blocks[i] = get_value_block(log_fd, log_keys[i]);
+
+        if (i != 0 && log_blocks[i] != log_blocks[i - 1] + 1) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    // A second key with the first value shares its block
+    if (ret == 0 && (create_kv_pair(log_fd, log_keys[log_count],
+        log_values[0]) != 0 ||
+        get_value_block(log_fd, log_keys[log_count]) !=
+        (int64_t)log_blocks[0] ||
+        get_reference_count(log_fd, log_blocks[0]) != 2)) {
+        ret = EXIT_FAILURE;
+    }
+
+    // Leave one block in eight of the first segment live. A view of a
+    // deleted key keeps the cleaner off the segment until it goes.
+    struct ddfs_value_view log_view;
+    memset(&log_view, 0, sizeof(struct ddfs_value_view));
+
+    if (ret == 0 && ddfs_borrow_value(log_fd, log_keys[1], &log_view) != 0) {
+        ret = EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < log_half; i++) {
+        if (i % 8 != 0) {
+            ret = delete_kv_pair(log_fd, log_keys[i]);
+        }
+    }
+
+    if (ret == 0 && (clean_segments(log_fd, 1) != 0 ||
+        memcmp(log_view.data, log_values[1], DDFS_BLOCK_SIZE) != 0)) {
+        ret = EXIT_FAILURE;
+    }
+
+    ddfs_release_value(&log_view);
+
+    if (ret == 0) {
+        log_free = get_free_segments(log_fd);
+
+        if (clean_segments(log_fd, 1) != 1 ||
+            get_free_segments(log_fd) != log_free) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    // The survivors moved to the next segment, keeping their references;
+    // the head the cleaner opened took the place of the freed segment
+    for (uint32_t i = 0; ret == 0 && i < log_half; i += 8) {
+        int64_t moved = get_value_block(log_fd, log_keys[i]);
+
+        if (moved < (int64_t)log_blocks[log_count - 1] ||
+            get_value(log_fd, log_keys[i], log_buffer) != 0 ||
+            memcmp(log_buffer, log_values[i], DDFS_BLOCK_SIZE) != 0 ||
+            get_reference_count(log_fd, log_blocks[i]) != 0 ||
+            get_reference_count(log_fd, moved) != (i == 0 ? 2 : 1)) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (ret == 0 && get_value_block(log_fd, log_keys[log_count]) !=
+        get_value_block(log_fd, log_keys[0])) {
+        ret = EXIT_FAILURE;
+    }
+
+    // Appends carry on after the relocated blocks once reopened
+    if (ret == 0) {
+        int64_t last = get_value_block(log_fd, log_keys[log_half - 8]);
+
+        ddfs_close(log_fd);
+        log_fd = ddfs_open(log_path, O_RDWR, 0);
+
+        if (log_fd == -1 ||
+            delete_kv_pair(log_fd, log_keys[log_half + 1]) != 0 ||
+            create_kv_pair(log_fd, log_keys[1], log_values[1]) != 0 ||
+            get_value_block(log_fd, log_keys[1]) != last + 1 ||
+            get_value(log_fd, log_keys[log_half], log_buffer) != 0 ||
+            memcmp(log_buffer, log_values[log_half],
+            DDFS_BLOCK_SIZE) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (log_fd != -1) {
+        ddfs_close(log_fd);
+    }
+
+    if (ret == 0) {
+        printf("Test log-structured layout successful\n\n");
+    } else {
+        printf("Test log-structured layout unsuccessful\n\n");
+    }
+
+    for (uint32_t i = 0; log_values != NULL && i < log_count; i++) {
+        free(log_values[i]);
+    }
+
+    free(log_keys);
+    free(log_values);
+    free(log_blocks);
+    free(log_status);
+    put_block_buffer(log_buffer);
+
+    // The cleaner leaves alone what changes in progress hold: the
+    // references the journal holds until a release is committed, and the
+    // blocks a store took and the head it filled
+    uint32_t pending_count = 10 * DDFS_SEGMENT_BLOCKS;
+    uint32_t pending_dead = DDFS_SEGMENT_BLOCKS - (DDFS_SEGMENT_BLOCKS / 8);
+    uint8_t (*pending_keys)[20] = malloc(pending_count * 20);
+    uint8_t **pending_values = calloc(pending_count, sizeof(uint8_t *));
+    int *pending_status = calloc(pending_count, sizeof(int));
+    uint8_t *pending_buffer = get_block_buffer();
+    struct ddfs_superblock *pending_sb = NULL;
+    int pending_fd = -1;
+    uint32_t pending_live = 0;
+    ret = EXIT_FAILURE;
+
+    if (log_tmp != -1 && pending_keys != NULL && pending_values != NULL &&
+        pending_status != NULL && pending_buffer != NULL) {
+        ret = EXIT_SUCCESS;
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < pending_count; i++) {
+        pending_values[i] = malloc(DDFS_BLOCK_SIZE);
+
+        if (pending_values[i] == NULL) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    // Journaled on a file: fill a segment, leave one block in eight of it
+    // live, then change a key without committing and clean the segment
+    if (ret == 0) {
+        pending_fd = ddfs_open(log_path, O_RDWR, 0);
+
+        if (pending_fd == -1 ||
+            format_ddfs(pending_fd, &log_geometry) != 0 ||
+            (pending_sb = get_superblock(pending_fd)) == NULL ||
+            distinct_values(pending_sb, pending_values,
+            DDFS_SEGMENT_BLOCKS + 2, 1) != 0 ||
+            distinct_keys(pending_sb, pending_keys,
+            DDFS_SEGMENT_BLOCKS + 1) != 0 ||
+            ddfs_close(pending_fd) != 0 ||
+            (pending_fd = ddfs_open(log_path, O_RDWR,
+            DDFS_OPEN_JOURNAL)) == -1) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    for (uint32_t i = 0; ret == 0 && i <= DDFS_SEGMENT_BLOCKS; i++) {
+        ret = create_kv_pair(pending_fd, pending_keys[i], pending_values[i]);
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < DDFS_SEGMENT_BLOCKS; i++) {
+        if (i % 8 != 0) {
+            ret = delete_kv_pair(pending_fd, pending_keys[i]);
+        }
+    }
+
+    if (ret == 0 && (ddfs_sync(pending_fd) != 0 ||
+        modify_value(pending_fd, pending_keys[0],
+        pending_values[DDFS_SEGMENT_BLOCKS + 1]) != 0 ||
+        clean_segments(pending_fd, 1) != 1 || ddfs_sync(pending_fd) != 0)) {
+        ret = EXIT_FAILURE;
+    }
+
+    // Only the keys' blocks are left live, each with its one reference
+    pending_live = (DDFS_SEGMENT_BLOCKS / 8) + 1;
+
+    if (ret == 0 && count_live_blocks(pending_fd,
+        pending_sb->info.fs_data_offset / DDFS_BLOCK_SIZE,
+        pending_sb->info.fs_segment_count * DDFS_SEGMENT_BLOCKS) !=
+        pending_live) {
+        ret = EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; ret == 0 && i <= DDFS_SEGMENT_BLOCKS; i += 8) {
+        uint32_t v = i == 0 ? DDFS_SEGMENT_BLOCKS + 1 : i;
+
+        if (get_reference_count(pending_fd,
+            get_value_block(pending_fd, pending_keys[i])) != 1 ||
+            get_value(pending_fd, pending_keys[i], pending_buffer) != 0 ||
+            memcmp(pending_buffer, pending_values[v], DDFS_BLOCK_SIZE) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    put_block_buffer(pending_sb);
+    pending_sb = NULL;
+
+    if (pending_fd != -1) {
+        ddfs_close(pending_fd);
+    }
+
+    // In memory: fill all but the reserve and the head with segments one
+    // block in four of which is live, leave a few blocks of the head to a
+    // batch and let the batch's last value run the cleaner
+    pending_fd = ddfs_open_memory(16 * 1024 * 1024);
+
+    if (ret == 0 && (pending_fd == -1 ||
+        format_ddfs(pending_fd, &log_geometry) != 0 ||
+        (pending_sb = get_superblock(pending_fd)) == NULL)) {
+        ret = EXIT_FAILURE;
+    }
+
+    int64_t pending_segments = ret == 0 ?
+        get_free_segments(pending_fd) - DDFS_LOG_RESERVE - 1 : -1;
+    uint32_t pending_batch = DDFS_SEGMENT_BLOCKS - pending_dead + 1;
+    uint32_t pending_next = 0;
+    pending_live = 0;
+
+    if (pending_segments < 1 || (uint64_t)(pending_segments + 1) *
+        DDFS_SEGMENT_BLOCKS >= pending_count ||
+        distinct_values(pending_sb, pending_values,
+        (pending_segments + 1) * DDFS_SEGMENT_BLOCKS + 1, 1) != 0 ||
+        distinct_keys(pending_sb, pending_keys,
+        (pending_segments + 1) * DDFS_SEGMENT_BLOCKS + 1) != 0) {
+        ret = EXIT_FAILURE;
+    }
+
+    for (int64_t s = 0; ret == 0 && s < pending_segments; s++) {
+        for (uint32_t i = 0; ret == 0 && i < DDFS_SEGMENT_BLOCKS; i++) {
+            ret = create_kv_pair(pending_fd, pending_keys[pending_next + i],
+                pending_values[pending_next + i]);
+        }
+
+        for (uint32_t i = 0; ret == 0 && i < DDFS_SEGMENT_BLOCKS; i++) {
+            if (i % 4 != 0) {
+                ret = delete_kv_pair(pending_fd,
+                    pending_keys[pending_next + i]);
+            } else {
+                pending_live++;
+            }
+        }
+
+        pending_next += DDFS_SEGMENT_BLOCKS;
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < pending_dead; i++) {
+        ret = create_kv_pair(pending_fd, pending_keys[pending_next + i],
+            pending_values[pending_next + i]);
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < pending_dead; i++) {
+        ret = delete_kv_pair(pending_fd, pending_keys[pending_next + i]);
+    }
+
+    pending_next += pending_dead;
+
+    // The head is the emptiest full segment when the cleaner runs, but
+    // it only holds the batch's values
+    if (ret == 0 && ddfs_put_batch(pending_fd, pending_keys + pending_next,
+        pending_values + pending_next, pending_batch, pending_status) != 0) {
+        ret = EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < pending_next + pending_batch;
+        i++) {
+        if (i < pending_next && (i >= pending_segments *
+            DDFS_SEGMENT_BLOCKS || i % 4 != 0)) {
+            continue;
+        }
+
+        if (get_reference_count(pending_fd,
+            get_value_block(pending_fd, pending_keys[i])) != 1 ||
+            get_value(pending_fd, pending_keys[i], pending_buffer) != 0 ||
+            memcmp(pending_buffer, pending_values[i], DDFS_BLOCK_SIZE) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (ret == 0 && count_live_blocks(pending_fd,
+        pending_sb->info.fs_data_offset / DDFS_BLOCK_SIZE,
+        pending_sb->info.fs_segment_count * DDFS_SEGMENT_BLOCKS) !=
+        pending_live + pending_batch) {
+        ret = EXIT_FAILURE;
+    }
+
+    put_block_buffer(pending_sb);
+
+    if (pending_fd != -1) {
+        ddfs_close(pending_fd);
+    }
+
+    if (ret == 0) {
+        printf("Test log cleaner and changes in progress successful\n\n");
+    } else {
+        printf("Test log cleaner and changes in progress unsuccessful\n\n");
+    }
+
+    for (uint32_t i = 0; pending_values != NULL && i < pending_count; i++) {
+        free(pending_values[i]);
+    }
+
+    free(pending_keys);
+    free(pending_values);
+    free(pending_status);
+    put_block_buffer(pending_buffer);
+
+    if (log_tmp != -1) {
+        close(log_tmp);
+        unlink(log_path);
+    }
+
+    // Threads working on their own keys at once leave every key and
+    // reference count as if they had run one after the other: in memory,
+    // log-structured in memory, and journaled on a file with the collector
+    char stress_path[] = "/tmp/ddfs-stress-XXXXXX";
+    int stress_tmp = mkstemp(stress_path);
+    uint32_t stress_total = STRESS_THREADS * STRESS_KEYS;
+    uint8_t (*stress_keys)[20] = malloc(stress_total * 20);
+    uint8_t **stress_values = calloc(2 * STRESS_VALUES, sizeof(uint8_t *));
+    uint8_t *stress_buffer = get_block_buffer();
+    ret = EXIT_FAILURE;
+
+    if (stress_tmp != -1 && stress_keys != NULL && stress_values != NULL &&
+        stress_buffer != NULL &&
+        ftruncate(stress_tmp, 64 * 1024 * 1024) == 0) {
+        ret = EXIT_SUCCESS;
+    }
+
+    for (uint32_t v = 0; ret == 0 && v < 2 * STRESS_VALUES; v++) {
+        stress_values[v] = malloc(DDFS_BLOCK_SIZE);
+
+        if (stress_values[v] == NULL) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    for (uint8_t config = 0; ret == 0 && config < 3; config++) {
+        struct ddfs_geometry stress_geometry = {
+            .flags = config == 1 ? DDFS_FS_LOG : 0
+        };
+        int stress_fd = config < 2 ? ddfs_open_memory(64 * 1024 * 1024) :
+            ddfs_open(stress_path, O_RDWR, DDFS_OPEN_JOURNAL | DDFS_OPEN_GC);
+        struct ddfs_superblock *stress_sb = NULL;
+
+        if (stress_fd == -1 || 
+            format_ddfs(stress_fd, &stress_geometry) != 0 ||
+            (stress_sb = get_superblock(stress_fd)) == NULL) {
+            ret = EXIT_FAILURE;
+        }
+
+        // Values land in distinct blocks and index slots, and keys in
+        // distinct inode slots, so no two of them collide
+        if (ret == 0 && (distinct_values(stress_sb, stress_values,
+            2 * STRESS_VALUES, config == 1) != 0 ||
+            distinct_keys(stress_sb, stress_keys, stress_total) != 0)) {
+            ret = EXIT_FAILURE;
+        }
+
+        pthread_t stress_threads[STRESS_THREADS];
+        struct stress_args stress_args[STRESS_THREADS];
+        uint32_t started = 0;
+
+        for (; ret == 0 && started < STRESS_THREADS; started++) {
+            stress_args[started] = (struct stress_args) {
+                .fd = stress_fd,
+                .keys = stress_keys + (started * STRESS_KEYS),
+                .values = stress_values,
+                .ret = EXIT_FAILURE
+            };
+
+            if (pthread_create(&stress_threads[started], NULL, 
+                stress_worker, &stress_args[started]) != 0) {
+                ret = EXIT_FAILURE;
+                break;
+            }
+        }
+
+        for (uint32_t joined = 0; joined < started; joined++) {
+            pthread_join(stress_threads[joined], NULL);
+
+            if (stress_args[joined].ret != 0) {
+                ret = EXIT_FAILURE;
+            }
+        }
+
+        // Check every key, then that each value's block is shared by the
+        // keys holding it and counts exactly their references
+        int64_t stress_blocks[2 * STRESS_VALUES];
+        int64_t stress_refs[2 * STRESS_VALUES];
+
+        for (uint32_t v = 0; v < 2 * STRESS_VALUES; v++) {
+            stress_blocks[v] = -1;
+            stress_refs[v] = 0;
+        }
+
+        for (uint32_t i = 0; ret == 0 && i < stress_total; i++) {
+            uint32_t k = i % STRESS_KEYS;
+            uint32_t v = (k % 2 ? STRESS_VALUES : 0) + (k % STRESS_VALUES);
+            int64_t block = get_value_block(stress_fd, stress_keys[i]);
+
+            if (k % 4 == 2) {
+                ret = block == -1 ? EXIT_SUCCESS : EXIT_FAILURE;
+                continue;
+            }
+
+            if (get_value(stress_fd, stress_keys[i], stress_buffer) != 0 ||
+                memcmp(stress_buffer, stress_values[v], 
+                DDFS_BLOCK_SIZE) != 0 ||
+                (stress_blocks[v] != -1 && stress_blocks[v] != block)) {
+                ret = EXIT_FAILURE;
+            }
+
+            stress_blocks[v] = block;
+            stress_refs[v]++;
+        }
+
+        // Odd first values lost every key to modify_value()
+        for (uint32_t v = 0; ret == 0 && v < 2 * STRESS_VALUES; v++) {
+            if (stress_refs[v] != 0 &&
+                get_reference_count(stress_fd, stress_blocks[v]) !=
+                stress_refs[v]) {
+                ret = EXIT_FAILURE;
+            }
+        }
+
+        put_block_buffer(stress_sb);
+
+        if (stress_fd != -1) {
+            ddfs_close(stress_fd);
+        }
+    }
+
+    if (ret == 0) {
+        printf("Test concurrent key operations successful\n\n");
+    } else {
+        printf("Test concurrent key operations unsuccessful\n\n");
+    }
+
+    for (uint32_t v = 0; stress_values != NULL && v < 2 * STRESS_VALUES; 
+        v++) {
+        free(stress_values[v]);
+    }
+
+    free(stress_keys);
+    free(stress_values);
+    put_block_buffer(stress_buffer);
+
+    if (stress_tmp != -1) {
+        close(stress_tmp);
+        unlink(stress_path);
+    }
+
+    // Lookups that take no locks never see a value half written, or a
+    // key missing, while another thread keeps changing the keys, both in
+    // place and log-structured
+    uint8_t (*flip_keys)[20] = malloc(FLIP_KEYS * 20);
+    uint8_t **flip_values = calloc(2 * FLIP_KEYS, sizeof(uint8_t *));
+    uint8_t *flip_buffer = get_block_buffer();
+    uint64_t lookups = 0;
+    ret = flip_keys != NULL && flip_values != NULL && flip_buffer != NULL ?
+        EXIT_SUCCESS : EXIT_FAILURE;
+
+    for (uint32_t v = 0; ret == 0 && v < 2 * FLIP_KEYS; v++) {
+        flip_values[v] = malloc(DDFS_BLOCK_SIZE);
+
+        if (flip_values[v] == NULL) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    for (uint8_t config = 0; ret == 0 && config < 2; config++) {
+        struct ddfs_geometry flip_geometry = {
+            .flags = config == 1 ? DDFS_FS_LOG : 0
+        };
+        int flip_fd = ddfs_open_memory(64 * 1024 * 1024);
+        struct ddfs_superblock *flip_sb = NULL;
+        struct flip_args flip_args = {
+            .fd = flip_fd,
+            .keys = flip_keys,
+            .values = flip_values,
+            .ret = EXIT_FAILURE
+        };
+        pthread_t flip_thread;
+        int flip_started = 0;
+
+        if (flip_fd == -1 || format_ddfs(flip_fd, &flip_geometry) != 0 ||
+            (flip_sb = get_superblock(flip_fd)) == NULL ||
+            distinct_values(flip_sb, flip_values, 2 * FLIP_KEYS,
+            config == 1) != 0 ||
+            distinct_keys(flip_sb, flip_keys, FLIP_KEYS) != 0) {
+            ret = EXIT_FAILURE;
+        }
+
+        for (uint32_t i = 0; ret == 0 && i < FLIP_KEYS; i++) {
+            ret = create_kv_pair(flip_fd, flip_keys[i], flip_values[2 * i]);
+        }
+
+        if (ret == 0) {
+            flip_started = pthread_create(&flip_thread, NULL, flip_worker,
+                &flip_args) == 0;
+            ret = flip_started ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        while (ret == 0 &&
+            !__atomic_load_n(&flip_args.done, __ATOMIC_ACQUIRE)) {
+            uint32_t i = lookups++ % FLIP_KEYS;
+
+            if (get_value(flip_fd, flip_keys[i], flip_buffer) != 0 ||
+                (memcmp(flip_buffer, flip_values[2 * i],
+                DDFS_BLOCK_SIZE) != 0 &&
+                memcmp(flip_buffer, flip_values[2 * i + 1],
+                DDFS_BLOCK_SIZE) != 0)) {
+                ret = EXIT_FAILURE;
+            }
+        }
+
+        if (flip_started) {
+            pthread_join(flip_thread, NULL);
+
+            if (flip_args.ret != 0) {
+                ret = EXIT_FAILURE;
+            }
+        }
+
+        // The last round left every key with its first value
+        for (uint32_t i = 0; ret == 0 && i < FLIP_KEYS; i++) {
+            if (get_value(flip_fd, flip_keys[i], flip_buffer) != 0 ||
+                memcmp(flip_buffer, flip_values[2 * i + FLIP_ROUNDS % 2],
+                DDFS_BLOCK_SIZE) != 0) {
+                ret = EXIT_FAILURE;
+            }
+        }
+
+        put_block_buffer(flip_sb);
+
+        if (flip_fd != -1) {
+            ddfs_close(flip_fd);
+        }
+    }
+
+    if (ret == 0) {
+        printf("Test lock-free lookups successful\n\n");
+    } else {
+        printf("Test lock-free lookups unsuccessful\n\n");
+    }
+
+    for (uint32_t v = 0; flip_values != NULL && v < 2 * FLIP_KEYS; v++) {
+        free(flip_values[v]);
+    }
+
+    free(flip_keys);
+    free(flip_values);
+    put_block_buffer(flip_buffer);
+
+    // Loops and tasks spread over the worker pool run every index exactly
+    // once, report failed ranges and nest, and puts, formats and lookups
+    // give the same results with workers as without
+    uint32_t pool_default = ddfs_get_workers();
+    uint32_t *pool_seen = calloc(POOL_COUNT, sizeof(uint32_t));
+    uint8_t **pool_blocks = calloc(POOL_BLOCKS, sizeof(uint8_t *));
+    uint8_t (*pool_fingerprints)[POOL_BLOCKS][20] = malloc(
+        POOL_RANGES * sizeof(*pool_fingerprints));
+    uint8_t (*pool_keys)[20] = malloc(POOL_BLOCKS * 20);
+    uint8_t (*pool_expected)[20] = calloc(POOL_BLOCKS, 20);
+    uint8_t *pool_buffer = get_block_buffer();
+    int pool_status[POOL_BLOCKS];
+    ret = pool_seen != NULL && pool_blocks != NULL &&
+        pool_fingerprints != NULL && pool_keys != NULL &&
+        pool_expected != NULL && pool_buffer != NULL ?
+        EXIT_SUCCESS : EXIT_FAILURE;
+
+    for (uint32_t b = 0; ret == 0 && b < POOL_BLOCKS; b++) {
+        pool_blocks[b] = malloc(DDFS_BLOCK_SIZE);
+
+        if (pool_blocks[b] == NULL) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+    }
+
+    for (uint8_t workers = 0; ret == 0 && workers < 2; workers++) {
+        struct ddfs_task_group pool_group;
+        struct ddfs_task pool_tasks[64];
+        uint32_t pool_runs = 0;
+        struct pool_loop pool_loop = {
+            .seen = pool_seen,
+            .fail = POOL_COUNT,
+            .blocks = pool_blocks,
+            .fingerprints = pool_fingerprints
+        };
+
+        if (ddfs_set_workers(workers ? POOL_WORKERS : 0) != 0 ||
+            ddfs_get_workers() != (workers ? POOL_WORKERS : 0u)) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        // Format fans out over the workers
+        int pool_fd = ddfs_open_memory(64 * 1024 * 1024);
+        struct ddfs_superblock *pool_sb = NULL;
+
+        if (pool_fd == -1 || format_ddfs(pool_fd, NULL) != 0 ||
+            (pool_sb = get_superblock(pool_fd)) == NULL ||
+            distinct_values(pool_sb, pool_blocks, POOL_BLOCKS, 0) != 0 ||
+            distinct_keys(pool_sb, pool_keys, POOL_BLOCKS) != 0) {
+            ret = EXIT_FAILURE;
+        }
+
+        put_block_buffer(pool_sb);
+
+        for (uint32_t b = 0; ret == 0 && b < POOL_BLOCKS; b++) {
+            uint8_t *pool_result = pool_expected[b];
+
+            memset(pool_result, 0, 20);
+            hash_block(pool_blocks[b], &pool_result);
+        }
+
+        memset(pool_seen, 0, POOL_COUNT * sizeof(uint32_t));
+
+        if (parallel_for(POOL_COUNT, 1, DDFS_POOL_FOREGROUND, pool_range,
+            &pool_loop) != 0) {
+            ret = EXIT_FAILURE;
+        }
+
+        for (uint32_t i = 0; i < POOL_COUNT; i++) {
+            if (pool_seen[i] != 1) {
+                ret = EXIT_FAILURE;
+            }
+        }
+
+        for (uint32_t r = 0; r < pool_loop.ranges; r++) {
+            if (memcmp(pool_fingerprints[r], pool_expected,
+                sizeof(*pool_fingerprints)) != 0) {
+                ret = EXIT_FAILURE;
+            }
+        }
+
+        // With workers the loop was split, and a failing range fails it
+        pool_loop.fail = POOL_COUNT / 2;
+        pool_loop.ranges = 0;
+
+        if (parallel_for(POOL_COUNT, 1, DDFS_POOL_BACKGROUND, pool_range,
+            &pool_loop) == 0 || (workers && pool_loop.ranges < 2)) {
+            ret = EXIT_FAILURE;
+        }
+
+        task_group_init(&pool_group, DDFS_POOL_BACKGROUND);
+
+        for (uint32_t k = 0; k < 64; k++) {
+            pool_tasks[k].run = pool_task;
+            pool_tasks[k].arg = &pool_runs;
+            submit_task(&pool_group, &pool_tasks[k]);
+        }
+
+        if (wait_task_group(&pool_group) != 0 || pool_runs != 64) {
+            ret = EXIT_FAILURE;
+        }
+
+        // So does fingerprinting a batch put's values
+        if (ret == 0 && ddfs_put_batch(pool_fd, pool_keys, pool_blocks,
+            POOL_BLOCKS, pool_status) != 0) {
+            ret = EXIT_FAILURE;
+        }
+
+        for (uint32_t b = 0; ret == 0 && b < POOL_BLOCKS; b++) {
+            if (pool_status[b] != 0 ||
+                get_value(pool_fd, pool_keys[b], pool_buffer) != 0 ||
+                memcmp(pool_buffer, pool_blocks[b], DDFS_BLOCK_SIZE) != 0) {
+                ret = EXIT_FAILURE;
+            }
+        }
+
+        if (pool_fd != -1) {
+            ddfs_close(pool_fd);
+        }
+    }
+
+    if (ddfs_set_workers(pool_default) != 0) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (ret == 0) {
+        printf("Test worker pool successful\n\n");
+    } else {
+        printf("Test worker pool unsuccessful\n\n");
+    }
+
+    for (uint32_t b = 0; pool_blocks != NULL && b < POOL_BLOCKS; b++) {
+        free(pool_blocks[b]);
+    }
+
+    free(pool_seen);
+    free(pool_blocks);
+    free(pool_fingerprints);
+    free(pool_keys);
+    free(pool_expected);
+    put_block_buffer(pool_buffer);
+
+    // A snapshot keeps the values its keys had while the live index moves
+    // on, deleting the newer of two hands its pages down to the older and
+    // a clone brings the older one's keys back
+    uint8_t (*snap_keys)[20] = malloc(SNAPSHOT_KEYS * 20);
+    uint8_t **snap_values = calloc(2 * SNAPSHOT_KEYS, sizeof(uint8_t *));
+    uint64_t *snap_blocks = calloc(2 * SNAPSHOT_KEYS, sizeof(uint64_t));
+    uint8_t *snap_buffer = get_block_buffer();
+    int snap_fd = ddfs_open_memory(64 * 1024 * 1024);
+    struct ddfs_superblock *snap_sb = NULL;
+    int64_t snap_ids[2] = { -1, -1 };
+    uint64_t snap_listed[DDFS_SNAPSHOT_MAX];
+    int64_t snap_pages = 0;
+    ret = EXIT_FAILURE;
+
+    if (snap_keys != NULL && snap_values != NULL && snap_blocks != NULL &&
+        snap_buffer != NULL && snap_fd != -1 &&
+        initialize_ddfs(snap_fd) == 0 &&
+        (snap_sb = get_superblock(snap_fd)) != NULL) {
+        ret = EXIT_SUCCESS;
+    }
+
+    for (uint32_t v = 0; ret == 0 && v < 2 * SNAPSHOT_KEYS; v++) {
+        if ((snap_values[v] = malloc(DDFS_BLOCK_SIZE)) == NULL) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (ret == 0 && (distinct_values(snap_sb, snap_values,
+        2 * SNAPSHOT_KEYS, 0) != 0 ||
+        distinct_keys(snap_sb, snap_keys, SNAPSHOT_KEYS) != 0)) {
+        ret = EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < SNAPSHOT_KEYS; i++) {
+        if (create_kv_pair(snap_fd, snap_keys[i], snap_values[i]) != 0) {
+            ret = EXIT_FAILURE;
+        }
+
+        snap_blocks[i] = get_value_block(snap_fd, snap_keys[i]);
+    }
+
+    // Nothing is copied until a page changes
+    if (ret == 0 && ((snap_ids[0] = create_snapshot(snap_fd)) < 0 ||
+        get_snapshot_pages(snap_fd) != 0)) {
+        ret = EXIT_FAILURE;
+    }
+
+    // Odd keys change, every fourth key goes, the rest stay
+    for (uint32_t i = 0; ret == 0 && i < SNAPSHOT_KEYS; i++) {
+        uint32_t v = SNAPSHOT_KEYS + i;
+
+        if (i % 2 == 1) {
+            ret = modify_value(snap_fd, snap_keys[i], snap_values[v]);
+            snap_blocks[v] = get_value_block(snap_fd, snap_keys[i]);
+        } else if (i % 4 == 0) {
+            ret = delete_kv_pair(snap_fd, snap_keys[i]);
+        }
+    }
+
+    snap_pages = get_snapshot_pages(snap_fd);
+
+    if (ret == 0 && (snap_pages <= 0 ||
+        (uint64_t)snap_pages > snap_sb->info.fs_istore_block_count ||
+        (snap_ids[1] = create_snapshot(snap_fd)) <= snap_ids[0] ||
+        get_snapshot_pages(snap_fd) != snap_pages)) {
+        ret = EXIT_FAILURE;
+    }
+
+    // The keys the newer snapshot kept as they were change after it
+    for (uint32_t i = 2; ret == 0 && i < SNAPSHOT_KEYS; i += 4) {
+        ret = modify_value(snap_fd, snap_keys[i],
+            snap_values[SNAPSHOT_KEYS + i]);
+        snap_blocks[SNAPSHOT_KEYS + i] = get_value_block(snap_fd,
+            snap_keys[i]);
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < SNAPSHOT_KEYS; i++) {
+        uint32_t newer = i % 4 == 2 ? i : SNAPSHOT_KEYS + i;
+        int gone = i % 4 == 0;
+
+        // Values only a snapshot still holds keep their blocks
+        if (get_reference_count(snap_fd, snap_blocks[i]) <= 0 ||
+            get_value(snap_fd, snap_keys[i], snap_buffer) != gone ||
+            (!gone && memcmp(snap_buffer, snap_values[SNAPSHOT_KEYS + i],
+            DDFS_BLOCK_SIZE) != 0) ||
+            get_snapshot_value(snap_fd, snap_ids[0], snap_keys[i],
+            snap_buffer) != 0 ||
+            memcmp(snap_buffer, snap_values[i], DDFS_BLOCK_SIZE) != 0 ||
+            get_snapshot_value(snap_fd, snap_ids[1], snap_keys[i],
+            snap_buffer) != gone ||
+            (!gone && memcmp(snap_buffer, snap_values[newer],
+            DDFS_BLOCK_SIZE) != 0)) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (ret == 0 && (list_snapshots(snap_fd, snap_listed,
+        DDFS_SNAPSHOT_MAX) != 2 || snap_listed[0] != (uint64_t)snap_ids[0] ||
+        snap_listed[1] != (uint64_t)snap_ids[1] ||
+        delete_snapshot(snap_fd, snap_ids[1]) != 0 ||
+        delete_snapshot(snap_fd, snap_ids[1]) == 0 ||
+        get_snapshot_value(snap_fd, snap_ids[1], snap_keys[1],
+        snap_buffer) == 0 ||
+        list_snapshots(snap_fd, snap_listed, DDFS_SNAPSHOT_MAX) != 1)) {
+        ret = EXIT_FAILURE;
+    }
+
+    // The clone puts every key back, deleted ones included
+    for (uint32_t i = 0; ret == 0 && i < SNAPSHOT_KEYS; i++) {
+        if (get_snapshot_value(snap_fd, snap_ids[0], snap_keys[i],
+            snap_buffer) != 0 ||
+            memcmp(snap_buffer, snap_values[i], DDFS_BLOCK_SIZE) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (ret == 0 && clone_snapshot(snap_fd, snap_ids[0]) != 0) {
+        ret = EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < SNAPSHOT_KEYS; i++) {
+        if (get_value(snap_fd, snap_keys[i], snap_buffer) != 0 ||
+            memcmp(snap_buffer, snap_values[i], DDFS_BLOCK_SIZE) != 0 ||
+            get_inode_bit(snap_fd, key_hash(snap_keys[i],
+            snap_sb->info.fs_inode_count)) != 1) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    // Once the last snapshot goes the pool is empty and only the live
+    // keys hold their values
+    if (ret == 0 && (delete_snapshot(snap_fd, snap_ids[0]) != 0 ||
+        get_snapshot_pages(snap_fd) != 0 ||
+        list_snapshots(snap_fd, snap_listed, DDFS_SNAPSHOT_MAX) != 0)) {
+        ret = EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; ret == 0 && i < SNAPSHOT_KEYS; i++) {
+        if (get_reference_count(snap_fd, snap_blocks[i]) != 1 ||
+            (i % 4 != 0 && get_reference_count(snap_fd,
+            snap_blocks[SNAPSHOT_KEYS + i]) != 0)) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    put_block_buffer(snap_sb);
+
+    if (snap_fd != -1) {
+        ddfs_close(snap_fd);
+    }
+
+    // Snapshots survive a reopen of a volume on a file
+    char snap_path[] = "/tmp/ddfs-snap-XXXXXX";
+    int snap_tmp = mkstemp(snap_path);
+    snap_fd = -1;
+
+    if (ret == 0 && (snap_tmp == -1 ||
+        ftruncate(snap_tmp, 64 * 1024 * 1024) != 0 ||
+        (snap_fd = ddfs_open(snap_path, O_RDWR, 0)) == -1 ||
+        initialize_ddfs(snap_fd) != 0 ||
+        create_kv_pair(snap_fd, snap_keys[0], snap_values[0]) != 0 ||
+        (snap_ids[0] = create_snapshot(snap_fd)) < 0 ||
+        modify_value(snap_fd, snap_keys[0], snap_values[1]) != 0 ||
+        ddfs_close(snap_fd) != 0 ||
+        (snap_fd = ddfs_open(snap_path, O_RDWR, 0)) == -1 ||
+        list_snapshots(snap_fd, snap_listed, 1) != 1 ||
+        snap_listed[0] != (uint64_t)snap_ids[0] ||
+        get_snapshot_pages(snap_fd) != 1 ||
+        get_snapshot_value(snap_fd, snap_ids[0], snap_keys[0],
+        snap_buffer) != 0 ||
+        memcmp(snap_buffer, snap_values[0], DDFS_BLOCK_SIZE) != 0 ||
+        get_value(snap_fd, snap_keys[0], snap_buffer) != 0 ||
+        memcmp(snap_buffer, snap_values[1], DDFS_BLOCK_SIZE) != 0)) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (snap_fd != -1) {
+        ddfs_close(snap_fd);
+    }
+
+    // A page the map names keeps its values' references through a crash:
+    // the child preserves a page by deleting its key on a journaled volume
+    // and crashes before committing, so the key comes back and both it
+    // and the snapshot hold the value
+    snap_fd = -1;
+
+    if (ret == 0 && (snap_tmp == -1 ||
+        (snap_fd = ddfs_open(snap_path, O_RDWR, 0)) == -1 ||
+        initialize_ddfs(snap_fd) != 0 ||
+        create_kv_pair(snap_fd, snap_keys[0], snap_values[0]) != 0 ||
+        ddfs_close(snap_fd) != 0)) {
+        ret = EXIT_FAILURE;
+    }
+
+    pid_t snap_child = ret == 0 ? fork() : -1;
+
+    if (snap_child == 0) {
+        int child_fd = ddfs_open(snap_path, O_RDWR, DDFS_OPEN_JOURNAL);
+        int preserved = child_fd != -1 && create_snapshot(child_fd) >= 0 &&
+            delete_kv_pair(child_fd, snap_keys[0]) == 0;
+
+        _exit(preserved ? 0 : 1);
+    }
+
+    int snap_status = 0;
+    int64_t snap_block = -1;
+    snap_fd = -1;
+
+    if (ret == 0 && (snap_child == -1 ||
+        waitpid(snap_child, &snap_status, 0) != snap_child ||
+        !WIFEXITED(snap_status) || WEXITSTATUS(snap_status) != 0 ||
+        (snap_fd = ddfs_open(snap_path, O_RDWR, DDFS_OPEN_JOURNAL)) == -1 ||
+        list_snapshots(snap_fd, snap_listed, 1) != 1 ||
+        get_snapshot_pages(snap_fd) != 1 ||
+        (snap_block = get_value_block(snap_fd, snap_keys[0])) <= 0 ||
+        get_reference_count(snap_fd, snap_block) != 2 ||
+        delete_kv_pair(snap_fd, snap_keys[0]) != 0 ||
+        ddfs_sync(snap_fd) != 0 ||
+        get_reference_count(snap_fd, snap_block) != 1 ||
+        get_snapshot_value(snap_fd, snap_listed[0], snap_keys[0],
+        snap_buffer) != 0 ||
+        memcmp(snap_buffer, snap_values[0], DDFS_BLOCK_SIZE) != 0)) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (snap_fd != -1) {
+        ddfs_close(snap_fd);
+    }
+
+    if (snap_tmp != -1) {
+        close(snap_tmp);
+        unlink(snap_path);
+    }
+
+    // Log-structured volumes have no snapshot region
+    struct ddfs_geometry snap_geometry = { .flags = DDFS_FS_LOG };
+    snap_fd = ddfs_open_memory(64 * 1024 * 1024);
+
+    if (ret == 0 && (snap_fd == -1 ||
+        format_ddfs(snap_fd, &snap_geometry) != 0 ||
+        create_snapshot(snap_fd) != -1 || errno != EOPNOTSUPP)) {
+        ret = EXIT_FAILURE;
+    }
+
+    if (snap_fd != -1) {
+        ddfs_close(snap_fd);
+    }
+
+    if (ret == 0) {
+        printf("Test snapshots and clones successful\n\n");
+    } else {
+        printf("Test snapshots and clones unsuccessful\n\n");
+    }
+
+    for (uint32_t v = 0; snap_values != NULL && v < 2 * SNAPSHOT_KEYS; v++) {
+        free(snap_values[v]);
+    }
+
+    free(snap_keys);
+    free(snap_values);
+    free(snap_blocks);
+    put_block_buffer(snap_buffer);
+
+    struct ddfs_stats before;
+    struct ddfs_stats after;
+    ret = EXIT_SUCCESS;
+
+    // The first round fills the thread's pools, later rounds reuse them
+    for (uint8_t i = 0; i < 16; i++) {
+        if (i == 1) {
+            ddfs_get_stats(&before);
+        }
+
+        if (create_kv_pair(fd, batch_keys[7], batch_values[7]) != 0 ||
+            get_value(fd, batch_keys[7], data) != 0 ||
+            delete_kv_pair(fd, batch_keys[7]) != 0 ||
+            delete_kv_pair(fd, batch_keys[7]) != 0) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    ddfs_get_stats(&after);
+
+    if (ret == 0 && after.allocations == before.allocations) {
+        printf("Test ddfs_get_stats() successful\n\n");
+    } else {
+        printf("Test ddfs_get_stats() unsuccessful\n\n");
+    }
+
+    for (uint8_t i = 0; i < 8; i++) {
+        delete_kv_pair(fd, batch_keys[i]);
+        free(batch_values[i]);
+        free(batch_results[i]);
+    }
 
-    printf("Block number: %d\n", block_ptr);
-    printf("Reference count: %d\n", reference_count);
     printf("\n");
 
     return EXIT_SUCCESS;